@@ -0,0 +1,90 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_BOUNDED_QUEUE_HPP
+#define MUSICMOVE_BOUNDED_QUEUE_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+namespace mm {
+
+// A blocking first-in, first-out queue holding at most a fixed number of
+// items, used to pass work between pipeline stages without letting any
+// stage run unboundedly far ahead of the next.
+template <typename T>
+class bounded_queue
+{
+public:
+    explicit bounded_queue(std::size_t capacity) :
+        capacity_{capacity > 0 ? capacity : 1}, closed_{false}
+    {}
+    bounded_queue(const bounded_queue &) = delete;
+    bounded_queue &operator=(const bounded_queue &) = delete;
+    
+    // Add an item, waiting for space if need be.  Returns false, discarding
+    // the item, if the queue has been closed.
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock{mutex_};
+        not_full_.wait(lock,
+            [this] { return closed_ || items_.size() < capacity_; });
+        if (closed_)
+            return false;
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+    
+    // Take the next item, waiting for one if need be.  Returns false once
+    // the queue has been closed and there is nothing left in it.
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock{mutex_};
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        if (items_.empty())
+            return false;
+        item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+    
+    // Stop accepting items, and wake anyone waiting
+    void close()
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+    
+private:
+    const std::size_t capacity_;
+    bool closed_;
+    std::deque<T> items_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
+
+} // namespace mm
+
+#endif // MUSICMOVE_BOUNDED_QUEUE_HPP
@@ -19,32 +19,82 @@
 #define MUSICMOVE_CONTEXT_HPP
 
 #include <boost/filesystem/path.hpp>
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace fs = boost::filesystem;
 
 namespace mm {
 
+class dir_state;
+class journal;
+class output;
+class run_stats;
+class tag_cache;
+class transfer_queue;
+#ifdef MUSICMOVE_TRACING
+class tracer;
+#endif
+
 enum class path_uniqueness_t { skip, exit };
 
 enum class path_conversion_t { posix, utf8, windows_ascii };
 
+// When a file is copied to another filesystem, how sure to be that the copy
+// is on disk before removing the original: not at all, by syncing each
+// copy, or by syncing each destination filesystem once per batch of copies
+enum class durability_t { none, file, batch };
+
 struct context
 {
     context() :
-        use_format_script{false}, format{}, format_script{},
+        use_format_script{false}, format{}, format_script{}, base_dir{},
         simulate{true}, verbose{false},
         path_uniqueness{path_uniqueness_t::skip},
-        path_conversion{path_conversion_t::windows_ascii}
+        path_conversion{path_conversion_t::windows_ascii},
+        native_tag_reader{false}, cache{}, jobs{1},
+        durability{durability_t::file}, transfers{},
+        include_extensions{}, exclude_extensions{}, state{}, journal{},
+        keep_root{false}, out{}, stats{}
     {}
 
     bool use_format_script;
     std::string format;
     fs::path format_script;
+    // Where dot-relative new paths start, if not the working directory
+    fs::path base_dir;
     bool simulate;
     bool verbose;
     path_uniqueness_t path_uniqueness;
     path_conversion_t path_conversion;
+    bool native_tag_reader;
+    // Persistent tag cache, if one is in use
+    std::shared_ptr<tag_cache> cache;
+    // Number of files to read and format at once
+    unsigned int jobs;
+    durability_t durability;
+    // Background queue for transfers to other filesystems, if one is in use
+    std::shared_ptr<transfer_queue> transfers;
+    // File extensions, with their dots, to read in place of those that can
+    // be read as music, and to pass over regardless
+    std::vector<std::string> include_extensions;
+    std::vector<std::string> exclude_extensions;
+    // Directories left alone by earlier runs, if they are being remembered
+    std::shared_ptr<dir_state> state;
+    // Where each move is recorded before it is made, if anywhere
+    std::shared_ptr<mm::journal> journal;
+    // Leave a directory being processed in place, even if everything in it
+    // is moved out
+    bool keep_root;
+    // Where to report on each file, if not straight to stdout and stderr
+    std::shared_ptr<output> out;
+    // Timings and counts for the run, if they are being gathered
+    std::shared_ptr<run_stats> stats;
+#ifdef MUSICMOVE_TRACING
+    // Where to record the time spent on each file, if anywhere
+    std::shared_ptr<tracer> trace;
+#endif
 };
 
 } // namespace mm
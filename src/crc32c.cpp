@@ -0,0 +1,124 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "crc32c.hpp"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define MUSICMOVE_CRC32C_SSE42
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace mm {
+
+namespace {
+
+const std::uint32_t polynomial = 0x82f63b78; // Castagnoli, reversed
+
+constexpr std::array<std::uint32_t, 256> make_table()
+{
+    std::array<std::uint32_t, 256> table{};
+    for (std::uint32_t i = 0; i < 256; ++i)
+    {
+        std::uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit)
+            crc = (crc >> 1) ^ ((crc & 1) ? polynomial : 0);
+        table[i] = crc;
+    }
+    return table;
+}
+
+constexpr auto table = make_table();
+
+std::uint32_t crc32c_scalar(std::uint32_t crc, const unsigned char *p,
+                            std::size_t size)
+{
+    while (size-- > 0)
+        crc = (crc >> 8) ^ table[(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(MUSICMOVE_CRC32C_SSE42)
+
+__attribute__((target("sse4.2")))
+std::uint32_t crc32c_hw(std::uint32_t crc, const unsigned char *p,
+                        std::size_t size)
+{
+    std::uint64_t crc64 = crc;
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        std::uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<std::uint32_t>(crc64);
+    for (; size > 0; --size)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+bool have_hw()
+{
+    static const bool supported = __builtin_cpu_supports("sse4.2");
+    return supported;
+}
+
+#elif defined(__ARM_FEATURE_CRC32)
+
+std::uint32_t crc32c_hw(std::uint32_t crc, const unsigned char *p,
+                        std::size_t size)
+{
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        std::uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; size > 0; --size)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+
+bool have_hw() { return true; }
+
+#else
+
+std::uint32_t crc32c_hw(std::uint32_t crc, const unsigned char *p,
+                        std::size_t size)
+{
+    return crc32c_scalar(crc, p, size);
+}
+
+bool have_hw() { return false; }
+
+#endif
+
+} // anonymous namespace
+
+std::uint32_t crc32c(std::uint32_t crc, const void *data, std::size_t size)
+{
+    auto p = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+    crc = have_hw() ? crc32c_hw(crc, p, size) : crc32c_scalar(crc, p, size);
+    return ~crc;
+}
+
+} // namespace mm
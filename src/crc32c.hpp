@@ -0,0 +1,32 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_CRC32C_HPP
+#define MUSICMOVE_CRC32C_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mm {
+
+// Continue a CRC-32C (Castagnoli) checksum over more data.  Start with a crc
+// of zero.  Uses the CPU's CRC instructions where it has them.
+std::uint32_t crc32c(std::uint32_t crc, const void *data, std::size_t size);
+
+} // namespace mm
+
+#endif // MUSICMOVE_CRC32C_HPP
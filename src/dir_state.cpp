@@ -0,0 +1,258 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dir_state.hpp"
+#include "posix_util.hpp"
+
+#include <boost/filesystem.hpp>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+
+namespace fs = boost::filesystem;
+
+namespace mm {
+
+using std::string;
+using std::uint32_t;
+using std::uint64_t;
+
+namespace {
+
+const char state_magic[4] = {'M', 'M', 'D', 'S'};
+const uint32_t state_version = 1;
+
+struct file_header
+{
+    file_tag tag;
+    uint32_t reserved;
+    uint64_t settings;
+    uint64_t count;
+};
+
+// Each entry is followed by the directory's path
+struct file_entry
+{
+    tag_cache_key dir;
+    uint64_t entries;
+    uint64_t digest;
+    uint32_t length;
+    // Checksum of the entry, with this field zeroed, and the path together
+    uint32_t checksum;
+};
+
+static_assert(sizeof(file_header) == 32, "unexpected header padding");
+static_assert(sizeof(file_entry) == 56, "unexpected entry padding");
+
+// 64-bit FNV-1a
+uint64_t hash64(const void *data, std::size_t len,
+                uint64_t hash = 14695981039346656037ull)
+{
+    auto *p = static_cast<const unsigned char *>(data);
+    for (std::size_t i = 0; i < len; ++i)
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+uint64_t hash_string(const string &s,
+                     uint64_t hash = 14695981039346656037ull)
+{
+    // Include the length, so that consecutive strings can't run together
+    uint64_t len = s.size();
+    return hash64(s.data(), s.size(), hash64(&len, sizeof(len), hash));
+}
+
+uint32_t entry_checksum(file_entry entry, const char *path, std::size_t len)
+{
+    entry.checksum = 0;
+    auto hash = hash64(path, len, hash64(&entry, sizeof(entry)));
+    return static_cast<uint32_t>(hash ^ (hash >> 32));
+}
+
+} // anonymous namespace
+
+void dir_signature::add(const string &name, const tag_cache_key &key)
+{
+    // Summed, so that the order of the listing doesn't matter
+    digest += hash64(&key, sizeof(key), hash_string(name));
+}
+
+bool dir_signature::operator==(const dir_signature &other) const
+{
+    return dir == other.dir && entries == other.entries &&
+           digest == other.digest;
+}
+
+dir_state::dir_state(const fs::path &path, uint64_t settings) :
+    path_{path}, settings_{settings}, hits_{0}, misses_{0}
+{
+    // A missing, truncated or foreign file, or one from a run with other
+    // settings, is treated as being empty
+    std::ifstream file{path_.string(), std::ios::in | std::ios::binary};
+    if (!file)
+        return;
+    string data{std::istreambuf_iterator<char>{file},
+                std::istreambuf_iterator<char>{}};
+    if (data.size() < sizeof(file_header))
+        return;
+    file_header header;
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (!header.tag.matches(state_magic, state_version) ||
+        header.settings != settings_)
+        return;
+
+    std::size_t pos = sizeof(header);
+    for (uint64_t i = 0; i < header.count; ++i)
+    {
+        file_entry entry;
+        if (data.size() - pos < sizeof(entry))
+            break;
+        std::memcpy(&entry, data.data() + pos, sizeof(entry));
+        pos += sizeof(entry);
+        if (data.size() - pos < entry.length)
+            break;
+        auto *dir = data.data() + pos;
+        pos += entry.length;
+        if (entry_checksum(entry, dir, entry.length) != entry.checksum)
+            continue;
+
+        dir_signature signature;
+        signature.dir = entry.dir;
+        signature.entries = entry.entries;
+        signature.digest = entry.digest;
+        dirs_.emplace(string{dir, entry.length}, signature);
+    }
+}
+
+uint64_t dir_state::settings_digest(const context &ctx)
+{
+    uint64_t hash = hash_string(ctx.use_format_script ? "script" : "format");
+    if (ctx.use_format_script)
+    {
+        // The script decides where files go, so it is its contents that
+        // matter, rather than its name
+        std::ifstream script{ctx.format_script.string()};
+        std::stringstream contents;
+        contents << script.rdbuf();
+        hash = hash_string(ctx.format_script.string(), hash);
+        hash = hash_string(contents.str(), hash);
+    }
+    else
+        hash = hash_string(ctx.format, hash);
+    // Dot-relative new paths depend on the directory they start from, too
+    if (!ctx.base_dir.empty() &&
+        (ctx.use_format_script || ctx.format.compare(0, 1, ".") == 0))
+        hash = hash_string(ctx.base_dir.string(), hash);
+    hash = hash_string(
+        std::to_string(static_cast<int>(ctx.path_conversion)), hash);
+    hash = hash_string(ctx.native_tag_reader ? "native" : "taglib", hash);
+    for (const auto &ext : ctx.include_extensions)
+        hash = hash_string("+" + ext, hash);
+    for (const auto &ext : ctx.exclude_extensions)
+        hash = hash_string("-" + ext, hash);
+    return hash;
+}
+
+string dir_state::key_of(const fs::path &dir)
+{
+    return fs::absolute(dir).lexically_normal().string();
+}
+
+bool dir_state::settled(const fs::path &dir,
+                        const dir_signature &signature) const
+{
+    auto key = key_of(dir);
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto iter = dirs_.find(key);
+        if (iter != dirs_.end() && iter->second == signature)
+        {
+            ++hits_;
+            return true;
+        }
+    }
+    ++misses_;
+    return false;
+}
+
+void dir_state::record(const fs::path &dir, const dir_signature &signature)
+{
+    auto key = key_of(dir);
+    std::lock_guard<std::mutex> lock{mutex_};
+    dirs_[key] = signature;
+}
+
+void dir_state::forget(const fs::path &dir)
+{
+    auto key = key_of(dir);
+    std::lock_guard<std::mutex> lock{mutex_};
+    dirs_.erase(key);
+}
+
+std::size_t dir_state::entries() const
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+    return dirs_.size();
+}
+
+void dir_state::save()
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+
+    file_header header{};
+    header.tag = file_tag::make(state_magic, state_version);
+    header.settings = settings_;
+    header.count = dirs_.size();
+
+    string buf;
+    buf.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (const auto &dir : dirs_)
+    {
+        file_entry entry{dir.second.dir, dir.second.entries,
+                         dir.second.digest,
+                         static_cast<uint32_t>(dir.first.size()), 0};
+        entry.checksum = entry_checksum(entry, dir.first.data(),
+                                        dir.first.size());
+        buf.append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+        buf += dir.first;
+    }
+
+    // Write a new file alongside the old one.  If it is lost or damaged,
+    // the next run just has more to read.
+    fs::path tmp_path{path_.string() + ".tmp"};
+    {
+        std::ofstream file{tmp_path.string(),
+                           std::ios::out | std::ios::trunc | std::ios::binary};
+        if (file)
+            file.write(buf.data(), buf.size());
+        if (!file)
+            throw dir_state_error{errno_message("Failed to write", tmp_path)};
+    }
+    boost::system::error_code ec;
+    fs::rename(tmp_path, path_, ec);
+    if (ec)
+        throw dir_state_error{"Failed to replace " + path_.string() + ": " +
+                              ec.message()};
+}
+
+} // namespace mm
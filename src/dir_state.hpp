@@ -0,0 +1,111 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_DIR_STATE_HPP
+#define MUSICMOVE_DIR_STATE_HPP
+
+#include "context.hpp"
+#include "tag_cache.hpp"
+
+#include <boost/filesystem/path.hpp>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+namespace mm {
+
+// What a directory looked like when it was listed: the directory's own key,
+// which changes whenever an entry is added, removed or renamed, the number
+// of entries in it, and a digest of the names and keys of the files in it
+// that would be read
+struct dir_signature
+{
+    dir_signature() : dir{}, entries{0}, digest{0} {}
+
+    tag_cache_key dir;
+    std::uint64_t entries;
+    std::uint64_t digest;
+
+    // Account for one file, in any order
+    void add(const std::string &name, const tag_cache_key &key);
+
+    bool operator==(const dir_signature &other) const;
+};
+
+struct dir_state_error : std::runtime_error
+{
+    explicit dir_state_error(const std::string &what_arg) :
+        std::runtime_error(what_arg)
+    {}
+};
+
+// Persistent record of the directories that a previous run left alone, so
+// that a later run can pass over any of them that have not changed without
+// opening the files in them.
+//
+// The state only applies to runs with the same settings, so it is kept
+// along with a digest of the settings, and is ignored if they differ.  Each
+// entry carries its own checksum, and any entry that fails it is dropped.
+class dir_state
+{
+public:
+    dir_state(const boost::filesystem::path &path, std::uint64_t settings);
+    dir_state(const dir_state &) = delete;
+    dir_state &operator=(const dir_state &) = delete;
+
+    // Get a digest of the settings that decide where files go
+    static std::uint64_t settings_digest(const context &ctx);
+
+    // Is the directory as it was when a previous run left it alone?
+    bool settled(const boost::filesystem::path &dir,
+                 const dir_signature &signature) const;
+
+    // Note that everything in a directory was left alone, or that something
+    // in it wasn't
+    void record(const boost::filesystem::path &dir,
+                const dir_signature &signature);
+    void forget(const boost::filesystem::path &dir);
+
+    // Write the state out, replacing the file.  Throws dir_state_error on
+    // failure.
+    void save();
+
+    const boost::filesystem::path &path() const { return path_; }
+    std::uint64_t settings() const { return settings_; }
+    std::size_t entries() const;
+    std::size_t hits() const { return hits_; }
+    std::size_t misses() const { return misses_; }
+
+private:
+    static std::string key_of(const boost::filesystem::path &dir);
+
+    boost::filesystem::path path_;
+    std::uint64_t settings_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, dir_signature> dirs_;
+
+    mutable std::atomic<std::size_t> hits_;
+    mutable std::atomic<std::size_t> misses_;
+};
+
+} // namespace mm
+
+#endif // MUSICMOVE_DIR_STATE_HPP
@@ -0,0 +1,158 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dir_state.hpp"
+#include "test_fixture.hpp"
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE dir_state_test
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+
+namespace fs = boost::filesystem;
+using namespace std;
+
+struct state_fixture : fixture
+{
+    state_fixture() :
+        state_path{tmp_dir / "dirs.state"}
+    {}
+
+    const fs::path state_path;
+};
+
+mm::dir_signature make_signature(uint64_t ino, int64_t mtime_ns)
+{
+    mm::dir_signature signature;
+    signature.dir = mm::tag_cache_key{1, ino, 4096, mtime_ns};
+    signature.entries = 2;
+    signature.add("01.flac", mm::tag_cache_key{1, ino + 1, 1000, 5});
+    signature.add("02.flac", mm::tag_cache_key{1, ino + 2, 1000, 5});
+    return signature;
+}
+
+BOOST_AUTO_TEST_CASE (missing_state_file)
+{
+    state_fixture f;
+
+    mm::dir_state state{f.state_path, 1};
+    BOOST_CHECK_EQUAL(state.entries(), 0);
+    BOOST_CHECK(!state.settled("/music/a", make_signature(1, 1)));
+    BOOST_CHECK_EQUAL(state.misses(), 1);
+}
+
+BOOST_AUTO_TEST_CASE (signature_ignores_order)
+{
+    mm::dir_signature a, b;
+    a.add("01.flac", mm::tag_cache_key{1, 2, 3, 4});
+    a.add("02.flac", mm::tag_cache_key{1, 3, 3, 4});
+    b.add("02.flac", mm::tag_cache_key{1, 3, 3, 4});
+    b.add("01.flac", mm::tag_cache_key{1, 2, 3, 4});
+    BOOST_CHECK(a == b);
+
+    // But not which name goes with which file
+    mm::dir_signature c;
+    c.add("01.flac", mm::tag_cache_key{1, 3, 3, 4});
+    c.add("02.flac", mm::tag_cache_key{1, 2, 3, 4});
+    BOOST_CHECK(!(a == c));
+}
+
+BOOST_AUTO_TEST_CASE (save_and_reload)
+{
+    state_fixture f;
+
+    {
+        mm::dir_state state{f.state_path, 1};
+        for (int i = 0; i < 100; ++i)
+            state.record("/music/" + to_string(i), make_signature(i * 10, 5));
+        state.forget("/music/7");
+        state.save();
+        BOOST_CHECK_EQUAL(state.entries(), 99);
+    }
+
+    mm::dir_state state{f.state_path, 1};
+    BOOST_CHECK_EQUAL(state.entries(), 99);
+    BOOST_CHECK(state.settled("/music/42", make_signature(420, 5)));
+    BOOST_CHECK(state.settled("/music/./42", make_signature(420, 5)));
+
+    // Any change to the directory or the files in it means a miss
+    BOOST_CHECK(!state.settled("/music/42", make_signature(420, 6)));
+    auto signature = make_signature(420, 5);
+    signature.add("03.flac", mm::tag_cache_key{1, 423, 1000, 5});
+    BOOST_CHECK(!state.settled("/music/42", signature));
+    BOOST_CHECK(!state.settled("/music/7", make_signature(70, 5)));
+    BOOST_CHECK(!state.settled("/music/100", make_signature(1000, 5)));
+    BOOST_CHECK_EQUAL(state.hits(), 2);
+    BOOST_CHECK_EQUAL(state.misses(), 4);
+}
+
+BOOST_AUTO_TEST_CASE (other_settings_ignored)
+{
+    state_fixture f;
+
+    {
+        mm::dir_state state{f.state_path, 1};
+        state.record("/music/a", make_signature(1, 5));
+        state.save();
+    }
+
+    mm::dir_state state{f.state_path, 2};
+    BOOST_CHECK_EQUAL(state.entries(), 0);
+    BOOST_CHECK(!state.settled("/music/a", make_signature(1, 5)));
+
+    // Any change to the format is a change to the settings
+    mm::context ctx;
+    ctx.format = "%a/%b/%n-%t";
+    auto before = mm::dir_state::settings_digest(ctx);
+    BOOST_CHECK_EQUAL(before, mm::dir_state::settings_digest(ctx));
+    ctx.format = "%a/%b/%n - %t";
+    BOOST_CHECK(before != mm::dir_state::settings_digest(ctx));
+}
+
+BOOST_AUTO_TEST_CASE (corrupt_entries_ignored)
+{
+    state_fixture f;
+
+    {
+        mm::dir_state state{f.state_path, 1};
+        state.record("/music/a", make_signature(1, 5));
+        state.record("/music/b", make_signature(2, 5));
+        state.save();
+    }
+
+    // Damage the last path in the file
+    auto size = fs::file_size(f.state_path);
+    {
+        fstream file{f.state_path.string(), ios::in | ios::out | ios::binary};
+        file.seekp(size - 1);
+        file.put('X');
+    }
+
+    {
+        mm::dir_state state{f.state_path, 1};
+        BOOST_CHECK_EQUAL(state.entries(), 1);
+    }
+
+    // A truncated file is treated as empty
+    fs::resize_file(f.state_path, 10);
+    mm::dir_state state{f.state_path, 1};
+    BOOST_CHECK_EQUAL(state.entries(), 0);
+}
@@ -17,12 +17,22 @@
 */
 #include "format.hpp"
 
-#include <boost/locale.hpp>
-#include <algorithm>
-#include <regex>
-#include <iostream>
-#include <sstream>
-#include <stdexcept>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 namespace fs = boost::filesystem;
 
@@ -30,72 +40,371 @@ namespace mm {
 
 using std::string;
 
-string convert_for_filesystem(const string &str, const context &ctx)
+namespace {
+
+// How each byte is converted for one path_conversion_t.  For UTF-8 paths the
+// tables apply to raw bytes; otherwise they apply to Latin-1 characters, as
+// decoded from the UTF-8 input.
+struct conversion_table
 {
-    // Make the string suitable for writing as a path to the filesystem
-    // Assume it is in UTF-8.
+    // Replacement for each character
+    std::array<char, 256> map;
+    // Characters that are ASCII and map to themselves
+    std::array<bool, 256> safe;
+};
+
+constexpr bool is_windows_reserved(unsigned char c)
+{
+    return c == '<' || c == '>' || c == ':' || c == '"' || c == '/' ||
+           c == '\\' || c == '|' || c == '?' || c == '*';
+}
+
+constexpr bool is_posix_portable(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+           (c >= '0' && c <= '9') || c == '.' || c == '_' || c == '-';
+}
+
+constexpr conversion_table make_table(path_conversion_t conv)
+{
+    // Remove marked characters using a small lookup table
+    // This is very crude, and not linguistically accurate, but can be
+    // argued to suffice for conversion to a 'safe' filesystem path
+    const char *tr =
+        "AAAAAAECEEEEIIIIDNOOOOO*OUUUUYPsaaaaaaeceeeeiiiionooooo/ouuuuypy";
+    //  "ÀÁÂÃÄÅÆÇÈÉÊËÌÍÎÏÐÑÒÓÔÕÖ×ØÙÚÛÜÝÞßàáâãäåæçèéêëìíîïðñòóôõö÷øùúûüýþÿ"
+
+    conversion_table table{};
+    for (int i = 0; i < 256; ++i)
+    {
+        auto c = static_cast<unsigned char>(i);
+        auto out = c;
+        // Always convert typical directory separators to hyphen.
+        if (c == '/' || c == '\\')
+            out = '-';
+        else if (conv != path_conversion_t::utf8 && c >= 192)
+            out = tr[c - 192];
+        else if (conv != path_conversion_t::utf8 && c >= 128)
+            out = '_';
+        
+        // Remove control characters in all cases
+        if (out < 0x20)
+            out = '_';
+        
+        // Remove any non-portable characters
+        if (conv == path_conversion_t::posix && !is_posix_portable(out))
+            out = '_';
+        else if (conv == path_conversion_t::windows_ascii &&
+                 is_windows_reserved(out))
+            out = '_';
+        
+        table.map[i] = static_cast<char>(out);
+        table.safe[i] = c < 0x80 && out == c;
+    }
+    return table;
+}
+
+constexpr conversion_table posix_table = make_table(path_conversion_t::posix);
+constexpr conversion_table utf8_table = make_table(path_conversion_t::utf8);
+constexpr conversion_table windows_table =
+    make_table(path_conversion_t::windows_ascii);
+
+// Index of the lowest zero bit in a mask that is not all ones
+inline std::size_t first_clear_bit(std::uint32_t mask)
+{
+    std::size_t n = 0;
+    for (; mask & 1u; mask >>= 1)
+        ++n;
+    return n;
+}
+
+// Length of the run of safe ASCII characters at the start of a string, for
+// which the output is the same as the input.  Vector kernels check 32 or 16
+// bytes at a time, leaving the tail to the table.
+std::size_t safe_run(const unsigned char *p, std::size_t len,
+                     path_conversion_t conv, const conversion_table &table)
+{
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= len; i += 32)
+    {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        __m256i ok;
+        if (conv == path_conversion_t::posix)
+        {
+            // Letters, digits, dot, underscore and hyphen
+            auto in_range = [&v](char lo, char hi) {
+                auto x = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+                auto n = _mm256_set1_epi8(static_cast<char>(hi - lo));
+                return _mm256_cmpeq_epi8(_mm256_min_epu8(x, n), x);
+            };
+            ok = _mm256_or_si256(
+                _mm256_or_si256(in_range('A', 'Z'), in_range('a', 'z')),
+                _mm256_or_si256(in_range('-', '9'), in_range('_', '_')));
+            // The digit range also takes in the separator
+            ok = _mm256_andnot_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')), ok);
+        }
+        else
+        {
+            // Printable ASCII (signed comparison excludes bytes from 0x80),
+            // less separators and reserved characters
+            ok = _mm256_cmpgt_epi8(v, _mm256_set1_epi8(0x1F));
+            auto bad = _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+            if (conv == path_conversion_t::windows_ascii)
+            {
+                for (char c : {'<', '>', ':', '"', '|', '?', '*'})
+                    bad = _mm256_or_si256(
+                        bad, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+            }
+            ok = _mm256_andnot_si256(bad, ok);
+        }
+        auto mask = static_cast<std::uint32_t>(_mm256_movemask_epi8(ok));
+        if (mask != 0xFFFFFFFFu)
+            return i + first_clear_bit(mask);
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    for (; i + 16 <= len; i += 16)
+    {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        __m128i ok;
+        if (conv == path_conversion_t::posix)
+        {
+            // Letters, digits, dot, underscore and hyphen
+            auto in_range = [&v](char lo, char hi) {
+                auto x = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+                auto n = _mm_set1_epi8(static_cast<char>(hi - lo));
+                return _mm_cmpeq_epi8(_mm_min_epu8(x, n), x);
+            };
+            ok = _mm_or_si128(
+                _mm_or_si128(in_range('A', 'Z'), in_range('a', 'z')),
+                _mm_or_si128(in_range('-', '9'), in_range('_', '_')));
+            // The digit range also takes in the separator
+            ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')), ok);
+        }
+        else
+        {
+            // Printable ASCII (signed comparison excludes bytes from 0x80),
+            // less separators and reserved characters
+            ok = _mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F));
+            auto bad = _mm_or_si128(
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('/')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+            if (conv == path_conversion_t::windows_ascii)
+            {
+                for (char c : {'<', '>', ':', '"', '|', '?', '*'})
+                    bad = _mm_or_si128(
+                        bad, _mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+            }
+            ok = _mm_andnot_si128(bad, ok);
+        }
+        auto mask = static_cast<std::uint32_t>(_mm_movemask_epi8(ok));
+        if (mask != 0xFFFFu)
+            return i + first_clear_bit(mask);
+    }
+#else
+    (void)conv;
+#endif
+    while (i < len && table.safe[p[i]])
+        ++i;
+    return i;
+}
+
+// Decode one UTF-8 sequence, returning the number of bytes it occupies, or
+// zero if it is not valid.
+std::size_t decode_utf8(const unsigned char *p, std::size_t len,
+                        std::uint32_t &cp)
+{
+    auto c = p[0];
+    std::size_t n;
+    std::uint32_t min;
+    if (c < 0x80)
+    {
+        cp = c;
+        return 1;
+    }
+    else if ((c & 0xE0) == 0xC0)
+        n = 2, cp = c & 0x1F, min = 0x80;
+    else if ((c & 0xF0) == 0xE0)
+        n = 3, cp = c & 0x0F, min = 0x800;
+    else if ((c & 0xF8) == 0xF0)
+        n = 4, cp = c & 0x07, min = 0x10000;
+    else
+        return 0;
+    if (n > len)
+        return 0;
+    for (std::size_t i = 1; i < n; ++i)
+    {
+        if ((p[i] & 0xC0) != 0x80)
+            return 0;
+        cp = (cp << 6) | (p[i] & 0x3F);
+    }
+    // Reject overlong forms, surrogates and anything beyond Unicode
+    if (cp < min || (cp >= 0xD800 && cp < 0xE000) || cp > 0x10FFFF)
+        return 0;
+    return n;
+}
+
+string convert_uncached(const string &str, path_conversion_t conv)
+{
+    const auto &table =
+        conv == path_conversion_t::posix ? posix_table :
+        conv == path_conversion_t::utf8  ? utf8_table :
+                                           windows_table;
+    auto *p = reinterpret_cast<const unsigned char *>(str.data());
+    auto len = str.size();
     
-    // Always convert typical directory separators to hyphen.
-    string safe = std::regex_replace(str, std::regex{"[/\\\\]"}, "-");
+    string safe;
+    safe.reserve(len);
+    std::size_t i = 0;
+    while (i < len)
+    {
+        // Copy runs of characters that need no conversion as they are
+        auto run = safe_run(p + i, len - i, conv, table);
+        safe.append(str, i, run);
+        i += run;
+        if (i == len)
+            break;
+        
+        if (conv == path_conversion_t::utf8 || p[i] < 0x80)
+        {
+            safe += table.map[p[i]];
+            ++i;
+            continue;
+        }
+        
+        // Convert to 8-bit Latin1, dropping anything that won't fit
+        std::uint32_t cp;
+        auto n = decode_utf8(p + i, len - i, cp);
+        if (n == 0)
+            ++i;
+        else
+        {
+            if (cp <= 0xFF)
+                safe += table.map[cp];
+            i += n;
+        }
+    }
     
-    if (ctx.path_conversion != path_conversion_t::utf8)
+    if (conv == path_conversion_t::windows_ascii)
     {
-        // First, convert to 8-bit Latin1
-        safe = boost::locale::conv::from_utf(safe, "Latin1");
+        if (!safe.empty() && safe[safe.size() - 1] == '.')
+            safe.pop_back();
+    }
     
-        // Remove marked characters using a small lookup table
-        // This is very crude, and not linguistically accurate, but can be
-        // argued to suffice for conversion to a 'safe' filesystem path
-        const char *tr =
-            "AAAAAAECEEEEIIIIDNOOOOO*OUUUUYPsaaaaaaeceeeeiiiionooooo/ouuuuypy";
-        //  "ÀÁÂÃÄÅÆÇÈÉÊËÌÍÎÏÐÑÒÓÔÕÖ×ØÙÚÛÜÝÞßàáâãäåæçèéêëìíîïðñòóôõö÷øùúûüýþÿ"
-        std::transform(safe.begin(), safe.end(), safe.begin(),
-            [&tr](char &sc) {
-                unsigned char &c = reinterpret_cast<unsigned char &>(sc);
-                if (c >= 192)
-                    return tr[c - 192];
-                else if (c >= 128)
-                    return '_';
-                else
-                    return sc;
-            });
+    // Trim trailing underscores if not native UTF-8
+    if (conv != path_conversion_t::utf8)
+    {
+        auto end = safe.find_last_not_of('_');
+        safe.erase(end == string::npos ? 0 : end + 1);
     }
     
-    // Remove control characters in all cases
-    std::transform(safe.begin(), safe.end(), safe.begin(),
-        [](char &sc) {
-            unsigned char &c = reinterpret_cast<unsigned char &>(sc);
-            if (c < 0x20)
-                return '_';
-            else
-                return sc;
-        });
+    return safe;
+}
+
+// Bounded LRU cache of converted strings.  The same artist, album and genre
+// turn up in the paths of many files, so most conversions are repeats.  The
+// cache is split into shards, each with its own lock, so that it can be
+// shared between threads without much contention.
+class conversion_cache
+{
+public:
+    bool find(const string &key, string &value)
+    {
+        auto &s = shard_for(key);
+        std::lock_guard<std::mutex> lock{s.mutex};
+        auto iter = s.index.find(key);
+        if (iter == s.index.end())
+        {
+            ++misses_;
+            return false;
+        }
+        // Move to the front, as the most recently used
+        s.entries.splice(s.entries.begin(), s.entries, iter->second);
+        value = iter->second->second;
+        ++hits_;
+        return true;
+    }
     
-    // Remove any non-portable characters
-    if (ctx.path_conversion == path_conversion_t::posix)
+    void insert(const string &key, const string &value)
     {
-        std::regex posix_exp{"[^A-Za-z0-9\\._\\-]"};
-        safe = std::regex_replace(safe, posix_exp, "_");
+        auto &s = shard_for(key);
+        std::lock_guard<std::mutex> lock{s.mutex};
+        if (s.index.count(key) > 0)
+            return;
+        s.entries.emplace_front(key, value);
+        s.index.emplace(key, s.entries.begin());
+        if (s.entries.size() > shard_capacity)
+        {
+            s.index.erase(s.entries.back().first);
+            s.entries.pop_back();
+        }
     }
-    else if (ctx.path_conversion == path_conversion_t::windows_ascii)
+    
+    conversion_cache_stats stats()
     {
-        std::regex windows_exp{"[<>:\"/\\\\\\|\\?\\*]"};
-        safe = std::regex_replace(safe, windows_exp, "_");
-        
-        if (!safe.empty() && safe[safe.size() - 1] == '.')
-            safe = safe.substr(0, safe.size() - 1);
+        std::size_t entries = 0;
+        for (auto &s : shards_)
+        {
+            std::lock_guard<std::mutex> lock{s.mutex};
+            entries += s.entries.size();
+        }
+        return conversion_cache_stats{hits_, misses_, entries};
     }
-
-    // Trim trailing underscores if not native UTF-8
-    if (ctx.path_conversion != path_conversion_t::utf8)
+    
+private:
+    static const std::size_t shard_count = 16;
+    static const std::size_t shard_capacity = 1024;
+    
+    typedef std::list<std::pair<string, string>> entry_list;
+    struct shard
     {
-        safe.erase(
-            std::find_if(safe.rbegin(), safe.rend(),
-                         [](auto c) { return c != '_'; }).base(),
-            safe.end());
+        std::mutex mutex;
+        entry_list entries;
+        std::unordered_map<string, entry_list::iterator> index;
+    };
+    
+    shard &shard_for(const string &key)
+    {
+        return shards_[std::hash<string>{}(key) % shard_count];
     }
     
-    return safe;
+    std::array<shard, shard_count> shards_;
+    std::atomic<std::size_t> hits_{0};
+    std::atomic<std::size_t> misses_{0};
+};
+
+conversion_cache &cache()
+{
+    static conversion_cache c;
+    return c;
+}
+
+} // anonymous namespace
+
+string convert_for_filesystem(const string &str, const context &ctx)
+{
+    // Make the string suitable for writing as a path to the filesystem
+    // Assume it is in UTF-8.
+    
+    // The same string converts differently for each path conversion
+    thread_local string key;
+    key.assign(1, static_cast<char>(ctx.path_conversion));
+    key += str;
+    
+    string converted;
+    if (cache().find(key, converted))
+        return converted;
+    converted = convert_uncached(str, ctx.path_conversion);
+    cache().insert(key, converted);
+    return converted;
+}
+
+conversion_cache_stats get_conversion_cache_stats()
+{
+    return cache().stats();
 }
 
 } // namespace mm
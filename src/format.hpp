@@ -18,21 +18,76 @@
 #ifndef MUSICMOVE_FORMAT_HPP
 #define MUSICMOVE_FORMAT_HPP
 
+#include <cstddef>
 #include <string>
+#include <vector>
 #include <boost/filesystem/path.hpp>
 #include "context.hpp"
 #include "metadata.hpp"
 
 namespace mm {
 
+// Convert a string for use as one element of a path.  Results are cached,
+// since the same strings tend to appear in the paths of many files.
 std::string convert_for_filesystem(const std::string &str, const context &ctx);
 
+struct conversion_cache_stats
+{
+    std::size_t hits;
+    std::size_t misses;
+    // Number of strings held in the cache at the moment
+    std::size_t entries;
+};
+
+conversion_cache_stats get_conversion_cache_stats();
+
+// An EasyTag-style format string, parsed and validated once so that it can
+// be applied to any number of files without being scanned again.
+class easytag_format
+{
+public:
+    // Throws std::invalid_argument or std::out_of_range if the format
+    // string is malformed
+    explicit easytag_format(const std::string &format);
+
+    const std::string &str() const { return format_; }
+
+    // Expand the format for a single file, replacing the contents of out
+    void expand(const metadata &tag, std::string &out) const;
+
+private:
+    enum class field_t
+    {
+        none, artist, album, comment, disc_number, encoded_by, genre,
+        track_total, track_number, original_artist, composer, copyright,
+        title, url, disc_total, date, album_artist
+    };
+
+    // Literal text, followed by a field (if any)
+    struct segment
+    {
+        std::string literal;
+        field_t field;
+    };
+
+    static field_t field_for(char c);
+
+    std::string format_;
+    std::vector<segment> segments_;
+};
+
 boost::filesystem::path format_path_easytag(
         const boost::filesystem::path &file,
         const std::string &format,
         const metadata &tag,
         const context &ctx);
 
+boost::filesystem::path format_path_easytag(
+        const boost::filesystem::path &file,
+        const easytag_format &format,
+        const metadata &tag,
+        const context &ctx);
+
 } // namespace mm
 
 #endif // MUSICMOVE_FORMAT_HPP
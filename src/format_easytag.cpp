@@ -19,7 +19,7 @@
 
 #include <iostream>
 #include <sstream>
-#include <regex>
+#include <memory>
 #include <stdexcept>
 
 namespace fs = boost::filesystem;
@@ -31,9 +31,8 @@ using std::cerr;
 using std::endl;
 using std::string;
 using std::stringstream;
-using std::for_each;
 
-static string get_token_easytag(const metadata &tag, const char c)
+easytag_format::field_t easytag_format::field_for(char c)
 {
     // %a - Track artist
     // %b - Album
@@ -51,99 +50,175 @@ static string get_token_easytag(const metadata &tag, const char c)
     // %x - Number of discs
     // %y - Year
     // %z - Album artist
-    string val;
     stringstream err_msg;
     switch (c)
     {
-        case 'a':
-            return tag.artist();
-        case 'b':
-            return tag.album();
-        case 'c':
-            return tag.comment();
-        case 'd':
-            return tag.disc_number();
-        case 'e':
-            return tag.encoded_by();
-        case 'g':
-            return tag.genre();
-        case 'l':
-            // Pad with zero if the number is only one character long
-            val = tag.track_total();
-            if (val.length() == 1)
-                val.insert(0, 1, '0');
-            return val;
-        case 'n':
-            // Pad with zero if the number is only one character long
-            val = tag.track_number();
-            if (val.length() == 1)
-                val.insert(0, 1, '0');
-            return val;
-        case 'o':
-            return tag.original_artist();
-        case 'p':
-            return tag.composer();
-        case 'r':
-            return tag.copyright();
-        case 't':
-            return tag.title();
-        case 'u':
-            return tag.url();
-        case 'x':
-            return tag.disc_total();
-        case 'y':
-            return tag.date();
-        case 'z':
-            // Fall back to artist if album artist is not available
-            val = tag.album_artist();
-            if (val == "")
-                return tag.artist();
-            return val;
-        case '%':
-            // It's an actual percentage sign in the filename!
-            return "%";
+        case 'a': return field_t::artist;
+        case 'b': return field_t::album;
+        case 'c': return field_t::comment;
+        case 'd': return field_t::disc_number;
+        case 'e': return field_t::encoded_by;
+        case 'g': return field_t::genre;
+        case 'l': return field_t::track_total;
+        case 'n': return field_t::track_number;
+        case 'o': return field_t::original_artist;
+        case 'p': return field_t::composer;
+        case 'r': return field_t::copyright;
+        case 't': return field_t::title;
+        case 'u': return field_t::url;
+        case 'x': return field_t::disc_total;
+        case 'y': return field_t::date;
+        case 'z': return field_t::album_artist;
         default:
             err_msg << "Unknown format specifier `%" << c << "'";
             throw std::out_of_range(err_msg.str().c_str());
     }
 }
 
-fs::path format_path_easytag(const fs::path &file, const string &format,
-                             const metadata &tag, const context &ctx)
+easytag_format::easytag_format(const string &format) :
+    format_{format}
 {
-    // Replace tokens in a format string.  Expect EasyTag-style expressions
-    // where each token is a '%' symbol followed by a single letter
-
-    string new_path_str;
-    string::size_type len = format.length();
-    string::size_type last_start = 0;
-    new_path_str.reserve(format.length());
-    for (auto found = format.find_first_of('%');
-         found != string::npos;
-         last_start = found + 1, found = format.find_first_of('%', found + 1))
+    // Expect EasyTag-style expressions where each token is a '%' symbol
+    // followed by a single letter
+    string literal;
+    for (string::size_type i = 0; i < format.length(); ++i)
     {
-        // Copy anything found so far to the new path
-        if (found > 0 && found > last_start)
-            new_path_str.append(format, last_start, found - last_start);
+        if (format[i] != '%')
+        {
+            literal += format[i];
+            continue;
+        }
         
         // Ensure no unfinished tokens at end of string
-        ++found;
-        if (found == len)
+        if (++i == format.length())
         {
             throw std::invalid_argument(
                 "Unmatched `%' sign at end of format string");
         }
-    
-        auto c = format[found];
-        // Decode the token, make sure it doesn't contain any path separator
-        // characters, and append to the path
-        new_path_str.append(std::regex_replace(
-            get_token_easytag(tag, c), std::regex{"[/\\\\]"}, "-"));
+        
+        // It's an actual percentage sign in the filename!
+        if (format[i] == '%')
+        {
+            literal += '%';
+            continue;
+        }
+        
+        segments_.push_back(segment{std::move(literal), field_for(format[i])});
+        literal.clear();
+    }
+    if (!literal.empty())
+        segments_.push_back(segment{std::move(literal), field_t::none});
+}
+
+// Append a field value, making sure it doesn't contain any path separator
+// characters
+static void append_field(string &out, const string &val)
+{
+    auto start = out.size();
+    out += val;
+    for (auto i = start; i < out.size(); ++i)
+    {
+        if (out[i] == '/' || out[i] == '\\')
+            out[i] = '-';
+    }
+}
+
+// Append a number, padded with zero if it is only one character long
+static void append_number(string &out, const string &val)
+{
+    if (val.length() == 1)
+        out += '0';
+    append_field(out, val);
+}
+
+void easytag_format::expand(const metadata &tag, string &out) const
+{
+    out.clear();
+    for (auto &seg : segments_)
+    {
+        out += seg.literal;
+        switch (seg.field)
+        {
+            case field_t::none:
+                break;
+            case field_t::artist:
+                append_field(out, tag.artist());
+                break;
+            case field_t::album:
+                append_field(out, tag.album());
+                break;
+            case field_t::comment:
+                append_field(out, tag.comment());
+                break;
+            case field_t::disc_number:
+                append_field(out, tag.disc_number());
+                break;
+            case field_t::encoded_by:
+                append_field(out, tag.encoded_by());
+                break;
+            case field_t::genre:
+                append_field(out, tag.genre());
+                break;
+            case field_t::track_total:
+                append_number(out, tag.track_total());
+                break;
+            case field_t::track_number:
+                append_number(out, tag.track_number());
+                break;
+            case field_t::original_artist:
+                append_field(out, tag.original_artist());
+                break;
+            case field_t::composer:
+                append_field(out, tag.composer());
+                break;
+            case field_t::copyright:
+                append_field(out, tag.copyright());
+                break;
+            case field_t::title:
+                append_field(out, tag.title());
+                break;
+            case field_t::url:
+                append_field(out, tag.url());
+                break;
+            case field_t::disc_total:
+                append_field(out, tag.disc_total());
+                break;
+            case field_t::date:
+                append_field(out, tag.date());
+                break;
+            case field_t::album_artist:
+            {
+                // Fall back to artist if album artist is not available
+                auto val = tag.album_artist();
+                append_field(out, val != "" ? val : tag.artist());
+                break;
+            }
+        }
     }
-    // If the string was empty, it means we didn't find any % tokens
-    // In such a case, just use the format as a hard-coded path
-    if (new_path_str == "")
-        new_path_str = format;
+    // If the string was empty, it means we didn't get anything from the
+    // format.  In such a case, just use the format as a hard-coded path
+    if (out.empty())
+        out = format_;
+}
+
+fs::path format_path_easytag(const fs::path &file, const string &format,
+                             const metadata &tag, const context &ctx)
+{
+    // Keep the last format used on this thread, which is almost always the
+    // same one, so that it needn't be parsed again for every file
+    thread_local std::unique_ptr<easytag_format> last_format;
+    if (!last_format || last_format->str() != format)
+        last_format.reset(new easytag_format{format});
+    return format_path_easytag(file, *last_format, tag, ctx);
+}
+
+fs::path format_path_easytag(const fs::path &file,
+                             const easytag_format &format,
+                             const metadata &tag, const context &ctx)
+{
+    // Expand into a buffer that is reused between files
+    thread_local string new_path_str;
+    format.expand(tag, new_path_str);
     
     // Construct the path, and make sure each element is suitable for writing
     // to the filesystem
@@ -173,11 +248,13 @@ fs::path format_path_easytag(const fs::path &file, const string &format,
     if (new_path.is_relative())
     {
         // Do we have a relative dir specifier like dot or dot-dot?
-        // If so, convert to absolute based on the current working directory.
+        // If so, convert to absolute based on the current working directory,
+        // or the directory that musicmove was asked to work from.
         if (new_path.has_parent_path() &&
             !new_path_str.empty() && new_path_str[0] == '.')
             // Path actually starts from CWD like an absolute path
-            new_path = fs::current_path() / new_path;
+            new_path = (ctx.base_dir.empty() ? fs::current_path() :
+                ctx.base_dir) / new_path;
         else
             // Path is relative.  This means relative to its current directory
             new_path = file.parent_path() / new_path;
@@ -55,6 +55,10 @@ fs::path format_path_easytag(const fs::path &file, const string &format,
     else if (typ == "010") p /= "Alb2/102-AA1-TT2";
     else if (typ == "011") p /= "Alb2/201-AA1-TT3";
     else if (typ == "012") p /= "Alb2/202-AA1-TT4";
+    // MOCK - keep the same filename, in a new directory
+    else if (typ == "021") p /= "Alb3/" + file.stem().string();
+    // MOCK - stay where it is
+    else if (typ == "022") p = file.parent_path() / file.stem();
     else
         throw std::out_of_range(typ.c_str());
     p += ext;
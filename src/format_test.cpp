@@ -295,5 +295,68 @@ BOOST_AUTO_TEST_CASE (easytag_format)
             "/foo/%g/%z/%b/%d%n-%a-%t",
             tag, ctx).string(),
         "/foo/genre/albumartist/album/discnumbertracknumber-artist-title.txt");
+
+    // Dot-relative formats start from the base directory, if one is given;
+    // a percent sign in it is left alone
+    ctx.base_dir = "/srv/100%a";
+    BOOST_CHECK_EQUAL(
+        mm::format_path_easytag(file,
+            "./%a/%t",
+            tag, ctx).string(),
+        "/srv/100%a/artist/title.txt");
+}
+
+
+BOOST_AUTO_TEST_CASE (easytag_format_compiled)
+{
+    mm::context ctx;
+    fs::path file{testdata_dir_str + "/foo.txt"};
+    mm::metadata tag{file};
+
+    // Malformed formats are rejected when parsed, before any file is used
+    BOOST_CHECK_THROW(mm::easytag_format{"/foo/%a/%"}, std::invalid_argument);
+    BOOST_CHECK_THROW(mm::easytag_format{"/foo/%q-%t"}, std::out_of_range);
+    BOOST_CHECK_NO_THROW(mm::easytag_format{"/foo/%%/%a"});
+
+    // The same compiled format can be applied many times
+    mm::easytag_format format{"/foo/%z/100%% %n - %t (live)"};
+    for (int i = 0; i < 3; ++i)
+    {
+        BOOST_CHECK_EQUAL(
+            mm::format_path_easytag(file, format, tag, ctx).string(),
+            "/foo/albumartist/100% tracknumber - title (live).txt");
+    }
+    string expanded;
+    format.expand(tag, expanded);
+    BOOST_CHECK_EQUAL(expanded, "/foo/albumartist/100% tracknumber - title (live)");
 }
 
+BOOST_AUTO_TEST_CASE (path_conversion_cached)
+{
+    mm::context posix_ctx;
+    posix_ctx.path_conversion = mm::path_conversion_t::posix;
+    mm::context utf8_ctx;
+    utf8_ctx.path_conversion = mm::path_conversion_t::utf8;
+
+    // Repeated conversions are served from the cache, separately for each
+    // kind of path conversion
+    auto before = mm::get_conversion_cache_stats();
+    for (int i = 0; i < 3; ++i)
+    {
+        BOOST_CHECK_EQUAL(convert_for_filesystem(
+            "Cached årtist", posix_ctx), "Cached_artist");
+        BOOST_CHECK_EQUAL(convert_for_filesystem(
+            "Cached årtist", utf8_ctx), "Cached årtist");
+    }
+    auto after = mm::get_conversion_cache_stats();
+    BOOST_CHECK_EQUAL(after.misses - before.misses, 2);
+    BOOST_CHECK_EQUAL(after.hits - before.hits, 4);
+
+    // Many distinct strings don't make the cache grow without bound, and
+    // evicted strings still convert correctly
+    for (int i = 0; i < 100000; ++i)
+        convert_for_filesystem("artist " + to_string(i), posix_ctx);
+    BOOST_CHECK_LE(mm::get_conversion_cache_stats().entries, 16 * 1024);
+    BOOST_CHECK_EQUAL(convert_for_filesystem(
+        "Cached årtist", posix_ctx), "Cached_artist");
+}
@@ -0,0 +1,724 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "fs_ops.hpp"
+
+#include <boost/filesystem.hpp>
+#include <cctype>
+#include <cerrno>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "posix_util.hpp"
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+namespace fs = boost::filesystem;
+
+namespace mm {
+
+using std::string;
+
+namespace {
+
+// Is a path the given directory, or somewhere beneath it?
+bool is_under(const string &path, const string &dir)
+{
+    return path.compare(0, dir.size(), dir) == 0 &&
+        (path.size() == dir.size() || path[dir.size()] == '/' ||
+         path[dir.size()] == fs::path::preferred_separator);
+}
+
+// Directories known to exist, shared by every thread until the run is over,
+// so that making the same destination directory for each file in it costs
+// nothing after the first.  The set is split into shards, each with its own
+// lock, so that it can be shared between threads without much contention.
+class directory_set
+{
+public:
+    bool contains(const string &dir)
+    {
+        auto &s = shard_for(dir);
+        std::lock_guard<std::mutex> lock{s.mutex};
+        return s.dirs.count(dir) > 0;
+    }
+    
+    void insert(const string &dir)
+    {
+        auto &s = shard_for(dir);
+        std::lock_guard<std::mutex> lock{s.mutex};
+        s.dirs.insert(dir);
+    }
+    
+    void erase(const string &dir)
+    {
+        auto &s = shard_for(dir);
+        std::lock_guard<std::mutex> lock{s.mutex};
+        s.dirs.erase(dir);
+    }
+    
+    // Forget a directory and everything beneath it
+    void erase_under(const string &dir)
+    {
+        for (auto &s : shards_)
+        {
+            std::lock_guard<std::mutex> lock{s.mutex};
+            for (auto iter = s.dirs.begin(); iter != s.dirs.end();)
+            {
+                if (is_under(*iter, dir))
+                    iter = s.dirs.erase(iter);
+                else
+                    ++iter;
+            }
+        }
+    }
+    
+    void clear()
+    {
+        for (auto &s : shards_)
+        {
+            std::lock_guard<std::mutex> lock{s.mutex};
+            s.dirs.clear();
+        }
+    }
+    
+private:
+    static const std::size_t shard_count = 16;
+    
+    struct shard
+    {
+        std::mutex mutex;
+        std::unordered_set<string> dirs;
+    };
+    
+    shard &shard_for(const string &dir)
+    {
+        return shards_[std::hash<string>{}(dir) % shard_count];
+    }
+    
+    std::array<shard, shard_count> shards_;
+};
+
+directory_set known_dirs;
+
+// Is a name one that transfer_file() gives a copy while writing it, i.e.
+// `.NAME.XXXXXXXX.part', where the Xs are hex digits?
+bool is_partial_copy(const string &name)
+{
+    static const string suffix{".part"};
+    const std::size_t unique_len = 8;
+    if (name.size() < 3 + unique_len + suffix.size() || name[0] != '.' ||
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+        return false;
+    auto unique_start = name.size() - suffix.size() - unique_len;
+    if (name[unique_start - 1] != '.')
+        return false;
+    for (auto i = unique_start; i < unique_start + unique_len; ++i)
+    {
+        if (!std::isxdigit(static_cast<unsigned char>(name[i])))
+            return false;
+    }
+    return true;
+}
+
+// Decide whether to list an entry
+bool wanted(const string &name, entry_kind kind)
+{
+    // Hidden directories, including `.' and `..', are left alone, as are
+    // copies still being written
+    if (name.empty() || name[0] != '.')
+        return true;
+    return kind != entry_kind::directory && !is_partial_copy(name);
+}
+
+} // anonymous namespace
+
+std::string_view extension_of(const fs::path &path)
+{
+    std::basic_string_view<fs::path::value_type> native{path.native()};
+    auto name_start = native.find_last_of(fs::path::preferred_separator);
+    name_start = name_start == native.npos ? 0 : name_start + 1;
+    auto dot = native.rfind('.');
+    
+    // A leading dot, or the names `.' and `..', aren't extensions
+    bool dot_dot = native.size() == name_start + 2 &&
+        native[name_start] == '.' && native[name_start + 1] == '.';
+    if (dot == native.npos || dot <= name_start || dot_dot)
+        return std::string_view{};
+#ifdef _WIN32
+    // Paths are wide here, so compare the extension as a narrow string
+    thread_local string narrow;
+    narrow = fs::path{native.substr(dot)}.string();
+    return narrow;
+#else
+    return native.substr(dot);
+#endif
+}
+
+bool extension_equals(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (std::size_t i = 0; i < a.size(); ++i)
+    {
+        auto ca = a[i], cb = b[i];
+        if (ca >= 'A' && ca <= 'Z')
+            ca += 'a' - 'A';
+        if (cb >= 'A' && cb <= 'Z')
+            cb += 'a' - 'A';
+        if (ca != cb)
+            return false;
+    }
+    return true;
+}
+
+#ifdef _WIN32
+
+// No directory handles here; just use paths
+
+dir_listing list_directory(const fs::path &dir)
+{
+    dir_listing listing;
+    for (auto iter = fs::directory_iterator{dir};
+         iter != fs::directory_iterator{}; ++iter)
+    {
+        auto status = iter->status();
+        auto kind = !fs::exists(status) ? entry_kind::missing
+            : fs::is_directory(status) ? entry_kind::directory
+            : entry_kind::file;
+        if (!wanted(iter->path().filename().string(), kind))
+            continue;
+        listing.push_back(dir_entry{iter->path(), kind});
+    }
+    return listing;
+}
+
+bool rename_no_replace(const fs::path &from, const fs::path &to)
+{
+    // This leaves a window in which a file that appears at the new path will
+    // be overwritten, but it's the best we can do.
+    if (fs::exists(to))
+        return false;
+    boost::system::error_code ec;
+    fs::rename(from, to, ec);
+    if (ec && remake_directories(to.parent_path()))
+        fs::rename(from, to, ec);
+    if (ec)
+        throw fs::filesystem_error{"rename_no_replace", from, to, ec};
+    return true;
+}
+
+bool rename_directory_no_replace(const fs::path &from, const fs::path &to)
+{
+    known_dirs.erase_under(from.lexically_normal().string());
+    return rename_no_replace(from, to);
+}
+
+void make_directories(const fs::path &dir)
+{
+    auto key = dir.lexically_normal().string();
+    if (known_dirs.contains(key))
+        return;
+    fs::create_directories(dir);
+    known_dirs.insert(key);
+}
+
+bool remake_directories(const fs::path &dir)
+{
+    auto normal = dir.lexically_normal();
+    if (!known_dirs.contains(normal.string()) || fs::is_directory(normal))
+        return false;
+    for (auto p = normal; !p.empty() && !fs::is_directory(p);
+         p = p.parent_path())
+        known_dirs.erase(p.string());
+    make_directories(normal);
+    return true;
+}
+
+void forget_directories()
+{
+    known_dirs.clear();
+}
+
+void remove_file(const fs::path &file)
+{
+    fs::remove(file);
+}
+
+bool remove_empty_directory(const fs::path &dir)
+{
+    if (!fs::is_empty(dir))
+        return false;
+    known_dirs.erase(dir.lexically_normal().string());
+    return fs::remove(dir);
+}
+
+#else
+
+namespace {
+
+#ifdef O_PATH
+// Handles are only ever used to look things up relative to
+const int dir_open_flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+#else
+const int dir_open_flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+#endif
+
+// Most directories we will have open at once, per thread
+const std::size_t max_dir_handles = 64;
+
+[[noreturn]] void throw_errno(const char *what, const fs::path &p, int err)
+{
+    throw fs::filesystem_error{what, p,
+        boost::system::error_code{err, boost::system::system_category()}};
+}
+
+[[noreturn]] void throw_errno(const char *what, const fs::path &p1,
+                              const fs::path &p2, int err)
+{
+    throw fs::filesystem_error{what, p1, p2,
+        boost::system::error_code{err, boost::system::system_category()}};
+}
+
+// The directory a path is in, and its name within that directory
+fs::path parent_of(const fs::path &p)
+{
+    auto parent = p.parent_path();
+    return parent.empty() ? fs::path{"."} : parent;
+}
+
+// Least-recently-used cache of open directory handles, keyed by path
+class dir_handle_cache
+{
+public:
+    dir_handle_cache() = default;
+    dir_handle_cache(const dir_handle_cache &) = delete;
+    dir_handle_cache &operator=(const dir_handle_cache &) = delete;
+    ~dir_handle_cache()
+    {
+        clear();
+    }
+    
+    // Close every handle
+    void clear()
+    {
+        for (auto &entry : handles_)
+            ::close(entry.second);
+        handles_.clear();
+        index_.clear();
+    }
+    
+    // Get a handle to a directory, or -1 with errno set if it can't be opened
+    int open(const fs::path &dir)
+    {
+        auto normal = dir.lexically_normal();
+        auto key = normal.string();
+        auto iter = index_.find(key);
+        if (iter != index_.end())
+        {
+            handles_.splice(handles_.begin(), handles_, iter->second);
+            return iter->second->second;
+        }
+        
+        // Look up just the last component, if we have its parent to hand,
+        // but go by the whole path if that doesn't work out
+        int fd = -1;
+        auto parent_iter = index_.find(normal.parent_path().string());
+        if (normal.has_parent_path() && parent_iter != index_.end())
+            fd = ::openat(parent_iter->second->second,
+                          normal.filename().c_str(), dir_open_flags);
+        if (fd < 0)
+            fd = ::open(normal.c_str(), dir_open_flags);
+        if (fd < 0)
+            return -1;
+        
+        if (handles_.size() >= max_dir_handles)
+        {
+            ::close(handles_.back().second);
+            index_.erase(handles_.back().first);
+            handles_.pop_back();
+        }
+        handles_.emplace_front(key, fd);
+        index_[key] = handles_.begin();
+        return fd;
+    }
+    
+    // Get a handle to a directory, throwing if it can't be opened
+    int open_or_throw(const fs::path &dir)
+    {
+        int fd = open(dir);
+        if (fd < 0)
+            throw_errno("open directory", dir, errno);
+        return fd;
+    }
+    
+    // Close any handles to a directory and everything beneath it, e.g. if it
+    // has been removed, or a handle no longer seems to lead anywhere
+    void forget(const fs::path &dir)
+    {
+        auto key = dir.lexically_normal().string();
+        for (auto iter = handles_.begin(); iter != handles_.end();)
+        {
+            const auto &path = iter->first;
+            if (is_under(path, key))
+            {
+                ::close(iter->second);
+                index_.erase(path);
+                iter = handles_.erase(iter);
+            }
+            else
+                ++iter;
+        }
+    }
+    
+    // Handles are only kept for as long as this stays the same
+    unsigned generation = 0;
+    
+private:
+    typedef std::list<std::pair<string, int>> handle_list;
+    handle_list handles_;
+    std::unordered_map<string, handle_list::iterator> index_;
+};
+
+// Bumped by forget_directories(), so that each thread drops the handles it
+// has before it next uses one
+std::atomic<unsigned> handle_generation{0};
+
+dir_handle_cache &dir_handles()
+{
+    thread_local dir_handle_cache cache;
+    auto generation = handle_generation.load(std::memory_order_acquire);
+    if (cache.generation != generation)
+    {
+        cache.clear();
+        cache.generation = generation;
+    }
+    return cache;
+}
+
+#if defined(__linux__) && defined(SYS_renameat2)
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+// Returns 0 on success, or an errno value
+int renameat2_no_replace(int from_dir, const char *from,
+                         int to_dir, const char *to)
+{
+    // Called directly, as older C libraries have no wrapper for it
+    if (::syscall(SYS_renameat2, from_dir, from, to_dir, to,
+                  RENAME_NOREPLACE) == 0)
+        return 0;
+    return errno;
+}
+
+#else
+
+int renameat2_no_replace(int, const char *, int, const char *)
+{
+    return ENOSYS;
+}
+
+#endif
+
+// Returns 0 on success, EEXIST if the new path is taken, or another errno
+int rename_at(int from_dir, const char *from, int to_dir, const char *to)
+{
+    int err = renameat2_no_replace(from_dir, from, to_dir, to);
+    
+    // The kernel or the filesystem doesn't support the flag?
+    if (err != EINVAL && err != ENOSYS && err != EOPNOTSUPP)
+        return err;
+    
+    // A hard link can't replace anything either, so try that before falling
+    // back on checking first.  Directories can't be linked, so they always
+    // take the slow way.
+    if (::linkat(from_dir, from, to_dir, to, 0) == 0)
+    {
+        if (::unlinkat(from_dir, from, 0) != 0)
+        {
+            err = errno;
+            ::unlinkat(to_dir, to, 0);
+            return err;
+        }
+        return 0;
+    }
+    err = errno;
+    if (err == EEXIST || err == EXDEV || err == ENOENT)
+        return err;
+    
+    // This leaves a window in which a file that appears at the new path will
+    // be overwritten, but it's the best we can do.
+    struct stat st;
+    if (::fstatat(to_dir, to, &st, AT_SYMLINK_NOFOLLOW) == 0)
+        return EEXIST;
+    if (::renameat(from_dir, from, to_dir, to) != 0)
+        return errno;
+    return 0;
+}
+
+// Size of the buffer that directory entries are read into at once
+const std::size_t dirent_buffer_size = 64 * 1024;
+
+// Find out what kind of thing an entry leads to, the slow way
+entry_kind look_up_kind(int dir_fd, const char *name, const fs::path &dir)
+{
+#if defined(__linux__) && defined(STATX_TYPE)
+    struct statx stx;
+    if (::statx(dir_fd, name, AT_NO_AUTOMOUNT, STATX_TYPE, &stx) == 0)
+        return S_ISDIR(stx.stx_mode) ? entry_kind::directory
+                                     : entry_kind::file;
+    if (errno != ENOSYS)
+    {
+        if (errno == ENOENT || errno == ELOOP)
+            return entry_kind::missing;
+        throw_errno("statx", dir / name, errno);
+    }
+#endif
+    struct stat st;
+    if (::fstatat(dir_fd, name, &st, 0) == 0)
+        return S_ISDIR(st.st_mode) ? entry_kind::directory : entry_kind::file;
+    if (errno == ENOENT || errno == ELOOP)
+        return entry_kind::missing;
+    throw_errno("fstatat", dir / name, errno);
+}
+
+} // anonymous namespace
+
+dir_listing list_directory(const fs::path &dir)
+{
+    fd_closer dir_fd{::open(dir.c_str(),
+                            O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+    if (dir_fd.fd < 0)
+        throw_errno("list_directory", dir, errno);
+    
+    dir_listing listing;
+    auto add = [&](const char *name, unsigned char type) {
+        entry_kind kind;
+        switch (type)
+        {
+        case DT_DIR:
+            kind = entry_kind::directory;
+            break;
+        case DT_LNK:
+        case DT_UNKNOWN:
+            kind = look_up_kind(dir_fd.fd, name, dir);
+            break;
+        default:
+            kind = entry_kind::file;
+            break;
+        }
+        if (!wanted(name, kind))
+            return;
+        listing.push_back(dir_entry{dir / name, kind});
+    };
+    
+#if defined(__linux__) && defined(SYS_getdents64)
+    // Read entries in bulk, straight from the kernel
+    struct linux_dirent64
+    {
+        std::uint64_t d_ino;
+        std::int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+    thread_local std::vector<char> buffer(dirent_buffer_size);
+    for (;;)
+    {
+        auto n = ::syscall(SYS_getdents64, dir_fd.fd, buffer.data(),
+                           buffer.size());
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw_errno("list_directory", dir, errno);
+        if (n == 0)
+            break;
+        for (long offset = 0; offset < n;)
+        {
+            auto entry = reinterpret_cast<const linux_dirent64 *>(
+                buffer.data() + offset);
+            add(entry->d_name, entry->d_type);
+            offset += entry->d_reclen;
+        }
+    }
+#else
+    DIR *d = ::fdopendir(dir_fd.fd);
+    if (d == nullptr)
+        throw_errno("list_directory", dir, errno);
+    dir_fd.fd = -1; // Now owned by the DIR
+    for (;;)
+    {
+        errno = 0;
+        struct dirent *entry = ::readdir(d);
+        if (entry == nullptr)
+            break;
+        add(entry->d_name, entry->d_type);
+    }
+    int err = errno;
+    ::closedir(d);
+    if (err != 0)
+        throw_errno("list_directory", dir, err);
+#endif
+    
+    return listing;
+}
+
+bool rename_no_replace(const fs::path &from, const fs::path &to)
+{
+    auto &handles = dir_handles();
+    auto from_dir = parent_of(from), to_dir = parent_of(to);
+    
+    int err = 0;
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        int from_fd = handles.open_or_throw(from_dir);
+        int to_fd = handles.open(to_dir);
+        if (to_fd < 0)
+            err = errno;
+        else
+            err = rename_at(from_fd, from.filename().c_str(),
+                            to_fd, to.filename().c_str());
+        if (err != ENOENT)
+            break;
+        
+        // One of the directories may have been replaced since we opened it,
+        // or the one we're moving to removed since we made it
+        handles.forget(from_dir);
+        handles.forget(to_dir);
+        remake_directories(to_dir);
+    }
+    
+    if (err == 0)
+        return true;
+    if (err == EEXIST)
+        return false;
+    throw_errno("rename_no_replace", from, to, err);
+}
+
+bool rename_directory_no_replace(const fs::path &from, const fs::path &to)
+{
+    // Handles to the directory would follow it to its new path, so they
+    // mustn't be found under the old one
+    auto normal = from.lexically_normal();
+    dir_handles().forget(normal);
+    known_dirs.erase_under(normal.string());
+    return rename_no_replace(normal, to);
+}
+
+void make_directories(const fs::path &dir)
+{
+    auto normal = dir.lexically_normal();
+    if (known_dirs.contains(normal.string()))
+        return;
+    
+    // Find the nearest ancestor that exists, noting those that don't
+    auto &handles = dir_handles();
+    std::vector<fs::path> missing;
+    for (auto p = normal; !known_dirs.contains(p.string()); p = parent_of(p))
+    {
+        if (handles.open(p) >= 0)
+        {
+            known_dirs.insert(p.string());
+            break;
+        }
+        if (errno != ENOENT)
+            throw_errno("make_directories", p, errno);
+        missing.push_back(p);
+    }
+    
+    // Create just the ones that are missing, from the top down
+    for (auto iter = missing.rbegin(); iter != missing.rend(); ++iter)
+    {
+        int parent_fd = handles.open_or_throw(parent_of(*iter));
+        if (::mkdirat(parent_fd, iter->filename().c_str(), 0777) != 0 &&
+            errno != EEXIST)
+            throw_errno("make_directories", *iter, errno);
+        known_dirs.insert(iter->string());
+    }
+}
+
+bool remake_directories(const fs::path &dir)
+{
+    auto normal = dir.lexically_normal();
+    struct stat st;
+    if (!known_dirs.contains(normal.string()) ||
+        ::stat(normal.c_str(), &st) == 0)
+        return false;
+    
+    // Any of its parents that went with it are no longer there either, and
+    // handles to them lead nowhere
+    auto &handles = dir_handles();
+    for (auto p = normal; !p.empty() && ::stat(p.c_str(), &st) != 0;
+         p = p.parent_path())
+    {
+        known_dirs.erase(p.string());
+        handles.forget(p);
+    }
+    make_directories(normal);
+    return true;
+}
+
+void forget_directories()
+{
+    known_dirs.clear();
+    handle_generation.fetch_add(1, std::memory_order_release);
+}
+
+void remove_file(const fs::path &file)
+{
+    auto dir = parent_of(file);
+    int dir_fd = dir_handles().open_or_throw(dir);
+    if (::unlinkat(dir_fd, file.filename().c_str(), 0) != 0)
+        throw_errno("remove_file", file, errno);
+}
+
+bool remove_empty_directory(const fs::path &dir)
+{
+    auto &handles = dir_handles();
+    auto normal = dir.lexically_normal();
+    handles.forget(normal);
+    known_dirs.erase(normal.string());
+    int parent_fd = handles.open_or_throw(parent_of(normal));
+    if (::unlinkat(parent_fd, normal.filename().c_str(), AT_REMOVEDIR) == 0)
+        return true;
+    if (errno == ENOTEMPTY || errno == EEXIST)
+        return false;
+    throw_errno("remove_empty_directory", dir, errno);
+}
+
+#endif // _WIN32
+
+} // namespace mm
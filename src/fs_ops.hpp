@@ -0,0 +1,99 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_FS_OPS_HPP
+#define MUSICMOVE_FS_OPS_HPP
+
+#include <boost/filesystem/path.hpp>
+#include <string_view>
+#include <vector>
+
+namespace mm {
+
+// Filesystem operations used when moving files.
+//
+// Each thread keeps a small cache of open handles to the directories it has
+// used most recently, and works relative to those, so that the kernel need
+// not look up every component of a long path again for each file.  Once a
+// directory is open, renames of its ancestors don't affect operations in it,
+// so handles are only kept until forget_directories() is called.
+// All of these throw boost::filesystem::filesystem_error on failure.
+
+// The extension of a path's filename, including the dot, or empty if it has
+// none.  Refers to the path's own storage rather than making a copy.
+std::string_view extension_of(const boost::filesystem::path &path);
+
+// Do two extensions match, ignoring the case of any ASCII letters?
+bool extension_equals(std::string_view a, std::string_view b);
+
+enum class entry_kind { missing, directory, file };
+
+struct dir_entry
+{
+    boost::filesystem::path path;
+    // What the entry leads to, following any symbolic link; missing if it
+    // is a link that leads nowhere
+    entry_kind kind;
+};
+
+typedef std::vector<dir_entry> dir_listing;
+
+// List the entries in a directory, in the order the filesystem gives them.
+// Hidden directories, whose names start with a dot, are left out, as are
+// the hidden files that transfer_file() writes copies to.  Where the
+// filesystem says what kind of thing each entry is, it is taken at its
+// word, so only links and entries of unknown kind have to be looked up.
+dir_listing list_directory(const boost::filesystem::path &dir);
+
+// Rename a file, unless something already exists at the new path, in which
+// case nothing is changed and false is returned.  Where the filesystem
+// allows it, the check and the rename happen as one atomic operation.
+bool rename_no_replace(const boost::filesystem::path &from,
+                       const boost::filesystem::path &to);
+
+// Rename a directory, along with everything in it, unless something already
+// exists at the new path, in which case nothing is changed and false is
+// returned.  Anything remembered about the directory and what is beneath it
+// is forgotten.
+bool rename_directory_no_replace(const boost::filesystem::path &from,
+                                 const boost::filesystem::path &to);
+
+// Create a directory, along with any of its parents that don't exist yet.
+// Directories made or found to exist are remembered until
+// forget_directories() is called, so asking for one again costs nothing.
+void make_directories(const boost::filesystem::path &dir);
+
+// If a directory that make_directories() made or found has gone since, e.g.
+// because something else removed it, forget it and make it again.  Returns
+// whether it did, so that whatever failed for want of it can be retried.
+bool remake_directories(const boost::filesystem::path &dir);
+
+// Forget every directory that make_directories() made or found, and close
+// the directory handles that every thread has cached.  Called at the start
+// of each run after the first in the same process, as anything may have
+// been removed or renamed in between.
+void forget_directories();
+
+// Remove a file
+void remove_file(const boost::filesystem::path &file);
+
+// Remove a directory if it is empty, returning whether it was removed
+bool remove_empty_directory(const boost::filesystem::path &dir);
+
+} // namespace mm
+
+#endif // MUSICMOVE_FS_OPS_HPP
@@ -0,0 +1,267 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "fs_ops.hpp"
+#include "test_fixture.hpp"
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE fs_ops_test
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+
+namespace fs = boost::filesystem;
+using namespace std;
+
+BOOST_AUTO_TEST_CASE (rename_no_replace_moves)
+{
+    fixture f;
+
+    fs::path s1{f.tmp_dir / "a.inc"};
+    fs::path d1{f.tmp_dir / "b.inc"};
+    ofstream{s1.string()} << "one";
+
+    BOOST_CHECK(mm::rename_no_replace(s1, d1));
+    BOOST_CHECK_EQUAL(fs::exists(s1), false);
+    BOOST_CHECK_EQUAL(read_file(d1), "one");
+}
+
+BOOST_AUTO_TEST_CASE (rename_no_replace_clash)
+{
+    fixture f;
+
+    fs::path s1{f.tmp_dir / "a.inc"};
+    fs::path d1{f.tmp_dir / "b.inc"};
+    ofstream{s1.string()} << "one";
+    ofstream{d1.string()} << "two";
+
+    // Neither file should be touched
+    BOOST_CHECK(!mm::rename_no_replace(s1, d1));
+    BOOST_CHECK_EQUAL(read_file(s1), "one");
+    BOOST_CHECK_EQUAL(read_file(d1), "two");
+}
+
+BOOST_AUTO_TEST_CASE (rename_no_replace_missing)
+{
+    fixture f;
+
+    BOOST_CHECK_THROW(mm::rename_no_replace(f.tmp_dir / "a.inc",
+                                            f.tmp_dir / "b.inc"),
+                      fs::filesystem_error);
+    BOOST_CHECK_THROW(mm::rename_no_replace(f.tmp_dir / "a.inc",
+                                            f.tmp_dir / "x" / "b.inc"),
+                      fs::filesystem_error);
+}
+
+BOOST_AUTO_TEST_CASE (make_and_remove_directories)
+{
+    fixture f;
+
+    fs::path d1{f.tmp_dir / "a" / "b" / "c"};
+    mm::make_directories(d1);
+    BOOST_CHECK(fs::is_directory(d1));
+    mm::make_directories(d1);
+
+    // Only empty directories are removed
+    fs::path s1{d1 / "a.inc"};
+    ofstream{s1.string()} << "one";
+    BOOST_CHECK(!mm::remove_empty_directory(d1));
+    mm::remove_file(s1);
+    BOOST_CHECK_EQUAL(fs::exists(s1), false);
+    BOOST_CHECK(mm::remove_empty_directory(d1));
+    BOOST_CHECK_EQUAL(fs::exists(d1), false);
+
+    // A directory can be made again after it has been removed
+    mm::make_directories(d1);
+    BOOST_CHECK(fs::is_directory(d1));
+    ofstream{s1.string()} << "one";
+    BOOST_CHECK(mm::rename_no_replace(s1, f.tmp_dir / "a" / "a.inc"));
+    BOOST_CHECK_EQUAL(read_file(f.tmp_dir / "a" / "a.inc"), "one");
+}
+
+BOOST_AUTO_TEST_CASE (rename_directory)
+{
+    fixture f;
+
+    fs::path d1{f.tmp_dir / "a" / "b"};
+    fs::path d2{f.tmp_dir / "c"};
+    fs::path d3{f.tmp_dir / "d"};
+    mm::make_directories(d1);
+    ofstream{(d1 / "a.inc").string()} << "one";
+    BOOST_CHECK(mm::rename_no_replace(d1 / "a.inc", d1 / "b.inc"));
+
+    // Whatever was known about the directory goes with it
+    BOOST_CHECK(mm::rename_directory_no_replace(f.tmp_dir / "a", d2));
+    BOOST_CHECK_EQUAL(read_file(d2 / "b" / "b.inc"), "one");
+    BOOST_CHECK_EQUAL(fs::exists(f.tmp_dir / "a"), false);
+    mm::make_directories(d1);
+    BOOST_CHECK(fs::is_directory(d1));
+    ofstream{(d1 / "a.inc").string()} << "two";
+    BOOST_CHECK(mm::rename_no_replace(d1 / "a.inc", d1 / "b.inc"));
+    BOOST_CHECK_EQUAL(read_file(d1 / "b.inc"), "two");
+    BOOST_CHECK_EQUAL(read_file(d2 / "b" / "b.inc"), "one");
+
+    // Nothing already there is replaced
+    fs::create_directory(d3);
+    BOOST_CHECK(!mm::rename_directory_no_replace(d2, d3));
+    BOOST_CHECK(fs::is_directory(d2));
+}
+
+BOOST_AUTO_TEST_CASE (directory_replaced)
+{
+    fixture f;
+
+    fs::path d1{f.tmp_dir / "a"};
+    fs::path s1{d1 / "a.inc"};
+    fs::path s2{d1 / "b.inc"};
+    mm::make_directories(d1);
+    ofstream{s1.string()} << "one";
+    BOOST_CHECK(mm::rename_no_replace(s1, s2));
+
+    // Replace the directory behind our backs
+    fs::remove_all(d1);
+    fs::create_directory(d1);
+    ofstream{s1.string()} << "two";
+    BOOST_CHECK(mm::rename_no_replace(s1, s2));
+    BOOST_CHECK_EQUAL(read_file(s2), "two");
+}
+
+BOOST_AUTO_TEST_CASE (directory_renamed_between_runs)
+{
+    fixture f;
+
+    fs::path d1{f.tmp_dir / "a" / "b"};
+    fs::path s1{f.tmp_dir / "a.inc"};
+    fs::path s2{f.tmp_dir / "b.inc"};
+    mm::make_directories(d1);
+    ofstream{s1.string()} << "one";
+    ofstream{s2.string()} << "two";
+    BOOST_CHECK(mm::rename_no_replace(s1, d1 / "a.inc"));
+
+    // Between runs, the directory is renamed and another takes its place.
+    // The next run moves into the new one, not the one its handle led to.
+    fs::rename(f.tmp_dir / "a", f.tmp_dir / "c");
+    fs::create_directories(d1);
+    mm::forget_directories();
+    BOOST_CHECK(mm::rename_no_replace(s2, d1 / "b.inc"));
+    BOOST_CHECK_EQUAL(read_file(d1 / "b.inc"), "two");
+    BOOST_CHECK(!fs::exists(f.tmp_dir / "c" / "b" / "b.inc"));
+}
+
+BOOST_AUTO_TEST_CASE (directory_removed)
+{
+    fixture f;
+
+    fs::path d1{f.tmp_dir / "a" / "b"};
+    fs::path s1{f.tmp_dir / "a.inc"};
+    fs::path s2{f.tmp_dir / "b.inc"};
+    mm::make_directories(d1);
+    ofstream{s1.string()} << "one";
+    BOOST_CHECK(mm::rename_no_replace(s1, d1 / "a.inc"));
+
+    // Remove the directory and its parent behind our backs.  Making it again
+    // costs nothing, as it is remembered, but moving into it still works.
+    fs::remove_all(f.tmp_dir / "a");
+    mm::make_directories(d1);
+    ofstream{s1.string()} << "two";
+    BOOST_CHECK(mm::rename_no_replace(s1, d1 / "a.inc"));
+    BOOST_CHECK_EQUAL(read_file(d1 / "a.inc"), "two");
+
+    // Only directories that were made or found before are made again, and
+    // only if they have gone
+    fs::remove_all(f.tmp_dir / "a");
+    BOOST_CHECK(!mm::remake_directories(f.tmp_dir / "c"));
+    BOOST_CHECK(mm::remake_directories(d1));
+    BOOST_CHECK(fs::is_directory(d1));
+    BOOST_CHECK(!mm::remake_directories(d1));
+    fs::remove_all(f.tmp_dir / "a");
+    ofstream{s2.string()} << "three";
+    BOOST_CHECK(mm::rename_no_replace(s2, d1 / "b.inc"));
+    BOOST_CHECK_EQUAL(read_file(d1 / "b.inc"), "three");
+
+    // Once forgotten, e.g. at the start of the next run, they are looked for
+    // and made again
+    fs::remove_all(f.tmp_dir / "a");
+    mm::forget_directories();
+    BOOST_CHECK(!mm::remake_directories(d1));
+    mm::make_directories(d1);
+    BOOST_CHECK(fs::is_directory(d1));
+
+    // Directories that were never made aren't made by a move
+    BOOST_CHECK_THROW(mm::rename_no_replace(d1 / "b.inc",
+                                            f.tmp_dir / "x" / "b.inc"),
+                      fs::filesystem_error);
+}
+
+BOOST_AUTO_TEST_CASE (list_directory_kinds)
+{
+    fixture f;
+
+    fs::create_directory(f.tmp_dir / "dir");
+    fs::create_directory(f.tmp_dir / ".hidden_dir");
+    ofstream{(f.tmp_dir / "file.inc").string()} << "one";
+    ofstream{(f.tmp_dir / ".hidden_file").string()} << "two";
+    ofstream{(f.tmp_dir / ".file.inc.0123abcd.part").string()} << "three";
+    ofstream{(f.tmp_dir / ".notes.part").string()} << "four";
+    fs::create_directory_symlink(f.tmp_dir / "dir", f.tmp_dir / "dir_link");
+    fs::create_symlink(f.tmp_dir / "file.inc", f.tmp_dir / "file_link");
+    fs::create_symlink(f.tmp_dir / "nowhere", f.tmp_dir / "broken_link");
+
+    auto listing = mm::list_directory(f.tmp_dir);
+    sort(listing.begin(), listing.end(),
+         [](const mm::dir_entry &a, const mm::dir_entry &b) {
+             return a.path < b.path;
+         });
+
+    // Hidden directories and copies still being written are left out, but
+    // other hidden files aren't, and links are followed
+    BOOST_REQUIRE_EQUAL(listing.size(), 7);
+    BOOST_CHECK_EQUAL(listing[0].path, f.tmp_dir / ".hidden_file");
+    BOOST_CHECK(listing[0].kind == mm::entry_kind::file);
+    BOOST_CHECK_EQUAL(listing[1].path, f.tmp_dir / ".notes.part");
+    BOOST_CHECK(listing[1].kind == mm::entry_kind::file);
+    BOOST_CHECK_EQUAL(listing[2].path, f.tmp_dir / "broken_link");
+    BOOST_CHECK(listing[2].kind == mm::entry_kind::missing);
+    BOOST_CHECK_EQUAL(listing[3].path, f.tmp_dir / "dir");
+    BOOST_CHECK(listing[3].kind == mm::entry_kind::directory);
+    BOOST_CHECK_EQUAL(listing[4].path, f.tmp_dir / "dir_link");
+    BOOST_CHECK(listing[4].kind == mm::entry_kind::directory);
+    BOOST_CHECK_EQUAL(listing[5].path, f.tmp_dir / "file.inc");
+    BOOST_CHECK(listing[5].kind == mm::entry_kind::file);
+    BOOST_CHECK_EQUAL(listing[6].path, f.tmp_dir / "file_link");
+    BOOST_CHECK(listing[6].kind == mm::entry_kind::file);
+
+    BOOST_CHECK_THROW(mm::list_directory(f.tmp_dir / "missing"),
+                      fs::filesystem_error);
+    BOOST_CHECK_THROW(mm::list_directory(f.tmp_dir / "file.inc"),
+                      fs::filesystem_error);
+}
+
+BOOST_AUTO_TEST_CASE (list_directory_large)
+{
+    fixture f;
+
+    // More entries than can be read in one go
+    for (int i = 0; i < 3000; ++i)
+        ofstream{(f.tmp_dir / ("file-with-a-longish-name-" +
+                               to_string(i) + ".inc")).string()};
+    BOOST_CHECK_EQUAL(mm::list_directory(f.tmp_dir).size(), 3000);
+}
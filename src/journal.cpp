@@ -0,0 +1,420 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "journal.hpp"
+#include "crc32c.hpp"
+#include "posix_util.hpp"
+
+#include <boost/filesystem.hpp>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = boost::filesystem;
+
+namespace mm {
+
+using std::string;
+using std::uint8_t;
+using std::uint32_t;
+using std::uint64_t;
+
+namespace {
+
+const char journal_magic[4] = {'M', 'M', 'J', 'L'};
+const uint32_t journal_version = 1;
+
+// Force the journal to disk once this many records have been written since
+// it last was, or once this long has passed, whichever comes first
+const std::size_t group_records = 1024;
+const std::chrono::seconds group_interval{1};
+
+struct file_header
+{
+    file_tag tag;
+    uint32_t reserved;
+    uint64_t settings;
+};
+
+// A record that begins a move is followed by its source and destination
+// paths.  A record that finishes one has neither.
+struct record_header
+{
+    // CRC-32C of the record, with this field zeroed, and the paths together
+    uint32_t checksum;
+    uint32_t source_length;
+    uint32_t destination_length;
+    uint8_t action;
+    uint8_t status;
+    uint16_t reserved;
+    uint64_t id;
+    tag_cache_key key;
+};
+
+static_assert(sizeof(file_header) == 24, "unexpected header padding");
+static_assert(sizeof(record_header) == 56, "unexpected record padding");
+
+int sync_data(int fd)
+{
+#ifdef __linux__
+    return ::fdatasync(fd);
+#else
+    return ::fsync(fd);
+#endif
+}
+
+uint32_t record_checksum(record_header record, const char *paths,
+                         std::size_t len)
+{
+    record.checksum = 0;
+    return crc32c(crc32c(0, &record, sizeof(record)), paths, len);
+}
+
+fs::path normalise(const fs::path &p)
+{
+    return fs::absolute(p).lexically_normal();
+}
+
+// Everything that could be read from a journal file
+struct journal_contents
+{
+    uint64_t settings = 0;
+    std::vector<journal_entry> entries;
+    std::unordered_map<uint64_t, std::size_t> index;
+    // Up to the end of the last whole record
+    std::size_t length = 0;
+    std::size_t size = 0;
+};
+
+journal_contents load(const fs::path &path)
+{
+    std::ifstream file{path.string(), std::ios::in | std::ios::binary};
+    if (!file)
+        throw journal_error{errno_message("Failed to open", path)};
+    string data{std::istreambuf_iterator<char>{file},
+                std::istreambuf_iterator<char>{}};
+
+    journal_contents contents;
+    contents.size = data.size();
+    file_header header;
+    if (data.size() < sizeof(header))
+        throw journal_error{path.string() + " is not a journal"};
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (std::memcmp(header.tag.magic, journal_magic,
+                    sizeof(journal_magic)) != 0)
+        throw journal_error{path.string() + " is not a journal"};
+    if (!header.tag.matches(journal_magic, journal_version))
+    {
+        throw journal_error{path.string() +
+                            " was written by another version or machine"};
+    }
+    contents.settings = header.settings;
+
+    // Anything after a damaged or incomplete record was written after it,
+    // so can't be trusted either
+    std::size_t pos = sizeof(header);
+    contents.length = pos;
+    for (;;)
+    {
+        record_header record;
+        if (data.size() - pos < sizeof(record))
+            break;
+        std::memcpy(&record, data.data() + pos, sizeof(record));
+        std::size_t paths_length = std::size_t{record.source_length} +
+                                   record.destination_length;
+        if (data.size() - pos - sizeof(record) < paths_length)
+            break;
+        auto *paths = data.data() + pos + sizeof(record);
+        if (record_checksum(record, paths, paths_length) != record.checksum)
+            break;
+        pos += sizeof(record) + paths_length;
+        contents.length = pos;
+
+        auto status = static_cast<journal_status>(record.status);
+        auto iter = contents.index.find(record.id);
+        if (status == journal_status::begun)
+        {
+            if (iter != contents.index.end())
+                continue;
+            journal_entry entry;
+            entry.id = record.id;
+            entry.action = static_cast<journal_action>(record.action);
+            entry.status = status;
+            entry.source = string{paths, record.source_length};
+            entry.destination = string{paths + record.source_length,
+                                       record.destination_length};
+            entry.key = record.key;
+            contents.index.emplace(entry.id, contents.entries.size());
+            contents.entries.push_back(std::move(entry));
+        }
+        else if (iter != contents.index.end())
+            contents.entries[iter->second].status = status;
+    }
+    return contents;
+}
+
+// Work out from what is on disk whether a move that was begun but never
+// finished was made: only if the destination is there and the source isn't
+journal_status settle(const journal_entry &entry)
+{
+    boost::system::error_code ec;
+    if (entry.action != journal_action::contained &&
+        fs::exists(fs::symlink_status(entry.source, ec)))
+    {
+        return journal_status::failed;
+    }
+    return fs::exists(fs::symlink_status(entry.destination, ec))
+        ? journal_status::done
+        : journal_status::failed;
+}
+
+} // anonymous namespace
+
+journal::journal(const fs::path &path, uint64_t settings) :
+    path_{path}, settings_{settings}, fd_{-1}, next_id_{1}, recorded_{0},
+    unsynced_{0}, last_sync_{std::chrono::steady_clock::now()},
+    resumed_{0}
+{
+    fd_closer fd{::open(path_.c_str(),
+                        O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC,
+                        0644)};
+    if (fd.fd < 0 && errno == EEXIST)
+        throw journal_error{"Journal " + path_.string() + " already exists"};
+    if (fd.fd < 0)
+        throw journal_error{errno_message("Failed to create", path_)};
+
+    file_header header{};
+    header.tag = file_tag::make(journal_magic, journal_version);
+    header.settings = settings_;
+    write_all<journal_error>(fd.fd, reinterpret_cast<const char *>(&header),
+                             sizeof(header), path_);
+
+    // Make sure the journal itself will still be there, whatever happens
+    if (::fsync(fd.fd) != 0)
+        throw journal_error{errno_message("Failed to sync", path_)};
+    auto dir = path_.parent_path().empty() ? fs::path{"."}
+                                           : path_.parent_path();
+    fd_closer dir_fd{::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+    if (dir_fd.fd >= 0)
+        ::fsync(dir_fd.fd);
+
+    std::swap(fd_, fd.fd);
+}
+
+journal::journal(const fs::path &path) :
+    path_{path}, settings_{0}, fd_{-1}, next_id_{1}, recorded_{0},
+    unsynced_{0}, last_sync_{std::chrono::steady_clock::now()},
+    resumed_{0}
+{
+    auto contents = load(path_);
+    settings_ = contents.settings;
+    loaded_ = std::move(contents.entries);
+    index_ = std::move(contents.index);
+
+    // Drop whatever was left of a record that was being written when the
+    // last run stopped, so that new records follow on from whole ones
+    if (contents.length < contents.size &&
+        ::truncate(path_.c_str(), contents.length) != 0)
+    {
+        throw journal_error{errno_message("Failed to truncate", path_)};
+    }
+    fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd_ < 0)
+        throw journal_error{errno_message("Failed to open", path_)};
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    for (std::size_t i = 0; i < loaded_.size(); ++i)
+    {
+        auto &entry = loaded_[i];
+        if (entry.id >= next_id_)
+            next_id_ = entry.id + 1;
+        if (entry.status == journal_status::begun)
+        {
+            entry.status = settle(entry);
+            journal_entry record;
+            record.id = entry.id;
+            record.action = entry.action;
+            record.status = entry.status;
+            write_record(record);
+        }
+        if (entry.action != journal_action::directory &&
+            entry.status == journal_status::done)
+        {
+            arrivals_[entry.destination.native()] = i;
+        }
+    }
+    sync_locked();
+}
+
+journal::~journal()
+{
+    if (fd_ >= 0)
+    {
+        sync_data(fd_);
+        ::close(fd_);
+    }
+}
+
+std::vector<journal_entry> journal::read(const fs::path &path)
+{
+    auto contents = load(path);
+    for (auto &entry : contents.entries)
+    {
+        if (entry.status == journal_status::begun)
+            entry.status = settle(entry);
+    }
+    return std::move(contents.entries);
+}
+
+uint64_t journal::begin(journal_action action, const fs::path &source,
+                        const fs::path &destination,
+                        const tag_cache_key &key)
+{
+    journal_entry entry;
+    entry.action = action;
+    entry.status = journal_status::begun;
+    entry.source = normalise(source);
+    entry.destination = normalise(destination);
+    entry.key = key;
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    entry.id = next_id_++;
+    write_record(entry);
+    ++recorded_;
+    auto id = entry.id;
+    pending_.emplace(id, std::move(entry));
+    return id;
+}
+
+void journal::finish(uint64_t id, journal_status status)
+{
+    journal_entry record;
+    record.id = id;
+    record.status = status;
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    auto iter = pending_.find(id);
+    if (iter != pending_.end())
+    {
+        record.action = iter->second.action;
+        pending_.erase(iter);
+    }
+    else
+    {
+        auto loaded = index_.find(id);
+        if (loaded == index_.end())
+            return;
+        loaded_[loaded->second].status = status;
+        record.action = loaded_[loaded->second].action;
+    }
+    write_record(record);
+}
+
+bool journal::arrived(const fs::path &file) const
+{
+    // Only ever read once the journal has been opened, so needs no lock
+    if (arrivals_.empty())
+        return false;
+    auto normal = normalise(file);
+    auto iter = arrivals_.find(normal.native());
+    if (iter == arrivals_.end())
+        return false;
+
+    // Renaming a file leaves its key as it was, but anything else that has
+    // happened to it since means it has to be read again
+    tag_cache_key key{};
+    if (!tag_cache::make_key(file, key) || !(key == loaded_[iter->second].key))
+        return false;
+    ++resumed_;
+    return true;
+}
+
+void journal::sync()
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+    sync_locked();
+}
+
+std::vector<journal_entry> journal::entries() const
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+    return loaded_;
+}
+
+void journal::write_record(const journal_entry &entry)
+{
+    // Once a write has failed part way, any record after it would be lost
+    // when the journal is read back, so nothing more can be noted
+    if (fd_ < 0)
+        throw journal_error{"Journal " + path_.string() +
+                            " can no longer be written"};
+
+    const auto &source = entry.source.native();
+    const auto &destination = entry.destination.native();
+    record_header record{};
+    record.source_length = static_cast<uint32_t>(source.size());
+    record.destination_length = static_cast<uint32_t>(destination.size());
+    record.action = static_cast<uint8_t>(entry.action);
+    record.status = static_cast<uint8_t>(entry.status);
+    record.id = entry.id;
+    record.key = entry.key;
+
+    string buf;
+    buf.reserve(sizeof(record) + source.size() + destination.size());
+    buf.append(reinterpret_cast<const char *>(&record), sizeof(record));
+    buf += source;
+    buf += destination;
+    record.checksum = record_checksum(record, buf.data() + sizeof(record),
+                                      buf.size() - sizeof(record));
+    std::memcpy(&buf[0], &record.checksum, sizeof(record.checksum));
+    try
+    {
+        write_all<journal_error>(fd_, buf.data(), buf.size(), path_);
+    }
+    catch (...)
+    {
+        ::close(fd_);
+        fd_ = -1;
+        throw;
+    }
+
+    // Written straight away, so that it outlasts the process, but only
+    // forced to disk along with the rest of its group
+    ++unsynced_;
+    if (unsynced_ >= group_records ||
+        std::chrono::steady_clock::now() - last_sync_ >= group_interval)
+    {
+        sync_locked();
+    }
+}
+
+void journal::sync_locked()
+{
+    if (fd_ < 0 || unsynced_ == 0)
+        return;
+    if (sync_data(fd_) != 0)
+        throw journal_error{errno_message("Failed to sync", path_)};
+    unsynced_ = 0;
+    last_sync_ = std::chrono::steady_clock::now();
+}
+
+} // namespace mm
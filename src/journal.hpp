@@ -0,0 +1,148 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_JOURNAL_HPP
+#define MUSICMOVE_JOURNAL_HPP
+
+#include "tag_cache.hpp"
+
+#include <boost/filesystem/path.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace mm {
+
+// What a journal entry moved: a file on its own, a whole directory, or a
+// file that went along with its directory and needs no undoing of its own
+enum class journal_action : std::uint8_t { file, directory, contained };
+
+// How far a move got: about to be made, made, not made, or put back
+enum class journal_status : std::uint8_t { begun, done, failed, undone };
+
+struct journal_entry
+{
+    journal_entry() :
+        id{0}, action{journal_action::file}, status{journal_status::begun},
+        source{}, destination{}, key{}
+    {}
+
+    std::uint64_t id;
+    journal_action action;
+    journal_status status;
+    // Absolute paths
+    boost::filesystem::path source;
+    boost::filesystem::path destination;
+    // What the source looked like just before it was moved
+    tag_cache_key key;
+};
+
+struct journal_error : std::runtime_error
+{
+    explicit journal_error(const std::string &what_arg) :
+        std::runtime_error(what_arg)
+    {}
+};
+
+// Append-only record of the moves made by a run, so that a run that is
+// interrupted can be resumed without reading again the files it had
+// already moved, and so that a run can be undone.
+//
+// Each move is noted before it is made, and again once it is known how it
+// turned out.  Every record is written as soon as it is made, so it
+// survives the process being killed, but records are only forced to disk
+// once per group, so that keeping a journal costs next to nothing.  After a
+// power cut, the moves in the last group may be missing.  Each record
+// carries a CRC-32C, and a journal is only read up to its first damaged or
+// incomplete record.  Moves that were begun but never finished are settled
+// by looking at what is on disk.
+class journal
+{
+public:
+    // Start a new journal for a run with the given settings.  Throws
+    // journal_error if the file already exists.
+    journal(const boost::filesystem::path &path, std::uint64_t settings);
+    // Carry on with a journal left by an earlier run.  Throws journal_error
+    // if it can't be read.
+    explicit journal(const boost::filesystem::path &path);
+    ~journal();
+    journal(const journal &) = delete;
+    journal &operator=(const journal &) = delete;
+
+    // Read a journal without changing it
+    static std::vector<journal_entry> read(
+        const boost::filesystem::path &path);
+
+    // Note a move that is about to be made, getting an id for it
+    std::uint64_t begin(journal_action action,
+                        const boost::filesystem::path &source,
+                        const boost::filesystem::path &destination,
+                        const tag_cache_key &key);
+
+    // Note how a move turned out
+    void finish(std::uint64_t id, journal_status status);
+
+    // Was a file moved to where it is by the run being resumed, and left
+    // unchanged since?
+    bool arrived(const boost::filesystem::path &file) const;
+
+    // Force everything noted so far to disk.  Throws journal_error on
+    // failure.
+    void sync();
+
+    // Every move that was in the journal when it was opened, in the order
+    // they were begun, as they stand now
+    std::vector<journal_entry> entries() const;
+
+    const boost::filesystem::path &path() const { return path_; }
+    std::uint64_t settings() const { return settings_; }
+    std::size_t recorded() const { return recorded_; }
+    std::size_t resumed() const { return resumed_; }
+
+private:
+    void write_record(const journal_entry &entry);
+    void sync_locked();
+
+    boost::filesystem::path path_;
+    std::uint64_t settings_;
+    int fd_;
+
+    mutable std::mutex mutex_;
+    std::uint64_t next_id_;
+    std::size_t recorded_;
+    std::size_t unsynced_;
+    std::chrono::steady_clock::time_point last_sync_;
+    // Moves begun since the journal was opened that haven't finished yet
+    std::unordered_map<std::uint64_t, journal_entry> pending_;
+    // Moves that were already in the journal, and where to find each one
+    std::vector<journal_entry> loaded_;
+    std::unordered_map<std::uint64_t, std::size_t> index_;
+
+    // Files moved by the run being resumed, by where they were moved to
+    std::unordered_map<std::string_view, std::size_t> arrivals_;
+    mutable std::atomic<std::size_t> resumed_;
+};
+
+} // namespace mm
+
+#endif // MUSICMOVE_JOURNAL_HPP
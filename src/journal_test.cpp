@@ -0,0 +1,218 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "journal.hpp"
+#include "test_fixture.hpp"
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE journal_test
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+
+namespace fs = boost::filesystem;
+using namespace std;
+
+struct journal_fixture : fixture
+{
+    journal_fixture() :
+        journal_path{tmp_dir / "run.journal"}
+    {}
+
+    const fs::path journal_path;
+};
+
+mm::tag_cache_key key_of(const fs::path &file)
+{
+    mm::tag_cache_key key{};
+    mm::tag_cache::make_key(file, key);
+    return key;
+}
+
+BOOST_AUTO_TEST_CASE (record_and_read)
+{
+    journal_fixture f;
+
+    fs::path s1{f.tmp_dir / "a.inc"};
+    fs::path d1{f.tmp_dir / "b" / "a.inc"};
+    {
+        mm::journal journal{f.journal_path, 42};
+        auto id1 = journal.begin(mm::journal_action::file, s1, d1,
+                                 mm::tag_cache_key{1, 2, 3, 4});
+        journal.finish(id1, mm::journal_status::done);
+        auto id2 = journal.begin(mm::journal_action::directory,
+                                 f.tmp_dir / "c", f.tmp_dir / "d",
+                                 mm::tag_cache_key{});
+        journal.finish(id2, mm::journal_status::failed);
+        BOOST_CHECK_EQUAL(journal.recorded(), 2);
+        BOOST_CHECK(id2 > id1);
+    }
+
+    auto entries = mm::journal::read(f.journal_path);
+    BOOST_REQUIRE_EQUAL(entries.size(), 2);
+    BOOST_CHECK(entries[0].action == mm::journal_action::file);
+    BOOST_CHECK(entries[0].status == mm::journal_status::done);
+    BOOST_CHECK_EQUAL(entries[0].source, s1);
+    BOOST_CHECK_EQUAL(entries[0].destination, d1);
+    BOOST_CHECK(entries[0].key == (mm::tag_cache_key{1, 2, 3, 4}));
+    BOOST_CHECK(entries[1].action == mm::journal_action::directory);
+    BOOST_CHECK(entries[1].status == mm::journal_status::failed);
+
+    // Carrying on keeps the settings, and numbers new moves after the old
+    mm::journal journal{f.journal_path};
+    BOOST_CHECK_EQUAL(journal.settings(), 42);
+    BOOST_CHECK_EQUAL(journal.entries().size(), 2);
+    auto id3 = journal.begin(mm::journal_action::file, d1, s1,
+                             mm::tag_cache_key{});
+    BOOST_CHECK(id3 > entries[1].id);
+    journal.finish(entries[0].id, mm::journal_status::undone);
+    journal.sync();
+    entries = mm::journal::read(f.journal_path);
+    BOOST_REQUIRE_EQUAL(entries.size(), 3);
+    BOOST_CHECK(entries[0].status == mm::journal_status::undone);
+}
+
+BOOST_AUTO_TEST_CASE (unfinished_moves_settled)
+{
+    journal_fixture f;
+
+    // Killed after one move was made, and before another was
+    fs::path s1{f.tmp_dir / "a.inc"};
+    fs::path d1{f.tmp_dir / "b.inc"};
+    fs::path s2{f.tmp_dir / "c.inc"};
+    fs::path d2{f.tmp_dir / "d.inc"};
+    ofstream{s1.string()} << "one";
+    ofstream{s2.string()} << "two";
+    {
+        mm::journal journal{f.journal_path, 1};
+        journal.begin(mm::journal_action::file, s1, d1, key_of(s1));
+        fs::rename(s1, d1);
+        journal.begin(mm::journal_action::file, s2, d2, key_of(s2));
+    }
+
+    // What is on disk says how far each got
+    auto entries = mm::journal::read(f.journal_path);
+    BOOST_REQUIRE_EQUAL(entries.size(), 2);
+    BOOST_CHECK(entries[0].status == mm::journal_status::done);
+    BOOST_CHECK(entries[1].status == mm::journal_status::failed);
+
+    // Once carried on with, that is settled for good
+    mm::journal{f.journal_path};
+    fs::rename(d1, s1);
+    entries = mm::journal::read(f.journal_path);
+    BOOST_REQUIRE_EQUAL(entries.size(), 2);
+    BOOST_CHECK(entries[0].status == mm::journal_status::done);
+}
+
+BOOST_AUTO_TEST_CASE (damaged_tail)
+{
+    journal_fixture f;
+
+    {
+        mm::journal journal{f.journal_path, 1};
+        for (int i = 0; i < 3; ++i)
+        {
+            auto id = journal.begin(mm::journal_action::file,
+                f.tmp_dir / ("s" + to_string(i)),
+                f.tmp_dir / ("d" + to_string(i)), mm::tag_cache_key{});
+            journal.finish(id, mm::journal_status::failed);
+        }
+    }
+    auto size = fs::file_size(f.journal_path);
+
+    // Half a record, as if the last run was killed while writing it
+    fs::resize_file(f.journal_path, size - 30);
+    BOOST_CHECK_EQUAL(mm::journal::read(f.journal_path).size(), 3);
+
+    // A record that fails its checksum, and everything after it, is lost
+    fs::path damaged{f.tmp_dir / "damaged.journal"};
+    fs::copy_file(f.journal_path, damaged);
+    {
+        fstream file{damaged.string(), ios::in | ios::out | ios::binary};
+        file.seekp(size / 2);
+        file.put('x');
+    }
+    auto entries = mm::journal::read(damaged);
+    BOOST_CHECK(entries.size() < 3);
+
+    // New records follow on from the last whole one
+    {
+        // The half record gives way to the outcome of the move it would
+        // have finished, as found on disk
+        mm::journal journal{f.journal_path};
+        BOOST_CHECK_EQUAL(fs::file_size(f.journal_path), size);
+        auto id = journal.begin(mm::journal_action::file, f.tmp_dir / "s3",
+                                f.tmp_dir / "d3", mm::tag_cache_key{});
+        journal.finish(id, mm::journal_status::failed);
+    }
+    entries = mm::journal::read(f.journal_path);
+    BOOST_REQUIRE_EQUAL(entries.size(), 4);
+    BOOST_CHECK_EQUAL(entries[3].source, f.tmp_dir / "s3");
+    BOOST_CHECK(entries[3].status == mm::journal_status::failed);
+}
+
+BOOST_AUTO_TEST_CASE (arrived_files)
+{
+    journal_fixture f;
+
+    fs::path s1{f.tmp_dir / "a.inc"};
+    fs::path d1{f.tmp_dir / "b" / "a.inc"};
+    fs::path s2{f.tmp_dir / "c.inc"};
+    fs::path d2{f.tmp_dir / "b" / "c.inc"};
+    fs::create_directory(f.tmp_dir / "b");
+    ofstream{s1.string()} << "one";
+    ofstream{s2.string()} << "two";
+    {
+        mm::journal journal{f.journal_path, 1};
+        auto id1 = journal.begin(mm::journal_action::file, s1, d1,
+                                 key_of(s1));
+        fs::rename(s1, d1);
+        journal.finish(id1, mm::journal_status::done);
+        auto id2 = journal.begin(mm::journal_action::file, s2, d2,
+                                 key_of(s2));
+        fs::rename(s2, d2);
+        journal.finish(id2, mm::journal_status::done);
+
+        // Only moves made by an earlier run count
+        BOOST_CHECK(!journal.arrived(d1));
+    }
+
+    // Anything changed since it was moved has to be read again
+    fs::last_write_time(d2, fs::last_write_time(d2) - 10);
+    mm::journal journal{f.journal_path};
+    BOOST_CHECK(journal.arrived(d1));
+    BOOST_CHECK(journal.arrived(f.tmp_dir / "b" / "." / "a.inc"));
+    BOOST_CHECK(!journal.arrived(d2));
+    BOOST_CHECK(!journal.arrived(s1));
+    BOOST_CHECK_EQUAL(journal.resumed(), 2);
+}
+
+BOOST_AUTO_TEST_CASE (refused_files)
+{
+    journal_fixture f;
+
+    // A new journal never replaces anything
+    ofstream{f.journal_path.string()} << "not a journal";
+    BOOST_CHECK_THROW(mm::journal(f.journal_path, 1), mm::journal_error);
+    BOOST_CHECK_THROW(mm::journal{f.journal_path}, mm::journal_error);
+    BOOST_CHECK_THROW(mm::journal::read(f.journal_path), mm::journal_error);
+    BOOST_CHECK_THROW(mm::journal{f.tmp_dir / "missing.journal"},
+                      mm::journal_error);
+}
@@ -17,10 +17,13 @@
 */
 #include "metadata.hpp"
 #include "metadata_base.hpp"
+#include "metadata_native.hpp"
 #include "metadata_flac.hpp"
 #include "metadata_mp4.hpp"
 #include "metadata_mpeg.hpp"
 #include "metadata_ogg_vorbis.hpp"
+#include "tag_cache.hpp"
+#include "fs_ops.hpp"
 
 #include <boost/filesystem.hpp>
 #include <memory>
@@ -28,6 +31,7 @@
 #include <string>
 #include <sstream>
 #include <stdexcept>
+#include <utility>
 
 namespace fs = boost::filesystem;
 
@@ -35,19 +39,44 @@ namespace mm {
 
 using std::string;
 
-std::unique_ptr<metadata::base_impl> metadata::make_impl(const fs::path &path)
+std::unique_ptr<metadata::base_impl> metadata::make_impl(
+        const fs::path &path, const context &ctx)
 {
-    // Select metadata impl based on file extension (assume lowercase ASCII)
+    // Select metadata impl based on file extension (assume lowercase ASCII).
+    // Try the native reader first if asked, and fall back to TagLib for
+    // anything it doesn't understand.
     string ext{path.extension().c_str()};
     std::transform(std::begin(ext), std::end(ext), std::begin(ext), ::tolower);
+    property_values props;
     if (ext == ".flac")
+    {
+        if (ctx.native_tag_reader && read_flac_properties(path, props))
+            return std::unique_ptr<metadata::base_impl>{
+                new flac_impl{std::move(props)}};
         return std::unique_ptr<metadata::base_impl>{new flac_impl{path}};
+    }
     if (ext == ".m4a")
+    {
+        if (ctx.native_tag_reader && read_mp4_properties(path, props))
+            return std::unique_ptr<metadata::base_impl>{
+                new mp4_impl{std::move(props)}};
         return std::unique_ptr<metadata::base_impl>{new mp4_impl{path}};
+    }
     if (ext == ".mp3")
+    {
+        if (ctx.native_tag_reader && read_mpeg_properties(path, props))
+            return std::unique_ptr<metadata::base_impl>{
+                new mpeg_impl{std::move(props)}};
         return std::unique_ptr<metadata::base_impl>{new mpeg_impl{path}};
+    }
     if (ext == ".ogg")
-        return std::unique_ptr<metadata::base_impl>{new ogg_vorbis_impl{path}};
+    {
+        if (ctx.native_tag_reader && read_ogg_vorbis_properties(path, props))
+            return std::unique_ptr<metadata::base_impl>{
+                new ogg_vorbis_impl{std::move(props)}};
+        return std::unique_ptr<metadata::base_impl>{
+            new ogg_vorbis_impl{path}};
+    }
     
     std::stringstream err_msg;
     err_msg << "Unrecognised file extension "
@@ -57,9 +86,37 @@ std::unique_ptr<metadata::base_impl> metadata::make_impl(const fs::path &path)
     throw std::out_of_range{err_msg.str().c_str()};
 }
 
-metadata::metadata(const fs::path &path) :
-    impl_{make_impl(path)}
-{}
+bool metadata::supports(const fs::path &path)
+{
+    // Must match the extensions known to make_impl()
+    static const char *const extensions[] = {".flac", ".m4a", ".mp3", ".ogg"};
+    auto ext = extension_of(path);
+    for (auto known : extensions)
+    {
+        if (extension_equals(ext, known))
+            return true;
+    }
+    return false;
+}
+
+metadata::metadata(const fs::path &path, const context &ctx)
+{
+    // Unchanged files can be served from the tag cache without opening them
+    tag_cache_key key;
+    bool cacheable = ctx.cache && tag_cache::make_key(path, key);
+    tag_record record;
+    if (cacheable && ctx.cache->find(key, record))
+    {
+        impl_.reset(new base_impl{record});
+        return;
+    }
+
+    impl_ = make_impl(path, ctx);
+    // Everything we need is in the record now, so don't hold the file open
+    impl_->close();
+    if (cacheable)
+        ctx.cache->insert(key, impl_->record());
+}
 
 metadata::~metadata()
 {}
@@ -69,22 +126,22 @@ void metadata::print_properties(std::ostream &os)
     impl_->print_properties(os);
 }
 
-bool   metadata::has_tag()         const { return impl_->has_tag(); }
-string metadata::album()           const { return impl_->album(); }
-string metadata::album_artist()    const { return impl_->album_artist(); }
-string metadata::artist()          const { return impl_->artist(); }
-string metadata::comment()         const { return impl_->comment(); }
-string metadata::composer()        const { return impl_->composer(); }
-string metadata::copyright()       const { return impl_->copyright(); }
-string metadata::encoded_by()      const { return impl_->encoded_by(); }
-string metadata::date()            const { return impl_->date(); }
-string metadata::disc_number()     const { return impl_->disc_number(); }
-string metadata::disc_total()      const { return impl_->disc_total(); }
-string metadata::genre()           const { return impl_->genre(); }
-string metadata::original_artist() const { return impl_->original_artist(); }
-string metadata::title()           const { return impl_->title(); }
-string metadata::track_number()    const { return impl_->track_number(); }
-string metadata::track_total()     const { return impl_->track_total(); }
-string metadata::url()             const { return impl_->url(); }
+bool   metadata::has_tag()         const { return impl_->record().has_tag; }
+string metadata::album()           const { return impl_->record().album; }
+string metadata::album_artist()    const { return impl_->record().album_artist; }
+string metadata::artist()          const { return impl_->record().artist; }
+string metadata::comment()         const { return impl_->record().comment; }
+string metadata::composer()        const { return impl_->record().composer; }
+string metadata::copyright()       const { return impl_->record().copyright; }
+string metadata::encoded_by()      const { return impl_->record().encoded_by; }
+string metadata::date()            const { return impl_->record().date; }
+string metadata::disc_number()     const { return impl_->record().disc_number; }
+string metadata::disc_total()      const { return impl_->record().disc_total; }
+string metadata::genre()           const { return impl_->record().genre; }
+string metadata::original_artist() const { return impl_->record().original_artist; }
+string metadata::title()           const { return impl_->record().title; }
+string metadata::track_number()    const { return impl_->record().track_number; }
+string metadata::track_total()     const { return impl_->record().track_total; }
+string metadata::url()             const { return impl_->record().url; }
 
 } // namespace mm
@@ -18,6 +18,8 @@
 #ifndef MUSICMOVE_METADATA_HPP
 #define MUSICMOVE_METADATA_HPP
 
+#include "context.hpp"
+
 #include <boost/filesystem.hpp>
 #include <string>
 #include <memory>
@@ -25,10 +27,35 @@
 
 namespace mm {
 
+// Tag values for a single file, normalised for use by musicmove
+struct tag_record
+{
+    tag_record() : has_tag{false} {}
+
+    bool has_tag;
+    std::string album;
+    std::string album_artist;
+    std::string artist;
+    std::string comment;
+    std::string composer;
+    std::string copyright;
+    std::string date;
+    std::string disc_number;
+    std::string disc_total;
+    std::string encoded_by;
+    std::string genre;
+    std::string original_artist;
+    std::string title;
+    std::string track_number;
+    std::string track_total;
+    std::string url;
+};
+
 class metadata
 {
 public:
-    metadata(const boost::filesystem::path &path);
+    metadata(const boost::filesystem::path &path,
+             const context &ctx = context{});
     ~metadata();
     
     bool has_tag() const;
@@ -51,6 +78,10 @@ public:
     std::string url() const;
 
     void print_properties(std::ostream &os);
+    
+    // Can tags be read from a file like this one?  Goes by the file's name
+    // alone, so it costs next to nothing.
+    static bool supports(const boost::filesystem::path &path);
 
 private:
     class base_impl;
@@ -58,7 +89,8 @@ private:
     class mp4_impl;
     class mpeg_impl;
     class ogg_vorbis_impl;
-    static std::unique_ptr<base_impl> make_impl(const boost::filesystem::path &path);
+    static std::unique_ptr<base_impl> make_impl(
+            const boost::filesystem::path &path, const context &ctx);
     
     std::unique_ptr<base_impl> impl_;
 };
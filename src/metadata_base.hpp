@@ -19,11 +19,21 @@
 #define MUSICMOVE_METADATA_BASE_HPP
 
 #include "metadata.hpp"
+#include "metadata_native.hpp"
 
 #include <tpropertymap.h>
 #include <tfile.h>
-#include <fileref.h>
+#include <tiostream.h>
+#include <algorithm>
+#include <memory>
 #include <ostream>
+#include <utility>
+
+#ifdef _WIN32
+#include <tfilestream.h>
+#else
+#include "metadata_stream.hpp"
+#endif
 
 namespace fs = boost::filesystem;
 
@@ -32,38 +42,48 @@ namespace mm {
 class metadata::base_impl
 {
 public:
-    base_impl(const fs::path &path) :
-        file_ref_{path.string().c_str()},
-        file_ptr_{file_ref_.file()}
+    // Function to open a specific type of TagLib file on a stream
+    typedef TagLib::File *(*file_opener)(TagLib::IOStream *stream);
+
+    base_impl(const fs::path &path, file_opener open_file) :
+        stream_{open_stream(path)},
+        file_{open_file(stream_.get())},
+        props_{file_->isValid()
+            ? first_values(file_->properties())
+            : property_values{}}
+    {
+        fill_record(file_->isValid() && file_->tag() != nullptr);
+    }
+
+    // Construct from a record that has already been normalised
+    base_impl(const tag_record &record) :
+        record_{record}
     {}
+
+    // Construct from properties already read by one of the native readers
+    base_impl(property_values &&props) :
+        props_{std::move(props)}
+    {
+        fill_record(true);
+    }
     virtual ~base_impl() {}
     
-    bool has_tag() const { return file_ptr_->tag() != nullptr; }
+    const tag_record &record() const { return record_; }
     
-    virtual std::string album()           const { return get_prop("ALBUM"); }
-    virtual std::string album_artist()    const { return get_prop("ALBUMARTIST"); }
-    virtual std::string artist()          const { return get_prop("ARTIST"); }
-    virtual std::string comment()         const { return get_prop("COMMENT"); }
-    virtual std::string composer()        const { return get_prop("COMPOSER"); }
-    virtual std::string copyright()       const { return get_prop("COPYRIGHT"); }
-    virtual std::string encoded_by()      const { return get_prop("ENCODEDBY"); }
-    virtual std::string date()            const { return get_prop("DATE"); }
-    virtual std::string disc_number()     const { return get_prop("DISCNUMBER"); }
-    virtual std::string disc_total()      const { return get_prop("DISCTOTAL"); }
-    virtual std::string genre()           const { return get_prop("GENRE"); }
-    virtual std::string original_artist() const { return get_prop("PERFORMER"); }
-    virtual std::string title()           const { return get_prop("TITLE"); }
-    virtual std::string track_number()    const { return get_prop("TRACKNUMBER"); }
-    virtual std::string track_total()     const { return get_prop("TRACKTOTAL"); }
-    virtual std::string url()             const { return get_prop("CONTACT"); }
+    // Release the underlying file once the record has been built
+    void close()
+    {
+        props_.clear();
+        file_.reset();
+        stream_.reset();
+    }
 
     #define TEST_AND_PRINT(tagname) \
-        auto tagname ## _val = tagname(); \
-        if (tagname ## _val != "") { \
-            os << #tagname " -> " << tagname ## _val << std::endl; \
+        if (record_.tagname != "") { \
+            os << #tagname " -> " << record_.tagname << std::endl; \
         }
 
-    void print_properties(std::ostream &os)
+    void print_properties(std::ostream &os) const
     {
         TEST_AND_PRINT(album);
         TEST_AND_PRINT(album_artist);
@@ -86,28 +106,98 @@ public:
     #undef TEST_AND_PRINT
 
 protected:
-    const TagLib::PropertyMap properties() const
+    std::string get_prop(const char *name) const
     {
-        return file_ptr_->properties();
+        auto iter = props_.find(name);
+        if (iter == props_.end())
+            return "";
+        return iter->second;
     }
-
-    std::string get_prop(const char *name, size_t index = 0) const
+    
+    // Get the number from a value in the format "NUMBER/TOTAL"
+    static std::string number_part(std::string val)
     {
-        auto vals = properties()[name];
-        if (vals.isEmpty())
-            return "";
-        if (index >= vals.size())
-            return "";
-        auto val = vals[index];
-        // Get UTF-8 encoding of the property value
-        return val.to8Bit(true);
+        // Remove anything after forward slash, if there is one.
+        auto pos = val.find_first_of('/');
+        if (pos != std::string::npos)
+            val.erase(pos);
+        return val;
+    }
+    
+    // Get the total from a value in the format "NUMBER/TOTAL"
+    static std::string total_part(std::string val)
+    {
+        // Remove up to and including a forward slash, if there is one.
+        auto pos = val.find_first_of('/');
+        if (pos != std::string::npos)
+            val.erase(0, std::min(pos + 1, val.size()));
+        else
+            val = "";
+        return val;
+    }
+    
+    static std::string strip_leading_zeroes(std::string val)
+    {
+        val.erase(0, std::min(val.find_first_not_of('0'), val.size()-1));
+        return val;
     }
     
-    const TagLib::File *file_ptr() const { return file_ptr_; }
+    const TagLib::File *file_ptr() const { return file_.get(); }
+    
+    tag_record record_;
     
 private:
-    TagLib::FileRef file_ref_;
-    TagLib::File *file_ptr_;
+    // Take the common properties from a single snapshot of the property
+    // map.  Subclasses adjust the record for their own tag format in
+    // their constructors, so that accessors need do no further work.
+    void fill_record(bool has_tag)
+    {
+        record_.has_tag         = has_tag;
+        record_.album           = get_prop("ALBUM");
+        record_.album_artist    = get_prop("ALBUMARTIST");
+        record_.artist          = get_prop("ARTIST");
+        record_.comment         = get_prop("COMMENT");
+        record_.composer        = get_prop("COMPOSER");
+        record_.copyright       = get_prop("COPYRIGHT");
+        record_.encoded_by      = get_prop("ENCODEDBY");
+        record_.date            = get_prop("DATE");
+        record_.disc_number     = get_prop("DISCNUMBER");
+        record_.disc_total      = get_prop("DISCTOTAL");
+        record_.genre           = get_prop("GENRE");
+        record_.original_artist = get_prop("PERFORMER");
+        record_.title           = get_prop("TITLE");
+        record_.track_number    = get_prop("TRACKNUMBER");
+        record_.track_total     = get_prop("TRACKTOTAL");
+        record_.url             = get_prop("CONTACT");
+    }
+
+    // Get UTF-8 encoding of the first value of each property
+    static property_values first_values(const TagLib::PropertyMap &map)
+    {
+        property_values props;
+        for (auto &prop : map)
+        {
+            if (!prop.second.isEmpty())
+                props.emplace(prop.first.to8Bit(true),
+                              prop.second.front().to8Bit(true));
+        }
+        return props;
+    }
+
+    static std::unique_ptr<TagLib::IOStream> open_stream(const fs::path &path)
+    {
+        // Open files read-only; musicmove never writes tags back.
+#ifdef _WIN32
+        return std::unique_ptr<TagLib::IOStream>{
+            new TagLib::FileStream{path.c_str(), true}};
+#else
+        return std::unique_ptr<TagLib::IOStream>{new readonly_stream{path}};
+#endif
+    }
+
+    std::unique_ptr<TagLib::IOStream> stream_;
+    std::unique_ptr<TagLib::File> file_;
+    property_values props_;
 };
 
 } // namespace mm
@@ -20,6 +20,8 @@
 
 #include "metadata.hpp"
 
+#include <flacfile.h>
+#include <id3v2framefactory.h>
 #include <algorithm>
 
 namespace fs = boost::filesystem;
@@ -30,71 +32,45 @@ class metadata::flac_impl : public metadata::base_impl
 {
 public:
     flac_impl(const fs::path &path) :
-        base_impl{path}
-    {}
-    ~flac_impl() {}
-    
-    virtual std::string comment() const { return get_prop("DESCRIPTION"); }
-    virtual std::string disc_number() const
+        base_impl{path, &open_file}
     {
-        auto val = base_impl::disc_number();
-        // Remove anything after forward slash, if format is "DISC/TOTAL".
-        auto pos = val.find_first_of('/');
-        if (pos != std::string::npos)
-            val.erase(pos);
-        return val;
+        normalise();
     }
-    virtual std::string disc_total() const
+    flac_impl(property_values &&props) :
+        base_impl{std::move(props)}
     {
-        auto val = base_impl::disc_total();
-        if (val != "")
-        {
-            // Remove leading zeroes
-            val.erase(0, std::min(val.find_first_not_of('0'), val.size()-1));
-            return val;
-        }
-        // Try looking for the field in disc number
-        val = base_impl::disc_number();
-        // Remove up to and including a forward slash if format is DISC/TOTAL.
-        auto pos = val.find_first_of('/');
-        if (pos != std::string::npos)
-            val.erase(0, std::min(pos + 1, val.size()));
-        else
-            val = "";
-        return val;
+        normalise();
     }
-    virtual std::string encoded_by() const { return get_prop("ENCODED-BY"); }
-    virtual std::string track_number() const
+    ~flac_impl() {}
+    
+private:
+    void normalise()
     {
-        auto val = base_impl::track_number();
-        // Remove anything after forward slash, if format is "TRACK/TOTAL".
-        auto pos = val.find_first_of('/');
-        if (pos != std::string::npos)
-            val.erase(pos);
-        // Remove leading zeroes
-        val.erase(0, std::min(val.find_first_not_of('0'), val.size()-1));
-        return val;
+        record_.comment = get_prop("DESCRIPTION");
+        record_.encoded_by = get_prop("ENCODED-BY");
+        
+        // Totals may be held in their own field, or in the number field if
+        // it is in the format "NUMBER/TOTAL".
+        if (record_.disc_total != "")
+            record_.disc_total = strip_leading_zeroes(record_.disc_total);
+        else
+            record_.disc_total = total_part(record_.disc_number);
+        record_.disc_number = number_part(record_.disc_number);
+        
+        if (record_.track_total != "")
+            record_.track_total = strip_leading_zeroes(record_.track_total);
+        else
+            record_.track_total = strip_leading_zeroes(
+                total_part(record_.track_number));
+        record_.track_number = strip_leading_zeroes(
+            number_part(record_.track_number));
     }
-    virtual std::string track_total() const
+    
+    static TagLib::File *open_file(TagLib::IOStream *stream)
     {
-        auto val = base_impl::track_total();
-        if (val != "")
-        {
-            // Remove leading zeroes
-            val.erase(0, std::min(val.find_first_not_of('0'), val.size()-1));
-            return val;
-        }
-        // Try looking for the field in track number
-        val = base_impl::track_number();
-        // Remove up to and including a forward slash if format is TRACK/TOTAL.
-        auto pos = val.find_first_of('/');
-        if (pos != std::string::npos)
-            val.erase(0, std::min(pos + 1, val.size()));
-        else
-            val = "";
-        // Remove leading zeroes
-        val.erase(0, std::min(val.find_first_not_of('0'), val.size()-1));
-        return val;
+        // Read tags only; the audio properties are never used
+        return new TagLib::FLAC::File{
+            stream, TagLib::ID3v2::FrameFactory::instance(), false};
     }
 };
 
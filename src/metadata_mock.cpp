@@ -16,6 +16,7 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "metadata.hpp"
+#include "fs_ops.hpp"
 
 #include <boost/filesystem.hpp>
 #include <algorithm>
@@ -35,7 +36,7 @@ class metadata::base_impl
 {
 public:
     base_impl(const fs::path &path) :
-        has_tag_{path.extension() == ".inc"}
+        has_tag_{metadata::supports(path)}
     {}
 
     bool has_tag() const { return has_tag_; }
@@ -44,18 +45,25 @@ private:
     bool has_tag_;
 };
 
-std::unique_ptr<metadata::base_impl> metadata::make_impl(const fs::path &path)
+std::unique_ptr<metadata::base_impl> metadata::make_impl(
+        const fs::path &path, const context &ctx)
 {
     return std::unique_ptr<metadata::base_impl>{new metadata::base_impl{path}};
 }
 
-metadata::metadata(const fs::path &path) :
-    impl_{make_impl(path)}
+metadata::metadata(const fs::path &path, const context &ctx) :
+    impl_{make_impl(path, ctx)}
 {}
 
 metadata::~metadata()
 {}
 
+// MOCK - only files ending .inc, in any case, hold tags
+bool metadata::supports(const fs::path &path)
+{
+    return extension_equals(extension_of(path), ".inc");
+}
+
 void metadata::print_properties(std::ostream &os)
 {
     // MOCK - do nothing
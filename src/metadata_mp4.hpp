@@ -33,15 +33,42 @@ class metadata::mp4_impl : public metadata::base_impl
 {
 public:
     mp4_impl(const fs::path &path) :
-        base_impl{path}
-    {}
+        base_impl{path, &open_file}
+    {
+        normalise();
+    }
+    mp4_impl(property_values &&props) :
+        base_impl{std::move(props)}
+    {
+        normalise();
+    }
     ~mp4_impl() {}
     
-    virtual std::string album_artist() const
+private:
+    void normalise()
+    {
+        // The native reader takes album artist straight from the atom
+        if (file_ptr() != nullptr)
+            record_.album_artist = read_album_artist();
+        
+        // Totals are held in the number field, in the format "NUMBER/TOTAL".
+        record_.disc_total = total_part(record_.disc_number);
+        record_.disc_number = number_part(record_.disc_number);
+        record_.track_total = total_part(record_.track_number);
+        record_.track_number = number_part(record_.track_number);
+    }
+    
+    static TagLib::File *open_file(TagLib::IOStream *stream)
+    {
+        // Read tags only; the audio properties are never used
+        return new TagLib::MP4::File{stream, false};
+    }
+    
+    std::string read_album_artist() const
     {
         // Expect album artist stored as a duplicate artist tag, but for
         // some reason is only accessible directly via the "aART" atom.
-        if (!has_tag())
+        if (!record_.has_tag)
             return "";
         auto *f = dynamic_cast<const TagLib::MP4::File *>(file_ptr());
         auto &item_map = f->tag()->itemListMap();
@@ -52,46 +79,6 @@ public:
             return "";
         return list[0].to8Bit(true);
     }
-    virtual std::string disc_number() const
-    {
-        auto val = base_impl::disc_number();
-        // Remove anything after forward slash, if format is "DISC/TOTAL".
-        auto pos = val.find_first_of('/');
-        if (pos != std::string::npos)
-            val.erase(pos);
-        return val;
-    }
-    virtual std::string disc_total() const
-    {
-        auto val = base_impl::disc_number();
-        // Remove up to and including a forward slash if format is DISC/TOTAL.
-        auto pos = val.find_first_of('/');
-        if (pos != std::string::npos)
-            val.erase(0, std::min(pos + 1, val.size()));
-        else
-            val = "";
-        return val;
-    }
-    virtual std::string track_number() const
-    {
-        auto val = base_impl::track_number();
-        // Remove anything after forward slash, if format is "TRACK/TOTAL".
-        auto pos = val.find_first_of('/');
-        if (pos != std::string::npos)
-            val.erase(pos);
-        return val;
-    }
-    virtual std::string track_total() const
-    {
-        auto val = base_impl::track_number();
-        // Remove up to and including a forward slash if format is TRACK/TOTAL.
-        auto pos = val.find_first_of('/');
-        if (pos != std::string::npos)
-            val.erase(0, std::min(pos + 1, val.size()));
-        else
-            val = "";
-        return val;
-    }
 };
 
 } // namespace mm
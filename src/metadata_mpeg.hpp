@@ -20,6 +20,8 @@
 
 #include "metadata.hpp"
 
+#include <mpegfile.h>
+#include <id3v2framefactory.h>
 #include <algorithm>
 
 namespace fs = boost::filesystem;
@@ -30,56 +32,38 @@ class metadata::mpeg_impl : public metadata::base_impl
 {
 public:
     mpeg_impl(const fs::path &path) :
-        base_impl{path}
-    {}
-    ~mpeg_impl() {}
-
-    virtual std::string disc_number() const
+        base_impl{path, &open_file}
     {
-        auto val = base_impl::disc_number();
-        // Remove anything after forward slash, if format is "DISC/TOTAL".
-        auto pos = val.find_first_of('/');
-        if (pos != std::string::npos)
-            val.erase(pos);
-        return val;
+        normalise();
     }
-    virtual std::string disc_total() const
+    mpeg_impl(property_values &&props) :
+        base_impl{std::move(props)}
     {
-        auto val = base_impl::disc_number();
-        // Remove up to and including a forward slash if format is DISC/TOTAL.
-        auto pos = val.find_first_of('/');
-        if (pos != std::string::npos)
-            val.erase(0, std::min(pos + 1, val.size()));
-        else
-            val = "";
-        return val;
+        normalise();
     }
-    virtual std::string original_artist() const { return get_prop("ORIGINALARTIST"); }
-    virtual std::string track_number() const
+    ~mpeg_impl() {}
+    
+private:
+    void normalise()
     {
-        auto val = base_impl::track_number();
-        // Remove anything after forward slash, if format is "TRACK/TOTAL".
-        auto pos = val.find_first_of('/');
-        if (pos != std::string::npos)
-            val.erase(pos);
-        // Remove leading zeroes
-        val.erase(0, std::min(val.find_first_not_of('0'), val.size()-1));
-        return val;
+        record_.original_artist = get_prop("ORIGINALARTIST");
+        record_.url = get_prop("URL");
+        
+        // Totals are held in the number field, in the format "NUMBER/TOTAL".
+        record_.disc_total = total_part(record_.disc_number);
+        record_.disc_number = number_part(record_.disc_number);
+        record_.track_total = strip_leading_zeroes(
+            total_part(record_.track_number));
+        record_.track_number = strip_leading_zeroes(
+            number_part(record_.track_number));
     }
-    virtual std::string track_total() const
+    
+    static TagLib::File *open_file(TagLib::IOStream *stream)
     {
-        auto val = base_impl::track_number();
-        // Remove up to and including a forward slash if format is TRACK/TOTAL.
-        auto pos = val.find_first_of('/');
-        if (pos != std::string::npos)
-            val.erase(0, std::min(pos + 1, val.size()));
-        else
-            val = "";
-        // Remove leading zeroes
-        val.erase(0, std::min(val.find_first_not_of('0'), val.size()-1));
-        return val;
+        // Read tags only; the audio properties are never used
+        return new TagLib::MPEG::File{
+            stream, TagLib::ID3v2::FrameFactory::instance(), false};
     }
-    virtual std::string url() const { return get_prop("URL"); }
 };
 
 } // namespace mm
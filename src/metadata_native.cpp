@@ -0,0 +1,825 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "metadata_native.hpp"
+
+#include <boost/filesystem/path.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include "metadata_stream.hpp"
+#endif
+
+namespace fs = boost::filesystem;
+
+namespace mm {
+
+using std::string;
+using std::uint8_t;
+using std::uint32_t;
+using std::uint64_t;
+
+#ifndef _WIN32
+
+namespace {
+
+// Largest single structure (tag, block, atom or packet) we will read
+const std::size_t max_read_size = 16 * 1024 * 1024;
+
+// Minimum amount to read at a time, so that small tags need only one read
+const std::size_t window_size = 64 * 1024;
+
+// Names of every property that musicmove looks at
+const char *const interesting_keys[] = {
+    "ALBUM", "ALBUMARTIST", "ARTIST", "COMMENT", "COMPOSER", "CONTACT",
+    "COPYRIGHT", "DATE", "DESCRIPTION", "DISCNUMBER", "DISCTOTAL",
+    "ENCODED-BY", "ENCODEDBY", "GENRE", "ORIGINALARTIST", "PERFORMER",
+    "TITLE", "TRACKNUMBER", "TRACKTOTAL", "URL",
+};
+
+// ID3v1 genres, indexed by number, as used by ID3v2 and MP4 numeric genres
+const char *const id3v1_genres[] = {
+    "Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk", "Grunge",
+    "Hip-Hop", "Jazz", "Metal", "New Age", "Oldies", "Other", "Pop", "R&B",
+    "Rap", "Reggae", "Rock", "Techno", "Industrial", "Alternative", "Ska",
+    "Death Metal", "Pranks", "Soundtrack", "Euro-Techno", "Ambient",
+    "Trip-Hop", "Vocal", "Jazz+Funk", "Fusion", "Trance", "Classical",
+    "Instrumental", "Acid", "House", "Game", "Sound Clip", "Gospel", "Noise",
+    "Alternative Rock", "Bass", "Soul", "Punk", "Space", "Meditative",
+    "Instrumental Pop", "Instrumental Rock", "Ethnic", "Gothic", "Darkwave",
+    "Techno-Industrial", "Electronic", "Pop-Folk", "Eurodance", "Dream",
+    "Southern Rock", "Comedy", "Cult", "Gangsta", "Top 40", "Christian Rap",
+    "Pop/Funk", "Jungle", "Native American", "Cabaret", "New Wave",
+    "Psychedelic", "Rave", "Showtunes", "Trailer", "Lo-Fi", "Tribal",
+    "Acid Punk", "Acid Jazz", "Polka", "Retro", "Musical", "Rock & Roll",
+    "Hard Rock", "Folk", "Folk/Rock", "National Folk", "Swing", "Fusion",
+    "Bebob", "Latin", "Revival", "Celtic", "Bluegrass", "Avantgarde",
+    "Gothic Rock", "Progressive Rock", "Psychedelic Rock", "Symphonic Rock",
+    "Slow Rock", "Big Band", "Chorus", "Easy Listening", "Acoustic", "Humour",
+    "Speech", "Chanson", "Opera", "Chamber Music", "Sonata", "Symphony",
+    "Booty Bass", "Primus", "Porn Groove", "Satire", "Slow Jam", "Club",
+    "Tango", "Samba", "Folklore", "Ballad", "Power Ballad", "Rhythmic Soul",
+    "Freestyle", "Duet", "Punk Rock", "Drum Solo", "A Cappella", "Euro-House",
+    "Dance Hall", "Goa", "Drum & Bass", "Club-House", "Hardcore", "Terror",
+    "Indie", "BritPop", "Negerpunk", "Polsk Punk", "Beat",
+    "Christian Gangsta Rap", "Heavy Metal", "Black Metal", "Crossover",
+    "Contemporary Christian", "Christian Rock", "Merengue", "Salsa",
+    "Thrash Metal", "Anime", "Jpop", "Synthpop", "Abstract", "Art Rock",
+    "Baroque", "Bhangra", "Big Beat", "Breakbeat", "Chillout", "Downtempo",
+    "Dub", "EBM", "Eclectic", "Electro", "Electroclash", "Emo",
+    "Experimental", "Garage", "Global", "IDM", "Illbient", "Industro-Goth",
+    "Jam Band", "Krautrock", "Leftfield", "Lounge", "Math Rock",
+    "New Romantic", "Nu-Breakz", "Post-Punk", "Post-Rock", "Psytrance",
+    "Shoegaze", "Space Rock", "Trop Rock", "World Music", "Neoclassical",
+    "Audiobook", "Audio Theatre", "Neue Deutsche Welle", "Podcast",
+    "Indie Rock", "G-Funk", "Dubstep", "Garage Rock", "Psybient",
+};
+
+const long id3v1_genre_count =
+    sizeof(id3v1_genres) / sizeof(id3v1_genres[0]);
+
+// Bounded, windowed reads from a file into a buffer that is reused between
+// files.  A pointer returned by read() is only valid until the next call.
+class tag_file
+{
+public:
+    tag_file(const fs::path &path) :
+        fd_{open_readonly(path)}, size_{0}, win_offset_{0}, win_length_{0},
+        buf_{buffer()}
+    {
+        struct stat st;
+        if (fd_ >= 0 && ::fstat(fd_, &st) == 0)
+            size_ = st.st_size;
+    }
+    ~tag_file()
+    {
+        if (fd_ >= 0)
+            ::close(fd_);
+    }
+    tag_file(const tag_file &) = delete;
+    tag_file &operator=(const tag_file &) = delete;
+
+    uint64_t size() const { return size_; }
+
+    const uint8_t *read(uint64_t offset, uint64_t length)
+    {
+        if (fd_ < 0 || length > max_read_size ||
+            offset > size_ || length > size_ - offset)
+            return nullptr;
+
+        // Already have it?
+        if (offset >= win_offset_ &&
+            offset + length <= win_offset_ + win_length_)
+            return buf_.data() + (offset - win_offset_);
+
+        auto want = std::min<uint64_t>(
+            std::max<uint64_t>(length, window_size), size_ - offset);
+        buf_.resize(want);
+        uint64_t done = 0;
+        while (done < want)
+        {
+            auto n = ::pread(fd_, buf_.data() + done, want - done,
+                             offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        win_offset_ = offset;
+        win_length_ = done;
+        if (done < length)
+            return nullptr;
+        return buf_.data();
+    }
+
+private:
+    static std::vector<uint8_t> &buffer()
+    {
+        thread_local std::vector<uint8_t> buf;
+        return buf;
+    }
+
+    int fd_;
+    uint64_t size_;
+    uint64_t win_offset_;
+    uint64_t win_length_;
+    std::vector<uint8_t> &buf_;
+};
+
+uint32_t be16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+uint32_t be32(const uint8_t *p)
+{
+    return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+uint64_t be64(const uint8_t *p)
+{
+    return (uint64_t(be32(p)) << 32) | be32(p + 4);
+}
+uint32_t le32(const uint8_t *p)
+{
+    return (uint32_t(p[3]) << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+bool is_syncsafe(const uint8_t *p)
+{
+    return ((p[0] | p[1] | p[2] | p[3]) & 0x80) == 0;
+}
+uint32_t syncsafe32(const uint8_t *p)
+{
+    return (p[0] << 21) | (p[1] << 14) | (p[2] << 7) | p[3];
+}
+
+void append_utf8(string &out, uint32_t c)
+{
+    if (c < 0x80)
+        out += static_cast<char>(c);
+    else if (c < 0x800)
+    {
+        out += static_cast<char>(0xC0 | (c >> 6));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    }
+    else if (c < 0x10000)
+    {
+        out += static_cast<char>(0xE0 | (c >> 12));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    }
+    else
+    {
+        out += static_cast<char>(0xF0 | (c >> 18));
+        out += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    }
+}
+
+string latin1_to_utf8(const uint8_t *p, std::size_t len)
+{
+    string out;
+    out.reserve(len);
+    for (std::size_t i = 0; i < len; ++i)
+        append_utf8(out, p[i]);
+    return out;
+}
+
+string utf16_to_utf8(const uint8_t *p, std::size_t len, bool big_endian)
+{
+    string out;
+    out.reserve(len / 2);
+    for (std::size_t i = 0; i + 1 < len; i += 2)
+    {
+        uint32_t c = big_endian ? be16(p + i) : (p[i] | (p[i + 1] << 8));
+        if (c >= 0xD800 && c < 0xDC00 && i + 3 < len)
+        {
+            // Surrogate pair
+            uint32_t lo = big_endian
+                ? be16(p + i + 2)
+                : (p[i + 2] | (p[i + 3] << 8));
+            if (lo >= 0xDC00 && lo < 0xE000)
+            {
+                c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+                i += 2;
+            }
+        }
+        append_utf8(out, c);
+    }
+    return out;
+}
+
+bool is_interesting(const string &key)
+{
+    for (auto *k : interesting_keys)
+        if (key == k)
+            return true;
+    return false;
+}
+
+string to_upper(string s)
+{
+    for (auto &c : s)
+        if (c >= 'a' && c <= 'z')
+            c -= 'a' - 'A';
+    return s;
+}
+
+// Parse a string as an integer in the same way as TagLib::String::toInt()
+bool to_int(const string &s, long &val)
+{
+    if (s.empty())
+        return false;
+    char *end;
+    errno = 0;
+    val = std::strtol(s.c_str(), &end, 10);
+    return errno == 0 && end != s.c_str() && *end == '\0';
+}
+
+string id3v1_genre(long index)
+{
+    if (index < 0 || index >= id3v1_genre_count)
+        return "";
+    return id3v1_genres[index];
+}
+
+// TagLib treats a tag as empty, and looks elsewhere in the file for another
+// one, if none of the basic fields are set.  Leave such files to TagLib.
+bool has_basic_fields(const property_values &props)
+{
+    for (auto *k : {"TITLE", "ARTIST", "ALBUM", "COMMENT", "GENRE", "DATE",
+                    "TRACKNUMBER"})
+        if (props.count(k) > 0)
+            return true;
+    return false;
+}
+
+bool parse_vorbis_comment(const uint8_t *p, std::size_t len,
+                          property_values &props)
+{
+    std::size_t pos = 0;
+    if (len < 4)
+        return false;
+    auto vendor_len = le32(p);
+    pos += 4;
+    if (vendor_len > len - pos || len - pos - vendor_len < 4)
+        return false;
+    pos += vendor_len;
+    auto count = le32(p + pos);
+    pos += 4;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (len - pos < 4)
+            return false;
+        auto field_len = le32(p + pos);
+        pos += 4;
+        if (field_len > len - pos)
+            return false;
+        auto *field = reinterpret_cast<const char *>(p + pos);
+        pos += field_len;
+
+        auto *sep = static_cast<const char *>(
+            std::memchr(field, '=', field_len));
+        if (sep == nullptr || sep == field)
+            continue;
+        // Field names are case-insensitive, and restricted to printable ASCII
+        string key = to_upper(string{field, sep});
+        if (std::any_of(key.begin(), key.end(),
+                [](char c) { return c < 0x20 || c > 0x7D; }))
+            continue;
+        props.try_emplace(key, sep + 1, field + field_len);
+    }
+    return true;
+}
+
+// Decode the first string in an ID3v2 field, and report how many bytes it
+// occupied including its terminator.
+bool id3v2_string(const uint8_t *p, std::size_t len, uint8_t encoding,
+                  string &out, std::size_t &used)
+{
+    if (encoding == 0 || encoding == 3)
+    {
+        auto *end = static_cast<const uint8_t *>(std::memchr(p, 0, len));
+        std::size_t n = end != nullptr ? end - p : len;
+        used = end != nullptr ? n + 1 : n;
+        out = encoding == 0
+            ? latin1_to_utf8(p, n)
+            : string{reinterpret_cast<const char *>(p), n};
+        return true;
+    }
+    if (encoding == 1 || encoding == 2)
+    {
+        std::size_t n = 0;
+        while (n + 1 < len && (p[n] != 0 || p[n + 1] != 0))
+            n += 2;
+        used = n + 1 < len ? n + 2 : len;
+        bool big_endian = encoding == 2;
+        std::size_t skip = 0;
+        if (encoding == 1)
+        {
+            // UTF-16 with byte order mark; an empty string may lack one
+            if (n >= 2 && p[0] == 0xFF && p[1] == 0xFE)
+                big_endian = false;
+            else if (n >= 2 && p[0] == 0xFE && p[1] == 0xFF)
+                big_endian = true;
+            else if (n > 0)
+                return false;
+            skip = n > 0 ? 2 : 0;
+        }
+        out = utf16_to_utf8(p + skip, n - skip, big_endian);
+        return true;
+    }
+    return false;
+}
+
+// Property name for an ID3v2 text frame, or nullptr if we do not need it
+const char *id3v2_text_key(const char *id, uint8_t version)
+{
+    static const char *const frames[][2] = {
+        {"TALB", "ALBUM"}, {"TPE2", "ALBUMARTIST"}, {"TPE1", "ARTIST"},
+        {"TCOM", "COMPOSER"}, {"TCOP", "COPYRIGHT"}, {"TENC", "ENCODEDBY"},
+        {"TDRC", "DATE"}, {"TPOS", "DISCNUMBER"}, {"TCON", "GENRE"},
+        {"TOPE", "ORIGINALARTIST"}, {"TIT2", "TITLE"},
+        {"TRCK", "TRACKNUMBER"},
+    };
+    for (auto &f : frames)
+        if (std::memcmp(id, f[0], 4) == 0)
+            return f[1];
+    // TagLib upgrades ID3v2.3 year frames to recording time frames
+    if (version == 3 && std::memcmp(id, "TYER", 4) == 0)
+        return "DATE";
+    return nullptr;
+}
+
+// Resolve a genre in the same way as TagLib, which accepts ID3v1 genre
+// numbers either bare or in parentheses, optionally followed by a name.
+bool id3v2_genre(const string &val, string &genre)
+{
+    long num;
+    auto close = val.find(')');
+    if (!val.empty() && val[0] == '(' && close != string::npos && close > 0)
+    {
+        auto text = val.substr(close + 1);
+        if (to_int(val.substr(1, close - 1), num) && num >= 0 && num <= 255 &&
+            id3v1_genre(num) != text)
+        {
+            genre = id3v1_genre(num);
+            return true;
+        }
+        if (text.empty())
+            return false;
+        genre = to_int(text, num) ? id3v1_genre(num) : text;
+        return true;
+    }
+    genre = to_int(val, num) ? id3v1_genre(num) : val;
+    return true;
+}
+
+bool parse_id3v2_frame(const char *id, const uint8_t *p, std::size_t len,
+                       uint8_t version, property_values &props)
+{
+    if (len < 1)
+        return false;
+    auto encoding = p[0];
+    string val;
+    std::size_t used;
+
+    if (std::memcmp(id, "COMM", 4) == 0)
+    {
+        // Only comments without a description are the COMMENT property
+        string desc;
+        if (len < 4 || !id3v2_string(p + 4, len - 4, encoding, desc, used))
+            return false;
+        desc = to_upper(desc);
+        if (desc != "" && desc != "COMMENT")
+            return true;
+        std::size_t start = 4 + used;
+        if (!id3v2_string(p + start, len - start, encoding, val, used))
+            return false;
+        props.try_emplace("COMMENT", val);
+        return true;
+    }
+    if (std::memcmp(id, "WXXX", 4) == 0)
+    {
+        // Only links without a description are the URL property
+        string desc;
+        if (!id3v2_string(p + 1, len - 1, encoding, desc, used))
+            return false;
+        desc = to_upper(desc);
+        if (desc != "" && desc != "URL")
+            return true;
+        std::size_t start = 1 + used;
+        if (!id3v2_string(p + start, len - start, 0, val, used))
+            return false;
+        props.try_emplace("URL", val);
+        return true;
+    }
+    if (std::memcmp(id, "TXXX", 4) == 0)
+    {
+        // User-defined frames can stand in for any property at all
+        string desc;
+        if (!id3v2_string(p + 1, len - 1, encoding, desc, used))
+            return false;
+        return !is_interesting(to_upper(desc));
+    }
+
+    auto *key = id3v2_text_key(id, version);
+    if (key == nullptr)
+        return true;
+    if (!id3v2_string(p + 1, len - 1, encoding, val, used))
+        return false;
+    if (std::strcmp(key, "GENRE") == 0 && !id3v2_genre(val, val))
+        return false;
+    props.try_emplace(key, val);
+    return true;
+}
+
+// Find a child atom of the given type between two offsets in an MP4 file
+bool find_mp4_atom(tag_file &file, uint64_t begin, uint64_t end,
+                   const char *type, uint64_t &body, uint64_t &body_end)
+{
+    auto pos = begin;
+    while (pos + 8 <= end)
+    {
+        auto *h = file.read(pos, 8);
+        if (h == nullptr)
+            return false;
+        uint64_t size = be32(h);
+        uint64_t header = 8;
+        bool match = std::memcmp(h + 4, type, 4) == 0;
+        if (size == 1)
+        {
+            // 64-bit size follows
+            auto *h64 = file.read(pos + 8, 8);
+            if (h64 == nullptr)
+                return false;
+            size = be64(h64);
+            header = 16;
+        }
+        else if (size == 0)
+        {
+            // Atom extends to the end of its container
+            size = end - pos;
+        }
+        if (size < header || size > end - pos)
+            return false;
+        if (match)
+        {
+            body = pos + header;
+            body_end = pos + size;
+            return true;
+        }
+        pos += size;
+    }
+    return false;
+}
+
+// Property name for an MP4 item, or nullptr if we do not need it
+const char *mp4_item_key(const uint8_t *type)
+{
+    static const char *const items[][2] = {
+        {"\251nam", "TITLE"}, {"\251ART", "ARTIST"}, {"\251alb", "ALBUM"},
+        {"\251cmt", "COMMENT"}, {"\251gen", "GENRE"}, {"\251day", "DATE"},
+        {"\251wrt", "COMPOSER"}, {"\251too", "ENCODEDBY"},
+        {"aART", "ALBUMARTIST"}, {"cprt", "COPYRIGHT"},
+        {"trkn", "TRACKNUMBER"}, {"disk", "DISCNUMBER"},
+    };
+    for (auto &i : items)
+        if (std::memcmp(type, i[0], 4) == 0)
+            return i[1];
+    return nullptr;
+}
+
+bool parse_mp4_item(const uint8_t *type, const uint8_t *p, std::size_t len,
+                    property_values &props, bool &numeric_genre)
+{
+    bool is_pair = std::memcmp(type, "trkn", 4) == 0 ||
+                   std::memcmp(type, "disk", 4) == 0;
+    bool is_gnre = std::memcmp(type, "gnre", 4) == 0;
+    bool is_freeform = std::memcmp(type, "----", 4) == 0;
+    auto *key = mp4_item_key(type);
+
+    std::size_t pos = 0;
+    while (pos + 8 <= len)
+    {
+        std::size_t size = be32(p + pos);
+        if (size < 8 || size > len - pos)
+            return false;
+        auto *child = p + pos + 8;
+        auto child_len = size - 8;
+        pos += size;
+
+        if (is_freeform)
+        {
+            // Free-form items are named by a "name" child, and TagLib uses
+            // that name as the property name
+            if (std::memcmp(child - 4, "name", 4) == 0 && child_len >= 4)
+            {
+                string name{reinterpret_cast<const char *>(child + 4),
+                            child_len - 4};
+                if (is_interesting(to_upper(name)))
+                    return false;
+            }
+            continue;
+        }
+        if (std::memcmp(child - 4, "data", 4) != 0 || child_len < 8)
+            continue;
+
+        auto data_type = be32(child) & 0xFFFFFF;
+        auto *data = child + 8;
+        auto data_len = child_len - 8;
+        if (is_pair)
+        {
+            if (data_len < 6)
+                return false;
+            string val = std::to_string(be16(data + 2));
+            auto total = be16(data + 4);
+            if (total != 0)
+                val += "/" + std::to_string(total);
+            props.try_emplace(key, val);
+            return true;
+        }
+        if (is_gnre)
+        {
+            if (data_len < 2)
+                return false;
+            // Genres are numbered from 1 here
+            long num = be16(data);
+            if (num > 0)
+            {
+                numeric_genre = true;
+                props.try_emplace("GENRE", id3v1_genre(num - 1));
+            }
+            return true;
+        }
+        if (key != nullptr && data_type == 1)
+        {
+            // UTF-8 text
+            props.try_emplace(key, reinterpret_cast<const char *>(data),
+                              data_len);
+            return true;
+        }
+    }
+    return true;
+}
+
+// Collects the segments of a packet from the pages of an Ogg stream
+bool read_ogg_packet(tag_file &file, uint64_t &pos, uint32_t serial,
+                     bool first_page, string &packet)
+{
+    packet.clear();
+    for (int pages = 0; pages < 1024; ++pages)
+    {
+        auto *h = file.read(pos, 27);
+        if (h == nullptr || std::memcmp(h, "OggS", 4) != 0 || h[4] != 0)
+            return false;
+        if (!first_page && le32(h + 14) != serial)
+            return false;
+        first_page = false;
+        std::size_t segments = h[26];
+        auto *table = file.read(pos + 27, segments);
+        if (table == nullptr)
+            return false;
+        std::vector<uint8_t> lacing{table, table + segments};
+        uint64_t body = pos + 27 + segments;
+        std::size_t body_len = 0;
+        for (auto l : lacing)
+            body_len += l;
+        auto *data = file.read(body, body_len);
+        if (data == nullptr)
+            return false;
+        pos = body + body_len;
+
+        // A packet ends on the first segment shorter than 255 bytes.  The
+        // header packets each start a new page, so anything after the end of
+        // the packet we want on this page can be ignored.
+        std::size_t offset = 0;
+        for (std::size_t i = 0; i < lacing.size(); ++i)
+        {
+            packet.append(reinterpret_cast<const char *>(data + offset),
+                          lacing[i]);
+            offset += lacing[i];
+            if (packet.size() > max_read_size)
+                return false;
+            if (lacing[i] < 255)
+                return true;
+        }
+    }
+    return false;
+}
+
+} // anonymous namespace
+
+bool read_flac_properties(const fs::path &path, property_values &props)
+{
+    tag_file file{path};
+    auto *magic = file.read(0, 4);
+    if (magic == nullptr || std::memcmp(magic, "fLaC", 4) != 0)
+        return false;
+
+    // Walk the metadata blocks, skipping over pictures, padding and the rest
+    uint64_t pos = 4;
+    for (int blocks = 0; blocks < 1024; ++blocks)
+    {
+        auto *h = file.read(pos, 4);
+        if (h == nullptr)
+            return false;
+        bool last = (h[0] & 0x80) != 0;
+        int type = h[0] & 0x7F;
+        uint32_t len = (h[1] << 16) | (h[2] << 8) | h[3];
+        // The stream info block must come first
+        if ((blocks == 0) != (type == 0) || type == 127)
+            return false;
+        if (type == 4)
+        {
+            auto *block = file.read(pos + 4, len);
+            return block != nullptr &&
+                   parse_vorbis_comment(block, len, props) &&
+                   !props.empty();
+        }
+        pos += 4 + len;
+        if (last)
+            break;
+    }
+    return false;
+}
+
+bool read_mp4_properties(const fs::path &path, property_values &props)
+{
+    tag_file file{path};
+    uint64_t moov, moov_end, udta, udta_end, meta, meta_end, ilst, ilst_end;
+    if (!find_mp4_atom(file, 0, file.size(), "moov", moov, moov_end) ||
+        !find_mp4_atom(file, moov, moov_end, "udta", udta, udta_end) ||
+        !find_mp4_atom(file, udta, udta_end, "meta", meta, meta_end) ||
+        // The meta atom has a version and flags before its children
+        !find_mp4_atom(file, meta + 4, meta_end, "ilst", ilst, ilst_end))
+        return false;
+
+    bool has_text_genre = false, numeric_genre = false;
+    auto pos = ilst;
+    while (pos + 8 <= ilst_end)
+    {
+        auto *h = file.read(pos, 8);
+        if (h == nullptr)
+            return false;
+        uint64_t size = be32(h);
+        if (size < 8 || size > ilst_end - pos)
+            return false;
+        uint8_t type[4];
+        std::memcpy(type, h + 4, 4);
+
+        // Only read the items we need; in particular skip cover art
+        if (mp4_item_key(type) != nullptr ||
+            std::memcmp(type, "gnre", 4) == 0 ||
+            std::memcmp(type, "----", 4) == 0)
+        {
+            auto *item = file.read(pos + 8, size - 8);
+            if (item == nullptr ||
+                !parse_mp4_item(type, item, size - 8, props, numeric_genre))
+                return false;
+            if (std::memcmp(type, "\251gen", 4) == 0)
+                has_text_genre = true;
+        }
+        pos += size;
+    }
+    // TagLib merges numeric and text genres into one item, in an order we
+    // don't want to second-guess
+    return !(has_text_genre && numeric_genre);
+}
+
+bool read_mpeg_properties(const fs::path &path, property_values &props)
+{
+    tag_file file{path};
+    auto *h = file.read(0, 10);
+    if (h == nullptr || std::memcmp(h, "ID3", 3) != 0)
+        return false;
+    uint8_t version = h[3];
+    uint8_t flags = h[5];
+    // Leave older versions, unsynchronisation and extended headers to TagLib
+    if ((version != 3 && version != 4) || (flags & 0xC0) != 0 ||
+        !is_syncsafe(h + 6))
+        return false;
+    uint64_t end = 10 + uint64_t(syncsafe32(h + 6));
+    if (end > file.size())
+        return false;
+
+    bool has_tdat = false;
+    uint64_t pos = 10;
+    while (pos + 10 <= end)
+    {
+        auto *fh = file.read(pos, 10);
+        if (fh == nullptr)
+            return false;
+        // Start of padding?
+        if (fh[0] == 0)
+            break;
+        char id[4];
+        std::memcpy(id, fh, 4);
+        if (!std::all_of(id, id + 4,
+                [](char c) {
+                    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+                }))
+            return false;
+        if (version == 4 && !is_syncsafe(fh + 4))
+            return false;
+        uint64_t size = version == 4 ? syncsafe32(fh + 4) : be32(fh + 4);
+        // Compression, encryption, grouping, unsynchronisation, etc.
+        uint8_t format_flags = fh[9] & (version == 4 ? 0x4F : 0xE0);
+        if (size == 0 || size > end - pos - 10)
+            return false;
+
+        if (std::memcmp(id, "TDAT", 4) == 0)
+            has_tdat = true;
+        if (id3v2_text_key(id, version) != nullptr ||
+            std::memcmp(id, "COMM", 4) == 0 ||
+            std::memcmp(id, "WXXX", 4) == 0 ||
+            std::memcmp(id, "TXXX", 4) == 0)
+        {
+            if (format_flags != 0)
+                return false;
+            auto *body = file.read(pos + 10, size);
+            if (body == nullptr ||
+                !parse_id3v2_frame(id, body, size, version, props))
+                return false;
+        }
+        pos += 10 + size;
+    }
+    // TagLib folds an ID3v2.3 date frame into the year
+    if (version == 3 && has_tdat)
+        return false;
+    return has_basic_fields(props);
+}
+
+bool read_ogg_vorbis_properties(const fs::path &path, property_values &props)
+{
+    tag_file file{path};
+    auto *h = file.read(0, 27);
+    if (h == nullptr)
+        return false;
+    uint32_t serial = le32(h + 14);
+
+    // The identification packet comes first, then the comment packet
+    uint64_t pos = 0;
+    string packet;
+    if (!read_ogg_packet(file, pos, serial, true, packet) ||
+        packet.compare(0, 7, "\001vorbis") != 0 ||
+        !read_ogg_packet(file, pos, serial, false, packet) ||
+        packet.compare(0, 7, "\003vorbis") != 0)
+        return false;
+    return parse_vorbis_comment(
+        reinterpret_cast<const uint8_t *>(packet.data()) + 7,
+        packet.size() - 7, props);
+}
+
+#else
+
+// No native readers on this platform; always fall back to TagLib.
+bool read_flac_properties(const fs::path &, property_values &)
+{ return false; }
+bool read_mp4_properties(const fs::path &, property_values &)
+{ return false; }
+bool read_mpeg_properties(const fs::path &, property_values &)
+{ return false; }
+bool read_ogg_vorbis_properties(const fs::path &, property_values &)
+{ return false; }
+
+#endif
+
+} // namespace mm
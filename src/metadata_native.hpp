@@ -0,0 +1,49 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_METADATA_NATIVE_HPP
+#define MUSICMOVE_METADATA_NATIVE_HPP
+
+#include <boost/filesystem/path.hpp>
+#include <string>
+#include <unordered_map>
+
+namespace mm {
+
+// The first value of each tag property in a file, in UTF-8, keyed by the
+// same property names that TagLib uses.
+typedef std::unordered_map<std::string, std::string> property_values;
+
+// Minimal built-in tag readers, covering only what musicmove needs from each
+// format: the FLAC VORBIS_COMMENT block, ID3v2 text frames at the start of
+// an MPEG file, MP4 moov/udta/meta/ilst items, and the Ogg Vorbis comment
+// packet.  Embedded pictures are skipped over without being read.
+//
+// Each reader returns false if it finds anything it does not understand, in
+// which case the caller should fall back to TagLib.
+bool read_flac_properties(
+        const boost::filesystem::path &path, property_values &props);
+bool read_mp4_properties(
+        const boost::filesystem::path &path, property_values &props);
+bool read_mpeg_properties(
+        const boost::filesystem::path &path, property_values &props);
+bool read_ogg_vorbis_properties(
+        const boost::filesystem::path &path, property_values &props);
+
+} // namespace mm
+
+#endif // MUSICMOVE_METADATA_NATIVE_HPP
@@ -0,0 +1,131 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_METADATA_STREAM_HPP
+#define MUSICMOVE_METADATA_STREAM_HPP
+
+#include <boost/filesystem/path.hpp>
+#include <tiostream.h>
+#include <tbytevector.h>
+#include <string>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace fs = boost::filesystem;
+
+namespace mm {
+
+// Open a file read-only, without updating its access time where we are
+// permitted to do so.  Returns -1 on failure, like open(2).
+inline int open_readonly(const fs::path &path)
+{
+    int flags = O_RDONLY | O_CLOEXEC;
+#ifdef O_NOATIME
+    int fd = ::open(path.c_str(), flags | O_NOATIME);
+    // O_NOATIME is only permitted for the owner of the file.
+    if (fd >= 0 || errno != EPERM)
+        return fd;
+#endif
+    return ::open(path.c_str(), flags);
+}
+
+// A read-only TagLib stream over a POSIX file descriptor.
+//
+// TagLib's own FileStream opens files for writing where it can, and
+// updates the access time of every file we look at.
+class readonly_stream : public TagLib::IOStream
+{
+public:
+    readonly_stream(const fs::path &path) :
+        name_{path.string()}, fd_{open_readonly(path)}, pos_{0}, length_{0}
+    {
+        struct stat st;
+        if (fd_ >= 0 && ::fstat(fd_, &st) == 0)
+            length_ = st.st_size;
+    }
+    ~readonly_stream()
+    {
+        if (fd_ >= 0)
+            ::close(fd_);
+    }
+    readonly_stream(const readonly_stream &) = delete;
+    readonly_stream &operator=(const readonly_stream &) = delete;
+
+    TagLib::FileName name() const override { return name_.c_str(); }
+
+    TagLib::ByteVector readBlock(unsigned long length) override
+    {
+        // Never allocate more than is left in the file
+        if (fd_ < 0 || pos_ >= length_)
+            return TagLib::ByteVector{};
+        if (length > static_cast<unsigned long>(length_ - pos_))
+            length = static_cast<unsigned long>(length_ - pos_);
+
+        TagLib::ByteVector block(static_cast<unsigned int>(length), 0);
+        unsigned long done = 0;
+        while (done < length)
+        {
+            auto n = ::pread(fd_, block.data() + done, length - done,
+                             pos_ + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        block.resize(static_cast<unsigned int>(done));
+        pos_ += done;
+        return block;
+    }
+
+    // The stream is read-only, so TagLib will never ask to write to it
+    void writeBlock(const TagLib::ByteVector &) override {}
+    void insert(const TagLib::ByteVector &, unsigned long,
+                unsigned long) override {}
+    void removeBlock(unsigned long, unsigned long) override {}
+    void truncate(long) override {}
+
+    bool readOnly() const override { return true; }
+    bool isOpen() const override { return fd_ >= 0; }
+
+    void seek(long offset, Position p) override
+    {
+        switch (p)
+        {
+            case Beginning: pos_ = offset; break;
+            case Current:   pos_ += offset; break;
+            case End:       pos_ = length_ + offset; break;
+        }
+        if (pos_ < 0)
+            pos_ = 0;
+    }
+    long tell() const override { return static_cast<long>(pos_); }
+    long length() override { return static_cast<long>(length_); }
+
+private:
+    std::string name_;
+    int fd_;
+    off_t pos_;
+    off_t length_;
+};
+
+} // namespace mm
+
+#endif // MUSICMOVE_METADATA_STREAM_HPP
@@ -16,6 +16,7 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "metadata.hpp"
+#include "metadata_native.hpp"
 
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE metadata_test
@@ -32,6 +33,17 @@ using namespace std;
 
 const string testdata_dir_str = STRINGIFY(TESTDATA_DIR) "/metadata";
 
+BOOST_AUTO_TEST_CASE (supported_extensions)
+{
+    // Extensions match regardless of case
+    for (auto &name : {"a.flac", "a.m4a", "a.mp3", "a.ogg", "a.FLAC", "a.Mp3",
+                       "dir.ogg/a.M4A"})
+        BOOST_CHECK_MESSAGE(mm::metadata::supports(name), name);
+    for (auto &name : {"a.txt", "a.flac.txt", "flac", ".flac", "a.flac/b",
+                       "a.mp", "a.mp33"})
+        BOOST_CHECK_MESSAGE(!mm::metadata::supports(name), name);
+}
+
 BOOST_AUTO_TEST_CASE (blank_metadata)
 {
     // TODO - test files with no metadata, making sure we get empty strings
@@ -238,3 +250,60 @@ BOOST_AUTO_TEST_CASE (easytag_full_metadata)
     BOOST_CHECK_EQUAL(tag_vorbis.track_total(),     "4");
     BOOST_CHECK_EQUAL(tag_vorbis.url(),             "URL field");
 }
+
+// Check that the native tag readers understand every test file, and agree
+// with TagLib on every field.
+BOOST_AUTO_TEST_CASE (native_metadata)
+{
+    mm::context native_ctx;
+    native_ctx.native_tag_reader = true;
+
+    for (auto &kind : {"min", "full"})
+    {
+        string prefix = testdata_dir_str + "/chirp." + kind + ".easytag.";
+        fs::path flac_path  {prefix + "01.flac"};
+        fs::path mp4_path   {prefix + "02.m4a"};
+        fs::path mpeg_path  {prefix + "03.mp3"};
+        fs::path vorbis_path{prefix + "04.ogg"};
+
+        mm::property_values props;
+        BOOST_CHECK(mm::read_flac_properties(flac_path, props));
+        props.clear();
+        BOOST_CHECK(mm::read_mp4_properties(mp4_path, props));
+        props.clear();
+        BOOST_CHECK(mm::read_mpeg_properties(mpeg_path, props));
+        props.clear();
+        BOOST_CHECK(mm::read_ogg_vorbis_properties(vorbis_path, props));
+
+        for (auto &path : {flac_path, mp4_path, mpeg_path, vorbis_path})
+        {
+            cout << "Testing " << path << endl;
+            mm::metadata tag_taglib{path};
+            mm::metadata tag_native{path, native_ctx};
+            BOOST_CHECK_EQUAL(tag_native.has_tag(), tag_taglib.has_tag());
+            BOOST_CHECK_EQUAL(tag_native.album(), tag_taglib.album());
+            BOOST_CHECK_EQUAL(tag_native.album_artist(),
+                              tag_taglib.album_artist());
+            BOOST_CHECK_EQUAL(tag_native.artist(), tag_taglib.artist());
+            BOOST_CHECK_EQUAL(tag_native.comment(), tag_taglib.comment());
+            BOOST_CHECK_EQUAL(tag_native.composer(), tag_taglib.composer());
+            BOOST_CHECK_EQUAL(tag_native.copyright(), tag_taglib.copyright());
+            BOOST_CHECK_EQUAL(tag_native.encoded_by(),
+                              tag_taglib.encoded_by());
+            BOOST_CHECK_EQUAL(tag_native.date(), tag_taglib.date());
+            BOOST_CHECK_EQUAL(tag_native.disc_number(),
+                              tag_taglib.disc_number());
+            BOOST_CHECK_EQUAL(tag_native.disc_total(),
+                              tag_taglib.disc_total());
+            BOOST_CHECK_EQUAL(tag_native.genre(), tag_taglib.genre());
+            BOOST_CHECK_EQUAL(tag_native.original_artist(),
+                              tag_taglib.original_artist());
+            BOOST_CHECK_EQUAL(tag_native.title(), tag_taglib.title());
+            BOOST_CHECK_EQUAL(tag_native.track_number(),
+                              tag_taglib.track_number());
+            BOOST_CHECK_EQUAL(tag_native.track_total(),
+                              tag_taglib.track_total());
+            BOOST_CHECK_EQUAL(tag_native.url(), tag_taglib.url());
+        }
+    }
+}
@@ -18,6 +18,14 @@
 #include "move.hpp"
 
 #include <boost/filesystem.hpp>
+#include <deque>
+#include <exception>
+#include <future>
+#include <set>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <iostream>
 #include <sstream>
@@ -26,9 +34,19 @@
 
 #include "config.hpp"
 
+#include "dir_state.hpp"
 #include "metadata.hpp"
 #include "format.hpp"
 #include "script_runner.hpp"
+#include "fs_ops.hpp"
+#include "journal.hpp"
+#include "output.hpp"
+#include "stats.hpp"
+#include "tag_cache.hpp"
+#include "trace.hpp"
+#include "transfer.hpp"
+#include "bounded_queue.hpp"
+#include "worker_pool.hpp"
 
 #include <algorithm>
 
@@ -42,86 +60,792 @@ using std::endl;
 using std::string;
 using std::stringstream;
 
-process_results process_path(const fs::path &p, const mm::context &ctx)
+namespace {
+
+// Report through the context's output if it has one, or else directly
+void print(const context &ctx, std::string_view text)
 {
-    process_results results;
+    if (ctx.out)
+        ctx.out->message(text);
+    else
+        cout << text << std::flush;
+}
+
+void print_warning(const context &ctx, std::string_view text)
+{
+    if (ctx.out)
+        ctx.out->warning(text);
+    else
+        cerr << text << std::flush;
+}
+
+// Account for what was done with a file
+void report_file(const context &ctx, const fs::path &source,
+                 const fs::path &destination, const string &action,
+                 const string &reason)
+{
+    if (ctx.out)
+        ctx.out->record(source, destination, action, reason);
+    if (ctx.stats)
+    {
+        if (action == "skip")
+            ctx.stats->count_skipped(reason);
+        else if (action == "error")
+            ctx.stats->count("errors");
+        else if (action == "move")
+            ctx.stats->count("files_moved");
+        else
+            ctx.stats->count("files_renamed");
+    }
+}
+
+dir_listing timed_listing(const fs::path &dir, const context &ctx)
+{
+    stage_timer timer{ctx.stats.get(), run_stats::stage::walk};
+    MUSICMOVE_TRACE_SPAN(span, ctx.trace.get(), "list", dir);
+    return list_directory(dir);
+}
+
+// Decide whether to read a file at all, going by its name alone
+bool wanted_file(const fs::path &p, const context &ctx)
+{
+    auto ext = extension_of(p);
+    for (const auto &excluded : ctx.exclude_extensions)
+    {
+        if (extension_equals(ext, excluded))
+            return false;
+    }
+    if (ctx.include_extensions.empty())
+        return metadata::supports(p);
+    for (const auto &included : ctx.include_extensions)
+    {
+        if (extension_equals(ext, included))
+            return true;
+    }
+    return false;
+}
+
+// A directory's entries, and whether the files in it can be passed over
+// because it is just as an earlier run left it
+struct scanned_dir
+{
+    dir_listing listing;
+    dir_signature signature;
+    bool settled = false;
+};
+
+scanned_dir scan_directory(const fs::path &dir, const context &ctx)
+{
+    scanned_dir scanned;
+    scanned.listing = timed_listing(dir, ctx);
+    if (!ctx.state)
+        return scanned;
     
-    if (!fs::exists(p))
+    // Anything that can't be looked at is left with an empty key, which
+    // won't match on a later run
+    stage_timer timer{ctx.stats.get(), run_stats::stage::walk};
+    tag_cache::make_key(dir, scanned.signature.dir);
+    scanned.signature.entries = scanned.listing.size();
+    for (const auto &entry : scanned.listing)
     {
-        cerr << "Warning: path does not exist: " << p.string() << endl;
-        return results;
+        if (entry.kind != entry_kind::file || !wanted_file(entry.path, ctx))
+            continue;
+        tag_cache_key key{};
+        tag_cache::make_key(entry.path, key);
+        scanned.signature.add(entry.path.filename().string(), key);
     }
+    scanned.settled = ctx.state->settled(dir, scanned.signature);
+    if (scanned.settled && ctx.stats)
+        ctx.stats->count("directories_unchanged");
+    return scanned;
+}
 
-    // Regular file or dir?
-    if (fs::is_directory(p))
+// Remove a directory whose entries have all moved out of it, returning
+// whether it was removed
+bool prune_directory(const fs::path &p, const context &ctx)
+{
+    string msg;
+    if (ctx.simulate || ctx.verbose)
+        msg = "Considering removal of potentially-empty directory " +
+            p.string() + ".. ";
+    
+    if (ctx.simulate)
     {
-        // It's a directory.  Recurse over everything within.
-        int dir_entry_count = 0;
-        ++results.dirs_processed;
-        
-        // It is unspecified behaviour what happens to directory_iterators if
-        // new subdirs are added to this path by the recursive calls.  We do not
-        // need to process any such newly-added subdirs (they'll already be
-        // perfectly named, by definition), so we will copy the list of entries
-        // in advance and then iterate over that.
-        std::vector<fs::path> sub_paths;
-        for (auto iter = fs::directory_iterator{p}; iter != fs::directory_iterator{}; ++iter)
+        print(ctx, msg + "\n");
+        return false;
+    }
+    
+    stage_timer timer{ctx.stats.get(), run_stats::stage::prune};
+    MUSICMOVE_TRACE_SPAN(span, ctx.trace.get(), "prune", p);
+    
+    // Originals that were copied elsewhere may not have been removed yet
+    for (const auto &error : finish_transfers())
+        print_warning(ctx, error + "\n");
+    
+    // Potentially, earlier moves could have created brand new subdirs in this
+    // directory, in which case we should not attempt removal.  Only remove
+    // the directory if it is genuinely empty.
+    // Because we rely on the filesystem to help us with this step, this is
+    // currently a shortcoming of the `simulate' option.
+    if (!remove_empty_directory(p))
+    {
+        if (ctx.verbose)
+            print(ctx, msg + "not empty\n");
+        return false;
+    }
+    
+    if (ctx.verbose)
+        print(ctx, msg + "empty\n");
+    return true;
+}
+
+// Wait for any transfers still going on in the background
+void drain_transfers(const context &ctx)
+{
+    if (ctx.transfers)
+    {
+        for (const auto &error : ctx.transfers->wait())
+            print_warning(ctx, error + "\n");
+    }
+    for (const auto &error : finish_transfers())
+        print_warning(ctx, error + "\n");
+}
+
+// Note a move in the journal, if one is being kept, before it is made.
+// Current is wherever the thing being moved is now.
+std::uint64_t journal_move(const context &ctx, journal_action action,
+                           const fs::path &source,
+                           const fs::path &destination,
+                           const fs::path &current)
+{
+    if (!ctx.journal)
+        return 0;
+    tag_cache_key key{};
+    tag_cache::make_key(current, key);
+    return ctx.journal->begin(action, source, destination, key);
+}
+
+void journal_outcome(const context &ctx, std::uint64_t id, bool made)
+{
+    if (ctx.journal)
+        ctx.journal->finish(id, made ? journal_status::done
+                                     : journal_status::failed);
+}
+
+// Describe a move for people to read
+string describe_move(const fs::path &file, const fs::path &new_file)
+{
+    stringstream msg;
+    bool dir_changed = file.parent_path() != new_file.parent_path();
+    bool filename_changed = file.filename() != new_file.filename();
+    if (dir_changed && filename_changed)
+        msg << "Move/rename " << file.string() << endl
+            << "         to " << new_file.string() << endl;
+    else if (dir_changed)
+        msg << "Move " << file.string() << endl
+            << "  to " << new_file.string() << endl;
+    else
+        msg << "Rename " << file.string() << endl
+            << "    to " << new_file.filename().string() << endl;
+    return msg.str();
+}
+
+// Deal with a plan whose destination is already taken
+void reject_move(move_plan &plan, const context &ctx)
+{
+    if (ctx.path_uniqueness == path_uniqueness_t::skip)
+    {
+        stringstream msg;
+        msg << "Warning: want to move " << plan.file.string()
+            << " to " << plan.new_file.string()
+            << ", but that path already exists.  Skipping for now.."
+            << endl;
+        plan.messages += msg.str();
+        plan.reason = "destination exists";
+        plan.clash_file = plan.new_file;
+        plan.new_file.clear();
+    }
+    else if (ctx.path_uniqueness == path_uniqueness_t::exit)
+    {
+        stringstream msg;
+        msg << "Tried to move " << plan.file.string()
+            << " to " << plan.new_file.string()
+            << ", but that path already exists";
+        throw path_uniqueness_violation(msg.str());
+    }
+    else
+        throw std::out_of_range("ASSERT: Unknown value of "
+            "path_uniqueness_t not handled!");
+}
+
+// What a transfer in the background needs to report on itself once it is
+// over, by which time the context it was queued from may have gone
+context reporting_context(const context &ctx)
+{
+    context reporting;
+    reporting.simulate = false;
+    reporting.verbose = ctx.verbose;
+    reporting.out = ctx.out;
+    reporting.stats = ctx.stats;
+    reporting.journal = ctx.journal;
+    return reporting;
+}
+
+// Report on a file moved to another filesystem in the background, once the
+// transfer is over
+void report_transfer(const context &ctx, const fs::path &file,
+                     const fs::path &new_file, bool moved,
+                     const string &error)
+{
+    if (!error.empty())
+    {
+        report_file(ctx, file, fs::path{}, "error", error);
+        print_warning(ctx, error + "\n");
+    }
+    else if (!moved)
+    {
+        print(ctx, "Warning: want to move " + file.string() + " to " +
+            new_file.string() + ", but that path already exists.  "
+            "Skipping for now..\n");
+        report_file(ctx, file, new_file, "skip", "destination exists");
+    }
+    else
+    {
+        report_file(ctx, file, new_file,
+            file.parent_path() != new_file.parent_path() ? "move" : "rename",
+            "");
+        if (ctx.verbose)
+            print(ctx, describe_move(file, new_file));
+    }
+}
+
+// How a move turned out.  One to another filesystem may only have been
+// queued, in which case it reports on itself once it is over.
+enum class move_outcome { moved, exists, queued };
+
+// Move a file unless something already exists at the new path.  If the move
+// is queued, its journal entry, if any, is finished once it is over: with
+// the given status if it was made, or as failed if it was a new move that
+// wasn't.  Otherwise that is left to the caller.
+move_outcome move_no_replace(const fs::path &file, const fs::path &new_file,
+                             const context &ctx, std::uint64_t journal_id = 0,
+                             journal_status made = journal_status::done)
+{
+    // The rename call might fail if the old and new file reside on different
+    // devices.  Look out for that situation
+    try
+    {
+        return rename_no_replace(file, new_file) ? move_outcome::moved
+                                                 : move_outcome::exists;
+    }
+    catch (fs::filesystem_error &e)
+    {
+        // Check for cross-device issue
+        if (e.code().category() != boost::system::system_category() ||
+            e.code().value() != EXDEV /* code 18 */)
         {
-            sub_paths.push_back(iter->path());
+            // It wasn't a cross-device issue, so rethrow
+            throw;
         }
+    }
+    
+    // Copy and remove instead, in the background if we can
+    if (ctx.stats)
+        ctx.stats->count("cross_device_moves");
+    if (ctx.transfers)
+    {
+        ctx.transfers->submit(file, new_file,
+            [reporting = reporting_context(ctx), file, new_file, journal_id,
+             made](bool moved, const string &error) {
+                // Only once the copy is safely in place can the journal say
+                // the move was made
+                if (reporting.journal && journal_id != 0 &&
+                    (moved || made == journal_status::done))
+                {
+                    reporting.journal->finish(journal_id,
+                        moved ? made : journal_status::failed);
+                }
+                report_transfer(reporting, file, new_file, moved, error);
+            });
+        return move_outcome::queued;
+    }
+    MUSICMOVE_TRACE_SPAN(span, ctx.trace.get(), "copy", file);
+    return transfer_file(file, new_file, ctx.durability)
+        ? move_outcome::moved : move_outcome::exists;
+}
 
-        for (const auto& sub_path : sub_paths)
+// Every destination claimed so far in a run, so that clashes can be found
+// before anything has been moved.  A destination is taken if an earlier
+// move in the run claimed it, or if something is already there that no
+// earlier move takes away.  Each destination directory is listed once,
+// rather than checking each destination in turn.
+class destination_index
+{
+public:
+    bool claim(const move_plan &plan)
+    {
+        auto dest = normalise(plan.new_file);
+        if (claimed_.count(dest.string()) > 0)
+            return false;
+        if (exists_on_disk(dest) && vacated_.count(dest.string()) == 0)
+            return false;
+        claimed_.insert(dest.string());
+        vacated_.insert(normalise(plan.file).string());
+        return true;
+    }
+    
+private:
+    static fs::path normalise(const fs::path &p)
+    {
+        return fs::absolute(p).lexically_normal();
+    }
+    
+    bool exists_on_disk(const fs::path &p)
+    {
+        auto dir = p.parent_path().string();
+        auto iter = dir_entries_.find(dir);
+        if (iter == dir_entries_.end())
         {
-            ++dir_entry_count;
-            // Process the sub-directory
-            auto sub_results = process_path(sub_path, ctx);
-            results.files_processed += sub_results.files_processed;
-            results.dirs_processed += sub_results.dirs_processed;
-            if (sub_results.moved_out_of_parent_dir)
-                --dir_entry_count;
+            std::unordered_set<string> names;
+            boost::system::error_code ec;
+            for (auto entry = fs::directory_iterator{dir, ec};
+                 !ec && entry != fs::directory_iterator{};
+                 entry.increment(ec))
+            {
+                names.insert(entry->path().filename().string());
+            }
+            iter = dir_entries_.emplace(dir, std::move(names)).first;
         }
-        
-        // Is the directory now potentially empty?
-        if (dir_entry_count == 0)
+        return iter->second.count(p.filename().string()) > 0;
+    }
+    
+    std::unordered_set<string> claimed_;
+    std::unordered_set<string> vacated_;
+    std::unordered_map<string, std::unordered_set<string>> dir_entries_;
+};
+
+// Something found while walking a directory tree, in the order in which the
+// recursive walk would have come across it
+struct walk_event
+{
+    enum class kind_t { missing, file, skipped, enter, leave, error };
+    
+    kind_t kind;
+    fs::path path;
+    std::future<move_plan> plan;
+    std::exception_ptr error;
+    // What a directory looked like when it was entered
+    dir_signature signature;
+};
+
+// Walks a directory tree on its own thread, handing each file to the worker
+// pool to be read and formatted, and queueing up events for the single
+// thread that commits the results in order.
+class tree_walker
+{
+public:
+    tree_walker(const context &ctx, worker_pool &pool,
+                bounded_queue<walk_event> &events) :
+        ctx_{ctx}, pool_{pool}, events_{events},
+        window_{ctx.jobs > 0 ? ctx.jobs : 1}
+    {}
+    
+    void run(const fs::path &root)
+    {
+        try
+        {
+            const context &ctx = ctx_;
+            auto listing = pool_.submit([root, &ctx] {
+                return scan_directory(root, ctx);
+            });
+            walk(root, listing);
+        }
+        catch (stopped &)
         {
-            if (ctx.simulate || ctx.verbose)
-                cout << "Considering removal of potentially-empty directory "
-                     << p.string() << ".. ";
+            // Nobody is listening any more
+        }
+        catch (...)
+        {
+            emit(walk_event::kind_t::error, root).error =
+                std::current_exception();
+            events_.push(std::move(pending_));
+        }
+        events_.close();
+    }
+    
+private:
+    struct stopped {};
+    
+    walk_event &emit(walk_event::kind_t kind, const fs::path &p)
+    {
+        pending_ = walk_event{};
+        pending_.kind = kind;
+        pending_.path = p;
+        return pending_;
+    }
+    
+    void push()
+    {
+        // The committer closes the queue early if it gives up
+        if (!events_.push(std::move(pending_)))
+            throw stopped{};
+    }
+    
+    // A directory part way through being walked
+    struct frame
+    {
+        fs::path dir;
+        dir_listing listing;
+        // Whether its files can be passed over without reading them
+        bool settled = false;
+        // Next entry to visit, and next to consider prefetching
+        std::size_t next = 0;
+        std::size_t next_prefetch = 0;
+        std::deque<std::future<scanned_dir>> prefetched;
+    };
+    
+    // Keep the listings of the next few subdirectories on their way, so that
+    // we are not left waiting on each one in turn
+    void prefetch(frame &f)
+    {
+        while (f.prefetched.size() < window_ &&
+               f.next_prefetch < f.listing.size())
+        {
+            const auto &entry = f.listing[f.next_prefetch++];
+            if (entry.kind != entry_kind::directory)
+                continue;
+            const context &ctx = ctx_;
+            f.prefetched.push_back(pool_.submit([p = entry.path, &ctx] {
+                return scan_directory(p, ctx);
+            }));
+        }
+    }
+    
+    void enter(std::deque<frame> &stack, const fs::path &dir,
+               std::future<scanned_dir> &listing)
+    {
+        auto scanned = listing.get();
+        frame f;
+        f.dir = dir;
+        f.listing = std::move(scanned.listing);
+        f.settled = scanned.settled;
+        stack.push_back(std::move(f));
+        emit(walk_event::kind_t::enter, dir).signature = scanned.signature;
+        push();
+    }
+    
+    void walk(const fs::path &root, std::future<scanned_dir> &root_listing)
+    {
+        // Walk depth-first, in the same order as a recursive walk would
+        std::deque<frame> stack;
+        enter(stack, root, root_listing);
+        while (!stack.empty())
+        {
+            auto &top = stack.back();
+            if (top.next == top.listing.size())
+            {
+                emit(walk_event::kind_t::leave, top.dir);
+                push();
+                stack.pop_back();
+                continue;
+            }
             
-            if (!ctx.simulate)
+            prefetch(top);
+            auto entry = std::move(top.listing[top.next++]);
+            switch (entry.kind)
             {
-                // Potentially, the recursive calls to process_path could have
-                // created brand new subdirs in this directory, in which case
-                // we should not attempt removal.  Only attempt removal if the
-                // directory is genuinely empty.
-                // Because we rely on the filesystem to help us with this step,
-                // this is currently a shortcoming of the `simulate' option.
-                if (fs::directory_iterator{p} == fs::directory_iterator{})
+            case entry_kind::missing:
+                emit(walk_event::kind_t::missing, entry.path);
+                push();
+                break;
+            case entry_kind::file:
+            {
+                if (!wanted_file(entry.path, ctx_))
                 {
-                    // Remove this dir and all its contents
-                    if (ctx.verbose)
-                        cout << "empty" << endl;
-                    fs::remove_all(p);
-                    results.moved_out_of_parent_dir = true;
+                    emit(walk_event::kind_t::skipped, entry.path);
+                    push();
+                    break;
                 }
-                else
+                if (top.settled)
                 {
-                    if (ctx.verbose)
-                        cout << "not empty" << endl;
+                    // Nothing has changed since the file was last left
+                    // where it is
+                    move_plan plan;
+                    plan.file = entry.path;
+                    plan.reason = "unchanged";
+                    std::promise<move_plan> settled;
+                    settled.set_value(std::move(plan));
+                    emit(walk_event::kind_t::file, entry.path).plan =
+                        settled.get_future();
+                    push();
+                    break;
                 }
+                const context &ctx = ctx_;
+                emit(walk_event::kind_t::file, entry.path).plan =
+                    pool_.submit([p = entry.path, &ctx] {
+                        return plan_move(p, ctx);
+                    });
+                push();
+                break;
             }
-            else
+            case entry_kind::directory:
             {
-                cout << endl;
+                auto listing = std::move(top.prefetched.front());
+                top.prefetched.pop_front();
+                enter(stack, entry.path, listing);
+                break;
+            }
             }
         }
     }
-    else
+    
+    const context &ctx_;
+    worker_pool &pool_;
+    bounded_queue<walk_event> &events_;
+    const std::size_t window_;
+    walk_event pending_;
+};
+
+// One step of a run, with the outcome of planning any file
+struct plan_step
+{
+    walk_event::kind_t kind;
+    fs::path path;
+    move_plan plan;
+    std::exception_ptr error;
+    dir_signature signature;
+};
+
+// Walk a directory tree and plan a move for every file in it, in order.
+// Files are read and formatted by a pool of workers while the tree is still
+// being walked, and their destinations are checked against each other here,
+// on this thread, in the same order as a plain recursive walk would visit
+// them.
+std::vector<plan_step> plan_tree(const fs::path &root, const context &ctx)
+{
+    auto jobs = ctx.jobs > 0 ? ctx.jobs : 1;
+    worker_pool pool{jobs > 1 ? jobs : 0};
+    bounded_queue<walk_event> events{64 * static_cast<std::size_t>(jobs)};
+    tree_walker walker{ctx, pool, events};
+    
+    struct walker_guard
+    {
+        bounded_queue<walk_event> &events;
+        std::thread thread;
+        ~walker_guard()
+        {
+            // Let the walker finish early if we are giving up
+            events.close();
+            thread.join();
+        }
+    } guard{events, std::thread{[&walker, &root] { walker.run(root); }}};
+    
+    std::vector<plan_step> steps;
+    destination_index destinations;
+    walk_event event;
+    while (events.pop(event))
+    {
+        if (event.kind == walk_event::kind_t::error)
+            std::rethrow_exception(event.error);
+        
+        plan_step step{event.kind, std::move(event.path), {}, nullptr,
+                       event.signature};
+        if (event.kind == walk_event::kind_t::file)
+        {
+            try
+            {
+                step.plan = event.plan.get();
+                stage_timer timer{ctx.stats.get(),
+                                  run_stats::stage::clash_check};
+                if (!step.plan.new_file.empty() &&
+                    !destinations.claim(step.plan))
+                {
+                    reject_move(step.plan, ctx);
+                }
+            }
+            catch (path_uniqueness_violation &)
+            {
+                throw;
+            }
+            catch (...)
+            {
+                // Report it when we get to this file
+                step.error = std::current_exception();
+            }
+        }
+        steps.push_back(std::move(step));
+    }
+    return steps;
+}
+
+// Find the directories that can be moved in one go, rather than file by
+// file, and where each would go.  That is any directory other than the root
+// with no subdirectories, all of whose files are moving to the same new
+// directory under the same names, where that new directory doesn't exist
+// yet and nothing else is moving into it.  Any files that aren't music go
+// along with the rest, rather than being left behind.
+std::unordered_map<string, fs::path> find_whole_directories(
+    const std::vector<plan_step> &steps, const fs::path &root)
+{
+    auto normal = [](const fs::path &p) {
+        return fs::absolute(p).lexically_normal();
+    };
+    
+    // Number of files moving into each directory, or anywhere beneath it
+    std::unordered_map<string, int> incoming;
+    for (const auto &step : steps)
+    {
+        if (step.kind != walk_event::kind_t::file ||
+            step.plan.new_file.empty())
+        {
+            continue;
+        }
+        for (auto dir = normal(step.plan.new_file).parent_path();
+             dir.has_relative_path(); dir = dir.parent_path())
+        {
+            ++incoming[dir.string()];
+        }
+    }
+    
+    struct candidate
+    {
+        fs::path dir;
+        fs::path new_dir;
+        bool eligible;
+        int files;
+    };
+    std::vector<candidate> candidates;
+    std::unordered_map<string, fs::path> whole;
+    for (const auto &step : steps)
+    {
+        switch (step.kind)
+        {
+        case walk_event::kind_t::enter:
+            if (!candidates.empty())
+                candidates.back().eligible = false;
+            candidates.push_back(
+                candidate{step.path, {}, step.path != root, 0});
+            break;
+            
+        case walk_event::kind_t::missing:
+        case walk_event::kind_t::error:
+            candidates.back().eligible = false;
+            break;
+            
+        case walk_event::kind_t::skipped:
+            break;
+            
+        case walk_event::kind_t::file:
+        {
+            auto &c = candidates.back();
+            const auto &new_file = step.plan.new_file;
+            if (step.error || new_file.empty() ||
+                new_file.filename() != step.path.filename())
+            {
+                c.eligible = false;
+            }
+            else if (c.new_dir.empty())
+                c.new_dir = new_file.parent_path();
+            else if (c.new_dir != new_file.parent_path())
+                c.eligible = false;
+            ++c.files;
+            break;
+        }
+            
+        case walk_event::kind_t::leave:
+        {
+            auto c = std::move(candidates.back());
+            candidates.pop_back();
+            if (!c.eligible)
+                break;
+            
+            // A directory with no music in it has nowhere to go.  Renaming a
+            // link to a directory would leave its contents behind.
+            if (c.files == 0 || c.new_dir.empty())
+                break;
+            boost::system::error_code ec;
+            auto new_dir = normal(c.new_dir).string();
+            if (incoming[new_dir] == c.files &&
+                incoming.count(normal(c.dir).string()) == 0 &&
+                !fs::exists(fs::symlink_status(c.new_dir, ec)) &&
+                fs::is_directory(fs::symlink_status(c.dir, ec)))
+            {
+                whole.emplace(c.dir.string(), c.new_dir);
+            }
+            break;
+        }
+        }
+    }
+    return whole;
+}
+
+// Move a whole directory found by find_whole_directories(), returning
+// whether it was moved
+bool move_directory(const fs::path &dir, const fs::path &new_dir,
+                    const context &ctx)
+{
+    if (!ctx.simulate)
     {
+        stage_timer timer{ctx.stats.get(), run_stats::stage::move};
+        MUSICMOVE_TRACE_SPAN(span, ctx.trace.get(), "move_directory", dir);
+        std::uint64_t id = 0;
+        bool moved = false;
+        try
+        {
+            make_directories(new_dir.parent_path());
+            id = journal_move(ctx, journal_action::directory, dir, new_dir,
+                              dir);
+            moved = rename_directory_no_replace(dir, new_dir);
+        }
+        catch (fs::filesystem_error &)
+        {
+            // E.g. the new directory is on another filesystem.  Moving each
+            // file will get there, or say what's wrong.
+        }
+        if (id != 0)
+            journal_outcome(ctx, id, moved);
+        if (!moved)
+            return false;
+    }
+    
+    if (ctx.stats)
+        ctx.stats->count("directories_moved");
+    bool records = ctx.out && ctx.out->records();
+    if (ctx.verbose || (ctx.simulate && !records))
+    {
+        print(ctx, "Move directory " + dir.string() + "\n" +
+            "            to " + new_dir.string() + "\n");
+    }
+    return true;
+}
+
+} // anonymous namespace
+
+process_results process_path(const fs::path &p, const mm::context &ctx)
+{
+    process_results results;
+    
+    if (!fs::exists(p))
+    {
+        print_warning(ctx, "Warning: path does not exist: " + p.string() +
+            "\n");
+        return results;
+    }
+
+    if (!fs::is_directory(p))
+    {
+        if (!wanted_file(p, ctx))
+        {
+            report_file(ctx, p, fs::path{}, "skip", "not music");
+            ++results.files_skipped;
+            return results;
+        }
+        
         // Read as a file
         try
         {
             auto file_results = move_file(p, ctx);
+            drain_transfers(ctx);
             // Update results for the path
             ++results.files_processed;
             results.moved_out_of_parent_dir = file_results.moved_out_of_parent_dir;
@@ -129,11 +853,156 @@ process_results process_path(const fs::path &p, const mm::context &ctx)
         catch (std::exception &e)
         {
             // Print error and skip onto next file
-            cerr << e.what() << endl;
-            results.moved_out_of_parent_dir = false;
+            report_file(ctx, p, fs::path{}, "error", e.what());
+            print_warning(ctx, string{e.what()} + "\n");
+        }
+        return results;
+    }
+    
+    // It's a directory.  Work out where everything in it should go before
+    // moving anything, so that clashes between any two files are found up
+    // front, and a simulated run reports exactly what a real run would do.
+    std::vector<plan_step> steps = plan_tree(p, ctx);
+    auto whole_dirs = find_whole_directories(steps, p);
+    
+    // Each directory still being processed, with a count of its entries that
+    // are still in it, where it has been moved to if it has been moved as a
+    // whole, and whether every file in it has been left alone so far
+    struct dir_frame
+    {
+        fs::path path;
+        int entry_count;
+        fs::path moved_to;
+        dir_signature signature;
+        bool left_alone;
+    };
+    std::vector<dir_frame> dirs;
+    bool defer_pruning = ctx.transfers && !ctx.simulate;
+    std::vector<fs::path> emptied;
+    
+    for (auto &step : steps)
+    {
+        switch (step.kind)
+        {
+        case walk_event::kind_t::error:
+            // plan_tree() throws these rather than returning them
+            break;
+            
+        case walk_event::kind_t::missing:
+            print_warning(ctx, "Warning: path does not exist: " +
+                step.path.string() + "\n");
+            ++dirs.back().entry_count;
+            dirs.back().left_alone = false;
+            break;
+            
+        case walk_event::kind_t::skipped:
+            if (!dirs.back().moved_to.empty())
+                report_file(ctx, step.path,
+                            dirs.back().moved_to / step.path.filename(),
+                            "move", "");
+            else
+                report_file(ctx, step.path, fs::path{}, "skip", "not music");
+            ++results.files_skipped;
+            ++dirs.back().entry_count;
+            break;
+            
+        case walk_event::kind_t::file:
+        {
+            bool moved_out = false;
+            try
+            {
+                if (step.error)
+                    std::rethrow_exception(step.error);
+                // Only files that are already where they belong, or that
+                // can't be placed at all, will be left alone next time too
+                if (!step.plan.new_file.empty() ||
+                    (step.plan.reason != "unchanged" &&
+                     step.plan.reason != "no tag"))
+                {
+                    dirs.back().left_alone = false;
+                }
+                auto file_results = commit_move(step.plan, ctx,
+                    !dirs.back().moved_to.empty());
+                ++results.files_processed;
+                moved_out = file_results.moved_out_of_parent_dir;
+            }
+            catch (std::exception &e)
+            {
+                // Print error and skip onto next file
+                report_file(ctx, step.path, fs::path{}, "error", e.what());
+                print_warning(ctx, string{e.what()} + "\n");
+                dirs.back().left_alone = false;
+            }
+            if (!moved_out)
+                ++dirs.back().entry_count;
+            break;
+        }
+            
+        case walk_event::kind_t::enter:
+        {
+            ++results.dirs_processed;
+            dirs.push_back(
+                dir_frame{step.path, 0, {}, step.signature, true});
+            auto iter = whole_dirs.find(step.path.string());
+            if (iter != whole_dirs.end() &&
+                move_directory(step.path, iter->second, ctx))
+            {
+                dirs.back().moved_to = iter->second;
+                dirs.back().left_alone = false;
+            }
+            break;
+        }
+            
+        case walk_event::kind_t::leave:
+        {
+            // Remember whether the next run can pass over the directory
+            if (ctx.state)
+            {
+                if (dirs.back().left_alone)
+                    ctx.state->record(dirs.back().path,
+                                      dirs.back().signature);
+                else
+                    ctx.state->forget(dirs.back().path);
+            }
+            
+            // Is the directory now potentially empty?  If files are still
+            // being copied out of it in the background, assume that they
+            // will all make it, and come back to it later.  The root may
+            // have to stay regardless.
+            bool removed = !dirs.back().moved_to.empty();
+            bool keep = ctx.keep_root && dirs.size() == 1;
+            if (!removed && !keep && dirs.back().entry_count == 0)
+            {
+                if (defer_pruning)
+                {
+                    emptied.push_back(dirs.back().path);
+                    removed = true;
+                }
+                else
+                    removed = prune_directory(dirs.back().path, ctx);
+            }
+            dirs.pop_back();
+            if (!dirs.empty())
+            {
+                if (!removed)
+                    ++dirs.back().entry_count;
+            }
+            else
+                results.moved_out_of_parent_dir = removed;
+            break;
+        }
         }
     }
     
+    drain_transfers(ctx);
+    
+    // Children are always emptied before their parents, and the root last
+    for (const auto &dir : emptied)
+    {
+        bool removed = prune_directory(dir, ctx);
+        if (dir == p)
+            results.moved_out_of_parent_dir = removed;
+    }
     return results;
 };
 
@@ -158,67 +1027,135 @@ static bool path_contains(const fs::path &parent, const fs::path &child)
     return true;
 }
 
-move_results move_file(const fs::path &file, const context &ctx)
+move_plan plan_move(const fs::path &file, const context &ctx)
 {
-    move_results results;
-    metadata tag{file};
+    move_plan plan;
+    plan.file = file;
+    
+    // A file already moved by an interrupted run that is being resumed is
+    // where it belongs
+    if (ctx.journal && ctx.journal->arrived(file))
+    {
+        plan.reason = "unchanged";
+        if (ctx.stats)
+            ctx.stats->count("files_resumed");
+        if (ctx.verbose)
+            plan.messages = "Already moved " + file.string() +
+                " before the run was interrupted\n";
+        return plan;
+    }
+    
+    stage_timer read_timer{ctx.stats.get(), run_stats::stage::read_tags};
+    MUSICMOVE_TRACE_SPAN(read_span, ctx.trace.get(), "metadata", file);
+    metadata tag{file, ctx};
+    MUSICMOVE_TRACE_END(read_span);
+    read_timer.stop();
     
     // Does this file have a tag?
     if (!tag.has_tag())
     {
+        plan.reason = "no tag";
         if (ctx.verbose)
-            cerr << "No tag found for file " << file.string()
-                 << ".. skipping" << endl;
-        return results;
+            plan.warnings = "No tag found for file " + file.string() +
+                ".. skipping\n";
+        return plan;
     }
     
+    stringstream messages;
     if (ctx.verbose)
     {
-        cout << "Properties for " << file.string() << endl;
-        tag.print_properties(cout);
+        messages << "Properties for " << file.string() << endl;
+        tag.print_properties(messages);
     }
     // Format the file, according to either string or script
-    auto format = ctx.use_format_script
-        ? get_format_from_script(file, tag, ctx)
-        : ctx.format;
+    stage_timer format_timer{ctx.stats.get(), run_stats::stage::format};
+    auto format = ctx.format;
+    if (ctx.use_format_script)
+    {
+        MUSICMOVE_TRACE_SPAN(script_span, ctx.trace.get(), "script", file);
+        format = get_format_from_script(file, tag, ctx);
+    }
     if (ctx.verbose)
     {
-        cout << "Using format \"" << format << "\"" << endl;
+        messages << "Using format \"" << format << "\"" << endl;
     }
+    MUSICMOVE_TRACE_SPAN(format_span, ctx.trace.get(), "format", file);
     auto new_file = format_path_easytag(file, format, tag, ctx);
+    MUSICMOVE_TRACE_END(format_span);
+    format_timer.stop();
     
     // See if the new path is actually any different
     if (new_file == file)
     {
         // No change in the file's path.
+        plan.reason = "unchanged";
         if (ctx.verbose)
-            cout << "No change in path for " << file.string() << endl;
+            messages << "No change in path for " << file.string() << endl;
+    }
+    else
+        plan.new_file = new_file;
+    
+    plan.messages = messages.str();
+    return plan;
+}
+
+move_results commit_move(const move_plan &plan, const context &ctx,
+                         bool already_moved)
+{
+    move_results results;
+    const auto &file = plan.file;
+    const auto &new_file = plan.new_file;
+    bool queued = false;
+    
+    print_warning(ctx, plan.warnings);
+    print(ctx, plan.messages);
+    if (new_file.empty())
+    {
+        report_file(ctx, file, plan.clash_file, "skip", plan.reason);
         return results;
     }
 
-    // Check to see if new path already exists
-    if (fs::exists(new_file))
+    if (!ctx.simulate && !already_moved)
     {
-        // Clash with destination path.
-        if (ctx.path_uniqueness == path_uniqueness_t::skip)
+        stage_timer timer{ctx.stats.get(), run_stats::stage::move};
+        MUSICMOVE_TRACE_SPAN(span, ctx.trace.get(), "move", file);
+        
+        // Ensure parent directory path exists before renaming
+        make_directories(new_file.parent_path());
+        
+        auto id = journal_move(ctx, journal_action::file, file, new_file,
+                               file);
+        auto outcome = move_outcome::exists;
+        try
         {
-            cout << "Warning: want to move " << file.string()
-                 << " to " << new_file.string()
-                 << ", but that path already exists.  Skipping for now.."
-                 << endl;
-            return results;
+            outcome = move_no_replace(file, new_file, ctx, id);
         }
-        else if (ctx.path_uniqueness == path_uniqueness_t::exit)
+        catch (...)
         {
-            stringstream msg;
-            msg << "Tried to move " << file.string()
-                << " to " << new_file.string()
-                << ", but that path already exists";
-            throw path_uniqueness_violation(msg.str());
+            journal_outcome(ctx, id, false);
+            throw;
         }
-        else
-            throw std::out_of_range("ASSERT: Unknown value of "
-                "path_uniqueness_t not handled!");
+        queued = outcome == move_outcome::queued;
+        if (!queued)
+            journal_outcome(ctx, id, outcome == move_outcome::moved);
+        if (outcome == move_outcome::exists)
+        {
+            // Something got there first.  Treat it like any other clash.
+            move_plan rejected{plan};
+            rejected.messages.clear();
+            reject_move(rejected, ctx);
+            print(ctx, rejected.messages);
+            report_file(ctx, file, rejected.clash_file, "skip",
+                        rejected.reason);
+            return results;
+        }
+    }
+    else if (!ctx.simulate && ctx.journal)
+    {
+        // Nothing to undo on its own, but a resumed run needn't read it
+        auto id = journal_move(ctx, journal_action::contained, file,
+                               new_file, new_file);
+        journal_outcome(ctx, id, true);
     }
     
     if (file.parent_path() != new_file.parent_path())
@@ -230,48 +1167,147 @@ move_results move_file(const fs::path &file, const context &ctx)
     if (file.filename() != new_file.filename())
         results.filename_changed = true;
     
-    if (ctx.simulate || ctx.verbose)
-    {
-        if (results.dir_changed && results.filename_changed)
-            cout << "Move/rename " << file.string() << endl
-                 << "         to " << new_file.string() << endl;
-        else if (results.dir_changed)
-            cout << "Move " << file.string() << endl
-                 << "  to " << new_file.string() << endl;
-        else
-            cout << "Rename " << file.string() << endl
-                 << "    to " << new_file.filename().string() << endl;
-    }
+    // A transfer still under way reports on itself once it is over
+    if (queued)
+        return results;
     
-    if (!ctx.simulate)
+    report_file(ctx, file, new_file,
+                results.dir_changed ? "move" : "rename", "");
+    
+    // A simulated run has nothing else to show for itself, unless records
+    // are being written
+    bool records = ctx.out && ctx.out->records();
+    if (ctx.verbose || (ctx.simulate && !records))
+        print(ctx, describe_move(file, new_file));
+
+    return results;
+}
+
+move_results move_file(const fs::path &file, const context &ctx)
+{
+    auto plan = plan_move(file, ctx);
+    
+    // A real move finds out for itself whether the new path already exists,
+    // but a simulated one has to look
+    stage_timer timer{ctx.stats.get(), run_stats::stage::clash_check};
+    if (ctx.simulate && !plan.new_file.empty() && fs::exists(plan.new_file))
+        reject_move(plan, ctx);
+    timer.stop();
+    return commit_move(plan, ctx);
+}
+
+process_results undo_moves(const std::vector<journal_entry> &entries,
+                           const context &ctx)
+{
+    process_results results;
+    bool records = ctx.out && ctx.out->records();
+    std::set<fs::path> emptied;
+    for (auto entry = entries.rbegin(); entry != entries.rend(); ++entry)
     {
-        // Ensure parent directory path exists before renaming
-        fs::create_directories(new_file.parent_path());
-        
-        // The rename call might fail if the old and new file reside on
-        // different devices.  Look out for that situation
-        try
+        // Files that went along with their directory go back with it too
+        if (entry->status != journal_status::done ||
+            entry->action == journal_action::contained)
         {
-            fs::rename(file, new_file);
+            continue;
         }
-        catch (fs::filesystem_error &e)
+        const auto &from = entry->destination;
+        const auto &to = entry->source;
+        bool is_dir = entry->action == journal_action::directory;
+        bool queued = false;
+        try
         {
-            // Check for cross-device issue
-            if (e.code().category() == boost::system::system_category() &&
-                e.code().value() == EXDEV /* code 18 */)
+            if (!fs::exists(from))
+            {
+                print_warning(ctx, "Warning: can't put back " + to.string() +
+                    ", as " + from.string() + " is no longer there\n");
+                if (!is_dir)
+                    report_file(ctx, from, to, "skip", "missing");
+                continue;
+            }
+            
+            auto outcome = move_outcome::exists;
+            if (ctx.simulate)
             {
-                // Copy and remove instead
-                fs::copy_file(file, new_file);
-                fs::remove(file);
+                if (!fs::exists(to))
+                    outcome = move_outcome::moved;
             }
             else
             {
-                // It wasn't a cross-device issue, so rethrow
-                std::rethrow_exception(std::current_exception());
+                stage_timer timer{ctx.stats.get(), run_stats::stage::move};
+                MUSICMOVE_TRACE_SPAN(span, ctx.trace.get(), "undo", from);
+                make_directories(to.parent_path());
+                if (!is_dir)
+                    outcome = move_no_replace(from, to, ctx,
+                        ctx.journal ? entry->id : 0, journal_status::undone);
+                else if (rename_directory_no_replace(from, to))
+                    outcome = move_outcome::moved;
             }
+            if (outcome == move_outcome::exists)
+            {
+                print(ctx, "Warning: want to move " + from.string() +
+                    " back to " + to.string() + ", but that path already "
+                    "exists.  Skipping..\n");
+                if (!is_dir)
+                    report_file(ctx, from, to, "skip", "destination exists");
+                continue;
+            }
+            queued = outcome == move_outcome::queued;
+            if (ctx.journal && !ctx.simulate && !queued)
+                ctx.journal->finish(entry->id, journal_status::undone);
+        }
+        catch (std::exception &e)
+        {
+            if (!is_dir)
+                report_file(ctx, from, fs::path{}, "error", e.what());
+            print_warning(ctx, string{e.what()} + "\n");
+            continue;
+        }
+        
+        if (is_dir)
+        {
+            ++results.dirs_processed;
+            if (ctx.stats)
+                ctx.stats->count("directories_moved");
+            if (ctx.verbose || (ctx.simulate && !records))
+                print(ctx, "Move directory " + from.string() + "\n" +
+                    "            to " + to.string() + "\n");
+        }
+        else
+        {
+            ++results.files_processed;
+            // A transfer still under way reports on itself once it is over
+            if (!queued)
+            {
+                report_file(ctx, from, to,
+                    from.parent_path() != to.parent_path() ? "move"
+                                                           : "rename",
+                    "");
+                if (ctx.verbose || (ctx.simulate && !records))
+                    print(ctx, describe_move(from, to));
+            }
+        }
+        
+        // Anything it came out of may now be empty, up to where its old and
+        // new paths part ways
+        fs::path common;
+        for (auto i = from.begin(), j = to.begin();
+             i != from.end() && j != to.end() && *i == *j; ++i, ++j)
+        {
+            common /= *i;
+        }
+        for (auto dir = from.parent_path();
+             dir != common && path_contains(common, dir);
+             dir = dir.parent_path())
+        {
+            emptied.insert(dir);
         }
     }
-
+    
+    drain_transfers(ctx);
+    
+    // Children sort after their parents, so are removed first
+    for (auto dir = emptied.rbegin(); dir != emptied.rend(); ++dir)
+        prune_directory(*dir, ctx);
     return results;
 }
 
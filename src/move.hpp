@@ -21,17 +21,23 @@
 #include <boost/filesystem/path.hpp>
 #include <string>
 #include <stdexcept>
+#include <vector>
 #include "context.hpp"
 
 namespace mm {
 
+struct journal_entry;
+
 struct process_results
 {
     process_results() :
-        files_processed{0}, dirs_processed{0}, moved_out_of_parent_dir{false}
+        files_processed{0}, files_skipped{0}, dirs_processed{0},
+        moved_out_of_parent_dir{false}
     {}
 
     int files_processed;
+    // Files passed over without being read, e.g. because they aren't music
+    int files_skipped;
     int dirs_processed;
     // Was the path moved "out" of its current parent path?
     bool moved_out_of_parent_dir;
@@ -62,9 +68,40 @@ struct move_results
     bool moved_out_of_parent_dir;
 };
 
+// The outcome of reading and formatting one file, before anything on disk
+// has been changed.  Planning is safe to run on any thread; the messages it
+// would have printed are kept so that they can be printed in order later.
+struct move_plan
+{
+    boost::filesystem::path file;
+    // Where the file should go, or empty if it should be left alone
+    boost::filesystem::path new_file;
+    // Why the file is being left alone, and where it would have gone if
+    // something else wasn't already there
+    std::string reason;
+    boost::filesystem::path clash_file;
+    // Text destined for stdout and stderr respectively
+    std::string messages;
+    std::string warnings;
+};
+
+move_plan plan_move(const boost::filesystem::path &file, const context &ctx);
+
+// Carry out a plan.  The caller is responsible for making sure that nothing
+// is in the way at the destination.  If the file has already been moved
+// along with the rest of its directory, it is only reported on.
+move_results commit_move(const move_plan &plan, const context &ctx,
+                         bool already_moved = false);
+
 move_results move_file(const boost::filesystem::path &file,
                        const context &ctx);
 
+// Put everything moved by the entries of a journal back where it came from,
+// most recent first, and remove any directories left empty.  Each move put
+// back is noted in the context's journal, if it has one.
+process_results undo_moves(const std::vector<journal_entry> &entries,
+                           const context &ctx);
+
 } // namespace mm
 
 #endif // MUSICMOVE_MOVE_HPP
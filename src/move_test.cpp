@@ -15,15 +15,24 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include "dir_state.hpp"
+#include "journal.hpp"
 #include "move.hpp"
+#include "output.hpp"
+#include "stats.hpp"
+#include "transfer.hpp"
+#include "test_fixture.hpp"
 
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE move_test
 #include <boost/test/unit_test.hpp>
 #include <boost/filesystem.hpp>
+#include <algorithm>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <stdexcept>
+#include <vector>
 
 #define STRINGIFY(x) STRINGIFY_(x)
 #define STRINGIFY_(x) #x
@@ -33,34 +42,6 @@ using namespace std;
 
 const fs::path sample_file{STRINGIFY(TESTDATA_DIR) "/move/foo.txt"};
 
-struct fixture
-{
-    fixture() :
-        tmp_dir{fs::temp_directory_path() /
-                fs::path{"musicmove-" + fs::unique_path().string()}}
-    {
-        // Ensure the tmp dir exists
-        cout << "Creating " << tmp_dir << endl;
-        if (fs::exists(tmp_dir))
-        {
-            throw std::runtime_error{"tmp_dir already exists!"};
-        }
-        fs::create_directories(tmp_dir);
-    }
-    
-    ~fixture()
-    {
-        // Remove the tmp dir if it exists
-        cout << "Removing " << tmp_dir << endl;
-        if (fs::is_directory(tmp_dir))
-        {
-            fs::remove_all(tmp_dir);
-        }
-    }
-    
-    const fs::path tmp_dir;
-};
-
 BOOST_AUTO_TEST_CASE (rename_file_same_dir)
 {
     fixture f;
@@ -508,6 +489,17 @@ BOOST_AUTO_TEST_CASE (process_path_flat_move_out)
     BOOST_CHECK_EQUAL(fs::exists(d2), true);
     BOOST_CHECK_EQUAL(fs::exists(d3), true);
     BOOST_CHECK_EQUAL(fs::exists(d4), true);
+    
+    // Unless it has to stay, e.g. because it is being watched, in which
+    // case only its emptied subdirectories are removed
+    fs::create_directories(start_dir / "bar");
+    fs::rename(d1, start_dir / "bar" / "005a.inc");
+    ctx.keep_root = true;
+    results = mm::process_path(start_dir, ctx);
+    BOOST_CHECK_EQUAL(results.moved_out_of_parent_dir, false);
+    BOOST_CHECK_EQUAL(fs::exists(start_dir / "bar"), false);
+    BOOST_CHECK_EQUAL(fs::is_directory(start_dir), true);
+    BOOST_CHECK_EQUAL(fs::exists(d1), true);
 }
 
 BOOST_AUTO_TEST_CASE (process_path_nested_move_out_sideways)
@@ -558,4 +550,497 @@ BOOST_AUTO_TEST_CASE (process_path_nested_move_out_sideways)
     BOOST_CHECK_EQUAL(fs::exists(d4), true);
 }
 
+BOOST_AUTO_TEST_CASE (process_path_parallel)
+{
+    fixture f;
+    
+    mm::context ctx;
+    ctx.format = f.tmp_dir.string();
+    ctx.simulate = false;
+    ctx.verbose = true;
+    ctx.path_uniqueness = mm::path_uniqueness_t::skip;
+    ctx.path_conversion = mm::path_conversion_t::posix;
+    ctx.jobs = 4;
+    
+    // Set up several directories to be read at once
+    fs::path start_dir{f.tmp_dir / "foo"};
+    fs::path hier1{f.tmp_dir / "Alb1"};
+    fs::path hier2{f.tmp_dir / "Alb2"};
+    fs::path sub1{start_dir / "a"};
+    fs::path sub2{start_dir / "b"};
+    fs::path sub3{start_dir / "c"};
+    fs::path sub4{start_dir / "d"};
+    fs::create_directories(sub1);
+    fs::create_directories(sub2);
+    fs::create_directories(sub3);
+    fs::create_directories(sub4);
+    
+    // Set up files, including two that want the same destination
+    fs::path s1{sub1 / "005a.inc"};
+    fs::path s2{sub1 / "006b.inc"};
+    fs::path s3{sub2 / "007c.inc"};
+    fs::path s4{sub2 / "008d.inc"};
+    fs::path s5{sub3 / "009a.inc"};
+    fs::path s6{sub3 / "010b.inc"};
+    fs::path s7{sub3 / "notes.txt"};
+    fs::path s8{sub4 / "009z.inc"};
+    fs::path d1{hier1 / "101-AA1-TT1.inc"};
+    fs::path d2{hier1 / "102-AA1-TT2.inc"};
+    fs::path d3{hier1 / "201-AA1-TT3.inc"};
+    fs::path d4{hier1 / "202-AA1-TT4.inc"};
+    fs::path d5{hier2 / "101-AA1-TT1.inc"};
+    fs::path d6{hier2 / "102-AA1-TT2.inc"};
+    for (auto &s : {s1, s2, s3, s4, s5, s6, s7, s8})
+        fs::copy_file(sample_file, s);
+    
+    // Process the path
+    auto results = mm::process_path(start_dir, ctx);
+    
+    // Check results
+    BOOST_CHECK_EQUAL(results.files_processed, 7);
+    BOOST_CHECK_EQUAL(results.files_skipped, 1);
+    BOOST_CHECK_EQUAL(results.dirs_processed, 5);
+    BOOST_CHECK_EQUAL(results.moved_out_of_parent_dir, false);
+    
+    // Check situation on disk
+    BOOST_CHECK_EQUAL(fs::exists(sub1), false);
+    BOOST_CHECK_EQUAL(fs::exists(sub2), false);
+    BOOST_CHECK_EQUAL(fs::exists(s6), false);
+    BOOST_CHECK_EQUAL(fs::exists(s7), true);
+    BOOST_CHECK_EQUAL(fs::exists(d1), true);
+    BOOST_CHECK_EQUAL(fs::exists(d2), true);
+    BOOST_CHECK_EQUAL(fs::exists(d3), true);
+    BOOST_CHECK_EQUAL(fs::exists(d4), true);
+    BOOST_CHECK_EQUAL(fs::exists(d5), true);
+    BOOST_CHECK_EQUAL(fs::exists(d6), true);
+    
+    // Exactly one of the clashing files was moved, and the other left alone
+    BOOST_CHECK_NE(fs::exists(s5), fs::exists(s8));
+    BOOST_CHECK_EQUAL(fs::exists(sub4), fs::exists(s8));
+}
+
+BOOST_AUTO_TEST_CASE (process_path_clash_found_before_moving)
+{
+    for (bool simulate : {true, false})
+    {
+        fixture f;
+        
+        mm::context ctx;
+        ctx.format = f.tmp_dir.string();
+        ctx.simulate = simulate;
+        ctx.verbose = true;
+        ctx.path_uniqueness = mm::path_uniqueness_t::exit;
+        ctx.path_conversion = mm::path_conversion_t::posix;
+        
+        // Set up two files in different dirs that want the same destination
+        fs::path start_dir{f.tmp_dir / "foo"};
+        fs::path sub1{start_dir / "a"};
+        fs::path sub2{start_dir / "b"};
+        fs::create_directories(sub1);
+        fs::create_directories(sub2);
+        fs::path s1{sub1 / "005a.inc"};
+        fs::path s2{sub2 / "005z.inc"};
+        fs::path d1{f.tmp_dir / "Alb1" / "101-AA1-TT1.inc"};
+        fs::copy_file(sample_file, s1);
+        fs::copy_file(sample_file, s2);
+        
+        // The clash is found even though neither file has been moved yet
+        BOOST_CHECK_THROW(mm::process_path(start_dir, ctx),
+                          mm::path_uniqueness_violation);
+        
+        // Check situation on disk: nothing should have been moved
+        BOOST_CHECK_EQUAL(fs::exists(s1), true);
+        BOOST_CHECK_EQUAL(fs::exists(s2), true);
+        BOOST_CHECK_EQUAL(fs::exists(d1), false);
+    }
+}
+
+BOOST_AUTO_TEST_CASE (process_path_extension_filter)
+{
+    fixture f;
+    
+    mm::context ctx;
+    ctx.format = f.tmp_dir.string();
+    ctx.simulate = false;
+    ctx.verbose = true;
+    ctx.path_uniqueness = mm::path_uniqueness_t::exit;
+    ctx.path_conversion = mm::path_conversion_t::posix;
+    
+    // Set up files, only some of which should be looked at
+    fs::path start_dir{f.tmp_dir / "foo"};
+    fs::create_directory(start_dir);
+    fs::path s1{start_dir / "009a.inc"};
+    fs::path s2{start_dir / "010b.INC"};
+    fs::path s3{start_dir / "cover.jpg"};
+    fs::path s4{start_dir / ".inc"};
+    fs::path s5{start_dir / "notes.TXT"};
+    fs::path d1{f.tmp_dir / "Alb2" / "101-AA1-TT1.inc"};
+    fs::path d2{f.tmp_dir / "Alb2" / "102-AA1-TT2.INC"};
+    for (auto &s : {s1, s2, s3, s4, s5})
+        fs::copy_file(sample_file, s);
+    
+    // Supported extensions match regardless of case, and a dot file's name
+    // isn't its extension
+    auto results1 = mm::process_path(start_dir, ctx);
+    BOOST_CHECK_EQUAL(results1.files_processed, 2);
+    BOOST_CHECK_EQUAL(results1.files_skipped, 3);
+    BOOST_CHECK_EQUAL(fs::exists(s4), true);
+    BOOST_CHECK_EQUAL(fs::exists(d1), true);
+    BOOST_CHECK_EQUAL(fs::exists(d2), true);
+    BOOST_CHECK_EQUAL(fs::exists(s5), true);
+    
+    // So do extensions given explicitly, and exclusions win over inclusions
+    ctx.include_extensions = {".txt", ".jpg"};
+    ctx.exclude_extensions = {".JPG"};
+    auto results2 = mm::process_path(start_dir, ctx);
+    BOOST_CHECK_EQUAL(results2.files_processed, 1);
+    BOOST_CHECK_EQUAL(results2.files_skipped, 2);
+    BOOST_CHECK_EQUAL(fs::exists(s3), true);
+}
+
+BOOST_AUTO_TEST_CASE (process_path_json_records)
+{
+    fixture f;
+    
+    mm::context ctx;
+    ctx.format = f.tmp_dir.string();
+    ctx.simulate = true;
+    ctx.verbose = false;
+    ctx.path_uniqueness = mm::path_uniqueness_t::skip;
+    ctx.path_conversion = mm::path_conversion_t::posix;
+    stringstream out, err;
+    ctx.out = std::make_shared<mm::output>(
+        out, err, mm::output_format_t::json, false);
+    ctx.stats = std::make_shared<mm::run_stats>();
+    
+    fs::path start_dir{f.tmp_dir / "foo"};
+    fs::create_directory(start_dir);
+    fs::path s1{start_dir / "009a.inc"};
+    fs::path s2{start_dir / "009b.inc"};
+    fs::path s3{start_dir / "notes.txt"};
+    fs::path d1{f.tmp_dir / "Alb2" / "101-AA1-TT1.inc"};
+    for (auto &s : {s1, s2, s3})
+        fs::copy_file(sample_file, s);
+    
+    mm::process_path(start_dir, ctx);
+    ctx.out->flush();
+    
+    // One record for each file.  Whichever of the two clashing files is
+    // found first gets to move.
+    vector<string> records;
+    string line;
+    while (getline(out, line))
+        records.push_back(line);
+    sort(records.begin(), records.end());
+    auto expected = [&](const fs::path &moved, const fs::path &clashed) {
+        vector<string> lines{
+            "{\"source\":\"" + moved.string() + "\",\"destination\":\"" +
+                d1.string() + "\",\"action\":\"move\",\"reason\":\"\"}",
+            "{\"source\":\"" + clashed.string() + "\",\"destination\":\"" +
+                d1.string() + "\",\"action\":\"skip\",\"reason\":"
+                "\"destination exists\"}",
+            "{\"source\":\"" + s3.string() + "\",\"destination\":\"\","
+                "\"action\":\"skip\",\"reason\":\"not music\"}"};
+        sort(lines.begin(), lines.end());
+        return lines;
+    };
+    BOOST_CHECK(records == expected(s1, s2) || records == expected(s2, s1));
+    
+    // The same outcomes are counted
+    stringstream stats;
+    ctx.stats->print(stats);
+    BOOST_CHECK(stats.str().find("files_moved: 1\n") != string::npos);
+    BOOST_CHECK(stats.str().find("skipped (destination exists): 1\n") !=
+                string::npos);
+    BOOST_CHECK(stats.str().find("skipped (not music): 1\n") !=
+                string::npos);
+    BOOST_CHECK_EQUAL(fs::exists(s1), true);
+}
+
+BOOST_AUTO_TEST_CASE (process_path_whole_directory)
+{
+    fixture f;
+    
+    mm::context ctx;
+    ctx.format = f.tmp_dir.string();
+    ctx.simulate = false;
+    ctx.verbose = true;
+    ctx.path_uniqueness = mm::path_uniqueness_t::exit;
+    ctx.path_conversion = mm::path_conversion_t::posix;
+    ctx.stats = std::make_shared<mm::run_stats>();
+    
+    // One directory whose files all keep their names in a new directory,
+    // and another that has to be split up
+    fs::path start_dir{f.tmp_dir / "foo"};
+    fs::path sub1{start_dir / "a"};
+    fs::path sub2{start_dir / "b"};
+    fs::create_directories(sub1);
+    fs::create_directories(sub2);
+    fs::path s1{sub1 / "021a.inc"};
+    fs::path s2{sub1 / "021b.inc"};
+    fs::path s3{sub1 / "cover.jpg"};
+    fs::path s4{sub1 / ".hidden"};
+    fs::path s5{sub2 / "009a.inc"};
+    fs::path s6{sub2 / "notes.txt"};
+    fs::path new_dir{f.tmp_dir / "Alb3"};
+    fs::path d5{f.tmp_dir / "Alb2" / "101-AA1-TT1.inc"};
+    for (auto &s : {s1, s2, s3, s4, s5, s6})
+        fs::copy_file(sample_file, s);
+    
+    auto results = mm::process_path(start_dir, ctx);
+    
+    // Check results
+    BOOST_CHECK_EQUAL(results.files_processed, 3);
+    BOOST_CHECK_EQUAL(results.files_skipped, 3);
+    BOOST_CHECK_EQUAL(results.dirs_processed, 3);
+    BOOST_CHECK_EQUAL(results.moved_out_of_parent_dir, false);
+    
+    // Everything in the first directory went along with it
+    BOOST_CHECK_EQUAL(fs::exists(sub1), false);
+    BOOST_CHECK_EQUAL(fs::exists(new_dir / "021a.inc"), true);
+    BOOST_CHECK_EQUAL(fs::exists(new_dir / "021b.inc"), true);
+    BOOST_CHECK_EQUAL(fs::exists(new_dir / "cover.jpg"), true);
+    BOOST_CHECK_EQUAL(fs::exists(new_dir / ".hidden"), true);
+    
+    // The other was dealt with file by file
+    BOOST_CHECK_EQUAL(fs::exists(d5), true);
+    BOOST_CHECK_EQUAL(fs::exists(s6), true);
+    
+    stringstream stats;
+    ctx.stats->print(stats);
+    // The cover and the hidden file went along too, so count as moved
+    BOOST_CHECK(stats.str().find("directories_moved: 1\n") != string::npos);
+    BOOST_CHECK(stats.str().find("files_moved: 5\n") != string::npos);
+    
+    // Nothing moves in one go into a directory that already exists
+    fs::path sub3{start_dir / "c"};
+    fs::create_directories(sub3);
+    fs::path s7{sub3 / "021c.inc"};
+    fs::path s8{sub3 / "cover.png"};
+    fs::copy_file(sample_file, s7);
+    fs::copy_file(sample_file, s8);
+    
+    auto results2 = mm::process_path(start_dir, ctx);
+    BOOST_CHECK_EQUAL(results2.files_processed, 1);
+    BOOST_CHECK_EQUAL(fs::exists(new_dir / "021c.inc"), true);
+    BOOST_CHECK_EQUAL(fs::exists(new_dir / "cover.png"), false);
+    BOOST_CHECK_EQUAL(fs::exists(s8), true);
+    
+    // A directory with no music in it has nowhere to go, either in a real
+    // run or a simulated one
+    fs::path sub4{start_dir / "Scans"};
+    fs::create_directories(sub4);
+    fs::path s9{sub4 / "front.jpg"};
+    fs::copy_file(sample_file, s9);
+    
+    for (bool simulate : {true, false})
+    {
+        ctx.simulate = simulate;
+        auto results3 = mm::process_path(start_dir, ctx);
+        BOOST_CHECK_EQUAL(results3.files_skipped, 3);
+        BOOST_CHECK_EQUAL(fs::exists(s9), true);
+    }
+    stringstream stats3;
+    ctx.stats->print(stats3);
+    BOOST_CHECK(stats3.str().find("directories_moved: 1\n") != string::npos);
+}
+
+BOOST_AUTO_TEST_CASE (process_path_incremental)
+{
+    fixture f;
+    
+    mm::context ctx;
+    ctx.format = f.tmp_dir.string();
+    ctx.simulate = false;
+    ctx.verbose = true;
+    ctx.path_uniqueness = mm::path_uniqueness_t::exit;
+    ctx.path_conversion = mm::path_conversion_t::posix;
+    ctx.state = std::make_shared<mm::dir_state>(f.tmp_dir / "dirs.state",
+        mm::dir_state::settings_digest(ctx));
+    
+    // One directory where everything stays put, and one where something
+    // moves out
+    fs::path start_dir{f.tmp_dir / "foo"};
+    fs::path sub1{start_dir / "a"};
+    fs::path sub2{start_dir / "b"};
+    fs::create_directories(sub1);
+    fs::create_directories(sub2);
+    fs::path s1{sub1 / "022a.inc"};
+    fs::path s2{sub1 / "022b.inc"};
+    fs::path s3{sub1 / "cover.jpg"};
+    fs::path s4{sub2 / "022c.inc"};
+    fs::path s5{sub2 / "009a.inc"};
+    for (auto &s : {s1, s2, s3, s4, s5})
+        fs::copy_file(sample_file, s);
+    
+    // Number of files read in each run
+    auto files_read = [](const mm::run_stats &stats) {
+        stringstream printed;
+        stats.print(printed);
+        string line;
+        while (getline(printed, line))
+        {
+            if (line.compare(0, 10, "read_tags ") == 0)
+                return stoi(line.substr(10));
+        }
+        return 0;
+    };
+    
+    ctx.stats = std::make_shared<mm::run_stats>();
+    auto results = mm::process_path(start_dir, ctx);
+    BOOST_CHECK_EQUAL(results.files_processed, 4);
+    BOOST_CHECK_EQUAL(files_read(*ctx.stats), 4);
+    BOOST_CHECK_EQUAL(ctx.state->hits(), 0);
+    ctx.state->save();
+    
+    // The next run passes over what was left alone last time, but still
+    // reports on it
+    ctx.state = std::make_shared<mm::dir_state>(f.tmp_dir / "dirs.state",
+        mm::dir_state::settings_digest(ctx));
+    ctx.stats = std::make_shared<mm::run_stats>();
+    auto results2 = mm::process_path(start_dir, ctx);
+    BOOST_CHECK_EQUAL(results2.files_processed, 3);
+    BOOST_CHECK_EQUAL(files_read(*ctx.stats), 1);
+    BOOST_CHECK_EQUAL(ctx.state->hits(), 2);
+    stringstream stats;
+    ctx.stats->print(stats);
+    BOOST_CHECK(stats.str().find("directories_unchanged: 2\n") !=
+                string::npos);
+    BOOST_CHECK(stats.str().find("skipped (unchanged): 3\n") !=
+                string::npos);
+    
+    // Any change to a file means its directory is read again
+    fs::last_write_time(s2, fs::last_write_time(s2) - 10);
+    ctx.stats = std::make_shared<mm::run_stats>();
+    mm::process_path(start_dir, ctx);
+    BOOST_CHECK_EQUAL(files_read(*ctx.stats), 2);
+    
+    // As does any change to the format
+    ctx.format = (f.tmp_dir / "bar").string();
+    ctx.state = std::make_shared<mm::dir_state>(f.tmp_dir / "dirs.state",
+        mm::dir_state::settings_digest(ctx));
+    BOOST_CHECK_EQUAL(ctx.state->entries(), 0);
+}
+
+BOOST_AUTO_TEST_CASE (process_path_journal)
+{
+    fixture f;
+    
+    mm::context ctx;
+    ctx.format = f.tmp_dir.string();
+    ctx.simulate = false;
+    ctx.verbose = true;
+    ctx.path_uniqueness = mm::path_uniqueness_t::exit;
+    ctx.path_conversion = mm::path_conversion_t::posix;
+    fs::path journal_path{f.tmp_dir / "run.journal"};
+    ctx.journal = std::make_shared<mm::journal>(journal_path,
+        mm::dir_state::settings_digest(ctx));
+    
+    // One directory that moves as a whole, and one whose files move one by
+    // one
+    fs::path start_dir{f.tmp_dir / "foo"};
+    fs::path sub1{start_dir / "a"};
+    fs::path sub2{start_dir / "b"};
+    fs::create_directories(sub1);
+    fs::create_directories(sub2);
+    fs::path s1{sub1 / "021a.inc"};
+    fs::path s2{sub1 / "021b.inc"};
+    fs::path s3{sub2 / "009a.inc"};
+    fs::path s4{sub2 / "010a.inc"};
+    fs::path new_dir{f.tmp_dir / "Alb3"};
+    fs::path d3{f.tmp_dir / "Alb2" / "101-AA1-TT1.inc"};
+    fs::path d4{f.tmp_dir / "Alb2" / "102-AA1-TT2.inc"};
+    for (auto &s : {s1, s2, s3, s4})
+        fs::copy_file(sample_file, s);
+    
+    auto results = mm::process_path(start_dir, ctx);
+    BOOST_CHECK_EQUAL(results.files_processed, 4);
+    BOOST_CHECK_EQUAL(ctx.journal->recorded(), 5);
+    BOOST_CHECK_EQUAL(fs::exists(start_dir), false);
+    BOOST_CHECK_EQUAL(fs::exists(new_dir / "021a.inc"), true);
+    BOOST_CHECK_EQUAL(fs::exists(d3), true);
+    BOOST_CHECK_EQUAL(fs::exists(d4), true);
+    
+    // Carrying on from the journal, nothing already moved is read again
+    ctx.journal = std::make_shared<mm::journal>(journal_path);
+    ctx.stats = std::make_shared<mm::run_stats>();
+    auto plan = mm::plan_move(d3, ctx);
+    BOOST_CHECK_EQUAL(plan.reason, "unchanged");
+    BOOST_CHECK(plan.new_file.empty());
+    plan = mm::plan_move(new_dir / "021a.inc", ctx);
+    BOOST_CHECK_EQUAL(plan.reason, "unchanged");
+    BOOST_CHECK_EQUAL(ctx.journal->resumed(), 2);
+    stringstream stats;
+    ctx.stats->print(stats);
+    BOOST_CHECK(stats.str().find("files_resumed: 2\n") != string::npos);
+    ctx.stats.reset();
+    
+    // A simulated undo changes nothing
+    ctx.simulate = true;
+    auto simulated = mm::undo_moves(mm::journal::read(journal_path), ctx);
+    BOOST_CHECK_EQUAL(simulated.files_processed, 2);
+    BOOST_CHECK_EQUAL(simulated.dirs_processed, 1);
+    BOOST_CHECK_EQUAL(fs::exists(d3), true);
+    ctx.simulate = false;
+    
+    // Undoing puts everything back, and tidies away what is left empty
+    auto undone = mm::undo_moves(ctx.journal->entries(), ctx);
+    BOOST_CHECK_EQUAL(undone.files_processed, 2);
+    BOOST_CHECK_EQUAL(undone.dirs_processed, 1);
+    for (auto &s : {s1, s2, s3, s4})
+        BOOST_CHECK_EQUAL(fs::exists(s), true);
+    BOOST_CHECK_EQUAL(fs::exists(new_dir), false);
+    BOOST_CHECK_EQUAL(fs::exists(d3.parent_path()), false);
+    
+    // Nothing is put back twice
+    ctx.journal = std::make_shared<mm::journal>(journal_path);
+    auto again = mm::undo_moves(ctx.journal->entries(), ctx);
+    BOOST_CHECK_EQUAL(again.files_processed, 0);
+    BOOST_CHECK_EQUAL(again.dirs_processed, 0);
+}
+
+BOOST_AUTO_TEST_CASE (process_path_background_transfers)
+{
+    fixture f;
+    
+    mm::context ctx;
+    ctx.format = f.tmp_dir.string();
+    ctx.simulate = false;
+    ctx.verbose = true;
+    ctx.path_uniqueness = mm::path_uniqueness_t::exit;
+    ctx.path_conversion = mm::path_conversion_t::posix;
+    ctx.transfers = std::make_shared<mm::transfer_queue>(
+        2, 1024 * 1024, 1, ctx.durability);
+    
+    // Set up nested dirs, which can only be removed once everything has
+    // moved out of them
+    fs::path start_dir{f.tmp_dir / "foo"};
+    fs::path sub1{start_dir / "a"};
+    fs::path sub2{start_dir / "b"};
+    fs::create_directories(sub1);
+    fs::create_directories(sub2);
+    fs::path s1{sub1 / "009a.inc"};
+    fs::path s2{sub1 / "010b.inc"};
+    fs::path s3{sub2 / "011c.inc"};
+    fs::path d1{f.tmp_dir / "Alb2" / "101-AA1-TT1.inc"};
+    fs::path d2{f.tmp_dir / "Alb2" / "102-AA1-TT2.inc"};
+    fs::path d3{f.tmp_dir / "Alb2" / "201-AA1-TT3.inc"};
+    fs::copy_file(sample_file, s1);
+    fs::copy_file(sample_file, s2);
+    fs::copy_file(sample_file, s3);
+    
+    auto results = mm::process_path(start_dir, ctx);
+    
+    // Check results
+    BOOST_CHECK_EQUAL(results.files_processed, 3);
+    BOOST_CHECK_EQUAL(results.dirs_processed, 3);
+    BOOST_CHECK_EQUAL(results.moved_out_of_parent_dir, true);
+    
+    // Check situation on disk
+    BOOST_CHECK_EQUAL(fs::exists(start_dir), false);
+    BOOST_CHECK_EQUAL(fs::exists(d1), true);
+    BOOST_CHECK_EQUAL(fs::exists(d2), true);
+    BOOST_CHECK_EQUAL(fs::exists(d3), true);
+}
+
 // TODO - add test cases in simulate mode
@@ -21,12 +21,28 @@
 #include <boost/filesystem.hpp>
 
 #include <algorithm>
+#include <chrono>
+#include <csignal>
 #include <iostream>
+#include <memory>
+#include <set>
+#include <sstream>
 #include <vector>
 #include <stdexcept>
 
 #include "context.hpp"
+#include "dir_state.hpp"
+#include "format.hpp"
+#include "fs_ops.hpp"
+#include "journal.hpp"
 #include "move.hpp"
+#include "output.hpp"
+#include "server.hpp"
+#include "stats.hpp"
+#include "tag_cache.hpp"
+#include "trace.hpp"
+#include "transfer.hpp"
+#include "watch.hpp"
 
 namespace po = boost::program_options;
 namespace fs = boost::filesystem;
@@ -71,6 +87,332 @@ static void print_version(std::ostream &os)
        << endl;
 }
 
+// Add each extension in a comma-separated list, as ".ext"
+static void parse_extensions(const string &list, vector<string> &extensions)
+{
+    string::size_type start = 0;
+    while (start <= list.size())
+    {
+        auto end = list.find(',', start);
+        if (end == string::npos)
+            end = list.size();
+        auto ext = list.substr(start, end - start);
+        if (!ext.empty())
+            extensions.push_back(ext[0] == '.' ? ext : "." + ext);
+        start = end + 1;
+    }
+}
+
+// Whatever is to be stopped when asked to
+static mm::watcher *active_watcher = nullptr;
+static mm::server *active_server = nullptr;
+
+extern "C" void stop_running(int)
+{
+    if (active_watcher != nullptr)
+        active_watcher->stop();
+    if (active_server != nullptr)
+        active_server->stop();
+}
+
+// Keep the tags read so far, in case we don't get to exit cleanly
+static void save_tag_cache(const mm::context &ctx)
+{
+    if (!ctx.cache)
+        return;
+    try
+    {
+        ctx.cache->save();
+    }
+    catch (std::exception &e)
+    {
+        ctx.out->warning(string{"Unable to save tag cache: "} + e.what() +
+            "\n");
+    }
+}
+
+// Make sure every move made so far is on record, rather than waiting for
+// the rest of its group
+static void sync_journal(const mm::context &ctx)
+{
+    if (!ctx.journal)
+        return;
+    try
+    {
+        ctx.journal->sync();
+    }
+    catch (std::exception &e)
+    {
+        ctx.out->warning(string{"Unable to sync journal: "} + e.what() +
+            "\n");
+    }
+}
+
+// Process files as they arrive, until asked to stop.  Returns non-zero if
+// something went wrong that means we can't carry on.
+static int watch_paths(mm::watcher &w, const mm::context &ctx,
+                       mm::process_results &totals)
+{
+    ctx.out->flush();
+    while (!w.stopped())
+    {
+        for (const auto &batch : w.wait(std::chrono::seconds{1}))
+        {
+            mm::forget_directories();
+            for (const auto &file : batch.files)
+            {
+                try
+                {
+                    auto results = mm::process_path(file, ctx);
+                    totals.files_processed += results.files_processed;
+                    totals.files_skipped += results.files_skipped;
+                }
+                catch (std::exception &e)
+                {
+                    ctx.out->warning(string{e.what()} + "\n");
+                    return 1;
+                }
+            }
+            
+            // Tidy away any directory that has been emptied, up to but not
+            // including the one being watched
+            for (auto dir = batch.dir; !ctx.simulate && !w.is_root(dir);
+                 dir = dir.parent_path())
+            {
+                try
+                {
+                    if (!mm::remove_empty_directory(dir))
+                        break;
+                }
+                catch (fs::filesystem_error &)
+                {
+                    break;
+                }
+                if (ctx.verbose)
+                    ctx.out->message("Removed empty directory " +
+                        dir.string() + "\n");
+            }
+            
+            save_tag_cache(ctx);
+            sync_journal(ctx);
+            ctx.out->flush();
+        }
+    }
+    return 0;
+}
+
+// Set up the context from the options that apply to each run, rather than
+// to the process as a whole.  Returns false, having said why, if any of them
+// are invalid.
+static bool apply_run_options(const po::variables_map &vm, mm::context &ctx,
+                              mm::output_format_t &output_format,
+                              std::ostream &err)
+{
+    // Simulate and for-real both specified?
+    if (vm["for-real"].as<bool>() && vm["simulate"].as<bool>())
+    {
+        err << "The `simulate' and `for-real' options cannot both be "
+            << "specified at the same time: please choose just one" << endl;
+        err << "Run `" PACKAGE " --help' for information on usage" << endl;
+        return false;
+    }
+    
+    if (vm.count("format-script") > 0)
+    {
+        ctx.use_format_script = true;
+        ctx.format_script = vm["format-script"].as<string>();
+    }
+    else if (vm.count("format") > 0)
+    {
+        ctx.use_format_script = false;
+        ctx.format = vm["format"].as<string>();
+        
+        // Make sure the format is valid before touching any files
+        try
+        {
+            mm::easytag_format{ctx.format};
+        }
+        catch (std::exception &e)
+        {
+            err << "Invalid format string: " << e.what() << endl;
+            return false;
+        }
+    }
+    ctx.simulate = !vm["for-real"].as<bool>();
+    ctx.verbose = vm["verbose"].as<bool>();
+    // A switch is always counted, so go by its value
+    ctx.path_uniqueness = vm["exit-on-duplicate"].as<bool>()
+        ? mm::path_uniqueness_t::exit
+        : mm::path_uniqueness_t::skip;
+    ctx.native_tag_reader = vm["native-tags"].as<bool>();
+    if (vm.count("include-ext") > 0)
+    {
+        for (auto &list : vm["include-ext"].as<vector<string>>())
+            parse_extensions(list, ctx.include_extensions);
+    }
+    if (vm.count("exclude-ext") > 0)
+    {
+        for (auto &list : vm["exclude-ext"].as<vector<string>>())
+            parse_extensions(list, ctx.exclude_extensions);
+    }
+    auto path_conversion_str = vm.count("path-conversion") <= 0
+        ? PATH_CONVERSION_DEFAULT_VALUE
+        : vm["path-conversion"].as<string>();
+    if (path_conversion_str == "windows-ascii")
+        ctx.path_conversion = mm::path_conversion_t::windows_ascii;
+    else if (path_conversion_str == "utf-8")
+        ctx.path_conversion = mm::path_conversion_t::utf8;
+    else if (path_conversion_str == "posix")
+        ctx.path_conversion = mm::path_conversion_t::posix;
+    else
+    {
+        err << "Unknown path-conversion value `" << path_conversion_str << "'"
+            << endl;
+        return false;
+    }
+
+    auto output_format_str = vm.count("output-format") <= 0
+        ? string{"text"}
+        : vm["output-format"].as<string>();
+    if (output_format_str == "text")
+        output_format = mm::output_format_t::text;
+    else if (output_format_str == "json")
+        output_format = mm::output_format_t::json;
+    else if (output_format_str == "nul")
+        output_format = mm::output_format_t::nul;
+    else
+    {
+        err << "Unknown output-format value `" << output_format_str << "'"
+            << endl;
+        return false;
+    }
+    return true;
+}
+
+// Options that a client may give for its own request.  Anything else
+// applies to the server as a whole.
+static const std::set<string> request_options{
+    "format", "format-script", "simulate", "for-real", "path-conversion",
+    "exit-on-duplicate", "native-tags", "include-ext", "exclude-ext",
+    "output-format", "verbose", "path",
+};
+
+// Handle one client's request in the same way as a command line, starting
+// from the server's context.  Returns the exit status for the client.
+static int handle_request(const mm::request &req, mm::connection &conn,
+                          const mm::context &base,
+                          const po::options_description &od,
+                          const po::positional_options_description &pos,
+                          mm::process_results &totals)
+{
+    po::variables_map vm;
+    po::parsed_options parsed = po::command_line_parser(req.args)
+        .options(od)
+        .positional(pos)
+        .run();
+    for (const auto &option : parsed.options)
+    {
+        if (request_options.count(option.string_key) == 0)
+        {
+            conn.err() << "The `" << option.string_key << "' option can "
+                       << "only be given when starting the server" << endl;
+            return 1;
+        }
+    }
+    po::store(parsed, vm);
+    po::notify(vm);
+    if (vm.count("path") <= 0)
+    {
+        conn.err() << "No path(s) specified" << endl;
+        return 1;
+    }
+    
+    // Only the format carries over from the server if not given
+    mm::context ctx{base};
+    ctx.include_extensions.clear();
+    ctx.exclude_extensions.clear();
+    mm::output_format_t output_format;
+    if (!apply_run_options(vm, ctx, output_format, conn.err()))
+        return 1;
+    
+    // Anything relative is relative to wherever the client was run,
+    // including the new paths that the format gives
+    if (vm.count("format-script") > 0)
+        ctx.format_script = fs::absolute(ctx.format_script, req.cwd);
+    ctx.base_dir = req.cwd;
+    
+    // What the server remembers about directories only holds for the
+    // settings it was started with
+    if (ctx.state &&
+        mm::dir_state::settings_digest(ctx) != ctx.state->settings())
+    {
+        ctx.state.reset();
+    }
+    
+    ctx.out = std::make_shared<mm::output>(
+        conn.out(), conn.err(), output_format, false);
+    mm::forget_directories();
+    int status = 0;
+    for (const auto &path_str : vm["path"].as<vector<string>>())
+    {
+        try
+        {
+            auto results = mm::process_path(
+                fs::absolute(path_str, req.cwd), ctx);
+            totals.files_processed += results.files_processed;
+            totals.files_skipped += results.files_skipped;
+            totals.dirs_processed += results.dirs_processed;
+        }
+        catch (std::exception &e)
+        {
+            ctx.out->warning(string{e.what()} + "\n");
+            status = 1;
+            break;
+        }
+    }
+    ctx.out->flush();
+    return status;
+}
+
+// Handle requests from clients one at a time, until asked to stop.  Returns
+// non-zero if the server can't carry on.
+static int serve_requests(mm::server &srv, const mm::context &ctx,
+                          const po::options_description &od,
+                          const po::positional_options_description &pos,
+                          mm::process_results &totals)
+{
+    ctx.out->flush();
+    for (;;)
+    {
+        std::unique_ptr<mm::connection> conn;
+        try
+        {
+            conn = srv.accept();
+        }
+        catch (std::exception &e)
+        {
+            ctx.out->warning(string{e.what()} + "\n");
+            return 1;
+        }
+        if (!conn)
+            return 0;
+        
+        int status = 1;
+        try
+        {
+            status = handle_request(conn->read_request(), *conn, ctx, od,
+                                    pos, totals);
+        }
+        catch (std::exception &e)
+        {
+            // E.g. options that don't parse, or a client that went away
+            conn->err() << e.what() << endl;
+        }
+        conn->finish(status);
+        save_tag_cache(ctx);
+    }
+}
+
 static void print_ex_and_abort()
 {
     auto e = std::current_exception();
@@ -85,6 +427,34 @@ static void print_ex_and_abort()
 int main(int argc, char *argv[])
 {
     std::set_terminate(print_ex_and_abort);
+    
+    // A client only passes its arguments on to a server, so it does as
+    // little as it can of its own
+    fs::path connect_socket;
+    vector<string> client_args;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg{argv[i]};
+        if (arg == "--connect" && i + 1 < argc)
+            connect_socket = argv[++i];
+        else if (arg.compare(0, 10, "--connect=") == 0)
+            connect_socket = arg.substr(10);
+        else
+            client_args.push_back(std::move(arg));
+    }
+    if (!connect_socket.empty())
+    {
+        try
+        {
+            return mm::run_client(connect_socket,
+                mm::request{fs::current_path(), client_args}, cout, cerr);
+        }
+        catch (std::exception &e)
+        {
+            cerr << e.what() << endl;
+            return 1;
+        }
+    }
 
     // Command-line options visible in the help screen
     po::options_description od_visible("Allowed options");
@@ -130,6 +500,120 @@ int main(int argc, char *argv[])
         ("exit-on-duplicate", po::bool_switch(),
             "Exit if we encounter two files that would be rewritten to the "
             "same path on disk (default is to skip any such duplicates).")
+        ("native-tags", po::bool_switch(),
+            "Read tags with " PACKAGE "'s own minimal parsers where possible, "
+            "which only read the parts of each file that hold the tag.  Any "
+            "file the parsers don't fully understand is read with TagLib as "
+            "usual.")
+        ("tag-cache", po::value<string>(),
+            "Keep the tags read from each file in the given cache file, and "
+            "use them again on later runs for any file whose size and "
+            "modification time have not changed.")
+        ("state-file", po::value<string>(),
+            "Remember in the given file which directories had every file in "
+            "them left where it was, and pass over their files without "
+            "reading them on later runs, as long as nothing in them has "
+            "changed and the format is the same.")
+        ("journal", po::value<string>(),
+            "Record each file and directory moved in the given journal, "
+            "which must not already exist, so that the run can be resumed "
+            "with --resume if it is interrupted, or undone with --undo.  "
+            "Records are forced to disk in groups, so keeping a journal "
+            "costs very little.  Only kept with --for-real.")
+        ("resume", po::value<string>(),
+            "Carry on with a run that was interrupted, recording in the "
+            "journal it was keeping.  Files that it had already moved are "
+            "passed over without being read again, unless they have "
+            "changed since.  The format and other settings must be the "
+            "same as before.  Only used with --for-real.")
+        ("undo", po::value<string>(),
+            "Rather than processing any paths, move everything recorded in "
+            "the given journal back to where it came from, most recent "
+            "first, and remove any directories left empty.  As with any "
+            "other run, nothing is changed without --for-real.")
+        ("durability", po::value<string>(),
+            "When a file has to be copied to another filesystem, how to make "
+            "sure the copy is safely on disk before the original is removed."
+            "\n`file' syncs each copy as it is made.\n"
+            "`batch' syncs each destination filesystem once for every batch "
+            "of copies, which is much faster for many small files.\n"
+            "`none' leaves it to the operating system.\n"
+            "The default option is `file'.\n")
+        ("copy-jobs", po::value<unsigned int>(),
+            "Number of files to copy to other filesystems at once, in the "
+            "background while other files are moved.  Each copy is checked "
+            "against the original before the original is removed.  Use 0 to "
+            "copy each file before moving on to the next.  The default is 4.")
+        ("copy-jobs-per-device", po::value<unsigned int>(),
+            "Number of files to copy to any one device at once, so that a "
+            "slow device can't hold up copies to the others.  The default "
+            "is 2.")
+        ("copy-limit", po::value<unsigned int>(),
+            "Most megabytes of files to have in the process of being copied "
+            "at once.  The default is 1024.")
+        ("jobs,j", po::value<unsigned int>(),
+            "Number of files to read and format in parallel.  Files are "
+            "still moved one at a time, in the same order as with a single "
+            "job.  The default is 1.")
+        ("include-ext", po::value<vector<string>>(),
+            "Only look at files with these extensions, given as a "
+            "comma-separated list such as `flac,mp3'.  By default, only "
+            "files with extensions that musicmove can read tags from are "
+            "looked at.  May be given more than once.")
+        ("exclude-ext", po::value<vector<string>>(),
+            "Never look at files with these extensions, given as a "
+            "comma-separated list.  May be given more than once.")
+        ("output-format", po::value<string>(),
+            "How to report what is done with each file.\n"
+            "`text' prints messages for people to read.\n"
+            "`json' prints a line of JSON for each file, with its source, "
+            "destination, action and the reason for any it was left alone.\n"
+            "`nul' prints the same four fields for each file, each ended by "
+            "a NUL character.\n"
+            "With `json' and `nul', any other messages are printed to "
+            "standard error.  The default option is `text'.\n")
+        ("stats", po::bool_switch(),
+            "Print how long each stage of handling files took, and counts of "
+            "what was done, once all paths have been processed.")
+        ("stats-file", po::value<string>(),
+            "Write the same statistics to the given file, replacing it.")
+        ("stats-format", po::value<string>(),
+            "Format of the statistics file.\n"
+            "`json' writes a single JSON object.\n"
+            "`prometheus' writes metrics in the Prometheus text format, "
+            "suitable for the node exporter's textfile collector.\n"
+            "The default option is `json'.\n")
+#ifdef MUSICMOVE_TRACING
+        ("trace-file", po::value<string>(),
+            "Record how long each step of handling each file took, on which "
+            "thread, and write it to the given file in the Chrome trace "
+            "event format, to be opened in a viewer such as Perfetto.  Only "
+            "the most recent steps on each thread are kept.")
+#endif
+        ("watch", po::bool_switch(),
+            "Once the given paths have been processed, keep watching them, "
+            "and process each new file as soon as it has been written or "
+            "moved in, along with the rest of the files arriving in the "
+            "same directory.  Each path must be a directory.  Runs until "
+            "interrupted.  Only supported on Linux.")
+        ("watch-delay", po::value<unsigned int>(),
+            "How long, in milliseconds, nothing must have changed in a "
+            "directory before the files that have arrived in it are "
+            "processed.  The default is 2000.")
+        ("serve", po::value<string>(),
+            "Rather than processing any paths, listen on the given Unix "
+            "domain socket for requests from clients run with --connect, "
+            "and handle each one with the format, scripts and caches "
+            "already loaded.  The format given here is used for any request "
+            "that doesn't give its own.  Runs until interrupted.")
+        ("connect", po::value<string>(),
+            "Pass the rest of the command line to a server run with --serve "
+            "on the given socket, rather than doing the work here.  Options "
+            "that apply to the server as a whole, such as --tag-cache or "
+            "--jobs, can only be given to the server.")
+        ("background-output", po::bool_switch(),
+            "Write output on a separate thread, so that a slow terminal or "
+            "pipe doesn't slow down the work being reported on.")
         ("verbose,v", po::bool_switch(),
             "Print additional messages about what's going on.")
         ("version", po::bool_switch(),
@@ -174,80 +658,391 @@ int main(int argc, char *argv[])
         return 0;
     }
     
-    // Do we have at least one path specified?
-    if (vm.count("path") <= 0)
+    // Do we have at least one path specified?  A server is given them by
+    // its clients instead.
+    bool serving = vm.count("serve") > 0;
+    if (serving && (vm.count("path") > 0 || vm["watch"].as<bool>()))
     {
-        cerr << "No path(s) specified" << endl;
+        cerr << "A server can't be given any paths of its own" << endl;
         cerr << "Run `" PACKAGE " --help' for information on usage" << endl;
         return 1;
     }
-    
-    // Do we have a format specified?
-    if (vm.count("format") <= 0 && vm.count("format-script") <= 0)
+    bool undoing = vm.count("undo") > 0;
+    bool journalling = vm.count("journal") > 0 || vm.count("resume") > 0;
+    if (vm.count("journal") > 0 && vm.count("resume") > 0)
     {
-        cerr << "No format string or script specified" << endl;
+        cerr << "The `journal' and `resume' options cannot both be "
+             << "specified at the same time: please choose just one" << endl;
+        cerr << "Run `" PACKAGE " --help' for information on usage" << endl;
+        return 1;
+    }
+    if (serving && (journalling || undoing))
+    {
+        cerr << "A server can't keep or undo a journal" << endl;
+        cerr << "Run `" PACKAGE " --help' for information on usage" << endl;
+        return 1;
+    }
+    if (undoing && (vm.count("path") > 0 || vm["watch"].as<bool>() ||
+                    journalling))
+    {
+        cerr << "A journal can only be undone on its own, without any "
+             << "paths to process" << endl;
+        cerr << "Run `" PACKAGE " --help' for information on usage" << endl;
+        return 1;
+    }
+    if (vm.count("path") <= 0 && !serving && !undoing)
+    {
+        cerr << "No path(s) specified" << endl;
         cerr << "Run `" PACKAGE " --help' for information on usage" << endl;
         return 1;
     }
     
-    // Simulate and for-real both specified?
-    if (vm["for-real"].as<bool>() && vm["simulate"].as<bool>())
+    // Do we have a format specified?
+    if (vm.count("format") <= 0 && vm.count("format-script") <= 0 &&
+        !undoing)
     {
-        cerr << "The `simulate' and `for-real' options cannot both be "
-             << "specified at the same time: please choose just one" << endl;
+        cerr << "No format string or script specified" << endl;
         cerr << "Run `" PACKAGE " --help' for information on usage" << endl;
         return 1;
     }
     
     // Form context struct
     mm::context ctx;
-    if (vm.count("format-script") > 0)
+    mm::output_format_t output_format;
+    if (!apply_run_options(vm, ctx, output_format, cerr))
+        return 1;
+    if (vm.count("tag-cache") > 0)
+        ctx.cache = std::make_shared<mm::tag_cache>(
+            vm["tag-cache"].as<string>());
+    if (vm.count("jobs") > 0)
     {
-        ctx.use_format_script = true;
-        ctx.format_script = vm["format-script"].as<string>();
+        ctx.jobs = vm["jobs"].as<unsigned int>();
+        if (ctx.jobs == 0)
+        {
+            cerr << "The number of jobs must be at least 1" << endl;
+            return 1;
+        }
     }
+    auto durability_str = vm.count("durability") <= 0
+        ? string{"file"}
+        : vm["durability"].as<string>();
+    if (durability_str == "none")
+        ctx.durability = mm::durability_t::none;
+    else if (durability_str == "file")
+        ctx.durability = mm::durability_t::file;
+    else if (durability_str == "batch")
+        ctx.durability = mm::durability_t::batch;
     else
     {
-        ctx.use_format_script = false;
-        ctx.format = vm["format"].as<string>();
+        cerr << "Unknown durability value `" << durability_str << "'" << endl;
+        return 1;
     }
-    ctx.simulate = !vm["for-real"].as<bool>();
-    ctx.verbose = vm["verbose"].as<bool>();
-    ctx.path_uniqueness = vm.count("exit-on-duplicate") <= 0
-        ? mm::path_uniqueness_t::skip
-        : mm::path_uniqueness_t::exit;
-    auto path_conversion_str = vm.count("path-conversion") <= 0
-        ? PATH_CONVERSION_DEFAULT_VALUE
-        : vm["path-conversion"].as<string>();
-    if (path_conversion_str == "windows-ascii")
-        ctx.path_conversion = mm::path_conversion_t::windows_ascii;
-    else if (path_conversion_str == "utf-8")
-        ctx.path_conversion = mm::path_conversion_t::utf8;
-    else if (path_conversion_str == "posix")
-        ctx.path_conversion = mm::path_conversion_t::posix;
+    unsigned int copy_jobs = vm.count("copy-jobs") > 0
+        ? vm["copy-jobs"].as<unsigned int>()
+        : 4;
+    if (copy_jobs > 0 && (!ctx.simulate || serving))
+    {
+        unsigned int per_device = vm.count("copy-jobs-per-device") > 0
+            ? vm["copy-jobs-per-device"].as<unsigned int>()
+            : 2;
+        std::uint64_t limit_mb = vm.count("copy-limit") > 0
+            ? vm["copy-limit"].as<unsigned int>()
+            : 1024;
+        ctx.transfers = std::make_shared<mm::transfer_queue>(
+            copy_jobs, limit_mb * 1024 * 1024, per_device, ctx.durability);
+    }
+    ctx.out = std::make_shared<mm::output>(
+        cout, cerr, output_format, vm["background-output"].as<bool>());
+    
+    auto stats_format_str = vm.count("stats-format") <= 0
+        ? string{"json"}
+        : vm["stats-format"].as<string>();
+    mm::stats_format_t stats_format;
+    if (stats_format_str == "json")
+        stats_format = mm::stats_format_t::json;
+    else if (stats_format_str == "prometheus")
+        stats_format = mm::stats_format_t::prometheus;
     else
     {
-        cerr << "Unknown path-conversion value `" << path_conversion_str << "'"
+        cerr << "Unknown stats-format value `" << stats_format_str << "'"
              << endl;
         return 1;
     }
+    // Dot-relative new paths start from each client's working directory,
+    // which is taken to be the server's own until one says otherwise
+    if (serving)
+        ctx.base_dir = fs::current_path();
+    
+    // Only once everything that decides where files go has been set
+    if (vm.count("state-file") > 0)
+        ctx.state = std::make_shared<mm::dir_state>(
+            vm["state-file"].as<string>(),
+            mm::dir_state::settings_digest(ctx));
+    // Likewise the journal, which is only kept when files are really moved
+    if (journalling && !ctx.simulate)
+    {
+        auto settings = mm::dir_state::settings_digest(ctx);
+        try
+        {
+            if (vm.count("journal") > 0)
+                ctx.journal = std::make_shared<mm::journal>(
+                    vm["journal"].as<string>(), settings);
+            else
+                ctx.journal = std::make_shared<mm::journal>(
+                    vm["resume"].as<string>());
+        }
+        catch (std::exception &e)
+        {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        if (ctx.journal->settings() != settings)
+        {
+            cerr << "The journal " << ctx.journal->path().string()
+                 << " was kept by a run with another format or other "
+                 << "settings" << endl;
+            return 1;
+        }
+    }
+    if (vm["stats"].as<bool>() || vm.count("stats-file") > 0)
+        ctx.stats = std::make_shared<mm::run_stats>();
+#ifdef MUSICMOVE_TRACING
+    if (vm.count("trace-file") > 0)
+    {
+        ctx.trace = std::make_shared<mm::tracer>(65536);
+        if (ctx.transfers)
+            ctx.transfers->trace_to(ctx.trace);
+    }
+#endif
 
+    // Start watching before processing, so that nothing arriving in the
+    // meantime is missed
+    const vector<string> paths = vm.count("path") > 0
+        ? vm["path"].as<vector<string>>()
+        : vector<string>{};
+    std::unique_ptr<mm::watcher> watcher;
+    if (vm["watch"].as<bool>())
+    {
+        std::chrono::milliseconds delay{vm.count("watch-delay") > 0
+            ? vm["watch-delay"].as<unsigned int>()
+            : 2000};
+        try
+        {
+            watcher.reset(new mm::watcher{
+                vector<fs::path>(paths.begin(), paths.end()), delay});
+        }
+        catch (std::exception &e)
+        {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        // The directories being watched have to stay where they are
+        ctx.keep_root = true;
+        active_watcher = watcher.get();
+        std::signal(SIGINT, stop_running);
+        std::signal(SIGTERM, stop_running);
+    }
+    
     // Process specified paths
-    const vector<string> &paths = vm["path"].as<vector<string>>();
+    int result = 0;
+    mm::process_results totals;
+    if (undoing)
+    {
+        try
+        {
+            fs::path journal_path{vm["undo"].as<string>()};
+            vector<mm::journal_entry> entries;
+            if (ctx.simulate)
+                entries = mm::journal::read(journal_path);
+            else
+            {
+                ctx.journal = std::make_shared<mm::journal>(journal_path);
+                entries = ctx.journal->entries();
+            }
+            auto results = mm::undo_moves(entries, ctx);
+            totals.files_processed += results.files_processed;
+            totals.dirs_processed += results.dirs_processed;
+        }
+        catch (std::exception &e)
+        {
+            ctx.out->warning(string{e.what()} + "\n");
+            result = 1;
+        }
+    }
     for (auto &path_str : paths)
     {
         fs::path p{path_str};
         try
         {
-            mm::process_path(p, ctx);
+            auto results = mm::process_path(p, ctx);
+            totals.files_processed += results.files_processed;
+            totals.files_skipped += results.files_skipped;
+            totals.dirs_processed += results.dirs_processed;
         }
         catch (std::exception &e)
         {
-            cerr << e.what() << endl;
-            return 1;
+            ctx.out->warning(string{e.what()} + "\n");
+            result = 1;
+            break;
         }
     }
+    if (watcher && result == 0)
+        result = watch_paths(*watcher, ctx, totals);
     
-    return 0;
+    // Or wait for requests from clients
+    std::unique_ptr<mm::server> server;
+    if (serving)
+    {
+        try
+        {
+            server.reset(new mm::server{vm["serve"].as<string>()});
+        }
+        catch (std::exception &e)
+        {
+            ctx.out->warning(string{e.what()} + "\n");
+            result = 1;
+        }
+    }
+    if (server)
+    {
+        active_server = server.get();
+        std::signal(SIGINT, stop_running);
+        std::signal(SIGTERM, stop_running);
+        if (ctx.verbose)
+            ctx.out->message("Listening on " + vm["serve"].as<string>() +
+                "\n");
+        result = serve_requests(*server, ctx, od, pos, totals);
+    }
+    
+    // Don't leave copied files' originals behind if we stopped early
+    try
+    {
+        if (ctx.transfers)
+        {
+            for (const auto &error : ctx.transfers->wait())
+                ctx.out->warning(error + "\n");
+        }
+        for (const auto &error : mm::finish_transfers())
+            ctx.out->warning(error + "\n");
+    }
+    catch (std::exception &e)
+    {
+        ctx.out->warning(string{e.what()} + "\n");
+        result = 1;
+    }
+    
+    if (ctx.verbose)
+    {
+        stringstream msg;
+        msg << "Skipped " << totals.files_skipped
+            << " files that are not music" << endl;
+        auto stats = mm::get_conversion_cache_stats();
+        msg << "Path conversion cache: " << stats.hits << " hits, "
+            << stats.misses << " misses" << endl;
+        ctx.out->message(msg.str());
+    }
+    
+    // Keep whatever tags we read, even if we stopped early
+    if (ctx.cache)
+    {
+        if (ctx.verbose)
+        {
+            stringstream msg;
+            msg << "Tag cache: " << ctx.cache->hits() << " hits, "
+                << ctx.cache->misses() << " misses" << endl;
+            ctx.out->message(msg.str());
+        }
+        try
+        {
+            ctx.cache->save();
+        }
+        catch (std::exception &e)
+        {
+            ctx.out->warning(string{"Unable to save tag cache: "} + e.what() +
+                "\n");
+        }
+    }
+    
+    // Likewise the directories that were left alone
+    if (ctx.state)
+    {
+        if (ctx.verbose)
+        {
+            stringstream msg;
+            msg << "Directory state: " << ctx.state->hits()
+                << " unchanged, " << ctx.state->misses() << " to be read"
+                << endl;
+            ctx.out->message(msg.str());
+        }
+        try
+        {
+            ctx.state->save();
+        }
+        catch (std::exception &e)
+        {
+            ctx.out->warning(string{"Unable to save directory state: "} +
+                e.what() + "\n");
+        }
+    }
+    
+    // And every move that was made
+    if (ctx.journal)
+    {
+        if (ctx.verbose)
+        {
+            stringstream msg;
+            msg << "Journal: " << ctx.journal->recorded()
+                << " moves recorded, " << ctx.journal->resumed()
+                << " files already moved" << endl;
+            ctx.out->message(msg.str());
+        }
+        sync_journal(ctx);
+    }
+    
+    if (ctx.stats)
+    {
+        ctx.stats->count("files_processed", totals.files_processed);
+        ctx.stats->count("directories_processed", totals.dirs_processed);
+        if (ctx.cache)
+        {
+            ctx.stats->count("tag_cache_hits", ctx.cache->hits());
+            ctx.stats->count("tag_cache_misses", ctx.cache->misses());
+        }
+        if (vm["stats"].as<bool>())
+        {
+            stringstream msg;
+            ctx.stats->print(msg);
+            ctx.out->message(msg.str());
+        }
+        if (vm.count("stats-file") > 0)
+        {
+            try
+            {
+                ctx.stats->save(vm["stats-file"].as<string>(), stats_format);
+            }
+            catch (std::exception &e)
+            {
+                ctx.out->warning(string{"Unable to save statistics: "} +
+                    e.what() + "\n");
+            }
+        }
+    }
+    
+#ifdef MUSICMOVE_TRACING
+    if (ctx.trace)
+    {
+        try
+        {
+            ctx.trace->save(vm["trace-file"].as<string>());
+        }
+        catch (std::exception &e)
+        {
+            ctx.out->warning(string{"Unable to save trace: "} + e.what() +
+                "\n");
+        }
+    }
+#endif
+    
+    ctx.out->flush();
+    return result;
 }
-
@@ -0,0 +1,226 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "output.hpp"
+
+#include <utility>
+
+namespace fs = boost::filesystem;
+
+namespace mm {
+
+namespace {
+
+// How much text to collect before writing it out
+constexpr std::size_t write_threshold = 64 * 1024;
+
+// How far the background writer may fall behind before whatever is giving
+// it text has to wait
+constexpr std::size_t max_pending = 4 * 1024 * 1024;
+
+} // anonymous namespace
+
+void append_json_string(std::string &json, std::string_view str)
+{
+    static const char hex[] = "0123456789abcdef";
+    json += '"';
+    for (char c : str)
+    {
+        switch (c)
+        {
+        case '"':  json += "\\\""; break;
+        case '\\': json += "\\\\"; break;
+        case '\n': json += "\\n"; break;
+        case '\r': json += "\\r"; break;
+        case '\t': json += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+            {
+                json += "\\u00";
+                json += hex[(c >> 4) & 0xf];
+                json += hex[c & 0xf];
+            }
+            else
+                json += c;
+        }
+    }
+    json += '"';
+}
+
+output::output(std::ostream &out, std::ostream &err, output_format_t format,
+               bool background) :
+    out_{out}, err_{err}, format_{format}, pending_{}, pending_bytes_{0},
+    taken_{0}, done_{0}, flush_wanted_{false}, stopping_{false}
+{
+    if (background)
+        writer_ = std::thread{[this] { run(); }};
+}
+
+output::~output()
+{
+    if (writer_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        writer_.join();
+    }
+    else
+        flush();
+}
+
+void output::message(std::string_view text)
+{
+    append(records(), text);
+}
+
+void output::warning(std::string_view text)
+{
+    append(true, text);
+}
+
+void output::record(const fs::path &source, const fs::path &destination,
+                    std::string_view action, std::string_view reason)
+{
+    std::string text;
+    switch (format_)
+    {
+    case output_format_t::text:
+        return;
+        
+    case output_format_t::json:
+        text += "{\"source\":";
+        append_json_string(text, source.string());
+        text += ",\"destination\":";
+        append_json_string(text, destination.string());
+        text += ",\"action\":";
+        append_json_string(text, action);
+        text += ",\"reason\":";
+        append_json_string(text, reason);
+        text += "}\n";
+        break;
+        
+    case output_format_t::nul:
+        text += source.string();
+        text += '\0';
+        text += destination.string();
+        text += '\0';
+        text += action;
+        text += '\0';
+        text += reason;
+        text += '\0';
+        break;
+    }
+    append(false, text);
+}
+
+void output::flush()
+{
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (!writer_.joinable())
+    {
+        write(pending_);
+        pending_.clear();
+        pending_bytes_ = 0;
+        return;
+    }
+    
+    // Wait for whatever the writer has already taken, and whatever it will
+    // take next
+    auto target = taken_ + (pending_.empty() ? 0 : 1);
+    if (done_ >= target)
+        return;
+    flush_wanted_ = true;
+    wake_.notify_one();
+    written_.wait(lock, [this, target] { return done_ >= target; });
+}
+
+void output::append(bool to_err, std::string_view text)
+{
+    if (text.empty())
+        return;
+    
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (writer_.joinable())
+        written_.wait(lock, [this] { return pending_bytes_ < max_pending; });
+    
+    // Keep runs of text for the same stream together
+    if (pending_.empty() || pending_.back().to_err != to_err)
+        pending_.push_back(chunk{to_err, std::string{}});
+    pending_.back().text += text;
+    pending_bytes_ += text.size();
+    
+    if (pending_bytes_ < write_threshold)
+        return;
+    if (writer_.joinable())
+        wake_.notify_one();
+    else
+    {
+        write(pending_);
+        pending_.clear();
+        pending_bytes_ = 0;
+    }
+}
+
+void output::write(std::vector<chunk> &chunks)
+{
+    // Each chunk is for the other stream from the last, so flush each one
+    // to keep the two streams in step with each other
+    for (const auto &c : chunks)
+    {
+        auto &os = c.to_err ? err_ : out_;
+        os.write(c.text.data(), c.text.size());
+        os.flush();
+    }
+}
+
+void output::run()
+{
+    std::unique_lock<std::mutex> lock{mutex_};
+    while (true)
+    {
+        wake_.wait(lock, [this] {
+            return stopping_ || flush_wanted_ ||
+                pending_bytes_ >= write_threshold;
+        });
+        if (pending_.empty())
+        {
+            // Nothing more was added after the last flush was taken
+            flush_wanted_ = false;
+            if (stopping_)
+                break;
+            continue;
+        }
+        
+        std::vector<chunk> chunks;
+        chunks.swap(pending_);
+        pending_bytes_ = 0;
+        flush_wanted_ = false;
+        auto ticket = ++taken_;
+        written_.notify_all();
+        
+        lock.unlock();
+        write(chunks);
+        lock.lock();
+        done_ = ticket;
+        written_.notify_all();
+    }
+}
+
+} // namespace mm
@@ -0,0 +1,104 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_OUTPUT_HPP
+#define MUSICMOVE_OUTPUT_HPP
+
+#include <boost/filesystem/path.hpp>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace mm {
+
+// How to report what is done with each file: as messages for people to
+// read, or as one record per file for other programs, either as a line of
+// JSON or as NUL-terminated fields
+enum class output_format_t { text, json, nul };
+
+// Append a string to some JSON, quoted and escaped as a JSON string
+void append_json_string(std::string &json, std::string_view str);
+
+// Buffered destination for everything reported while processing paths.
+//
+// Text is collected in memory and written out in large blocks, in the order
+// it was given, rather than flushing every line.  Optionally a background
+// thread does the writing, so that a slow terminal or pipe doesn't hold up
+// the work being reported on.  When records are being written, the records
+// alone go to the output stream and any messages go to the error stream.
+class output
+{
+public:
+    output(std::ostream &out, std::ostream &err, output_format_t format,
+           bool background);
+    ~output();
+    output(const output &) = delete;
+    output &operator=(const output &) = delete;
+    
+    // Are records being written, as well as or instead of messages?
+    bool records() const { return format_ != output_format_t::text; }
+    
+    void message(std::string_view text);
+    void warning(std::string_view text);
+    
+    // Report the fate of one file.  Destination may be empty, and reason is
+    // empty unless the file was left alone.  Does nothing unless records
+    // are being written.
+    void record(const boost::filesystem::path &source,
+                const boost::filesystem::path &destination,
+                std::string_view action, std::string_view reason);
+    
+    // Write out everything given so far, and wait for it to be written
+    void flush();
+    
+private:
+    struct chunk
+    {
+        bool to_err;
+        std::string text;
+    };
+    
+    void append(bool to_err, std::string_view text);
+    void write(std::vector<chunk> &chunks);
+    void run();
+    
+    std::ostream &out_;
+    std::ostream &err_;
+    output_format_t format_;
+    
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable written_;
+    std::vector<chunk> pending_;
+    std::size_t pending_bytes_;
+    // Number of times the pending text has been handed over for writing, and
+    // the number of those that have been written
+    std::size_t taken_;
+    std::size_t done_;
+    bool flush_wanted_;
+    bool stopping_;
+    std::thread writer_;
+};
+
+} // namespace mm
+
+#endif // MUSICMOVE_OUTPUT_HPP
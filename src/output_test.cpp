@@ -0,0 +1,102 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "output.hpp"
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE output_test
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem/path.hpp>
+#include <sstream>
+#include <string>
+
+namespace fs = boost::filesystem;
+using namespace std;
+
+BOOST_AUTO_TEST_CASE (text_buffered_until_flush)
+{
+    stringstream out, err;
+    {
+        mm::output o{out, err, mm::output_format_t::text, false};
+        o.message("one\n");
+        o.warning("two\n");
+        o.message("three\n");
+        o.record("a.mp3", "b.mp3", "move", "");
+        BOOST_CHECK_EQUAL(out.str(), "");
+        BOOST_CHECK_EQUAL(err.str(), "");
+        o.flush();
+        BOOST_CHECK_EQUAL(out.str(), "one\nthree\n");
+        BOOST_CHECK_EQUAL(err.str(), "two\n");
+        o.message("four\n");
+    }
+    // Anything left is written out on destruction
+    BOOST_CHECK_EQUAL(out.str(), "one\nthree\nfour\n");
+}
+
+BOOST_AUTO_TEST_CASE (json_records)
+{
+    stringstream out, err;
+    {
+        mm::output o{out, err, mm::output_format_t::json, false};
+        o.record("dir/a \"b\".mp3", "new\\dir/c.mp3", "move", "");
+        o.record(string{"x\n\x01.ogg"}, fs::path{}, "skip", "no tag");
+        o.message("Properties for x\n");
+    }
+    BOOST_CHECK_EQUAL(out.str(),
+        "{\"source\":\"dir/a \\\"b\\\".mp3\",\"destination\":"
+        "\"new\\\\dir/c.mp3\",\"action\":\"move\",\"reason\":\"\"}\n"
+        "{\"source\":\"x\\n\\u0001.ogg\",\"destination\":\"\","
+        "\"action\":\"skip\",\"reason\":\"no tag\"}\n");
+    // Messages are kept out of the way of the records
+    BOOST_CHECK_EQUAL(err.str(), "Properties for x\n");
+}
+
+BOOST_AUTO_TEST_CASE (nul_records)
+{
+    stringstream out, err;
+    {
+        mm::output o{out, err, mm::output_format_t::nul, false};
+        o.record("a b.mp3", "c\nd.mp3", "rename", "");
+        o.record("e.flac", "f.flac", "skip", "destination exists");
+    }
+    const string expected{
+        "a b.mp3\0c\nd.mp3\0rename\0\0"
+        "e.flac\0f.flac\0skip\0destination exists\0", 62};
+    BOOST_CHECK(out.str() == expected);
+}
+
+BOOST_AUTO_TEST_CASE (background_keeps_order)
+{
+    stringstream out, err;
+    string expected;
+    {
+        mm::output o{out, err, mm::output_format_t::text, true};
+        for (int i = 0; i < 100000; ++i)
+        {
+            auto line = "Line " + to_string(i) + "\n";
+            o.message(line);
+            expected += line;
+        }
+        o.flush();
+        BOOST_CHECK(out.str() == expected);
+        
+        o.message("last\n");
+        expected += "last\n";
+    }
+    BOOST_CHECK(out.str() == expected);
+    BOOST_CHECK_EQUAL(err.str(), "");
+}
@@ -0,0 +1,103 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_POSIX_UTIL_HPP
+#define MUSICMOVE_POSIX_UTIL_HPP
+
+#include <boost/filesystem/path.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <unistd.h>
+
+// Small helpers shared by the modules that work with file descriptors and
+// keep files of their own
+
+namespace mm {
+
+// Describe the failure of something done to a path, going by errno
+inline std::string errno_message(const std::string &what,
+                                 const boost::filesystem::path &path)
+{
+    return what + " " + path.string() + ": " + std::strerror(errno);
+}
+
+// Closes a file descriptor on scope exit
+struct fd_closer
+{
+    explicit fd_closer(int fd) : fd{fd} {}
+    ~fd_closer() { if (fd >= 0) ::close(fd); }
+    fd_closer(const fd_closer &) = delete;
+    fd_closer &operator=(const fd_closer &) = delete;
+    int fd;
+};
+
+// Write all of a buffer to a file, throwing Error if it can't be
+template <typename Error>
+void write_all(int fd, const char *data, std::size_t len,
+               const boost::filesystem::path &path)
+{
+    while (len > 0)
+    {
+        auto n = ::write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw Error{errno_message("Failed to write", path)};
+        data += n;
+        len -= n;
+    }
+}
+
+// The start of each file we keep, saying what kind of file it is.  Files are
+// written in native byte order, so that files from another machine are
+// recognised and not misread.
+struct file_tag
+{
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+
+    static constexpr std::uint32_t native_byte_order = 0x01020304;
+
+    // Tag a file as being the given kind, at the given version
+    static file_tag make(const char (&magic)[4], std::uint32_t version)
+    {
+        file_tag tag;
+        std::memcpy(tag.magic, magic, sizeof(tag.magic));
+        tag.version = version;
+        tag.byte_order = native_byte_order;
+        return tag;
+    }
+
+    // Is this file the given kind, at the given version, written here?
+    bool matches(const char (&expected)[4], std::uint32_t expected_version)
+        const
+    {
+        return std::memcmp(magic, expected, sizeof(magic)) == 0 &&
+               version == expected_version &&
+               byte_order == native_byte_order;
+    }
+};
+
+static_assert(sizeof(file_tag) == 12, "unexpected file tag padding");
+
+} // namespace mm
+
+#endif // MUSICMOVE_POSIX_UTIL_HPP
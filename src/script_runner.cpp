@@ -19,7 +19,9 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <stdexcept>
+#include <string>
 #include <chaiscript/chaiscript.hpp>
 
 namespace fs = boost::filesystem;
@@ -27,41 +29,152 @@ namespace cs = chaiscript;
 
 namespace mm {
 
+namespace {
+
+// A ChaiScript engine with the tag functions and path variables bound, and a
+// parsed format script.  Setting up the engine is far more expensive than
+// running a typical script, so one is kept per thread and reused for every
+// file, with only the current tag and paths changing between files.
+class script_engine
+{
+public:
+    script_engine() : declares_globals_{false}, tag_{nullptr}
+    {
+        // Add functions reading the current tag
+        // TODO - should any embedded percent % signs be escaped?
+        // TODO - offer the convert_for_filesystem() function to scripts
+        add_tag_function(&metadata::album, "album");
+        add_tag_function(&metadata::album_artist, "album_artist");
+        add_tag_function(&metadata::artist, "artist");
+        add_tag_function(&metadata::comment, "comment");
+        add_tag_function(&metadata::composer, "composer");
+        add_tag_function(&metadata::copyright, "copyright");
+        add_tag_function(&metadata::date, "date");
+        add_tag_function(&metadata::disc_number, "disc_number");
+        add_tag_function(&metadata::disc_total, "disc_total");
+        add_tag_function(&metadata::encoded_by, "encoded_by");
+        add_tag_function(&metadata::genre, "genre");
+        add_tag_function(&metadata::original_artist, "original_artist");
+        add_tag_function(&metadata::title, "title");
+        add_tag_function(&metadata::track_number, "track_number");
+        add_tag_function(&metadata::track_total, "track_total");
+        add_tag_function(&metadata::url, "url");
+        
+        // Add constant variables for the path, which refer to the values
+        // for the current file
+        chai_.add_global_const(cs::const_var(std::ref(path_)), "path");
+        chai_.add_global_const(cs::const_var(std::ref(filename_)), "filename");
+        chai_.add_global_const(
+            cs::const_var(std::ref(filename_stem_)), "filename_stem");
+        chai_.add_global_const(
+            cs::const_var(std::ref(parent_dir_)), "parent_dir");
+        
+        initial_state_ = chai_.get_state();
+    }
+    
+    std::string run(const fs::path &script, const fs::path &file,
+                    const metadata &tag)
+    {
+        if (!ast_ || script != script_)
+            load(script);
+        
+        tag_ = &tag;
+        path_ = file.string();
+        filename_ = file.filename().string();
+        filename_stem_ = file.filename().stem().string();
+        parent_dir_ = file.parent_path().string();
+        
+        // Functions and globals defined by the script would clash with
+        // those from the previous file, so start again from a clean state
+        if (declares_globals_)
+            chai_.set_state(initial_state_);
+        
+        // Discard variables left over from the previous file
+        chai_.set_locals({});
+        
+        cs::Boxed_Value result;
+        try
+        {
+            result = chai_.eval(*ast_);
+        }
+        catch (cs::eval::detail::Return_Value &rv)
+        {
+            result = rv.retval;
+        }
+        tag_ = nullptr;
+        return chai_.boxed_cast<std::string>(result);
+    }
+    
+private:
+    void add_tag_function(std::string (metadata::*getter)() const,
+                          const std::string &name)
+    {
+        chai_.add(cs::fun([this, getter]() { return (tag_->*getter)(); }),
+                  name);
+    }
+    
+    void load(const fs::path &script)
+    {
+        std::ifstream in{script.string(), std::ios::in | std::ios::binary};
+        if (!in)
+        {
+            throw std::runtime_error{
+                "Unable to open format script " + script.string()};
+        }
+        std::stringstream text;
+        text << in.rdbuf();
+        
+        // Don't leave anything behind from a different script
+        chai_.set_state(initial_state_);
+        ast_ = chai_.get_parser().parse(text.str(), script.string());
+        script_ = script;
+        declares_globals_ = has_declarations(*ast_);
+    }
+    
+    static bool has_declarations(const cs::AST_Node &node)
+    {
+        switch (node.identifier)
+        {
+            case cs::AST_Node_Type::Def:
+            case cs::AST_Node_Type::Class:
+            case cs::AST_Node_Type::Method:
+            case cs::AST_Node_Type::Attr_Decl:
+            case cs::AST_Node_Type::Global_Decl:
+                return true;
+            default:
+                break;
+        }
+        for (auto &child : node.get_children())
+        {
+            if (has_declarations(child.get()))
+                return true;
+        }
+        return false;
+    }
+    
+    cs::ChaiScript chai_;
+    cs::ChaiScript::State initial_state_;
+    fs::path script_;
+    cs::AST_NodePtr ast_;
+    bool declares_globals_;
+    
+    // The file the script is currently being run for
+    const metadata *tag_;
+    std::string path_;
+    std::string filename_;
+    std::string filename_stem_;
+    std::string parent_dir_;
+};
+
+} // anonymous namespace
+
 std::string get_format_from_script(
         const fs::path &file,
         const metadata &tag,
         const context &ctx)
 {
-    // Initialise chai
-    cs::ChaiScript chai;
-    
-    // Add bound members from metadata
-    // TODO - should any embedded percent % signs be escaped?
-    // TODO - offer the convert_for_filesystem() function to scripts
-    chai.add(cs::fun(&metadata::album, &tag), "album");
-    chai.add(cs::fun(&metadata::album_artist, &tag), "album_artist");
-    chai.add(cs::fun(&metadata::artist, &tag), "artist");
-    chai.add(cs::fun(&metadata::comment, &tag), "comment");
-    chai.add(cs::fun(&metadata::composer, &tag), "composer");
-    chai.add(cs::fun(&metadata::copyright, &tag), "copyright");
-    chai.add(cs::fun(&metadata::date, &tag), "date");
-    chai.add(cs::fun(&metadata::disc_number, &tag), "disc_number");
-    chai.add(cs::fun(&metadata::disc_total, &tag), "disc_total");
-    chai.add(cs::fun(&metadata::encoded_by, &tag), "encoded_by");
-    chai.add(cs::fun(&metadata::genre, &tag), "genre");
-    chai.add(cs::fun(&metadata::original_artist, &tag), "original_artist");
-    chai.add(cs::fun(&metadata::title, &tag), "title");
-    chai.add(cs::fun(&metadata::track_number, &tag), "track_number");
-    chai.add(cs::fun(&metadata::track_total, &tag), "track_total");
-    chai.add(cs::fun(&metadata::url, &tag), "url");
-    
-    // Add constant variables for the path
-    chai.add(cs::const_var(file.string()), "path");
-    chai.add(cs::const_var(file.filename().string()), "filename");
-    chai.add(cs::const_var(file.filename().stem().string()), "filename_stem");
-    chai.add(cs::const_var(file.parent_path().string()), "parent_dir");
-
-    return chai.eval_file<std::string>(ctx.format_script.string());
+    thread_local script_engine engine;
+    return engine.run(ctx.format_script, file, tag);
 }
 
 
@@ -69,3 +69,32 @@ BOOST_AUTO_TEST_CASE (chaiscript_format)
         mm::get_format_from_script(file, tag, ctx),
         "genre/albumartist/album/discnumbertracknumber-artist-title");
 }
+
+BOOST_AUTO_TEST_CASE (chaiscript_format_reused)
+{
+    mm::context ctx;
+    ctx.use_format_script = true;
+    fs::path foo_file{testdata_dir_str + "/foo.txt"};
+    fs::path bar_file{testdata_dir_str + "/bar.txt"};
+    mm::metadata tag{foo_file};
+    
+    // The same script is run for many files, and must see each file's own
+    // path, even when it declares variables and functions of its own.
+    ctx.format_script = fs::path{testdata_dir_str + "/05_declarations.chai"};
+    BOOST_CHECK(fs::exists(ctx.format_script));
+    for (int i = 0; i < 3; ++i)
+    {
+        BOOST_CHECK_EQUAL(
+            mm::get_format_from_script(foo_file, tag, ctx),
+            "foo/title");
+        BOOST_CHECK_EQUAL(
+            mm::get_format_from_script(bar_file, tag, ctx),
+            "bar/title");
+    }
+    
+    // Switching scripts takes effect straight away
+    ctx.format_script = fs::path{testdata_dir_str + "/02_constvars.chai"};
+    BOOST_CHECK_EQUAL(
+        mm::get_format_from_script(bar_file, tag, ctx),
+        "bar.txt");
+}
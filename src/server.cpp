@@ -0,0 +1,426 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "server.hpp"
+
+#include <boost/filesystem.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "posix_util.hpp"
+#endif
+
+namespace fs = boost::filesystem;
+
+namespace mm {
+
+using std::string;
+
+#ifndef _WIN32
+
+namespace {
+
+// Each frame sent back to a client is a channel byte, a length, and then
+// that many bytes
+const char out_channel = '1';
+const char err_channel = '2';
+const char exit_channel = 'x';
+
+// Largest request a client may send
+const std::size_t max_request_size = 1 << 20;
+
+bool send_all(int fd, const char *data, std::size_t len)
+{
+    while (len > 0)
+    {
+        // A client that has gone away mustn't take the server with it
+        auto n = ::send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool send_frame(int fd, char channel, const char *data, std::size_t len)
+{
+    char header[5];
+    header[0] = channel;
+    auto length = static_cast<std::uint32_t>(len);
+    std::memcpy(header + 1, &length, sizeof(length));
+    return send_all(fd, header, sizeof(header)) && send_all(fd, data, len);
+}
+
+// Read exactly the given number of bytes, or return false at the end
+bool read_all(int fd, char *data, std::size_t len)
+{
+    while (len > 0)
+    {
+        auto n = ::read(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+sockaddr_un make_address(const fs::path &socket)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket.native().size() >= sizeof(addr.sun_path))
+        throw server_error{"Socket path is too long: " + socket.string()};
+    std::strcpy(addr.sun_path, socket.c_str());
+    return addr;
+}
+
+} // anonymous namespace
+
+// Sends whatever is written to it as frames on one channel
+class connection::frame_buf : public std::streambuf
+{
+public:
+    frame_buf(int fd, char channel) : fd_{fd}, channel_{channel}
+    {
+        setp(buf_, buf_ + sizeof(buf_));
+    }
+
+protected:
+    int_type overflow(int_type c) override
+    {
+        if (sync() != 0)
+            return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override
+    {
+        std::size_t len = pptr() - pbase();
+        if (len == 0)
+            return 0;
+        bool sent = send_frame(fd_, channel_, pbase(), len);
+        setp(buf_, buf_ + sizeof(buf_));
+        return sent ? 0 : -1;
+    }
+
+private:
+    int fd_;
+    char channel_;
+    char buf_[8192];
+};
+
+connection::connection(int fd) :
+    fd_{fd},
+    out_buf_{new frame_buf{fd, out_channel}},
+    err_buf_{new frame_buf{fd, err_channel}},
+    out_{out_buf_.get()},
+    err_{err_buf_.get()}
+{}
+
+connection::~connection()
+{
+    ::close(fd_);
+}
+
+request connection::read_request()
+{
+    // A count of the strings to follow, the directory, and then each
+    // argument, each ended by a NUL
+    std::vector<string> strings;
+    string current;
+    std::size_t expected = 0;
+    std::size_t total = 0;
+    char buf[4096];
+    while (strings.empty() || strings.size() < expected + 1)
+    {
+        auto n = ::read(fd_, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw server_error{"Incomplete request from client"};
+        total += n;
+        if (total > max_request_size)
+            throw server_error{"Request from client is too large"};
+        for (ssize_t i = 0; i < n; ++i)
+        {
+            if (buf[i] != '\0')
+            {
+                current += buf[i];
+                continue;
+            }
+            strings.push_back(std::move(current));
+            current.clear();
+            if (strings.size() == 1)
+            {
+                try
+                {
+                    expected = std::stoul(strings[0]);
+                }
+                catch (std::exception &)
+                {
+                    throw server_error{"Malformed request from client"};
+                }
+                if (expected == 0)
+                    throw server_error{"Malformed request from client"};
+            }
+        }
+    }
+    if (strings.size() != expected + 1 || !current.empty())
+        throw server_error{"Malformed request from client"};
+
+    request req;
+    req.cwd = strings[1];
+    req.args.assign(strings.begin() + 2, strings.end());
+    return req;
+}
+
+void connection::finish(int status)
+{
+    out_.flush();
+    err_.flush();
+    auto text = std::to_string(status);
+    send_frame(fd_, exit_channel, text.data(), text.size());
+}
+
+server::server(const fs::path &socket) :
+    socket_{}, fd_{-1}, stop_fds_{-1, -1}, stopped_{false}
+{
+    try
+    {
+        auto addr = make_address(socket);
+        fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0)
+            throw server_error{errno_message("Unable to create", socket)};
+        
+        // See if another server is still listening
+        {
+            fd_closer probe{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+            if (probe.fd >= 0 &&
+                ::connect(probe.fd, reinterpret_cast<sockaddr *>(&addr),
+                          sizeof(addr)) == 0)
+            {
+                throw server_error{"Socket is already in use: " +
+                                   socket.string()};
+            }
+            struct stat st;
+            if (errno == ECONNREFUSED &&
+                ::lstat(socket.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            {
+                ::unlink(socket.c_str());
+            }
+        }
+        
+        // Only the user running the server may ask it to move files
+        auto old_mask = ::umask(0177);
+        int bound = ::bind(fd_, reinterpret_cast<sockaddr *>(&addr),
+                           sizeof(addr));
+        ::umask(old_mask);
+        if (bound != 0)
+            throw server_error{errno_message("Unable to bind", socket)};
+        socket_ = socket;
+        if (::listen(fd_, 64) != 0)
+            throw server_error{errno_message("Unable to listen on", socket)};
+        if (::pipe2(stop_fds_, O_NONBLOCK | O_CLOEXEC) != 0)
+            throw server_error{errno_message("Unable to listen on", socket)};
+    }
+    catch (...)
+    {
+        close_all();
+        throw;
+    }
+}
+
+server::~server()
+{
+    close_all();
+}
+
+void server::close_all()
+{
+    for (int fd : {fd_, stop_fds_[0], stop_fds_[1]})
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+    fd_ = stop_fds_[0] = stop_fds_[1] = -1;
+    if (!socket_.empty())
+        ::unlink(socket_.c_str());
+    socket_.clear();
+}
+
+std::unique_ptr<connection> server::accept()
+{
+    while (!stopped_)
+    {
+        struct pollfd fds[2] = {{fd_, POLLIN, 0}, {stop_fds_[0], POLLIN, 0}};
+        int n = ::poll(fds, 2, -1);
+        if (n < 0 && errno != EINTR)
+            throw server_error{errno_message("Unable to wait on", socket_)};
+        if (n <= 0 || !(fds[0].revents & POLLIN))
+            continue;
+        
+        int fd = ::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            // The client may have given up already
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN)
+                continue;
+            throw server_error{errno_message("Unable to accept on", socket_)};
+        }
+        
+        // Clients are served one at a time, so one that stalls mustn't hold
+        // up the rest for ever
+        struct timeval timeout{30, 0};
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        return std::unique_ptr<connection>{new connection{fd}};
+    }
+    return nullptr;
+}
+
+void server::stop()
+{
+    stopped_ = true;
+    char c = 0;
+    // Nothing can be done about a failure here, from a signal handler
+    [[maybe_unused]] auto n = ::write(stop_fds_[1], &c, 1);
+}
+
+int run_client(const fs::path &socket, const request &req,
+               std::ostream &out, std::ostream &err)
+{
+    auto addr = make_address(socket);
+    fd_closer fd{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+    if (fd.fd < 0 ||
+        ::connect(fd.fd, reinterpret_cast<sockaddr *>(&addr),
+                  sizeof(addr)) != 0)
+    {
+        throw server_error{errno_message("Unable to connect to", socket)};
+    }
+    
+    string message = std::to_string(req.args.size() + 1);
+    message += '\0';
+    message += req.cwd.string();
+    message += '\0';
+    for (const auto &arg : req.args)
+    {
+        message += arg;
+        message += '\0';
+    }
+    if (!send_all(fd.fd, message.data(), message.size()))
+        throw server_error{errno_message("Unable to send to", socket)};
+    
+    string payload;
+    for (;;)
+    {
+        char header[5];
+        std::uint32_t len;
+        if (!read_all(fd.fd, header, sizeof(header)))
+            break;
+        std::memcpy(&len, header + 1, sizeof(len));
+        payload.resize(len);
+        if (!read_all(fd.fd, payload.data(), len))
+            break;
+        switch (header[0])
+        {
+        case out_channel:
+            out << payload << std::flush;
+            break;
+        case err_channel:
+            err << payload << std::flush;
+            break;
+        case exit_channel:
+            return std::stoi(payload);
+        }
+    }
+    throw server_error{"Server went away before finishing the request"};
+}
+
+#else
+
+class connection::frame_buf : public std::streambuf
+{};
+
+connection::connection(int fd) :
+    fd_{fd}, out_{nullptr}, err_{nullptr}
+{}
+
+connection::~connection()
+{}
+
+request connection::read_request()
+{
+    return request{};
+}
+
+void connection::finish(int status)
+{}
+
+server::server(const fs::path &socket) :
+    socket_{}, fd_{-1}, stop_fds_{-1, -1}, stopped_{false}
+{
+    throw server_error{"Running as a server is not supported on Windows"};
+}
+
+server::~server()
+{}
+
+std::unique_ptr<connection> server::accept()
+{
+    return nullptr;
+}
+
+void server::stop()
+{
+    stopped_ = true;
+}
+
+int run_client(const fs::path &socket, const request &req,
+               std::ostream &out, std::ostream &err)
+{
+    throw server_error{"Running as a client is not supported on Windows"};
+}
+
+#endif // _WIN32
+
+bool server::stopped() const
+{
+    return stopped_;
+}
+
+} // namespace mm
@@ -0,0 +1,116 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_SERVER_HPP
+#define MUSICMOVE_SERVER_HPP
+
+#include <boost/filesystem/path.hpp>
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace mm {
+
+struct server_error : std::runtime_error
+{
+    explicit server_error(const std::string &what_arg) :
+        std::runtime_error(what_arg)
+    {}
+};
+
+// What a client was asked to do: the arguments it was run with, other than
+// the socket to use, and the directory it was run from
+struct request
+{
+    boost::filesystem::path cwd;
+    std::vector<std::string> args;
+};
+
+// One client connected to a server.  Anything written to out() and err()
+// is passed back to the client's standard output and standard error.
+class connection
+{
+public:
+    explicit connection(int fd);
+    ~connection();
+    connection(const connection &) = delete;
+    connection &operator=(const connection &) = delete;
+
+    // Throws server_error if the client doesn't send a whole request
+    request read_request();
+
+    std::ostream &out() { return out_; }
+    std::ostream &err() { return err_; }
+
+    // Tell the client how its request went, after which it goes away
+    void finish(int status);
+
+private:
+    class frame_buf;
+
+    int fd_;
+    std::unique_ptr<frame_buf> out_buf_;
+    std::unique_ptr<frame_buf> err_buf_;
+    std::ostream out_;
+    std::ostream err_;
+};
+
+// Listens on a Unix domain socket for clients, one at a time, so that
+// requests can be handled by a process that is already up and running
+// rather than each starting its own.  The socket can only be used by the
+// user who started the server.
+//
+// Not thread-safe, apart from stop(), which may also be called from a
+// signal handler.
+class server
+{
+public:
+    // A socket left behind by a server that has gone away is replaced, but
+    // not one that is still in use
+    explicit server(const boost::filesystem::path &socket);
+    ~server();
+    server(const server &) = delete;
+    server &operator=(const server &) = delete;
+
+    // Wait for the next client, or return nothing once stop() is called
+    std::unique_ptr<connection> accept();
+
+    void stop();
+    bool stopped() const;
+
+private:
+    void close_all();
+
+    boost::filesystem::path socket_;
+    int fd_;
+    // Written to by stop(), to wake up accept()
+    int stop_fds_[2];
+    std::atomic<bool> stopped_;
+};
+
+// Send a request to a server, and pass on what comes back.  Returns the
+// exit status that the server finished the request with.  Throws
+// server_error if the server can't be reached or goes away part way.
+int run_client(const boost::filesystem::path &socket, const request &req,
+               std::ostream &out, std::ostream &err);
+
+} // namespace mm
+
+#endif // MUSICMOVE_SERVER_HPP
@@ -0,0 +1,105 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "server.hpp"
+#include "test_fixture.hpp"
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE server_test
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace fs = boost::filesystem;
+using namespace std;
+
+struct server_fixture : fixture
+{
+    server_fixture() :
+        socket_path{tmp_dir / "musicmove.sock"}
+    {}
+
+    const fs::path socket_path;
+};
+
+BOOST_AUTO_TEST_CASE (request_and_reply)
+{
+    server_fixture f;
+
+    mm::server srv{f.socket_path};
+    mm::request received;
+    thread serving{[&srv, &received] {
+        auto conn = srv.accept();
+        received = conn->read_request();
+        conn->out() << "Moved " << received.args.size() << " files\n";
+        conn->err() << "Warning: " << string(20000, 'x') << "\n";
+        conn->finish(3);
+    }};
+
+    mm::request req{"/some/dir", {"--format", "", "a.flac", "b c.flac"}};
+    stringstream out, err;
+    int status = mm::run_client(f.socket_path, req, out, err);
+    serving.join();
+
+    BOOST_CHECK_EQUAL(received.cwd, "/some/dir");
+    BOOST_CHECK(received.args == req.args);
+    BOOST_CHECK_EQUAL(status, 3);
+    BOOST_CHECK_EQUAL(out.str(), "Moved 4 files\n");
+    BOOST_CHECK_EQUAL(err.str(), "Warning: " + string(20000, 'x') + "\n");
+}
+
+BOOST_AUTO_TEST_CASE (socket_in_use)
+{
+    server_fixture f;
+
+    {
+        mm::server srv{f.socket_path};
+        BOOST_CHECK((fs::status(f.socket_path).permissions() & 0777) == 0600);
+        BOOST_CHECK_THROW(mm::server{f.socket_path}, mm::server_error);
+    }
+    BOOST_CHECK_EQUAL(fs::exists(f.socket_path), false);
+
+    // Nothing else is replaced
+    ofstream{f.socket_path.string()} << "one";
+    BOOST_CHECK_THROW(mm::server{f.socket_path}, mm::server_error);
+    BOOST_CHECK_EQUAL(fs::exists(f.socket_path), true);
+
+    stringstream out, err;
+    BOOST_CHECK_THROW(mm::run_client(f.tmp_dir / "missing.sock",
+                                     mm::request{}, out, err),
+                      mm::server_error);
+}
+
+BOOST_AUTO_TEST_CASE (stop_serving)
+{
+    server_fixture f;
+
+    mm::server srv{f.socket_path};
+    thread stopping{[&srv] {
+        this_thread::sleep_for(chrono::milliseconds{50});
+        srv.stop();
+    }};
+    BOOST_CHECK(srv.accept() == nullptr);
+    BOOST_CHECK(srv.stopped());
+    stopping.join();
+}
@@ -0,0 +1,301 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "stats.hpp"
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+namespace fs = boost::filesystem;
+
+namespace mm {
+
+namespace {
+
+const char *const stage_names[run_stats::stage_count] = {
+    "walk", "read_tags", "format", "clash_check", "move", "prune"
+};
+
+// Upper bound of a histogram bucket, in seconds
+double bucket_bound(std::size_t i)
+{
+    return static_cast<double>(std::uint64_t{1} << i) / 1e6;
+}
+
+// Write a string as a JSON string, or a Prometheus label value, which
+// escape the same few characters
+void write_quoted(std::ostream &os, const std::string &str)
+{
+    os << '"';
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+            os << '\\' << c;
+        else if (c == '\n')
+            os << "\\n";
+        else
+            os << c;
+    }
+    os << '"';
+}
+
+} // anonymous namespace
+
+run_stats::run_stats() :
+    start_{clock::now()}
+{}
+
+void run_stats::record(stage s, clock::duration elapsed)
+{
+    auto ns = static_cast<std::uint64_t>(std::max<std::int64_t>(0,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+            .count()));
+    
+    // Round up to whole microseconds, and find the power of two at or above
+    auto us = (ns + 999) / 1000;
+    std::size_t bucket = us <= 1 ? 0 : std::bit_width(us - 1);
+    bucket = std::min(bucket, bucket_count - 1);
+    
+    auto &h = stages_[static_cast<std::size_t>(s)];
+    h.count.fetch_add(1, std::memory_order_relaxed);
+    h.total_ns.fetch_add(ns, std::memory_order_relaxed);
+    h.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    auto max = h.max_ns.load(std::memory_order_relaxed);
+    while (ns > max &&
+           !h.max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+    {}
+}
+
+void run_stats::count(const std::string &name, std::uint64_t n)
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+    counters_[name] += n;
+}
+
+void run_stats::count_skipped(const std::string &reason)
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+    ++skipped_[reason];
+}
+
+double run_stats::histogram::quantile(double q) const
+{
+    auto total = count.load(std::memory_order_relaxed);
+    if (total == 0)
+        return 0;
+    auto rank = static_cast<std::uint64_t>(q * total);
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < bucket_count - 1; ++i)
+    {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen > rank)
+            return bucket_bound(i);
+    }
+    // Somewhere beyond the last bound; the longest time is as good a guess
+    // as any
+    return max_ns.load(std::memory_order_relaxed) / 1e9;
+}
+
+double run_stats::run_seconds() const
+{
+    return std::chrono::duration<double>(clock::now() - start_).count();
+}
+
+void run_stats::print(std::ostream &os) const
+{
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3);
+    out << "Run time: " << run_seconds() << " s" << std::endl;
+    out << std::left << std::setw(12) << "Stage" << std::right
+        << std::setw(10) << "Count"
+        << std::setw(12) << "Total s"
+        << std::setw(11) << "Mean ms"
+        << std::setw(11) << "p50 ms"
+        << std::setw(11) << "p90 ms"
+        << std::setw(11) << "p99 ms"
+        << std::setw(11) << "Max ms" << std::endl;
+    for (std::size_t i = 0; i < stage_count; ++i)
+    {
+        const auto &h = stages_[i];
+        auto n = h.count.load(std::memory_order_relaxed);
+        if (n == 0)
+            continue;
+        auto total = h.total_ns.load(std::memory_order_relaxed) / 1e9;
+        out << std::left << std::setw(12) << stage_names[i] << std::right
+            << std::setw(10) << n
+            << std::setw(12) << total
+            << std::setw(11) << total * 1e3 / n
+            << std::setw(11) << h.quantile(0.5) * 1e3
+            << std::setw(11) << h.quantile(0.9) * 1e3
+            << std::setw(11) << h.quantile(0.99) * 1e3
+            << std::setw(11) << h.max_ns.load(std::memory_order_relaxed) / 1e6
+            << std::endl;
+    }
+    
+    std::lock_guard<std::mutex> lock{mutex_};
+    for (const auto &counter : counters_)
+        out << counter.first << ": " << counter.second << std::endl;
+    for (const auto &skip : skipped_)
+        out << "skipped (" << skip.first << "): " << skip.second << std::endl;
+    os << out.str();
+}
+
+void run_stats::write(std::ostream &os, stats_format_t format) const
+{
+    switch (format)
+    {
+    case stats_format_t::json:
+        write_json(os);
+        break;
+    case stats_format_t::prometheus:
+        write_prometheus(os);
+        break;
+    }
+}
+
+void run_stats::write_json(std::ostream &os) const
+{
+    os << std::setprecision(9);
+    os << "{\"run_seconds\":" << run_seconds() << ",\"stages\":{";
+    for (std::size_t i = 0; i < stage_count; ++i)
+    {
+        const auto &h = stages_[i];
+        if (i > 0)
+            os << ',';
+        os << '"' << stage_names[i] << "\":{"
+           << "\"count\":" << h.count.load(std::memory_order_relaxed)
+           << ",\"total_seconds\":"
+           << h.total_ns.load(std::memory_order_relaxed) / 1e9
+           << ",\"max_seconds\":"
+           << h.max_ns.load(std::memory_order_relaxed) / 1e9
+           << ",\"p50_seconds\":" << h.quantile(0.5)
+           << ",\"p90_seconds\":" << h.quantile(0.9)
+           << ",\"p99_seconds\":" << h.quantile(0.99)
+           << ",\"buckets\":[";
+        for (std::size_t b = 0; b < bucket_count; ++b)
+        {
+            if (b > 0)
+                os << ',';
+            os << h.buckets[b].load(std::memory_order_relaxed);
+        }
+        os << "]}";
+    }
+    os << "},\"bucket_bounds_seconds\":[";
+    for (std::size_t b = 0; b < bucket_count - 1; ++b)
+    {
+        if (b > 0)
+            os << ',';
+        os << bucket_bound(b);
+    }
+    os << "],\"counters\":{";
+    
+    std::lock_guard<std::mutex> lock{mutex_};
+    bool first = true;
+    for (const auto &counter : counters_)
+    {
+        if (!first)
+            os << ',';
+        first = false;
+        write_quoted(os, counter.first);
+        os << ':' << counter.second;
+    }
+    os << "},\"skipped\":{";
+    first = true;
+    for (const auto &skip : skipped_)
+    {
+        if (!first)
+            os << ',';
+        first = false;
+        write_quoted(os, skip.first);
+        os << ':' << skip.second;
+    }
+    os << "}}" << std::endl;
+}
+
+void run_stats::write_prometheus(std::ostream &os) const
+{
+    os << std::setprecision(9);
+    os << "# HELP musicmove_run_seconds Time taken by the run so far.\n"
+       << "# TYPE musicmove_run_seconds gauge\n"
+       << "musicmove_run_seconds " << run_seconds() << '\n';
+    
+    os << "# HELP musicmove_stage_seconds Time taken by each stage of "
+          "handling a file.\n"
+       << "# TYPE musicmove_stage_seconds histogram\n";
+    for (std::size_t i = 0; i < stage_count; ++i)
+    {
+        const auto &h = stages_[i];
+        std::string label = std::string{"stage=\""} + stage_names[i] + "\"";
+        std::uint64_t cumulative = 0;
+        for (std::size_t b = 0; b < bucket_count; ++b)
+        {
+            cumulative += h.buckets[b].load(std::memory_order_relaxed);
+            os << "musicmove_stage_seconds_bucket{" << label << ",le=\"";
+            if (b < bucket_count - 1)
+                os << bucket_bound(b);
+            else
+                os << "+Inf";
+            os << "\"} " << cumulative << '\n';
+        }
+        os << "musicmove_stage_seconds_sum{" << label << "} "
+           << h.total_ns.load(std::memory_order_relaxed) / 1e9 << '\n'
+           << "musicmove_stage_seconds_count{" << label << "} "
+           << h.count.load(std::memory_order_relaxed) << '\n';
+    }
+    
+    std::lock_guard<std::mutex> lock{mutex_};
+    for (const auto &counter : counters_)
+    {
+        os << "# TYPE musicmove_" << counter.first << "_total counter\n"
+           << "musicmove_" << counter.first << "_total " << counter.second
+           << '\n';
+    }
+    os << "# HELP musicmove_files_skipped_total Files left alone, by reason.\n"
+       << "# TYPE musicmove_files_skipped_total counter\n";
+    for (const auto &skip : skipped_)
+    {
+        os << "musicmove_files_skipped_total{reason=";
+        write_quoted(os, skip.first);
+        os << "} " << skip.second << '\n';
+    }
+    os.flush();
+}
+
+void run_stats::save(const fs::path &path, stats_format_t format) const
+{
+    auto tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream file{tmp.string(), std::ios::out | std::ios::trunc};
+        if (file)
+            write(file, format);
+        if (!file)
+        {
+            throw fs::filesystem_error{"Unable to write statistics", tmp,
+                boost::system::error_code{errno,
+                    boost::system::system_category()}};
+        }
+    }
+    fs::rename(tmp, path);
+}
+
+} // namespace mm
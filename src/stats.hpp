@@ -0,0 +1,122 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_STATS_HPP
+#define MUSICMOVE_STATS_HPP
+
+#include <boost/filesystem/path.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+namespace mm {
+
+enum class stats_format_t { json, prometheus };
+
+// Timings and counts gathered over a run, so that a slow run can be put
+// down to the right cause.  Each stage of handling a file keeps a histogram
+// of how long it took.  Safe to add to from any thread.
+class run_stats
+{
+public:
+    enum class stage { walk, read_tags, format, clash_check, move, prune };
+    static constexpr std::size_t stage_count = 6;
+    
+    typedef std::chrono::steady_clock clock;
+    
+    run_stats();
+    run_stats(const run_stats &) = delete;
+    run_stats &operator=(const run_stats &) = delete;
+    
+    void record(stage s, clock::duration elapsed);
+    void count(const std::string &name, std::uint64_t n = 1);
+    void count_skipped(const std::string &reason);
+    
+    // Summary for people to read
+    void print(std::ostream &os) const;
+    void write(std::ostream &os, stats_format_t format) const;
+    
+    // Replace a file with the statistics so far, such that anything
+    // reading the file never sees it partly written.  Throws
+    // boost::filesystem::filesystem_error on failure.
+    void save(const boost::filesystem::path &path,
+              stats_format_t format) const;
+    
+private:
+    // Bucket i counts times of up to 2^i microseconds, and the last bucket
+    // counts anything longer
+    static constexpr std::size_t bucket_count = 28;
+    
+    struct histogram
+    {
+        std::atomic<std::uint64_t> count{0};
+        std::atomic<std::uint64_t> total_ns{0};
+        std::atomic<std::uint64_t> max_ns{0};
+        std::array<std::atomic<std::uint64_t>, bucket_count> buckets{};
+        
+        // Upper bound of the bucket holding the given fraction of times
+        double quantile(double q) const;
+    };
+    
+    void write_json(std::ostream &os) const;
+    void write_prometheus(std::ostream &os) const;
+    double run_seconds() const;
+    
+    clock::time_point start_;
+    std::array<histogram, stage_count> stages_;
+    
+    mutable std::mutex mutex_;
+    std::map<std::string, std::uint64_t> counters_;
+    std::map<std::string, std::uint64_t> skipped_;
+};
+
+// Times one stage for as long as it is in scope, or until stopped.  Does
+// nothing if there are no statistics to add to.
+class stage_timer
+{
+public:
+    stage_timer(run_stats *stats, run_stats::stage s) :
+        stats_{stats}, stage_{s},
+        start_{stats ? run_stats::clock::now()
+                     : run_stats::clock::time_point{}}
+    {}
+    ~stage_timer() { stop(); }
+    stage_timer(const stage_timer &) = delete;
+    stage_timer &operator=(const stage_timer &) = delete;
+    
+    void stop()
+    {
+        if (stats_)
+            stats_->record(stage_, run_stats::clock::now() - start_);
+        stats_ = nullptr;
+    }
+    
+private:
+    run_stats *stats_;
+    run_stats::stage stage_;
+    run_stats::clock::time_point start_;
+};
+
+} // namespace mm
+
+#endif // MUSICMOVE_STATS_HPP
@@ -0,0 +1,144 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "stats.hpp"
+#include "test_fixture.hpp"
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE stats_test
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace fs = boost::filesystem;
+using namespace std;
+using namespace std::chrono_literals;
+
+BOOST_AUTO_TEST_CASE (histogram_buckets)
+{
+    mm::run_stats stats;
+    stats.record(mm::run_stats::stage::walk, 500ns);
+    stats.record(mm::run_stats::stage::walk, 3us);
+    stats.record(mm::run_stats::stage::walk, 3us);
+    stats.record(mm::run_stats::stage::walk, 100s);
+    
+    stringstream os;
+    stats.write(os, mm::stats_format_t::prometheus);
+    auto text = os.str();
+    BOOST_CHECK(text.find("musicmove_stage_seconds_bucket{stage=\"walk\","
+                          "le=\"1e-06\"} 1\n") != string::npos);
+    BOOST_CHECK(text.find("musicmove_stage_seconds_bucket{stage=\"walk\","
+                          "le=\"2e-06\"} 1\n") != string::npos);
+    BOOST_CHECK(text.find("musicmove_stage_seconds_bucket{stage=\"walk\","
+                          "le=\"4e-06\"} 3\n") != string::npos);
+    BOOST_CHECK(text.find("musicmove_stage_seconds_bucket{stage=\"walk\","
+                          "le=\"67.108864\"} 3\n") != string::npos);
+    BOOST_CHECK(text.find("musicmove_stage_seconds_bucket{stage=\"walk\","
+                          "le=\"+Inf\"} 4\n") != string::npos);
+    BOOST_CHECK(text.find("musicmove_stage_seconds_count{stage=\"walk\"} 4\n")
+                != string::npos);
+    BOOST_CHECK(text.find("musicmove_stage_seconds_count{stage=\"move\"} 0\n")
+                != string::npos);
+}
+
+BOOST_AUTO_TEST_CASE (counters_and_skips)
+{
+    mm::run_stats stats;
+    stats.count("files_moved");
+    stats.count("files_moved", 2);
+    stats.count_skipped("no tag");
+    stats.count_skipped("not music");
+    stats.count_skipped("no tag");
+    
+    stringstream json;
+    stats.write(json, mm::stats_format_t::json);
+    BOOST_CHECK(json.str().find("\"counters\":{\"files_moved\":3}") !=
+                string::npos);
+    BOOST_CHECK(json.str().find(
+        "\"skipped\":{\"no tag\":2,\"not music\":1}") != string::npos);
+    
+    stringstream prom;
+    stats.write(prom, mm::stats_format_t::prometheus);
+    BOOST_CHECK(prom.str().find("musicmove_files_moved_total 3\n") !=
+                string::npos);
+    BOOST_CHECK(prom.str().find(
+        "musicmove_files_skipped_total{reason=\"no tag\"} 2\n") !=
+        string::npos);
+    
+    stringstream summary;
+    stats.print(summary);
+    BOOST_CHECK(summary.str().find("files_moved: 3\n") != string::npos);
+    BOOST_CHECK(summary.str().find("skipped (not music): 1\n") !=
+                string::npos);
+}
+
+BOOST_AUTO_TEST_CASE (timers_from_many_threads)
+{
+    mm::run_stats stats;
+    vector<thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&stats] {
+            for (int i = 0; i < 1000; ++i)
+            {
+                mm::stage_timer timer{&stats, mm::run_stats::stage::format};
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    
+    // A timer with nothing to add to does nothing
+    {
+        mm::stage_timer timer{nullptr, mm::run_stats::stage::format};
+        timer.stop();
+    }
+    
+    stringstream os;
+    stats.write(os, mm::stats_format_t::prometheus);
+    BOOST_CHECK(os.str().find(
+        "musicmove_stage_seconds_count{stage=\"format\"} 4000\n") !=
+        string::npos);
+}
+
+BOOST_AUTO_TEST_CASE (save_replaces_file)
+{
+    fixture f;
+    
+    fs::path file{f.tmp_dir / "musicmove.prom"};
+    ofstream{file.string()} << "old";
+    mm::run_stats stats;
+    stats.count("errors");
+    stats.save(file, mm::stats_format_t::prometheus);
+    
+    ifstream in{file.string()};
+    stringstream contents;
+    contents << in.rdbuf();
+    BOOST_CHECK(contents.str().find("musicmove_errors_total 1\n") !=
+                string::npos);
+    BOOST_CHECK_EQUAL(fs::exists(f.tmp_dir / "musicmove.prom.tmp"), false);
+    BOOST_CHECK_THROW(stats.save(f.tmp_dir / "missing" / "stats.json",
+                                 mm::stats_format_t::json),
+                      fs::filesystem_error);
+}
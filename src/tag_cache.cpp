@@ -0,0 +1,422 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "tag_cache.hpp"
+#include "posix_util.hpp"
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace fs = boost::filesystem;
+
+namespace mm {
+
+using std::string;
+using std::uint8_t;
+using std::uint32_t;
+using std::uint64_t;
+
+namespace {
+
+const char cache_magic[4] = {'M', 'M', 'T', 'C'};
+const uint32_t cache_version = 2;
+// Entries left unused by this many runs that rewrote the cache are dropped
+const uint64_t retained_generations = 32;
+
+struct file_header
+{
+    file_tag tag;
+    uint32_t entry_size;
+    uint64_t count;
+    // Incremented by each run that rewrites the cache
+    uint64_t generation;
+};
+
+struct index_entry
+{
+    tag_cache_key key;
+    // Offset of the record from the start of the file
+    uint64_t offset;
+    uint32_t length;
+    // Checksum of the key and the record together
+    uint32_t checksum;
+    // Generation of the last run that used the entry
+    uint64_t generation;
+};
+
+static_assert(sizeof(file_header) == 32, "unexpected header padding");
+static_assert(sizeof(index_entry) == 56, "unexpected index padding");
+
+// 32-bit FNV-1a
+uint32_t checksum(const void *data, std::size_t len,
+                  uint32_t hash = 2166136261u)
+{
+    auto *p = static_cast<const uint8_t *>(data);
+    for (std::size_t i = 0; i < len; ++i)
+    {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint32_t entry_checksum(const tag_cache_key &key, const char *data,
+                        std::size_t len)
+{
+    return checksum(data, len, checksum(&key, sizeof(key)));
+}
+
+// Fields in the order they are encoded
+string tag_record::*const record_fields[] = {
+    &tag_record::album, &tag_record::album_artist, &tag_record::artist,
+    &tag_record::comment, &tag_record::composer, &tag_record::copyright,
+    &tag_record::date, &tag_record::disc_number, &tag_record::disc_total,
+    &tag_record::encoded_by, &tag_record::genre, &tag_record::original_artist,
+    &tag_record::title, &tag_record::track_number, &tag_record::track_total,
+    &tag_record::url,
+};
+
+string encode_record(const tag_record &record)
+{
+    string out;
+    out += static_cast<char>(record.has_tag ? 1 : 0);
+    for (auto field : record_fields)
+    {
+        auto &val = record.*field;
+        uint32_t len = val.size();
+        out.append(reinterpret_cast<const char *>(&len), sizeof(len));
+        out += val;
+    }
+    return out;
+}
+
+bool decode_record(const char *data, std::size_t len, tag_record &record)
+{
+    if (len < 1)
+        return false;
+    record.has_tag = data[0] != 0;
+    std::size_t pos = 1;
+    for (auto field : record_fields)
+    {
+        uint32_t field_len;
+        if (len - pos < sizeof(field_len))
+            return false;
+        std::memcpy(&field_len, data + pos, sizeof(field_len));
+        pos += sizeof(field_len);
+        if (len - pos < field_len)
+            return false;
+        (record.*field).assign(data + pos, field_len);
+        pos += field_len;
+    }
+    return pos == len;
+}
+
+} // anonymous namespace
+
+bool tag_cache_key::operator<(const tag_cache_key &other) const
+{
+    return std::tie(dev, ino, size, mtime_ns) <
+           std::tie(other.dev, other.ino, other.size, other.mtime_ns);
+}
+
+bool tag_cache_key::operator==(const tag_cache_key &other) const
+{
+    return dev == other.dev && ino == other.ino &&
+           size == other.size && mtime_ns == other.mtime_ns;
+}
+
+// A read-only mapping of a cache file.  A missing, truncated or foreign file
+// is treated as being empty.
+class tag_cache::mapping
+{
+public:
+    explicit mapping(const fs::path &path) :
+        data_{nullptr}, size_{0}, count_{0}, generation_{0}
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+        fd_closer closer{fd};
+        struct stat st;
+        if (::fstat(fd, &st) != 0 ||
+            st.st_size < static_cast<off_t>(sizeof(file_header)))
+            return;
+        auto *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED,
+                            fd, 0);
+        if (data == MAP_FAILED)
+            return;
+        data_ = static_cast<const char *>(data);
+        size_ = st.st_size;
+
+        auto *header = reinterpret_cast<const file_header *>(data_);
+        if (!header->tag.matches(cache_magic, cache_version) ||
+            header->entry_size != sizeof(index_entry) ||
+            header->count > (size_ - sizeof(file_header)) / sizeof(index_entry))
+            return;
+        count_ = header->count;
+        generation_ = header->generation;
+        // We'll be binary searching the index
+        ::madvise(data, size_, MADV_RANDOM);
+    }
+    ~mapping()
+    {
+        if (data_ != nullptr)
+            ::munmap(const_cast<char *>(data_), size_);
+    }
+    mapping(const mapping &) = delete;
+    mapping &operator=(const mapping &) = delete;
+
+    std::size_t count() const { return count_; }
+    uint64_t generation() const { return generation_; }
+
+    const index_entry *begin() const
+    {
+        return reinterpret_cast<const index_entry *>(
+            data_ + sizeof(file_header));
+    }
+    const index_entry *end() const { return begin() + count_; }
+
+    // Get the record for an entry, if it is intact
+    const char *record(const index_entry &entry) const
+    {
+        if (entry.offset > size_ || entry.length > size_ - entry.offset)
+            return nullptr;
+        auto *data = data_ + entry.offset;
+        if (entry_checksum(entry.key, data, entry.length) != entry.checksum)
+            return nullptr;
+        return data;
+    }
+
+private:
+    const char *data_;
+    std::size_t size_;
+    std::size_t count_;
+    uint64_t generation_;
+};
+
+tag_cache::tag_cache(const fs::path &path) :
+    path_{path}, map_{new mapping{path}}, entry_count_{map_->count()},
+    generation_{map_->generation() + 1}, seen_(entry_count_),
+    hits_{0}, misses_{0}
+{}
+
+tag_cache::~tag_cache()
+{}
+
+bool tag_cache::make_key(const fs::path &file, tag_cache_key &key)
+{
+    struct stat st;
+    if (::stat(file.c_str(), &st) != 0)
+        return false;
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    key.size = st.st_size;
+    key.mtime_ns = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                   st.st_mtim.tv_nsec;
+    return true;
+}
+
+bool tag_cache::find(const tag_cache_key &key, tag_record &record) const
+{
+    auto iter = std::lower_bound(
+        map_->begin(), map_->end(), key,
+        [](const index_entry &e, const tag_cache_key &k) { return e.key < k; });
+    if (iter != map_->end() && iter->key == key)
+    {
+        auto *data = map_->record(*iter);
+        if (data != nullptr && decode_record(data, iter->length, record))
+        {
+            seen_[iter - map_->begin()].store(true, std::memory_order_relaxed);
+            ++hits_;
+            return true;
+        }
+    }
+    ++misses_;
+    return false;
+}
+
+void tag_cache::insert(const tag_cache_key &key, const tag_record &record)
+{
+    auto encoded = encode_record(record);
+    std::lock_guard<std::mutex> lock{mutex_};
+    pending_[key] = std::move(encoded);
+}
+
+void tag_cache::save()
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (pending_.empty() && entry_count_ == 0)
+        return;
+
+    // Serialise against other runs saving to the same cache.  The lock is
+    // held on a separate file, as the cache file itself gets replaced.
+    fs::path lock_path{path_.string() + ".lock"};
+    fd_closer lock_fd{::open(lock_path.c_str(),
+                             O_RDWR | O_CREAT | O_CLOEXEC, 0644)};
+    if (lock_fd.fd < 0)
+        throw tag_cache_error{errno_message("Failed to open", lock_path)};
+    while (::flock(lock_fd.fd, LOCK_EX) != 0)
+    {
+        if (errno != EINTR)
+            throw tag_cache_error{errno_message("Failed to lock", lock_path)};
+    }
+
+    // Merge with the cache as it is now, which another run may have updated
+    // since we opened it.  Damaged entries are dropped along the way.
+    struct merge_entry
+    {
+        tag_cache_key key;
+        bool fresh;
+        const char *data;
+        uint32_t length;
+        uint64_t generation;
+    };
+    mapping current{path_};
+    auto generation = std::max(generation_, current.generation());
+
+    // Entries we used this run are kept as if they were new, and those that
+    // no recent run has used are dropped, along with any that are damaged.
+    // These are what stops the cache growing without bound as files are
+    // deleted or replaced.
+    std::vector<tag_cache_key> seen;
+    for (auto &entry : *map_)
+    {
+        if (seen_[&entry - map_->begin()].load(std::memory_order_relaxed))
+            seen.push_back(entry.key);
+    }
+    std::vector<merge_entry> merged;
+    merged.reserve(current.count() + pending_.size());
+    std::size_t dropped = 0;
+    for (auto &entry : current)
+    {
+        auto entry_generation = entry.generation;
+        if (std::binary_search(seen.begin(), seen.end(), entry.key))
+            entry_generation = generation;
+        auto *data = current.record(entry);
+        if (data == nullptr ||
+            entry_generation + retained_generations < generation)
+        {
+            ++dropped;
+            continue;
+        }
+        merged.push_back({entry.key, false, data, entry.length,
+                          entry_generation});
+    }
+    for (auto &entry : pending_)
+        merged.push_back({entry.first, true, entry.second.data(),
+                          static_cast<uint32_t>(entry.second.size()),
+                          generation});
+
+    // Bringing the entries we used up to date alone isn't worth rewriting
+    // the whole file for; that can wait until there is something to add or
+    // drop.
+    if (pending_.empty() && dropped == 0)
+        return;
+
+    // Keep only one entry per file, preferring the one we just read, or
+    // otherwise the most recently modified
+    std::sort(merged.begin(), merged.end(),
+        [](const merge_entry &a, const merge_entry &b) {
+            return std::tie(a.key.dev, a.key.ino, a.fresh, a.key.mtime_ns,
+                            a.key.size) <
+                   std::tie(b.key.dev, b.key.ino, b.fresh, b.key.mtime_ns,
+                            b.key.size);
+        });
+    std::vector<merge_entry> kept;
+    kept.reserve(merged.size());
+    for (std::size_t i = 0; i < merged.size(); ++i)
+    {
+        if (i + 1 < merged.size() &&
+            merged[i].key.dev == merged[i + 1].key.dev &&
+            merged[i].key.ino == merged[i + 1].key.ino)
+            continue;
+        kept.push_back(merged[i]);
+    }
+
+    // Write a new file alongside the old one
+    fs::path tmp_path{path_.string() + ".tmp"};
+    fd_closer tmp_fd{::open(tmp_path.c_str(),
+                            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+    if (tmp_fd.fd < 0)
+        throw tag_cache_error{errno_message("Failed to create", tmp_path)};
+
+    file_header header{};
+    header.tag = file_tag::make(cache_magic, cache_version);
+    header.entry_size = sizeof(index_entry);
+    header.count = kept.size();
+    header.generation = generation;
+
+    string buf;
+    const std::size_t flush_size = 1 << 20;
+    buf.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    uint64_t offset = sizeof(header) + kept.size() * sizeof(index_entry);
+    for (auto &e : kept)
+    {
+        index_entry entry{e.key, offset, e.length,
+                          entry_checksum(e.key, e.data, e.length),
+                          e.generation};
+        buf.append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+        offset += e.length;
+        if (buf.size() >= flush_size)
+        {
+            write_all<tag_cache_error>(tmp_fd.fd, buf.data(), buf.size(),
+                                       tmp_path);
+            buf.clear();
+        }
+    }
+    for (auto &e : kept)
+    {
+        buf.append(e.data, e.length);
+        if (buf.size() >= flush_size)
+        {
+            write_all<tag_cache_error>(tmp_fd.fd, buf.data(), buf.size(),
+                                       tmp_path);
+            buf.clear();
+        }
+    }
+    write_all<tag_cache_error>(tmp_fd.fd, buf.data(), buf.size(),
+                               tmp_path);
+
+    // Make sure the new file is complete on disk before it replaces the old
+    if (::fsync(tmp_fd.fd) != 0)
+        throw tag_cache_error{errno_message("Failed to sync", tmp_path)};
+    if (::rename(tmp_path.c_str(), path_.c_str()) != 0)
+        throw tag_cache_error{errno_message("Failed to replace", path_)};
+    auto dir = path_.parent_path().empty() ? fs::path{"."}
+                                           : path_.parent_path();
+    fd_closer dir_fd{::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+    if (dir_fd.fd >= 0)
+        ::fsync(dir_fd.fd);
+
+    pending_.clear();
+    map_.reset(new mapping{path_});
+    entry_count_ = map_->count();
+    seen_ = std::vector<std::atomic<bool>>(entry_count_);
+}
+
+} // namespace mm
@@ -0,0 +1,108 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_TAG_CACHE_HPP
+#define MUSICMOVE_TAG_CACHE_HPP
+
+#include "metadata.hpp"
+
+#include <boost/filesystem/path.hpp>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace mm {
+
+// Identifies one version of one file's contents
+struct tag_cache_key
+{
+    std::uint64_t dev;
+    std::uint64_t ino;
+    std::uint64_t size;
+    std::int64_t mtime_ns;
+
+    bool operator<(const tag_cache_key &other) const;
+    bool operator==(const tag_cache_key &other) const;
+};
+
+struct tag_cache_error : std::runtime_error
+{
+    explicit tag_cache_error(const std::string &what_arg) :
+        std::runtime_error(what_arg)
+    {}
+};
+
+// Persistent cache of tag records, so that files which have not changed
+// since a previous run need not be opened at all.
+//
+// The cache file is a sorted, fixed-width index followed by the encoded
+// records, and is memory-mapped for lookups.  Every entry carries its own
+// checksum, and any entry that fails it is treated as a miss.  New entries
+// are held in memory until save(), which merges them with whatever is on
+// disk at the time under a lock, and atomically replaces the file.  Each
+// entry also records the last run to use it, so that entries for files which
+// have gone are eventually dropped.
+class tag_cache
+{
+public:
+    explicit tag_cache(const boost::filesystem::path &path);
+    ~tag_cache();
+    tag_cache(const tag_cache &) = delete;
+    tag_cache &operator=(const tag_cache &) = delete;
+
+    // Get the key for the current state of a file
+    static bool make_key(const boost::filesystem::path &file,
+                         tag_cache_key &key);
+
+    bool find(const tag_cache_key &key, tag_record &record) const;
+    void insert(const tag_cache_key &key, const tag_record &record);
+
+    // Write new entries out to the cache file, dropping any entries that
+    // they supersede, and any that are damaged or have gone unused for a
+    // number of runs.  Throws tag_cache_error on failure.
+    void save();
+
+    const boost::filesystem::path &path() const { return path_; }
+    std::size_t entries() const { return entry_count_; }
+    std::size_t hits() const { return hits_; }
+    std::size_t misses() const { return misses_; }
+
+private:
+    class mapping;
+
+    boost::filesystem::path path_;
+    std::unique_ptr<mapping> map_;
+    std::size_t entry_count_;
+    // This run's generation, and which entries in the mapping it has used
+    std::uint64_t generation_;
+    mutable std::vector<std::atomic<bool>> seen_;
+
+    mutable std::mutex mutex_;
+    std::map<tag_cache_key, std::string> pending_;
+
+    mutable std::atomic<std::size_t> hits_;
+    mutable std::atomic<std::size_t> misses_;
+};
+
+} // namespace mm
+
+#endif // MUSICMOVE_TAG_CACHE_HPP
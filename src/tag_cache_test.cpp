@@ -0,0 +1,275 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "tag_cache.hpp"
+#include "test_fixture.hpp"
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE tag_cache_test
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+
+namespace fs = boost::filesystem;
+using namespace std;
+
+struct cache_fixture : fixture
+{
+    cache_fixture() :
+        cache_path{tmp_dir / "tags.cache"}
+    {}
+
+    const fs::path cache_path;
+};
+
+mm::tag_cache_key make_key(uint64_t ino, int64_t mtime_ns)
+{
+    return mm::tag_cache_key{1, ino, 1000, mtime_ns};
+}
+
+mm::tag_record make_record(const string &title)
+{
+    mm::tag_record record;
+    record.has_tag = true;
+    record.artist = "Artist";
+    record.title = title;
+    record.track_number = "1";
+    return record;
+}
+
+BOOST_AUTO_TEST_CASE (missing_cache_file)
+{
+    cache_fixture f;
+
+    mm::tag_cache cache{f.cache_path};
+    mm::tag_record record;
+    BOOST_CHECK_EQUAL(cache.entries(), 0);
+    BOOST_CHECK(!cache.find(make_key(1, 1), record));
+    BOOST_CHECK_EQUAL(cache.misses(), 1);
+}
+
+BOOST_AUTO_TEST_CASE (save_and_reload)
+{
+    cache_fixture f;
+
+    {
+        mm::tag_cache cache{f.cache_path};
+        for (int i = 0; i < 100; ++i)
+            cache.insert(make_key(i, 5), make_record("Title " + to_string(i)));
+        cache.save();
+        BOOST_CHECK_EQUAL(cache.entries(), 100);
+    }
+
+    mm::tag_cache cache{f.cache_path};
+    BOOST_CHECK_EQUAL(cache.entries(), 100);
+    mm::tag_record record;
+    BOOST_CHECK(cache.find(make_key(42, 5), record));
+    BOOST_CHECK(record.has_tag);
+    BOOST_CHECK_EQUAL(record.title, "Title 42");
+    BOOST_CHECK_EQUAL(record.artist, "Artist");
+    BOOST_CHECK_EQUAL(record.album, "");
+    BOOST_CHECK_EQUAL(record.track_number, "1");
+
+    // Any change to the file means a miss
+    BOOST_CHECK(!cache.find(make_key(42, 6), record));
+    BOOST_CHECK(!cache.find(make_key(100, 5), record));
+    BOOST_CHECK_EQUAL(cache.hits(), 1);
+    BOOST_CHECK_EQUAL(cache.misses(), 2);
+}
+
+BOOST_AUTO_TEST_CASE (superseded_entries_dropped)
+{
+    cache_fixture f;
+
+    {
+        mm::tag_cache cache{f.cache_path};
+        cache.insert(make_key(1, 5), make_record("Old"));
+        cache.insert(make_key(2, 5), make_record("Other"));
+        cache.save();
+    }
+    {
+        mm::tag_cache cache{f.cache_path};
+        cache.insert(make_key(1, 7), make_record("New"));
+        cache.save();
+        BOOST_CHECK_EQUAL(cache.entries(), 2);
+    }
+
+    mm::tag_cache cache{f.cache_path};
+    mm::tag_record record;
+    BOOST_CHECK(!cache.find(make_key(1, 5), record));
+    BOOST_CHECK(cache.find(make_key(1, 7), record));
+    BOOST_CHECK_EQUAL(record.title, "New");
+    BOOST_CHECK(cache.find(make_key(2, 5), record));
+    BOOST_CHECK_EQUAL(record.title, "Other");
+}
+
+BOOST_AUTO_TEST_CASE (concurrent_runs_merged)
+{
+    cache_fixture f;
+
+    // Two runs open the cache before either saves
+    mm::tag_cache cache1{f.cache_path};
+    mm::tag_cache cache2{f.cache_path};
+    cache1.insert(make_key(1, 5), make_record("One"));
+    cache2.insert(make_key(2, 5), make_record("Two"));
+    cache1.save();
+    cache2.save();
+
+    mm::tag_cache cache{f.cache_path};
+    mm::tag_record record;
+    BOOST_CHECK_EQUAL(cache.entries(), 2);
+    BOOST_CHECK(cache.find(make_key(1, 5), record));
+    BOOST_CHECK_EQUAL(record.title, "One");
+    BOOST_CHECK(cache.find(make_key(2, 5), record));
+    BOOST_CHECK_EQUAL(record.title, "Two");
+}
+
+BOOST_AUTO_TEST_CASE (corrupt_entries_ignored)
+{
+    cache_fixture f;
+
+    {
+        mm::tag_cache cache{f.cache_path};
+        cache.insert(make_key(1, 5), make_record("One"));
+        cache.insert(make_key(2, 5), make_record("Two"));
+        cache.save();
+    }
+
+    // Damage the last record in the file
+    auto size = fs::file_size(f.cache_path);
+    {
+        fstream file{f.cache_path.string(), ios::in | ios::out | ios::binary};
+        file.seekp(size - 2);
+        file.put('X');
+    }
+
+    {
+        mm::tag_cache cache{f.cache_path};
+        mm::tag_record record;
+        BOOST_CHECK(cache.find(make_key(1, 5), record));
+        BOOST_CHECK(!cache.find(make_key(2, 5), record));
+
+        // The damaged entry is dropped the next time the cache is saved
+        cache.insert(make_key(3, 5), make_record("Three"));
+        cache.save();
+        BOOST_CHECK_EQUAL(cache.entries(), 2);
+    }
+
+    // A truncated file is treated as empty
+    fs::resize_file(f.cache_path, 10);
+    mm::tag_cache cache{f.cache_path};
+    mm::tag_record record;
+    BOOST_CHECK_EQUAL(cache.entries(), 0);
+    BOOST_CHECK(!cache.find(make_key(1, 5), record));
+}
+
+BOOST_AUTO_TEST_CASE (unused_entries_dropped)
+{
+    cache_fixture f;
+
+    {
+        mm::tag_cache cache{f.cache_path};
+        cache.insert(make_key(1, 5), make_record("Used"));
+        cache.insert(make_key(2, 5), make_record("Gone"));
+        cache.save();
+    }
+
+    // Runs that only use the cache leave it as it is
+    {
+        mm::tag_cache cache{f.cache_path};
+        mm::tag_record record;
+        BOOST_CHECK(cache.find(make_key(1, 5), record));
+        auto write_time = fs::last_write_time(f.cache_path);
+        fs::last_write_time(f.cache_path, write_time - 100);
+        cache.save();
+        BOOST_CHECK(fs::last_write_time(f.cache_path) == write_time - 100);
+    }
+
+    // Runs that add to it refresh the entries they used, and eventually drop
+    // any that none of them did
+    int run = 0;
+    for (; run < 100; ++run)
+    {
+        mm::tag_cache cache{f.cache_path};
+        mm::tag_record record;
+        BOOST_CHECK(cache.find(make_key(1, 5), record));
+        if (!cache.find(make_key(2, 5), record))
+            break;
+        // Use only the first, so the second looks like a file that's gone
+        mm::tag_cache other{f.cache_path};
+        other.insert(make_key(100 + run, 5), make_record("New"));
+        BOOST_CHECK(other.find(make_key(1, 5), record));
+        other.save();
+    }
+    BOOST_CHECK_GT(run, 1);
+    BOOST_CHECK_LT(run, 100);
+
+    mm::tag_cache cache{f.cache_path};
+    mm::tag_record record;
+    BOOST_CHECK(cache.find(make_key(1, 5), record));
+    BOOST_CHECK_EQUAL(record.title, "Used");
+    BOOST_CHECK(!cache.find(make_key(2, 5), record));
+    // Entries added by the most recent runs are still there
+    BOOST_CHECK(cache.find(make_key(100 + run - 1, 5), record));
+}
+
+BOOST_AUTO_TEST_CASE (damaged_entries_compacted)
+{
+    cache_fixture f;
+
+    {
+        mm::tag_cache cache{f.cache_path};
+        cache.insert(make_key(1, 5), make_record("One"));
+        cache.insert(make_key(2, 5), make_record("Two"));
+        cache.save();
+    }
+    auto size = fs::file_size(f.cache_path);
+    {
+        fstream file{f.cache_path.string(), ios::in | ios::out | ios::binary};
+        file.seekp(size - 2);
+        file.put('X');
+    }
+
+    // Even with nothing new to add, the damaged entry is dropped
+    {
+        mm::tag_cache cache{f.cache_path};
+        cache.save();
+    }
+    BOOST_CHECK_LT(fs::file_size(f.cache_path), size);
+    mm::tag_cache cache{f.cache_path};
+    mm::tag_record record;
+    BOOST_CHECK_EQUAL(cache.entries(), 1);
+    BOOST_CHECK(cache.find(make_key(1, 5), record));
+}
+
+BOOST_AUTO_TEST_CASE (key_for_file)
+{
+    cache_fixture f;
+
+    fs::path file{f.tmp_dir / "file.flac"};
+    ofstream{file.string()} << "data";
+    mm::tag_cache_key key1, key2;
+    BOOST_CHECK(mm::tag_cache::make_key(file, key1));
+    BOOST_CHECK_EQUAL(key1.size, 4);
+    ofstream{file.string(), ios::app} << "more";
+    BOOST_CHECK(mm::tag_cache::make_key(file, key2));
+    BOOST_CHECK(!(key1 == key2));
+    BOOST_CHECK(!mm::tag_cache::make_key(f.tmp_dir / "missing", key1));
+}
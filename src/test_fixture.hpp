@@ -0,0 +1,82 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_TEST_FIXTURE_HPP
+#define MUSICMOVE_TEST_FIXTURE_HPP
+
+// Helpers shared by the unit tests
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+// Creates a uniquely-named temporary directory for a test to work in, and
+// removes it again afterwards
+struct fixture
+{
+    fixture() :
+        tmp_dir{boost::filesystem::temp_directory_path() /
+                boost::filesystem::path{
+                    "musicmove-" + boost::filesystem::unique_path().string()}}
+    {
+        // Ensure the tmp dir exists
+        std::cout << "Creating " << tmp_dir << std::endl;
+        if (boost::filesystem::exists(tmp_dir))
+        {
+            throw std::runtime_error{"tmp_dir already exists!"};
+        }
+        boost::filesystem::create_directories(tmp_dir);
+    }
+
+    ~fixture()
+    {
+        // Remove the tmp dir if it exists
+        std::cout << "Removing " << tmp_dir << std::endl;
+        if (boost::filesystem::is_directory(tmp_dir))
+        {
+            boost::filesystem::remove_all(tmp_dir);
+        }
+    }
+
+    fixture(const fixture &) = delete;
+    fixture &operator=(const fixture &) = delete;
+
+    // Number of entries in the tmp dir, to check nothing is left lying around
+    int entry_count() const
+    {
+        int count = 0;
+        for (auto iter = boost::filesystem::directory_iterator{tmp_dir};
+             iter != boost::filesystem::directory_iterator{}; ++iter)
+            ++count;
+        return count;
+    }
+
+    const boost::filesystem::path tmp_dir;
+};
+
+// Get the first line of a file
+inline std::string read_file(const boost::filesystem::path &p)
+{
+    std::ifstream file{p.string()};
+    std::string contents;
+    std::getline(file, contents);
+    return contents;
+}
+
+#endif // MUSICMOVE_TEST_FIXTURE_HPP
@@ -0,0 +1,191 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef MUSICMOVE_TRACING
+
+#include "trace.hpp"
+#include "output.hpp"
+
+#include <boost/filesystem.hpp>
+#include <atomic>
+#include <cerrno>
+#include <fstream>
+
+namespace fs = boost::filesystem;
+
+namespace mm {
+
+namespace {
+
+// Tells tracers apart, even one made where another used to be
+std::atomic<std::uint64_t> last_tracer_id{0};
+
+void append_microseconds(std::string &json, std::int64_t ns)
+{
+    // Whole microseconds, and three decimal places
+    json += std::to_string(ns / 1000);
+    auto frac = std::to_string(1000 + ns % 1000);
+    json += '.';
+    json += frac.substr(1);
+}
+
+} // anonymous namespace
+
+tracer::tracer(std::size_t spans_per_thread) :
+    id_{++last_tracer_id}, capacity_{spans_per_thread > 0 ? spans_per_thread
+                                                          : 1},
+    start_{clock::now()}, pool_{std::make_shared<buffer_pool>()}
+{}
+
+tracer::~tracer()
+{}
+
+thread_local tracer::thread_state tracer::this_thread_;
+
+void tracer::thread_state::release()
+{
+    if (auto p = pool.lock())
+    {
+        std::lock_guard<std::mutex> lock{p->mutex};
+        p->free.push_back(buffer);
+    }
+    tracer_id = 0;
+    buffer = nullptr;
+    pool.reset();
+}
+
+tracer::thread_buffer &tracer::buffer()
+{
+    if (this_thread_.tracer_id == id_)
+        return *this_thread_.buffer;
+    
+    // First span on this thread.  Carry on from where a thread that has
+    // exited left off, if there is one.
+    this_thread_.release();
+    std::lock_guard<std::mutex> lock{pool_->mutex};
+    thread_buffer *b;
+    if (!pool_->free.empty())
+    {
+        b = pool_->free.back();
+        pool_->free.pop_back();
+    }
+    else
+    {
+        pool_->buffers.push_back(std::make_unique<thread_buffer>());
+        b = pool_->buffers.back().get();
+        b->tid = static_cast<int>(pool_->buffers.size());
+        b->next = 0;
+    }
+    this_thread_.tracer_id = id_;
+    this_thread_.buffer = b;
+    this_thread_.pool = pool_;
+    return *b;
+}
+
+void tracer::record(const char *name, clock::time_point start,
+                    clock::time_point end, const fs::path &path)
+{
+    using std::chrono::duration_cast;
+    using std::chrono::nanoseconds;
+    
+    auto &b = buffer();
+    std::lock_guard<std::mutex> lock{b.mutex};
+    if (b.spans.size() < capacity_)
+        b.spans.emplace_back();
+    auto &s = b.spans[b.next];
+    b.next = (b.next + 1) % capacity_;
+    
+    s.name = name;
+    s.start_ns = duration_cast<nanoseconds>(start - start_).count();
+    s.duration_ns = duration_cast<nanoseconds>(end - start).count();
+    // Reuses whatever the slot last held, so there is rarely anything to
+    // allocate once the buffer has wrapped around
+    s.path.assign(path.string());
+}
+
+void tracer::write(std::ostream &os) const
+{
+    std::lock_guard<std::mutex> lock{pool_->mutex};
+    std::string json;
+    json += "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    for (const auto &b : pool_->buffers)
+    {
+        std::lock_guard<std::mutex> buffer_lock{b->mutex};
+        auto tid = std::to_string(b->tid);
+        
+        // Name each thread, as viewers otherwise show only its number
+        if (!first)
+            json += ',';
+        first = false;
+        json += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":";
+        json += tid;
+        json += ",\"args\":{\"name\":\"thread ";
+        json += tid;
+        json += "\"}}";
+        
+        // Oldest first, starting from the slot that will be overwritten next
+        auto count = b->spans.size();
+        auto oldest = count < capacity_ ? 0 : b->next;
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            const auto &s = b->spans[(oldest + i) % count];
+            json += ",{\"name\":";
+            append_json_string(json, s.name);
+            json += ",\"cat\":\"file\",\"ph\":\"X\",\"ts\":";
+            append_microseconds(json, s.start_ns);
+            json += ",\"dur\":";
+            append_microseconds(json, s.duration_ns);
+            json += ",\"pid\":1,\"tid\":";
+            json += tid;
+            json += ",\"args\":{\"path\":";
+            append_json_string(json, s.path);
+            json += "}}";
+            
+            if (json.size() > 1024 * 1024)
+            {
+                os << json;
+                json.clear();
+            }
+        }
+    }
+    json += "]}\n";
+    os << json;
+    os.flush();
+}
+
+void tracer::save(const fs::path &path) const
+{
+    auto tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream file{tmp.string(), std::ios::out | std::ios::trunc};
+        if (file)
+            write(file);
+        if (!file)
+        {
+            throw fs::filesystem_error{"Unable to write trace", tmp,
+                boost::system::error_code{errno,
+                    boost::system::system_category()}};
+        }
+    }
+    fs::rename(tmp, path);
+}
+
+} // namespace mm
+
+#endif // MUSICMOVE_TRACING
@@ -0,0 +1,159 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_TRACE_HPP
+#define MUSICMOVE_TRACE_HPP
+
+// Tracing is only built in if MUSICMOVE_TRACING is defined.  Otherwise the
+// macros below expand to nothing, and there is no tracer at all.
+#ifdef MUSICMOVE_TRACING
+
+#include <boost/filesystem/path.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace mm {
+
+// Records how long each step of handling each file took, on which thread,
+// to be looked at afterwards in a trace viewer such as Perfetto.
+//
+// Each thread records into its own ring buffer, so threads never wait on
+// each other, and only the latest spans on each thread are kept.  A thread's
+// buffer is handed on to a new thread once it exits, so a long run that
+// keeps starting threads needs no more buffers than it had threads at once.
+// The trace is written in the Chrome trace event format.
+class tracer
+{
+public:
+    typedef std::chrono::steady_clock clock;
+    
+    explicit tracer(std::size_t spans_per_thread);
+    ~tracer();
+    tracer(const tracer &) = delete;
+    tracer &operator=(const tracer &) = delete;
+    
+    // Record a span of time spent on a named step for the given path.  The
+    // name must be a string literal, or otherwise outlive the tracer.
+    void record(const char *name, clock::time_point start,
+                clock::time_point end, const boost::filesystem::path &path);
+    
+    void write(std::ostream &os) const;
+    
+    // Replace a file with the trace so far, such that anything reading the
+    // file never sees it partly written.  Throws
+    // boost::filesystem::filesystem_error on failure.
+    void save(const boost::filesystem::path &path) const;
+    
+private:
+    struct span
+    {
+        const char *name;
+        std::int64_t start_ns;
+        std::int64_t duration_ns;
+        std::string path;
+    };
+    
+    struct thread_buffer
+    {
+        int tid;
+        // Held by the owning thread while recording, which is never
+        // contended except while the trace is being written
+        std::mutex mutex;
+        std::vector<span> spans;
+        std::size_t next;
+    };
+    
+    // Shared with the threads recording into it, so that a thread exiting
+    // after the tracer has gone knows not to give its buffer back
+    struct buffer_pool
+    {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<thread_buffer>> buffers;
+        // Buffers whose threads have exited
+        std::vector<thread_buffer *> free;
+    };
+    
+    // The buffer a thread last recorded into, and the tracer it belongs to
+    struct thread_state
+    {
+        ~thread_state() { release(); }
+        void release();
+        
+        std::uint64_t tracer_id = 0;
+        thread_buffer *buffer = nullptr;
+        std::weak_ptr<buffer_pool> pool;
+    };
+    static thread_local thread_state this_thread_;
+    
+    thread_buffer &buffer();
+    
+    const std::uint64_t id_;
+    const std::size_t capacity_;
+    const clock::time_point start_;
+    
+    const std::shared_ptr<buffer_pool> pool_;
+};
+
+// A span that is recorded when it goes out of scope, or is ended
+class trace_span
+{
+public:
+    trace_span(tracer *t, const char *name,
+               const boost::filesystem::path &path) :
+        tracer_{t}, name_{name}, path_{path},
+        start_{t ? tracer::clock::now() : tracer::clock::time_point{}}
+    {}
+    ~trace_span() { end(); }
+    trace_span(const trace_span &) = delete;
+    trace_span &operator=(const trace_span &) = delete;
+    
+    void end()
+    {
+        if (tracer_)
+            tracer_->record(name_, start_, tracer::clock::now(), path_);
+        tracer_ = nullptr;
+    }
+    
+private:
+    tracer *tracer_;
+    const char *name_;
+    const boost::filesystem::path &path_;
+    tracer::clock::time_point start_;
+};
+
+} // namespace mm
+
+// Start a span called `name', for a path that must outlive it, with a
+// variable `var' that can be used to end it early
+#define MUSICMOVE_TRACE_SPAN(var, tracer, name, path) \
+    ::mm::trace_span var{tracer, name, path}
+#define MUSICMOVE_TRACE_END(var) var.end()
+
+#else
+
+#define MUSICMOVE_TRACE_SPAN(var, tracer, name, path) ((void)0)
+#define MUSICMOVE_TRACE_END(var) ((void)0)
+
+#endif // MUSICMOVE_TRACING
+
+#endif // MUSICMOVE_TRACE_HPP
@@ -0,0 +1,178 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "trace.hpp"
+#include "test_fixture.hpp"
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE trace_test
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace fs = boost::filesystem;
+using namespace std;
+
+size_t count_of(const string &text, const string &needle)
+{
+    size_t n = 0;
+    for (auto pos = text.find(needle); pos != string::npos;
+         pos = text.find(needle, pos + 1))
+    {
+        ++n;
+    }
+    return n;
+}
+
+BOOST_AUTO_TEST_CASE (spans_written)
+{
+    mm::tracer trace{16};
+    fs::path file{"dir/a \"b\".mp3"};
+    {
+        mm::trace_span span{&trace, "metadata", file};
+        mm::trace_span inner{&trace, "format", file};
+        inner.end();
+        // Ending twice records once
+        inner.end();
+    }
+    {
+        // Nothing to record to
+        mm::trace_span span{nullptr, "metadata", file};
+    }
+    
+    stringstream os;
+    trace.write(os);
+    auto json = os.str();
+    BOOST_CHECK_EQUAL(json.substr(0, 1), "{");
+    BOOST_CHECK_EQUAL(json.substr(json.size() - 3), "]}\n");
+    BOOST_CHECK_EQUAL(count_of(json, "\"ph\":\"X\""), 2);
+    BOOST_CHECK_EQUAL(count_of(json, "\"name\":\"metadata\""), 1);
+    BOOST_CHECK_EQUAL(count_of(json, "\"name\":\"format\""), 1);
+    BOOST_CHECK_EQUAL(count_of(json, "\"path\":\"dir/a \\\"b\\\".mp3\""), 2);
+    BOOST_CHECK_EQUAL(count_of(json, "\"name\":\"thread_name\""), 1);
+}
+
+BOOST_AUTO_TEST_CASE (only_latest_spans_kept)
+{
+    mm::tracer trace{4};
+    vector<fs::path> files;
+    for (int i = 0; i < 10; ++i)
+        files.push_back("file" + to_string(i));
+    for (const auto &file : files)
+    {
+        auto now = mm::tracer::clock::now();
+        trace.record("move", now, now, file);
+    }
+    
+    stringstream os;
+    trace.write(os);
+    auto json = os.str();
+    BOOST_CHECK_EQUAL(count_of(json, "\"ph\":\"X\""), 4);
+    BOOST_CHECK_EQUAL(count_of(json, "\"file5\""), 0);
+    
+    // Oldest first
+    auto pos6 = json.find("\"file6\"");
+    auto pos9 = json.find("\"file9\"");
+    BOOST_CHECK(pos6 != string::npos);
+    BOOST_CHECK(pos9 != string::npos);
+    BOOST_CHECK(pos6 < pos9);
+}
+
+BOOST_AUTO_TEST_CASE (thread_per_buffer)
+{
+    mm::tracer trace{1024};
+    vector<thread> threads;
+    // None exits until all have recorded, so none takes over another's
+    // buffer
+    atomic<int> recorded{0};
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&trace, &recorded, t] {
+            fs::path file{"thread" + to_string(t)};
+            for (int i = 0; i < 100; ++i)
+                mm::trace_span span{&trace, "copy", file};
+            ++recorded;
+            while (recorded < 4)
+                this_thread::yield();
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    
+    stringstream os;
+    trace.write(os);
+    auto json = os.str();
+    BOOST_CHECK_EQUAL(count_of(json, "\"ph\":\"X\""), 400);
+    BOOST_CHECK_EQUAL(count_of(json, "\"name\":\"thread_name\""), 4);
+    for (int t = 1; t <= 4; ++t)
+        BOOST_CHECK_EQUAL(count_of(json, "\"tid\":" + to_string(t) + ","),
+                          101);
+}
+
+BOOST_AUTO_TEST_CASE (buffers_reused)
+{
+    mm::tracer trace{1024};
+    
+    // Threads that come and go one after another share a buffer
+    for (int t = 0; t < 50; ++t)
+    {
+        thread{[&trace, t] {
+            fs::path file{"thread" + to_string(t)};
+            mm::trace_span span{&trace, "copy", file};
+        }}.join();
+    }
+    
+    // A thread can outlive the tracer it recorded into
+    thread{[] {
+        mm::tracer gone{4};
+        fs::path file{"gone"};
+        mm::trace_span span{&gone, "copy", file};
+    }}.join();
+    
+    stringstream os;
+    trace.write(os);
+    auto json = os.str();
+    BOOST_CHECK_EQUAL(count_of(json, "\"ph\":\"X\""), 50);
+    BOOST_CHECK_EQUAL(count_of(json, "\"name\":\"thread_name\""), 1);
+    BOOST_CHECK_EQUAL(count_of(json, "\"thread49\""), 1);
+}
+
+BOOST_AUTO_TEST_CASE (save_replaces_file)
+{
+    fixture f;
+    
+    fs::path file{f.tmp_dir / "trace.json"};
+    ofstream{file.string()} << "old";
+    mm::tracer trace{16};
+    {
+        mm::trace_span span{&trace, "list", f.tmp_dir};
+    }
+    trace.save(file);
+    
+    ifstream in{file.string()};
+    stringstream contents;
+    contents << in.rdbuf();
+    BOOST_CHECK_EQUAL(count_of(contents.str(), "\"name\":\"list\""), 1);
+    BOOST_CHECK_EQUAL(fs::exists(f.tmp_dir / "trace.json.tmp"), false);
+}
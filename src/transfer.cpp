@@ -0,0 +1,512 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "transfer.hpp"
+#include "crc32c.hpp"
+#include "fs_ops.hpp"
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "posix_util.hpp"
+#endif
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
+#endif
+
+namespace fs = boost::filesystem;
+
+namespace mm {
+
+using std::string;
+
+#ifdef _WIN32
+
+bool transfer_file(const fs::path &from, const fs::path &to,
+                   durability_t durability)
+{
+    try
+    {
+        fs::copy_file(from, to);
+    }
+    catch (fs::filesystem_error &e)
+    {
+        if (e.code() == boost::system::errc::file_exists)
+            return false;
+        throw;
+    }
+    fs::last_write_time(to, fs::last_write_time(from));
+    fs::remove(from);
+    return true;
+}
+
+std::vector<string> finish_transfers()
+{
+    return {};
+}
+
+#else
+
+namespace {
+
+// Most originals to hold on to before a batch is flushed
+const std::size_t max_batch_size = 64;
+
+// Buffer size for copying through user space
+const std::size_t copy_buffer_size = 1024 * 1024;
+
+[[noreturn]] void throw_errno(const char *what, const fs::path &p, int err)
+{
+    throw fs::filesystem_error{what, p,
+        boost::system::error_code{err, boost::system::system_category()}};
+}
+
+// Is this error just a sign that a way of copying isn't supported here?
+bool unsupported(int err)
+{
+    return err == ENOSYS || err == EXDEV || err == EINVAL ||
+        err == EOPNOTSUPP || err == ENOTTY || err == EBADF;
+}
+
+// Copy through a buffer, from the current offsets
+void copy_buffered(int in, int out, const fs::path &from)
+{
+    std::vector<char> buffer(copy_buffer_size);
+    for (;;)
+    {
+        auto n = ::read(in, buffer.data(), buffer.size());
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw_errno("read", from, errno);
+        if (n == 0)
+            return;
+        for (ssize_t done = 0; done < n;)
+        {
+            auto w = ::write(out, buffer.data() + done, n - done);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w < 0)
+                throw_errno("write", from, errno);
+            done += w;
+        }
+    }
+}
+
+// Copy all of a file's data, as cheaply as we can, returning true if the
+// copy shares the original's data rather than having its own
+bool copy_data(int in, int out, off_t size, const fs::path &from)
+{
+#ifdef __linux__
+    // A reflink shares the data outright, where the filesystem allows it
+    if (::ioctl(out, FICLONE, in) == 0)
+        return true;
+    
+    // Otherwise, keep the copy within the kernel
+    off_t done = 0;
+    while (done < size)
+    {
+        auto n = ::copy_file_range(in, nullptr, out, nullptr,
+                                   size - done, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && done == 0 && unsupported(errno))
+            break;
+        if (n < 0)
+            throw_errno("copy_file_range", from, errno);
+        if (n == 0)
+            return false;
+        done += n;
+    }
+    if (done >= size)
+        return false;
+    
+    while (done < size)
+    {
+        auto n = ::sendfile(out, in, nullptr, size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && done == 0 && unsupported(errno))
+            break;
+        if (n < 0)
+            throw_errno("sendfile", from, errno);
+        if (n == 0)
+            return false;
+        done += n;
+    }
+    if (done >= size)
+        return false;
+#endif
+    copy_buffered(in, out, from);
+    return false;
+}
+
+// Checksum the whole of an open file
+std::uint32_t file_crc(int fd, const fs::path &p)
+{
+    std::vector<char> buffer(copy_buffer_size);
+    std::uint32_t crc = 0;
+    for (off_t offset = 0;;)
+    {
+        auto n = ::pread(fd, buffer.data(), buffer.size(), offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw_errno("read", p, errno);
+        if (n == 0)
+            return crc;
+        crc = crc32c(crc, buffer.data(), n);
+        offset += n;
+    }
+}
+
+// Copy extended attributes, where both filesystems have them
+void copy_xattrs(int in, int out, const fs::path &from)
+{
+#ifdef __linux__
+    auto size = ::flistxattr(in, nullptr, 0);
+    if (size <= 0)
+        return;
+    std::vector<char> names(size);
+    size = ::flistxattr(in, names.data(), names.size());
+    if (size <= 0)
+        return;
+    
+    std::vector<char> value;
+    for (const char *name = names.data(); name < names.data() + size;
+         name += std::char_traits<char>::length(name) + 1)
+    {
+        auto len = ::fgetxattr(in, name, nullptr, 0);
+        if (len < 0)
+            continue;
+        value.resize(len);
+        len = ::fgetxattr(in, name, value.data(), value.size());
+        if (len < 0)
+            continue;
+        if (::fsetxattr(out, name, value.data(), len, 0) != 0 &&
+            errno != ENOTSUP && errno != EPERM && errno != EACCES)
+            throw_errno("fsetxattr", from, errno);
+    }
+#endif
+}
+
+// Originals waiting for their copies to be flushed to disk
+class transfer_batch
+{
+public:
+    ~transfer_batch()
+    {
+        for (auto &entry : filesystems_)
+            ::close(entry.second);
+    }
+    
+    void add(const fs::path &from, int dest_dir_fd, dev_t dev)
+    {
+        std::unique_lock<std::mutex> lock{mutex_};
+        if (filesystems_.count(dev) == 0)
+        {
+            int fd = ::dup(dest_dir_fd);
+            if (fd < 0)
+                throw_errno("dup", from, errno);
+            filesystems_[dev] = fd;
+        }
+        originals_.push_back(from);
+        if (originals_.size() >= max_batch_size)
+            flush(lock);
+    }
+    
+    std::vector<string> finish()
+    {
+        std::unique_lock<std::mutex> lock{mutex_};
+        flush(lock);
+        return std::move(errors_);
+    }
+    
+private:
+    void flush(std::unique_lock<std::mutex> &)
+    {
+        // Sync each destination filesystem once for the whole batch.  If any
+        // of them can't be, keep every original, as its copy may be lost.
+        int sync_err = 0;
+        for (auto &entry : filesystems_)
+        {
+#ifdef __linux__
+            if (::syncfs(entry.second) != 0 && sync_err == 0)
+                sync_err = errno;
+#else
+            ::sync();
+#endif
+            ::close(entry.second);
+        }
+        filesystems_.clear();
+        auto originals = std::move(originals_);
+        originals_.clear();
+        if (sync_err != 0)
+            throw_errno("syncfs", fs::path{}, sync_err);
+        
+        for (const auto &from : originals)
+        {
+            try
+            {
+                remove_file(from);
+            }
+            catch (fs::filesystem_error &e)
+            {
+                errors_.push_back(e.what());
+            }
+        }
+    }
+    
+    std::mutex mutex_;
+    std::map<dev_t, int> filesystems_;
+    std::vector<fs::path> originals_;
+    // Originals that couldn't be removed, since finish() was last called
+    std::vector<string> errors_;
+};
+
+transfer_batch batch;
+
+} // anonymous namespace
+
+bool transfer_file(const fs::path &from, const fs::path &to,
+                   durability_t durability)
+{
+    fd_closer in{::open(from.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (in.fd < 0)
+        throw_errno("open", from, errno);
+    struct stat st;
+    if (::fstat(in.fd, &st) != 0)
+        throw_errno("fstat", from, errno);
+    
+    auto dir = to.has_parent_path() ? to.parent_path() : fs::path{"."};
+    fd_closer dir_fd{::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+    if (dir_fd.fd < 0 && errno == ENOENT && remake_directories(dir))
+        dir_fd.fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd.fd < 0)
+        throw_errno("open", dir, errno);
+    
+    // Write the copy under a name that nothing else will be using, and that
+    // list_directory() knows to leave out
+    auto tmp = dir / ("." + to.filename().string() + "." +
+                      fs::unique_path("%%%%%%%%").string() + ".part");
+    fd_closer out{::openat(dir_fd.fd, tmp.filename().c_str(),
+                           O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)};
+    if (out.fd < 0)
+        throw_errno("open", tmp, errno);
+    
+    try
+    {
+        // Make sure the copy matches before the original goes anywhere
+        if (!copy_data(in.fd, out.fd, st.st_size, from) &&
+            file_crc(in.fd, from) != file_crc(out.fd, tmp))
+            throw_errno("verify copy", tmp, EIO);
+        copy_xattrs(in.fd, out.fd, from);
+        
+        // Not being able to give the copy away is no reason to stop
+        if (::fchown(out.fd, st.st_uid, st.st_gid) != 0 && errno != EPERM)
+            throw_errno("fchown", tmp, errno);
+        if (::fchmod(out.fd, st.st_mode & 07777) != 0)
+            throw_errno("fchmod", tmp, errno);
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        if (::futimens(out.fd, times) != 0)
+            throw_errno("futimens", tmp, errno);
+        
+        if (durability == durability_t::file && ::fsync(out.fd) != 0)
+            throw_errno("fsync", tmp, errno);
+        
+        if (!rename_no_replace(tmp, to))
+        {
+            ::unlinkat(dir_fd.fd, tmp.filename().c_str(), 0);
+            return false;
+        }
+    }
+    catch (...)
+    {
+        ::unlinkat(dir_fd.fd, tmp.filename().c_str(), 0);
+        throw;
+    }
+    
+    switch (durability)
+    {
+    case durability_t::none:
+        remove_file(from);
+        break;
+    case durability_t::file:
+        // Make sure the new name is on disk too
+        if (::fsync(dir_fd.fd) != 0)
+            throw_errno("fsync", dir, errno);
+        remove_file(from);
+        break;
+    case durability_t::batch:
+    {
+        struct stat dir_st;
+        if (::fstat(dir_fd.fd, &dir_st) != 0)
+            throw_errno("fstat", dir, errno);
+        batch.add(from, dir_fd.fd, dir_st.st_dev);
+        break;
+    }
+    }
+    return true;
+}
+
+std::vector<string> finish_transfers()
+{
+    return batch.finish();
+}
+
+#endif // _WIN32
+
+transfer_queue::transfer_queue(unsigned int threads,
+                               std::uint64_t max_bytes_in_flight,
+                               unsigned int max_per_device,
+                               durability_t durability) :
+    max_bytes_{max_bytes_in_flight},
+    max_per_device_{max_per_device > 0 ? max_per_device : 1},
+    durability_{durability},
+    closed_{false}, outstanding_{0}, bytes_{0}
+{
+    for (unsigned int i = 0; i < (threads > 0 ? threads : 1); ++i)
+        threads_.emplace_back([this] { run(); });
+}
+
+transfer_queue::~transfer_queue()
+{
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        closed_ = true;
+    }
+    changed_.notify_all();
+    for (auto &t : threads_)
+        t.join();
+}
+
+void transfer_queue::submit(const fs::path &from, const fs::path &to,
+                            completion done)
+{
+    task t{from, to, fs::file_size(from), 0, std::move(done)};
+#ifndef _WIN32
+    struct stat st;
+    auto dir = to.has_parent_path() ? to.parent_path() : fs::path{"."};
+    if (::stat(dir.c_str(), &st) == 0)
+        t.device = st.st_dev;
+#endif
+    
+    // A file bigger than the limit goes on its own
+    std::unique_lock<std::mutex> lock{mutex_};
+    changed_.wait(lock, [this, &t] {
+        return bytes_ == 0 || bytes_ + t.size <= max_bytes_;
+    });
+    bytes_ += t.size;
+    ++outstanding_;
+    tasks_.push_back(std::move(t));
+    changed_.notify_all();
+}
+
+std::vector<string> transfer_queue::wait()
+{
+    std::unique_lock<std::mutex> lock{mutex_};
+    changed_.wait(lock, [this] { return outstanding_ == 0; });
+    return std::move(errors_);
+}
+
+#ifdef MUSICMOVE_TRACING
+void transfer_queue::trace_to(std::shared_ptr<tracer> trace)
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+    trace_ = std::move(trace);
+}
+#endif
+
+void transfer_queue::run()
+{
+    std::unique_lock<std::mutex> lock{mutex_};
+    for (;;)
+    {
+        // Take the oldest transfer to a device that isn't already busy
+        auto next = tasks_.end();
+        changed_.wait(lock, [this, &next] {
+            next = std::find_if(tasks_.begin(), tasks_.end(),
+                [this](const task &t) {
+                    return active_[t.device] < max_per_device_;
+                });
+            return next != tasks_.end() || (closed_ && tasks_.empty());
+        });
+        if (next == tasks_.end())
+            return;
+        
+        task t = std::move(*next);
+        tasks_.erase(next);
+        ++active_[t.device];
+#ifdef MUSICMOVE_TRACING
+        auto trace = trace_;
+#endif
+        lock.unlock();
+        
+        bool moved = false;
+        string error;
+        try
+        {
+            MUSICMOVE_TRACE_SPAN(span, trace.get(), "copy", t.from);
+            moved = transfer_file(t.from, t.to, durability_);
+        }
+        catch (std::exception &e)
+        {
+            error = e.what();
+        }
+        if (t.done)
+        {
+            // Whatever goes wrong in reporting is reported by wait() instead
+            try
+            {
+                t.done(moved, error);
+                error.clear();
+            }
+            catch (std::exception &e)
+            {
+                error = e.what();
+            }
+        }
+        else if (!moved && error.empty())
+            error = "Warning: want to move " + t.from.string() + " to " +
+                t.to.string() + ", but that path already exists.  "
+                "Skipping for now..";
+        
+        lock.lock();
+        if (!error.empty())
+            errors_.push_back(std::move(error));
+        --active_[t.device];
+        bytes_ -= t.size;
+        --outstanding_;
+        changed_.notify_all();
+    }
+}
+
+} // namespace mm
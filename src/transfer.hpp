@@ -0,0 +1,124 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_TRANSFER_HPP
+#define MUSICMOVE_TRANSFER_HPP
+
+#include <boost/filesystem/path.hpp>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "context.hpp"
+#include "trace.hpp"
+
+namespace mm {
+
+// Move a file to another filesystem by copying it, then removing the
+// original, unless something already exists at the new path, in which case
+// nothing is changed and false is returned.
+//
+// The copy is made as cheaply as the filesystems allow: as a reflink if
+// possible, otherwise within the kernel, and only as a last resort through
+// a buffer.  The file's mode, ownership, extended attributes and times are
+// kept.  The copy is written under a temporary name and then renamed into
+// place, so the new path never holds a partial file.  Depending on the
+// durability policy, the original may not be removed until a later call to
+// finish_transfers().  Throws boost::filesystem::filesystem_error on failure.
+bool transfer_file(const boost::filesystem::path &from,
+                   const boost::filesystem::path &to,
+                   durability_t durability);
+
+// Flush any batched transfers to disk, and remove their originals.  Returns
+// a message for each original that couldn't be removed.  Throws
+// boost::filesystem::filesystem_error, having kept every original, if the
+// copies can't be flushed.
+std::vector<std::string> finish_transfers();
+
+// A pool of threads making transfers in the background, so that one large
+// file does not hold up everything else.  The total size of the files
+// being transferred at once is limited, as is the number of transfers to
+// any one device, so that a slow device can't take up every thread.
+class transfer_queue
+{
+public:
+    transfer_queue(unsigned int threads, std::uint64_t max_bytes_in_flight,
+                   unsigned int max_per_device, durability_t durability);
+    ~transfer_queue();
+    transfer_queue(const transfer_queue &) = delete;
+    transfer_queue &operator=(const transfer_queue &) = delete;
+    
+    // Called from one of the queue's threads once a transfer is over, with
+    // whether it was made, and if not, why not.  The error is empty if
+    // something was already at the new path.
+    typedef std::function<void(bool moved, const std::string &error)>
+        completion;
+    
+    // Queue a transfer, first waiting for others to finish if there is
+    // already too much on its way.  If there is a completion, it is told how
+    // the transfer went, rather than wait().
+    void submit(const boost::filesystem::path &from,
+                const boost::filesystem::path &to,
+                completion done = completion{});
+    
+    // Wait for every queued transfer to finish, and get a message for each
+    // one without a completion that couldn't be made
+    std::vector<std::string> wait();
+    
+#ifdef MUSICMOVE_TRACING
+    // Record a span for each transfer
+    void trace_to(std::shared_ptr<tracer> trace);
+#endif
+    
+private:
+    struct task
+    {
+        boost::filesystem::path from;
+        boost::filesystem::path to;
+        std::uint64_t size;
+        std::uint64_t device;
+        completion done;
+    };
+    void run();
+    
+    const std::uint64_t max_bytes_;
+    const unsigned int max_per_device_;
+    const durability_t durability_;
+    
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    bool closed_;
+    std::deque<task> tasks_;
+    std::size_t outstanding_;
+    std::uint64_t bytes_;
+    std::map<std::uint64_t, unsigned int> active_;
+    std::vector<std::string> errors_;
+    std::vector<std::thread> threads_;
+#ifdef MUSICMOVE_TRACING
+    std::shared_ptr<tracer> trace_;
+#endif
+};
+
+} // namespace mm
+
+#endif // MUSICMOVE_TRANSFER_HPP
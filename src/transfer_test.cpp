@@ -0,0 +1,230 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "transfer.hpp"
+#include "crc32c.hpp"
+#include "test_fixture.hpp"
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE transfer_test
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <sys/xattr.h>
+#endif
+
+namespace fs = boost::filesystem;
+using namespace std;
+
+BOOST_AUTO_TEST_CASE (transfer_keeps_attributes)
+{
+    fixture f;
+
+    fs::path s1{f.tmp_dir / "a.inc"};
+    fs::path d1{f.tmp_dir / "b.inc"};
+    ofstream{s1.string()} << "one";
+    fs::permissions(s1, fs::owner_read | fs::owner_write | fs::group_read);
+    std::time_t mtime = 1000000000;
+    fs::last_write_time(s1, mtime);
+#ifdef __linux__
+    bool has_xattr =
+        ::setxattr(s1.c_str(), "user.musicmove", "x", 1, 0) == 0;
+#endif
+
+    BOOST_CHECK(mm::transfer_file(s1, d1, mm::durability_t::file));
+    BOOST_CHECK_EQUAL(fs::exists(s1), false);
+    BOOST_CHECK_EQUAL(read_file(d1), "one");
+    BOOST_CHECK_EQUAL(fs::last_write_time(d1), mtime);
+    BOOST_CHECK_EQUAL(fs::status(d1).permissions(),
+                      fs::owner_read | fs::owner_write | fs::group_read);
+#ifdef __linux__
+    if (has_xattr)
+    {
+        char value[8];
+        BOOST_CHECK_EQUAL(::getxattr(d1.c_str(), "user.musicmove",
+                                     value, sizeof(value)), 1);
+    }
+#endif
+    BOOST_CHECK_EQUAL(f.entry_count(), 1);
+}
+
+BOOST_AUTO_TEST_CASE (transfer_clash)
+{
+    fixture f;
+
+    fs::path s1{f.tmp_dir / "a.inc"};
+    fs::path d1{f.tmp_dir / "b.inc"};
+    ofstream{s1.string()} << "one";
+    ofstream{d1.string()} << "two";
+
+    // Neither file should be touched, and no copy left behind
+    BOOST_CHECK(!mm::transfer_file(s1, d1, mm::durability_t::file));
+    BOOST_CHECK_EQUAL(read_file(s1), "one");
+    BOOST_CHECK_EQUAL(read_file(d1), "two");
+    BOOST_CHECK_EQUAL(f.entry_count(), 2);
+}
+
+BOOST_AUTO_TEST_CASE (transfer_batched)
+{
+    fixture f;
+
+    fs::path s1{f.tmp_dir / "a.inc"};
+    fs::path s2{f.tmp_dir / "b.inc"};
+    fs::path d1{f.tmp_dir / "c.inc"};
+    fs::path d2{f.tmp_dir / "d.inc"};
+    ofstream{s1.string()} << "one";
+    ofstream{s2.string()} << "two";
+
+    // Originals are kept until the batch is finished
+    BOOST_CHECK(mm::transfer_file(s1, d1, mm::durability_t::batch));
+    BOOST_CHECK(mm::transfer_file(s2, d2, mm::durability_t::batch));
+    BOOST_CHECK_EQUAL(fs::exists(s1), true);
+    BOOST_CHECK_EQUAL(fs::exists(s2), true);
+    BOOST_CHECK(mm::finish_transfers().empty());
+    BOOST_CHECK_EQUAL(fs::exists(s1), false);
+    BOOST_CHECK_EQUAL(fs::exists(s2), false);
+    BOOST_CHECK_EQUAL(read_file(d1), "one");
+    BOOST_CHECK_EQUAL(read_file(d2), "two");
+}
+
+BOOST_AUTO_TEST_CASE (transfer_batch_original_gone)
+{
+    fixture f;
+
+    fs::path s1{f.tmp_dir / "a.inc"};
+    fs::path s2{f.tmp_dir / "b.inc"};
+    fs::path s3{f.tmp_dir / "c.inc"};
+    ofstream{s1.string()} << "one";
+    ofstream{s2.string()} << "two";
+    ofstream{s3.string()} << "three";
+    BOOST_CHECK(mm::transfer_file(s1, f.tmp_dir / "d.inc",
+                                  mm::durability_t::batch));
+    BOOST_CHECK(mm::transfer_file(s2, f.tmp_dir / "e.inc",
+                                  mm::durability_t::batch));
+    BOOST_CHECK(mm::transfer_file(s3, f.tmp_dir / "f.inc",
+                                  mm::durability_t::batch));
+
+    // An original that can't be removed is reported, and the rest still are
+    fs::remove(s2);
+    auto errors = mm::finish_transfers();
+    BOOST_REQUIRE_EQUAL(errors.size(), 1);
+    BOOST_CHECK(errors[0].find(s2.string()) != string::npos);
+    BOOST_CHECK_EQUAL(fs::exists(s1), false);
+    BOOST_CHECK_EQUAL(fs::exists(s3), false);
+    BOOST_CHECK(mm::finish_transfers().empty());
+}
+
+BOOST_AUTO_TEST_CASE (transfer_missing)
+{
+    fixture f;
+
+    BOOST_CHECK_THROW(mm::transfer_file(f.tmp_dir / "a.inc",
+                                        f.tmp_dir / "b.inc",
+                                        mm::durability_t::none),
+                      fs::filesystem_error);
+    BOOST_CHECK_EQUAL(f.entry_count(), 0);
+}
+
+BOOST_AUTO_TEST_CASE (crc32c_values)
+{
+    BOOST_CHECK_EQUAL(mm::crc32c(0, "", 0), 0u);
+    BOOST_CHECK_EQUAL(mm::crc32c(0, "123456789", 9), 0xe3069283u);
+
+    // Checksums can be built up a piece at a time
+    string data(10000, 'x');
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<char>(i * 7);
+    auto whole = mm::crc32c(0, data.data(), data.size());
+    auto part = mm::crc32c(0, data.data(), 1234);
+    BOOST_CHECK_EQUAL(mm::crc32c(part, data.data() + 1234, data.size() - 1234),
+                      whole);
+}
+
+BOOST_AUTO_TEST_CASE (transfer_queue_runs_all)
+{
+    fixture f;
+
+    // Allow less in flight than the files add up to
+    mm::transfer_queue queue{3, 64, 1, mm::durability_t::none};
+    for (int i = 0; i < 20; ++i)
+    {
+        fs::path s{f.tmp_dir / ("s" + to_string(i))};
+        ofstream{s.string()} << string(30, 'a' + i);
+    }
+    ofstream{(f.tmp_dir / "d0").string()} << "taken";
+    for (int i = 0; i < 20; ++i)
+        queue.submit(f.tmp_dir / ("s" + to_string(i)),
+                     f.tmp_dir / ("d" + to_string(i)));
+
+    // Only the clash should be reported
+    auto errors = queue.wait();
+    BOOST_CHECK_EQUAL(errors.size(), 1);
+    BOOST_CHECK_EQUAL(read_file(f.tmp_dir / "d0"), "taken");
+    BOOST_CHECK_EQUAL(fs::exists(f.tmp_dir / "s0"), true);
+    for (int i = 1; i < 20; ++i)
+    {
+        BOOST_CHECK_EQUAL(fs::exists(f.tmp_dir / ("s" + to_string(i))), false);
+        BOOST_CHECK_EQUAL(read_file(f.tmp_dir / ("d" + to_string(i))),
+                          string(30, 'a' + i));
+    }
+}
+
+BOOST_AUTO_TEST_CASE (transfer_queue_completions)
+{
+    fixture f;
+
+    mm::transfer_queue queue{2, 1 << 20, 2, mm::durability_t::none};
+    ofstream{(f.tmp_dir / "s0").string()} << "zero";
+    ofstream{(f.tmp_dir / "s1").string()} << "one";
+    ofstream{(f.tmp_dir / "d1").string()} << "taken";
+    ofstream{(f.tmp_dir / "s2").string()} << "two";
+
+    // Each transfer is reported to its own completion once it is over, and
+    // not by wait()
+    std::mutex mutex;
+    std::map<string, std::pair<bool, string>> outcomes;
+    for (int i = 0; i < 3; ++i)
+    {
+        auto name = to_string(i);
+        // The last has nowhere to go
+        auto dir = i == 2 ? f.tmp_dir / "missing" : f.tmp_dir;
+        queue.submit(f.tmp_dir / ("s" + name), dir / ("d" + name),
+            [&, name](bool moved, const string &error) {
+                std::lock_guard<std::mutex> lock{mutex};
+                outcomes[name] = {moved, error};
+            });
+    }
+    BOOST_CHECK(queue.wait().empty());
+    BOOST_REQUIRE_EQUAL(outcomes.size(), 3);
+    BOOST_CHECK(outcomes["0"].first);
+    BOOST_CHECK(outcomes["0"].second.empty());
+    BOOST_CHECK_EQUAL(read_file(f.tmp_dir / "d0"), "zero");
+    BOOST_CHECK(!outcomes["1"].first);
+    BOOST_CHECK(outcomes["1"].second.empty());
+    BOOST_CHECK_EQUAL(read_file(f.tmp_dir / "d1"), "taken");
+    BOOST_CHECK(!outcomes["2"].first);
+    BOOST_CHECK(!outcomes["2"].second.empty());
+    BOOST_CHECK_EQUAL(read_file(f.tmp_dir / "s2"), "two");
+}
@@ -0,0 +1,336 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "watch.hpp"
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "posix_util.hpp"
+#endif
+
+namespace fs = boost::filesystem;
+
+namespace mm {
+
+using std::string;
+using std::chrono::milliseconds;
+
+#ifdef __linux__
+
+namespace {
+
+// Hidden files are often temporary files that are renamed into place once
+// they are complete, so they are left until then
+bool is_hidden(const fs::path &p)
+{
+    auto name = p.filename().string();
+    return !name.empty() && name[0] == '.';
+}
+
+bool is_under(const fs::path &p, const fs::path &dir)
+{
+    auto ip = p.begin();
+    for (auto id = dir.begin(); id != dir.end(); ++id, ++ip)
+    {
+        if (ip == p.end() || *ip != *id)
+            return false;
+    }
+    return true;
+}
+
+// What to hear about in each directory: files being finished or moved in or
+// out, and anything new, so that bursts of activity can be told apart
+const std::uint32_t watch_mask = IN_CLOSE_WRITE | IN_MOVED_TO |
+    IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+} // anonymous namespace
+
+watcher::watcher(const std::vector<fs::path> &roots, milliseconds quiet) :
+    roots_{}, quiet_{quiet}, fd_{-1}, stop_fds_{-1, -1}, stopped_{false}
+{
+    try
+    {
+        fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd_ < 0)
+            throw watch_error{string{"Unable to watch for new files: "} +
+                              std::strerror(errno)};
+        if (::pipe2(stop_fds_, O_NONBLOCK | O_CLOEXEC) != 0)
+            throw watch_error{string{"Unable to watch for new files: "} +
+                              std::strerror(errno)};
+        for (const auto &root : roots)
+        {
+            auto normal = fs::absolute(root).lexically_normal();
+            if (!fs::is_directory(normal))
+                throw watch_error{"Only directories can be watched: " +
+                                  root.string()};
+            roots_.push_back(normal);
+            // Whatever is already there is not new
+            add_tree(normal, false);
+        }
+    }
+    catch (...)
+    {
+        close_all();
+        throw;
+    }
+}
+
+watcher::~watcher()
+{
+    close_all();
+}
+
+void watcher::close_all()
+{
+    for (int fd : {fd_, stop_fds_[0], stop_fds_[1]})
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+    fd_ = stop_fds_[0] = stop_fds_[1] = -1;
+}
+
+void watcher::add_tree(const fs::path &dir, bool arriving)
+{
+    int wd = ::inotify_add_watch(fd_, dir.c_str(), watch_mask);
+    if (wd < 0)
+    {
+        // It may already have gone again, which is no concern of ours
+        if (errno == ENOENT || errno == ENOTDIR)
+            return;
+        // Most likely fs.inotify.max_user_watches is too low
+        throw watch_error{errno_message("Unable to watch", dir)};
+    }
+    // A directory that was moved within the tree keeps its watch
+    dirs_[wd] = dir;
+    
+    // Anything that was already in a new directory, or that got there
+    // before it was being watched, won't be heard about
+    boost::system::error_code ec;
+    for (auto entry = fs::directory_iterator{dir, ec};
+         !ec && entry != fs::directory_iterator{};
+         entry.increment(ec))
+    {
+        const auto &p = entry->path();
+        if (is_hidden(p))
+            continue;
+        auto status = entry->symlink_status(ec);
+        if (ec)
+            continue;
+        if (fs::is_directory(status))
+            add_tree(p, arriving);
+        else if (arriving)
+            arrived(dir, p);
+    }
+}
+
+void watcher::remove_tree(const fs::path &dir)
+{
+    // The directory is somewhere else now, which may not be watched at all
+    for (auto iter = dirs_.begin(); iter != dirs_.end();)
+    {
+        if (is_under(iter->second, dir))
+        {
+            ::inotify_rm_watch(fd_, iter->first);
+            iter = dirs_.erase(iter);
+        }
+        else
+            ++iter;
+    }
+    for (auto iter = pending_.begin(); iter != pending_.end();)
+    {
+        if (is_under(iter->first, dir))
+            iter = pending_.erase(iter);
+        else
+            ++iter;
+    }
+}
+
+void watcher::arrived(const fs::path &dir, const fs::path &file)
+{
+    auto &b = pending_[dir];
+    b.last = clock::now();
+    b.files.insert(file);
+}
+
+void watcher::read_events()
+{
+    alignas(struct inotify_event) char buf[65536];
+    for (;;)
+    {
+        auto n = ::read(fd_, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0)
+            throw watch_error{string{"Unable to read file events: "} +
+                              std::strerror(errno)};
+        
+        for (char *p = buf; p < buf + n;)
+        {
+            auto *event = reinterpret_cast<struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + event->len;
+            
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // Events were lost, so anything could have arrived
+                for (const auto &root : roots_)
+                    add_tree(root, true);
+                continue;
+            }
+            if (event->mask & IN_IGNORED)
+            {
+                dirs_.erase(event->wd);
+                continue;
+            }
+            auto iter = dirs_.find(event->wd);
+            if (iter == dirs_.end() || event->len == 0)
+                continue;
+            // Copied, as the entry may go away below
+            auto dir = iter->second;
+            auto path = dir / event->name;
+            if (is_hidden(path))
+                continue;
+            
+            if (event->mask & IN_ISDIR)
+            {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    add_tree(path, true);
+                else if (event->mask & IN_MOVED_FROM)
+                    remove_tree(path);
+                continue;
+            }
+            
+            auto &b = pending_[dir];
+            b.last = clock::now();
+            if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                b.files.insert(path);
+            else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                b.files.erase(path);
+        }
+    }
+}
+
+std::vector<arrivals> watcher::take_settled(clock::time_point now)
+{
+    std::vector<arrivals> settled;
+    for (auto iter = pending_.begin(); iter != pending_.end();)
+    {
+        if (now - iter->second.last < quiet_)
+        {
+            ++iter;
+            continue;
+        }
+        arrivals a;
+        a.dir = iter->first;
+        for (const auto &file : iter->second.files)
+        {
+            boost::system::error_code ec;
+            if (fs::exists(fs::symlink_status(file, ec)))
+                a.files.push_back(file);
+        }
+        if (!a.files.empty())
+            settled.push_back(std::move(a));
+        iter = pending_.erase(iter);
+    }
+    return settled;
+}
+
+std::vector<arrivals> watcher::wait(milliseconds timeout)
+{
+    auto deadline = clock::now() + timeout;
+    for (;;)
+    {
+        if (stopped_)
+            return {};
+        auto now = clock::now();
+        auto settled = take_settled(now);
+        if (!settled.empty())
+            return settled;
+        if (now >= deadline)
+            return {};
+        
+        // Sleep until something happens, or the next burst of activity
+        // might be over
+        auto until = deadline;
+        for (const auto &b : pending_)
+            until = std::min(until, b.second.last + quiet_);
+        auto ms = std::chrono::duration_cast<milliseconds>(until - now);
+        struct pollfd fds[2] = {{fd_, POLLIN, 0}, {stop_fds_[0], POLLIN, 0}};
+        int n = ::poll(fds, 2, static_cast<int>(ms.count()) + 1);
+        if (n < 0 && errno != EINTR)
+            throw watch_error{string{"Unable to wait for file events: "} +
+                              std::strerror(errno)};
+        if (n > 0 && (fds[0].revents & POLLIN))
+            read_events();
+    }
+}
+
+void watcher::stop()
+{
+    stopped_ = true;
+    char c = 0;
+    // Nothing can be done about a failure here, from a signal handler
+    [[maybe_unused]] auto n = ::write(stop_fds_[1], &c, 1);
+}
+
+#else
+
+watcher::watcher(const std::vector<fs::path> &roots, milliseconds quiet) :
+    roots_{}, quiet_{quiet}, fd_{-1}, stop_fds_{-1, -1}, stopped_{false}
+{
+    throw watch_error{"Watching for new files is only supported on Linux"};
+}
+
+watcher::~watcher()
+{}
+
+std::vector<arrivals> watcher::wait(milliseconds timeout)
+{
+    return {};
+}
+
+void watcher::stop()
+{
+    stopped_ = true;
+}
+
+#endif // __linux__
+
+bool watcher::stopped() const
+{
+    return stopped_;
+}
+
+bool watcher::is_root(const fs::path &dir) const
+{
+    auto normal = fs::absolute(dir).lexically_normal();
+    return std::find(roots_.begin(), roots_.end(), normal) != roots_.end();
+}
+
+} // namespace mm
@@ -0,0 +1,103 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_WATCH_HPP
+#define MUSICMOVE_WATCH_HPP
+
+#include <boost/filesystem/path.hpp>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mm {
+
+struct watch_error : std::runtime_error
+{
+    explicit watch_error(const std::string &what_arg) :
+        std::runtime_error(what_arg)
+    {}
+};
+
+// Files that have arrived in one directory and since stopped changing
+struct arrivals
+{
+    boost::filesystem::path dir;
+    std::vector<boost::filesystem::path> files;
+};
+
+// Watches directory trees for files that are finished being written or are
+// moved in, and hands them out a directory at a time, once nothing in that
+// directory has changed for a while.  New subdirectories are watched as
+// they appear, and any files already in them count as having arrived.
+//
+// Only supported on Linux, using inotify.  Not thread-safe, apart from
+// stop(), which may also be called from a signal handler.
+class watcher
+{
+public:
+    watcher(const std::vector<boost::filesystem::path> &roots,
+            std::chrono::milliseconds quiet);
+    ~watcher();
+    watcher(const watcher &) = delete;
+    watcher &operator=(const watcher &) = delete;
+
+    // Wait for up to the given time for any directories to settle.  Files
+    // that have gone again by then are left out.  Returns early, with
+    // nothing, once stop() has been called.
+    std::vector<arrivals> wait(std::chrono::milliseconds timeout);
+
+    void stop();
+    bool stopped() const;
+
+    // Is this one of the directories being watched from the top?
+    bool is_root(const boost::filesystem::path &dir) const;
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct burst
+    {
+        clock::time_point last;
+        std::set<boost::filesystem::path> files;
+    };
+
+    void add_tree(const boost::filesystem::path &dir, bool arriving);
+    void remove_tree(const boost::filesystem::path &dir);
+    void arrived(const boost::filesystem::path &dir,
+                 const boost::filesystem::path &file);
+    void close_all();
+    void read_events();
+    std::vector<arrivals> take_settled(clock::time_point now);
+
+    std::vector<boost::filesystem::path> roots_;
+    std::chrono::milliseconds quiet_;
+    int fd_;
+    // Written to by stop(), to wake up wait()
+    int stop_fds_[2];
+    std::atomic<bool> stopped_;
+    std::unordered_map<int, boost::filesystem::path> dirs_;
+    std::map<boost::filesystem::path, burst> pending_;
+};
+
+} // namespace mm
+
+#endif // MUSICMOVE_WATCH_HPP
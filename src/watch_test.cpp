@@ -0,0 +1,133 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "watch.hpp"
+#include "test_fixture.hpp"
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE watch_test
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+namespace fs = boost::filesystem;
+using namespace std;
+using std::chrono::milliseconds;
+
+BOOST_AUTO_TEST_CASE (files_settle)
+{
+    fixture f;
+
+    fs::path inbox{f.tmp_dir / "inbox"};
+    fs::create_directories(inbox);
+    ofstream{(inbox / "old.flac").string()} << "old";
+
+    mm::watcher w{{inbox}, milliseconds{200}};
+    BOOST_CHECK(w.is_root(inbox));
+    ofstream{(inbox / "a.flac").string()} << "one";
+    ofstream{(inbox / "b.flac").string()} << "two";
+    ofstream{(inbox / ".partial").string()} << "three";
+
+    // Nothing is handed out until the directory has been quiet for a while
+    BOOST_CHECK(w.wait(milliseconds{0}).empty());
+    auto settled = w.wait(milliseconds{5000});
+    BOOST_REQUIRE_EQUAL(settled.size(), 1);
+    BOOST_CHECK_EQUAL(settled[0].dir, inbox);
+    vector<fs::path> expected{inbox / "a.flac", inbox / "b.flac"};
+    BOOST_CHECK(settled[0].files == expected);
+
+    // Each file is only handed out once
+    BOOST_CHECK(w.wait(milliseconds{400}).empty());
+}
+
+BOOST_AUTO_TEST_CASE (directory_moved_in)
+{
+    fixture f;
+
+    fs::path inbox{f.tmp_dir / "inbox"};
+    fs::path album{f.tmp_dir / "album"};
+    fs::create_directories(inbox);
+    fs::create_directories(album / "cd1");
+    ofstream{(album / "cd1" / "01.flac").string()} << "one";
+    ofstream{(album / "cover.jpg").string()} << "two";
+
+    mm::watcher w{{inbox}, milliseconds{100}};
+    fs::rename(album, inbox / "album");
+    auto settled = w.wait(milliseconds{5000});
+    // The two directories may settle separately
+    if (settled.size() < 2)
+    {
+        auto more = w.wait(milliseconds{1000});
+        settled.insert(settled.end(), more.begin(), more.end());
+    }
+    BOOST_REQUIRE_EQUAL(settled.size(), 2);
+    sort(settled.begin(), settled.end(),
+         [](const mm::arrivals &a, const mm::arrivals &b) {
+             return a.dir < b.dir;
+         });
+    BOOST_CHECK_EQUAL(settled[0].dir, inbox / "album");
+    BOOST_REQUIRE_EQUAL(settled[0].files.size(), 1);
+    BOOST_CHECK_EQUAL(settled[0].files[0], inbox / "album" / "cover.jpg");
+    BOOST_CHECK_EQUAL(settled[1].dir, inbox / "album" / "cd1");
+    BOOST_REQUIRE_EQUAL(settled[1].files.size(), 1);
+
+    // The new directory is watched too
+    ofstream{(inbox / "album" / "cd1" / "02.flac").string()} << "three";
+    settled = w.wait(milliseconds{5000});
+    BOOST_REQUIRE_EQUAL(settled.size(), 1);
+    BOOST_CHECK_EQUAL(settled[0].files.size(), 1);
+    BOOST_CHECK_EQUAL(settled[0].files[0],
+                      inbox / "album" / "cd1" / "02.flac");
+}
+
+BOOST_AUTO_TEST_CASE (files_gone_before_settling)
+{
+    fixture f;
+
+    mm::watcher w{{f.tmp_dir}, milliseconds{100}};
+    ofstream{(f.tmp_dir / "a.flac").string()} << "one";
+    fs::rename(f.tmp_dir / "a.flac", f.tmp_dir / "b.flac");
+    ofstream{(f.tmp_dir / "c.flac").string()} << "two";
+    fs::remove(f.tmp_dir / "c.flac");
+
+    auto settled = w.wait(milliseconds{5000});
+    BOOST_REQUIRE_EQUAL(settled.size(), 1);
+    BOOST_REQUIRE_EQUAL(settled[0].files.size(), 1);
+    BOOST_CHECK_EQUAL(settled[0].files[0], f.tmp_dir / "b.flac");
+}
+
+BOOST_AUTO_TEST_CASE (stop_waiting)
+{
+    fixture f;
+
+    mm::watcher w{{f.tmp_dir}, milliseconds{100}};
+    BOOST_CHECK(!w.stopped());
+    w.stop();
+    auto start = chrono::steady_clock::now();
+    BOOST_CHECK(w.wait(milliseconds{60000}).empty());
+    BOOST_CHECK(chrono::steady_clock::now() - start < chrono::seconds{10});
+    BOOST_CHECK(w.stopped());
+
+    BOOST_CHECK_THROW((mm::watcher{{f.tmp_dir / "missing"}, milliseconds{1}}),
+                      mm::watch_error);
+}
@@ -0,0 +1,86 @@
+/*
+    musicmove - Bulk renamer for music files
+    Copyright (C) 2016-2017  Adam Szmigin (adam.szmigin@xsco.net)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MUSICMOVE_WORKER_POOL_HPP
+#define MUSICMOVE_WORKER_POOL_HPP
+
+#include "bounded_queue.hpp"
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace mm {
+
+// A fixed set of threads running tasks from a bounded queue.
+//
+// A pool with no threads runs each task lazily, in whichever thread first
+// waits for its result, so that single-threaded runs do their work in the
+// same order as they always have.
+class worker_pool
+{
+public:
+    explicit worker_pool(unsigned int threads) :
+        tasks_{16 * static_cast<std::size_t>(threads)}
+    {
+        for (unsigned int i = 0; i < threads; ++i)
+            threads_.emplace_back([this] { run(); });
+    }
+    ~worker_pool()
+    {
+        // Queued tasks are still run, so that nobody waits forever on them
+        tasks_.close();
+        for (auto &t : threads_)
+            t.join();
+    }
+    worker_pool(const worker_pool &) = delete;
+    worker_pool &operator=(const worker_pool &) = delete;
+    
+    // Queue a task, waiting if the queue is full, and get its result later
+    template <typename F>
+    std::future<std::invoke_result_t<F>> submit(F task)
+    {
+        typedef std::invoke_result_t<F> result_type;
+        if (threads_.empty())
+            return std::async(std::launch::deferred, std::move(task));
+        
+        auto packaged = std::make_shared<std::packaged_task<result_type()>>(
+            std::move(task));
+        auto result = packaged->get_future();
+        tasks_.push([packaged] { (*packaged)(); });
+        return result;
+    }
+    
+private:
+    void run()
+    {
+        std::function<void()> task;
+        while (tasks_.pop(task))
+            task();
+    }
+    
+    bounded_queue<std::function<void()>> tasks_;
+    std::vector<std::thread> threads_;
+};
+
+} // namespace mm
+
+#endif // MUSICMOVE_WORKER_POOL_HPP